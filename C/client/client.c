@@ -5,11 +5,13 @@
  *
  */
 
+#include <ctype.h>
+#include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <netdb.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #ifndef S_SPLIT_S     // Workaround for splint.
@@ -17,15 +19,34 @@
 #endif
 
 #include "client.h"
+#include "flight_recorder.h"
+
+// The largest exit status used to report the number of files that could not be fetched.
+#define MAX_FAILURE_STATUS 100
+
+//! The files to fetch in batch mode.
+typedef struct {
+    char  **names;     //!< The file names, in the order given.
+    size_t  count;     //!< Number of names.
+    size_t  capacity;  //!< Number of names there is room for.
+} file_list;
+
+
+// SIGUSR2 asks for the flight recording of the current transfer, even if it succeeds.
+static void sigusr2_handler(int signal_number)
+{
+    ++flight_dump_requests;
+}
 
 
 //! This is the main loop of the program.
 /*!
  * Get file names from the user and fetch the requested files from the server.
  *
- * \param server_address The IP/port address of the server host.
+ * \param servers The servers to fetch files from.
+ * \param options The options to request for every transfer.
  */
-static void main_loop(const struct sockaddr_in6 *server_address)
+static void main_loop(ServerSet *servers, const transfer_options *options)
 {
     int   socket_handle;
     char  file_name[128+2];
@@ -49,49 +70,281 @@ static void main_loop(const struct sockaddr_in6 *server_address)
             perror("Unable to create socket");
         }
         else {
-            receive_file(file_name, socket_handle, server_address);
+            receive_file(file_name, socket_handle, servers, options, NULL);
             close(socket_handle);
         }
     }
 }
 
 
+//! Add a name to a list of files. Returns -1 if memory runs out.
+static int add_file(file_list *files, const char *name)
+{
+    char **larger;
+
+    if (files->count == files->capacity) {
+        larger = realloc(files->names, (2 * files->capacity + 16) * sizeof(char *));
+        if (larger == NULL) return -1;
+        files->names    = larger;
+        files->capacity = 2 * files->capacity + 16;
+    }
+    if ((files->names[files->count] = strdup(name)) == NULL) return -1;
+    ++files->count;
+    return 0;
+}
+
+
+//! Add the files named in a manifest to a list.
+/*!
+ * The manifest has one file name per line. Blank lines and lines starting with '#' are
+ * skipped, as is white space around each name.
+ *
+ * \param manifest_name The manifest, or "-" for the standard input.
+ * \param files The list to add to.
+ *
+ * \return 0 if successful; -1 if the manifest can't be read or memory runs out.
+ */
+static int read_manifest(const char *manifest_name, file_list *files)
+{
+    FILE *manifest = strcmp(manifest_name, "-") == 0 ? stdin : fopen(manifest_name, "r");
+    char  line[512];
+    char *name;
+    char *end_ptr;
+    int   status = 0;
+
+    if (manifest == NULL) {
+        perror(manifest_name);
+        return -1;
+    }
+    while (status == 0 && fgets(line, sizeof(line), manifest) != NULL) {
+        for (name = line; isspace((unsigned char)*name); ++name) ;
+        end_ptr = name + strlen(name);
+        while (end_ptr > name && isspace((unsigned char)end_ptr[-1])) --end_ptr;
+        *end_ptr = '\0';
+        if (*name == '\0' || *name == '#') continue;
+        status = add_file(files, name);
+    }
+    if (ferror(manifest)) {
+        perror(manifest_name);
+        status = -1;
+    }
+    if (manifest != stdin) fclose(manifest);
+    return status;
+}
+
+
+//! A socket kept for the next transfer in a batch.
+typedef struct {
+    int handle;                    //!< The socket, or -1.
+    struct sockaddr_in6 last_tid;  //!< Server of the socket's last transfer (port 0 if none).
+} batch_socket;
+
+
+//! Get a socket for a transfer in a batch, reusing an idle one if there is one.
+/*!
+ * Datagrams that reached the idle socket since its last transfer are discarded. Any that come
+ * later are recognized by the server's transfer ID (see prefetch_state).
+ *
+ * \return 0 if successful; -1 if no socket could be created.
+ */
+static int take_socket(batch_socket *idle, batch_socket *taken)
+{
+    char packet[4];
+
+    if (idle->handle != -1) {
+        *taken = *idle;
+        idle->handle = -1;
+        while (recv(taken->handle, packet, sizeof(packet), MSG_DONTWAIT) != -1) ;
+        return 0;
+    }
+    memset(taken, 0, sizeof(*taken));
+    if ((taken->handle = socket(PF_INET6, SOCK_DGRAM, 0)) == -1) {
+        perror("Unable to create socket");
+        return -1;
+    }
+    return 0;
+}
+
+
+//! Finish with a socket used for a transfer in a batch.
+/*!
+ * The socket is kept for reuse only if its transfer succeeded. After a failure, the answer to
+ * a request may still be on its way, and it could not be told apart from the answer to the
+ * next request on the same socket.
+ */
+static void give_back_socket(batch_socket *idle, batch_socket *used, int reusable)
+{
+    if (!reusable || idle->handle != -1) {
+        close(used->handle);
+    }
+    else {
+        *idle = *used;
+    }
+    used->handle = -1;
+}
+
+
+//! Fetch a list of files without asking the user for anything.
+/*!
+ * The request for the next file is sent on a second socket while the current transfer is
+ * finishing, so the server's setup and the round trip for the request overlap with data that
+ * is still arriving. The two sockets are then reused for the rest of the batch rather than
+ * made anew for every file. Updates make several requests per file and are neither overlapped
+ * nor given reused sockets.
+ *
+ * A line giving the outcome is printed for each file.
+ *
+ * \param servers The servers to fetch files from.
+ * \param options The options to request for every transfer.
+ * \param files The files to fetch.
+ *
+ * \return The number of files that could not be fetched.
+ */
+static size_t batch_mode(ServerSet *servers, const transfer_options *options, file_list *files)
+{
+    prefetch_state prefetch;
+    TftpSession    sessions[2];
+    batch_socket   current;
+    batch_socket   next;
+    batch_socket   idle = { -1 };
+    int    status;
+    size_t failures = 0;
+    size_t i;
+
+    memset(&prefetch, 0, sizeof(prefetch));
+    take_socket(&idle, &current);
+    for (i = 0; i < files->count; ++i) {
+        prefetch.session      = prefetch.next_sent ? prefetch.next_session : NULL;
+        prefetch.next_session = &sessions[i % 2];
+        prefetch.next_sent    = 0;
+        prefetch.next_file    = NULL;
+        next.handle = -1;
+        if (i + 1 < files->count && take_socket(&idle, &next) == 0 && !options->update) {
+            prefetch.next_file      = files->names[i + 1];
+            prefetch.next_socket    = next.handle;
+            prefetch.next_stale_tid = next.last_tid;
+        }
+
+        status = -1;
+        if (current.handle != -1) {
+            prefetch.stale_tid = current.last_tid;
+            memset(&prefetch.server_tid, 0, sizeof(prefetch.server_tid));
+            status = receive_file(
+                files->names[i], current.handle, servers, options, &prefetch);
+            current.last_tid = prefetch.server_tid;
+            give_back_socket(&idle, &current, status == 0 && !options->update);
+        }
+        printf("%s: %s\n", files->names[i], status == 0 ? "ok" : "failed");
+        if (status != 0) ++failures;
+        current = next;
+    }
+    if (idle.handle != -1) close(idle.handle);
+    return failures;
+}
+
+
 // ============
 // Main Program
 // ============
 
 int main(int argc, char **argv)
 {
-    struct addrinfo  getaddr_hints;
-    struct addrinfo *lookup_result;
-    struct sockaddr_in6 server_address;
+    static const struct option long_options[] = {
+        { "manifest", required_argument, NULL, 'f' },
+        { NULL,       0,                 NULL,  0  }
+    };
+    ServerSet         servers;
     unsigned short    port = 69;
+    int               port_given = 0;
+    struct sigaction  dump_action;
+    transfer_options  options;
+    file_list         files;
+    size_t            failures;
+    int               manifest_given = 0;
+    int option;
+
+    // Process the command line options.
+    memset(&options, 0, sizeof(options));
+    memset(&files, 0, sizeof(files));
+    while ((option = getopt_long(argc, argv, "df:o:p:uzr:", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'd':
+            options.verify_digest = 1;
+            break;
+        case 'f':
+            if (read_manifest(optarg, &files) == -1) return EXIT_FAILURE;
+            manifest_given = 1;
+            break;
+        case 'o':
+            options.output_directory = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            port_given = 1;
+            break;
+        case 'u':
+            options.update = 1;
+            break;
+        case 'z':
+            options.compress = 1;
+            break;
+        case 'r':
+            if (FlightRecorder_configure(optarg) == -1) {
+                fprintf(stderr, "Invalid flight recorder directory: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            optind = argc + 1;  // Force the usage message below.
+            break;
+        }
+    }
 
     // Do I have a command line argument? I need at least the server name.
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s server-name [port]\n", argv[0]);
+    if (optind >= argc) {
+        fprintf(stderr,
+                "Usage: %s [-d] [-u] [-z] [-r [json:|pcap:]recording-dir] servers [port]\n"
+                "       %s [-d] [-u] [-z] [-r ...] [-p port] [-o directory] [--manifest file]\n"
+                "          servers [file ...]\n"
+                "Servers are host names separated by commas; the fastest to answer is used.\n"
+                "Given files (or a manifest, \"-\" for standard input) the files are fetched\n"
+                "without prompting and the exit status is the number of files that failed.\n",
+                argv[0], argv[0]);
         return EXIT_FAILURE;
     }
 
-    // Do I have an explicit port number?
-    if (argc == 3) {
-        port = atoi(argv[2]);
+    // Without -p, a single numeric argument after the server name is its port (the original
+    // interactive usage). Anything else names files to fetch.
+    if (!port_given && optind + 2 == argc && files.count == 0 &&
+        strspn(argv[optind + 1], "0123456789") == strlen(argv[optind + 1])) {
+        port = atoi(argv[optind + 1]);
+    }
+    else {
+        for (option = optind + 1; option < argc; ++option) {
+            if (add_file(&files, argv[option]) == -1) {
+                fprintf(stderr, "Out of memory\n");
+                return EXIT_FAILURE;
+            }
+        }
     }
 
-    // Look up the IP address associated with the desired host.
-    memset( &getaddr_hints, 0, sizeof(struct addrinfo) );
-    getaddr_hints.ai_family = AF_INET6;
-    getaddr_hints.ai_flags = AI_V4MAPPED;
-    if( getaddrinfo( argv[1], NULL, &getaddr_hints, &lookup_result ) != 0 ) {
-        printf("Can't find IP address for host name: %s!", argv[1] );
+    memset(&dump_action, 0, sizeof(dump_action));
+    dump_action.sa_handler = sigusr2_handler;
+    dump_action.sa_flags   = SA_RESTART;
+    sigemptyset(&dump_action.sa_mask);
+    sigaction(SIGUSR2, &dump_action, NULL);
+
+    // Look up the IP addresses of the servers. They are not looked up again.
+    // TODO: Echo back the IP and port addresses so the user can confirm their sensibility.
+    if (ServerSet_initialize(&servers, argv[optind], port) == -1) {
         return EXIT_FAILURE;
     }
-    server_address = *(struct sockaddr_in6 *)lookup_result->ai_addr;
-    server_address.sin6_port = htons( port );
-    // TODO: Echo back the IP and port addresses so the user can confirm their sensibility.
 
     // The main body of the program is here.
-    main_loop(&server_address);
-
-    return EXIT_SUCCESS;
+    if (files.count == 0 && !manifest_given) {
+        main_loop(&servers, &options);
+        return EXIT_SUCCESS;
+    }
+    failures = batch_mode(&servers, &options, &files);
+    return failures > MAX_FAILURE_STATUS ? MAX_FAILURE_STATUS : (int)failures;
 }
@@ -10,9 +10,44 @@
 
 #include <arpa/inet.h>
 
+#include "server_set.h"
+#include "tftp_session.h"
+
+//! Options the client asks the server for.
+typedef struct {
+    int verify_digest;  //!< Ask for the file's CRC-32C and check the received data against it.
+    int compress;       //!< Offer to receive the file compressed with zlib.
+    int update;         //!< Update an existing local copy by fetching only the changed blocks.
+    const char *output_directory;  //!< Where received files are written, or NULL for here.
+} transfer_options;
+
+//! Overlaps the start of the next transfer in a batch with the end of the current one.
+/*!
+ * The request for the next file is sent on its own socket as the current transfer nears its
+ * end, so the server's first reply is already waiting when the next transfer begins. The caller
+ * provides the storage for the session sent ahead (next_session) and hands it back as session.
+ *
+ * A batch also reuses its sockets. A server whose transfer ended on a socket may still send to
+ * it (if the last acknowledgement was lost), so the next transfer on the socket is told that
+ * server's transfer ID and doesn't mistake its packets for an answer.
+ */
+typedef struct {
+    TftpSession *session;      //!< The current file's session if it was sent ahead, or NULL.
+    const char  *next_file;    //!< The next file in the batch, or NULL if there is none.
+    int          next_socket;  //!< The socket the next file is requested on.
+    TftpSession *next_session; //!< Where the next file's session is kept.
+    int          next_sent;    //!< Set once the next file's request has been sent.
+    size_t       next_server;  //!< The server the next file was requested from.
+    struct sockaddr_in6 stale_tid;       //!< Server of the socket's last transfer (port 0 if none).
+    struct sockaddr_in6 next_stale_tid;  //!< The same for the next file's socket.
+    struct sockaddr_in6 server_tid;  //!< Set to the transfer ID of the server that sent the file.
+} prefetch_state;
+
 int receive_file(
     const char *file_name,
           int   socket_handle,
-    const struct sockaddr_in6 *server_address);
+    ServerSet  *servers,
+    const transfer_options *options,
+    prefetch_state *prefetch);
 
 #endif // CLIENT_H_INCLUDED
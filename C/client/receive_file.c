@@ -3,157 +3,848 @@
  * \author Peter C. Chapin
  * \brief Function for client side file transfers.
  *
+ * When asked to update a file that already exists, the client fetches the server's signature
+ * list for the file (the CRC-32C of each block), compares it with the local copy, and then asks
+ * for just the blocks that differ. Those are written into the local copy in place. The digest
+ * of the result is checked against the server's, and if anything went wrong (for example, the
+ * file changed on the server part way through) the whole file is fetched instead.
+ *
+ * The transfers themselves are run by sessions of the client library (see tftp_session.h). This
+ * module decides which servers to ask, races them, and waits on the sessions with poll().
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
 #include "client.h"
+#include "crc32c.h"
+#include "flight_recorder.h"
 #include "Timer.h"
 
-//! Receive a file from the server.
-/*!
- * \param file_name The name of the file to receive from the server.
- * \param socket_handle The UDP socket to use for communication with the server.
- * \param server_address Pointer to the server's address structure.
- *
- * \return 0 if the transfer is successful; -1 otherwise.
- */
-int receive_file(
+// Minimum time (ms) between updates of the progress display.
+#define PROGRESS_INTERVAL 250
+
+// The next file in a batch is requested when this many bytes of the current one remain.
+#define PREFETCH_DISTANCE 8192
+
+// Number of consecutive timeouts after which a server is taken to have stopped answering.
+#define MAX_TIMEOUTS 5
+
+// Returned by fetch() when the server stopped answering, so another server may be tried.
+#define FETCH_TIMED_OUT -2
+
+// Returned by fetch() when a whole file did not match the server's digest.
+#define FETCH_DIGEST_MISMATCH -3
+
+// A part of the file replaced during an update.
+typedef struct {
+    off_t offset;   // Where the part starts in the file.
+    off_t length;   // Number of bytes in the part.
+} patch_range;
+
+// How the data received during an update is used.
+typedef enum {
+    SINK_FILE,      // Written to the output file from the start.
+    SINK_MEMORY,    // Collected in memory (a signature list).
+    SINK_PATCH      // Written over the parts of an existing file listed in ranges.
+} sink_mode;
+
+// Where the data received during an update goes. A server that did not accept the option that
+// calls for a memory or patch sink is sending the whole file, which goes to the output file.
+typedef struct {
+    sink_mode mode;         // How the data is used.
+    TftpSink  memory;       // The signature list collected in SINK_MEMORY mode.
+    TftpSink  file;         // The output file written in SINK_FILE mode.
+    int       handle;       // File patched in SINK_PATCH mode.
+    const patch_range *ranges;  // Parts of the file replaced in SINK_PATCH mode.
+    size_t    range_count;  // Number of entries in ranges.
+    size_t    range_index;  // The part currently being written.
+    off_t     range_done;   // Bytes of that part already written.
+} update_sink;
+
+// The sessions started for one transfer, one per server raced.
+typedef struct {
+    size_t       count;                // Number of servers asked.
+    size_t       servers[MAX_RACE];    // Their indices in the server set.
+    TftpSession *sessions[MAX_RACE];   // The session asking each. The first uses the caller's
+                                       // socket; the others make their own.
+    TftpSession  storage[MAX_RACE];    // Where the sessions are kept (unless sent ahead).
+    int          answered[MAX_RACE];   // Non-zero once a server's reply or failure is counted.
+    long long    sent_at;              // Monotonic time (us) the requests were sent.
+} request_race;
+
+
+//
+// Write data over the parts of the file being patched, in order. Returns -1 if the data goes
+// past the last part or can't be written.
+//
+static int patch_data( update_sink *sink, const unsigned char *data, size_t length )
+{
+    const patch_range *range;
+    size_t part;
+
+    while( length > 0 ) {
+        if( sink->range_index >= sink->range_count ) return -1;
+        range = &sink->ranges[sink->range_index];
+        part  = length;
+        if( (off_t)part > range->length - sink->range_done ) {
+            part = (size_t)( range->length - sink->range_done );
+        }
+        if( pwrite( sink->handle, data, part, range->offset + sink->range_done ) !=
+            (ssize_t)part ) return -1;
+        data   += part;
+        length -= part;
+        sink->range_done += (off_t)part;
+        if( sink->range_done == range->length ) {
+            ++sink->range_index;
+            sink->range_done = 0;
+        }
+    }
+    return 0;
+}
+
+
+//
+// Told by a session that the data of an update is about to arrive. If the server ignored the
+// option asking for a signature list or ranges, it is sending the whole file.
+//
+static int start_update( void *context, const TftpSession *session )
+{
+    update_sink *sink = (update_sink *)context;
+
+    if( ( sink->mode == SINK_MEMORY && !session->reply.signatures ) ||
+        ( sink->mode == SINK_PATCH  && !session->reply.ranges ) ) {
+        sink->mode = SINK_FILE;
+        return TftpSink_start( &sink->file, session );
+    }
+    return 0;
+}
+
+
+//
+// Take the data of an update.
+//
+static int store_update( void *context, const unsigned char *data, size_t length )
+{
+    update_sink *sink = (update_sink *)context;
+
+    switch( sink->mode ) {
+    case SINK_MEMORY:
+        return TftpSink_write( &sink->memory, data, length );
+
+    case SINK_PATCH:
+        return patch_data( sink, data, length );
+
+    case SINK_FILE:
+        return TftpSink_write( &sink->file, data, length );
+    }
+    return -1;
+}
+
+
+//
+// Prepare an update sink and the session sink that feeds it.
+//
+static void open_update(
+    update_sink *object, sink_mode mode, const char *output_name, TftpSink *sink )
+{
+    memset( object, 0, sizeof( *object ) );
+    object->mode   = mode;
+    object->handle = -1;
+    TftpSink_memory( &object->memory );
+    TftpSink_file( &object->file, output_name );
+    TftpSink_callback( sink, store_update, start_update, object );
+}
+
+
+//
+// Start a session requesting a file from each of the chosen servers. The first server uses the
+// caller's socket. If server is not negative only that server is asked. Returns 0 if at least
+// one request was sent; -1 otherwise.
+//
+static int start_race(
+    request_race *race,
+    const char *file_name,
+          int   socket_handle,
+    const ServerSet *servers,
+          int   server,
+    tftp_options *options,
+    TftpSink   *sink )
+{
+    size_t i;
+
+    if( server >= 0 ) {
+        race->servers[0] = (size_t)server;
+        race->count = 1;
+    }
+    else {
+        race->count = ServerSet_choose( servers, ServerSet_now( ), race->servers );
+    }
+    race->sent_at = ServerSet_now( );
+    for( i = 0; i < race->count; ++i ) {
+        race->answered[i] = 0;
+        race->sessions[i] = &race->storage[i];
+        options->timeout  = ServerSet_timeout( servers, race->servers[i] );
+        if( TftpSession_open( race->sessions[i], i == 0 ? socket_handle : -1,
+                              &servers->servers[race->servers[i]].address,
+                              file_name, options, sink ) == -1 ) {
+            printf( "Unable to request %s: %s\n", file_name, race->sessions[i]->error_message );
+            race->count = i;
+            break;
+        }
+    }
+    return race->count > 0 ? 0 : -1;
+}
+
+
+//
+// Count a raced server's reply, if it has sent one since the last time.
+//
+static void count_reply( request_race *race, ServerSet *servers, size_t index )
+{
+    if( !race->answered[index] && race->sessions[index]->statistics.reply_time >= 0 ) {
+        ServerSet_answered(
+            servers, race->servers[index], race->sessions[index]->statistics.reply_time );
+        race->answered[index] = 1;
+    }
+}
+
+
+//
+// Tell the servers that lost a race to stop sending. Their replies are still used to measure
+// them. Servers that haven't replied yet are dealt with when end_race() is called.
+//
+static void cancel_losers( request_race *race, ServerSet *servers, int winner )
+{
+    size_t i;
+
+    for( i = 0; i < race->count; ++i ) {
+        if( (int)i == winner ) continue;
+        TftpSession_cancel( race->sessions[i] );
+        count_reply( race, servers, i );
+    }
+}
+
+
+//
+// Finish with the raced sessions. A server that never answered, even after the transfer is
+// over, is counted as failed.
+//
+static void end_race( request_race *race, ServerSet *servers, int winner )
+{
+    long long waited = ServerSet_now( ) - race->sent_at;
+    size_t i;
+
+    cancel_losers( race, servers, winner );
+    for( i = 0; i < race->count; ++i ) {
+        if( (int)i != winner && !race->answered[i] &&
+            waited > 1000LL * ServerSet_timeout( servers, race->servers[i] ) ) {
+            ServerSet_failed( servers, race->servers[i], ServerSet_now( ) );
+        }
+        TftpSession_close( race->sessions[i] );
+    }
+    race->count = 0;
+}
+
+
+//
+// Send the request for the next file in a batch, if there is one and it hasn't been sent yet.
+// The next transfer uses the same server and options as this one. Its session gets a sink
+// when its transfer begins.
+//
+static void start_next(
+    prefetch_state *prefetch,
+    const ServerSet *servers,
+          int   server,
+    const tftp_options *options )
+{
+    tftp_options next_options;
+
+    if( prefetch == NULL || prefetch->next_file == NULL || prefetch->next_sent ) return;
+    next_options = *options;
+    next_options.timeout   = ServerSet_timeout( servers, (size_t)server );
+    next_options.stale_tid = prefetch->next_stale_tid;
+    if( TftpSession_open( prefetch->next_session, prefetch->next_socket,
+                          &servers->servers[server].address, prefetch->next_file,
+                          &next_options, NULL ) == 0 ) {
+        prefetch->next_server = (size_t)server;
+        prefetch->next_sent   = 1;
+    }
+}
+
+
+//
+// Request a file with the given options and have the data the server sends delivered to the
+// sink.
+//
+// The request goes to the server given, or if that is negative, to the servers chosen from the
+// set, each in its own session. When several are raced the first to answer serves the file; a
+// server that answers with an error only wins if none of the others has the file. If nothing
+// answers, the servers are counted as failed and the request goes to the next choice. A server
+// that stops answering part way through is counted as failed and the transfer ends with
+// FETCH_TIMED_OUT.
+//
+// In a batch, the request for the next file is sent as this transfer nears its end, so the
+// server is already answering it when this transfer is done.
+//
+// Returns 0 if the transfer is successful; -1, FETCH_TIMED_OUT, or FETCH_DIGEST_MISMATCH
+// otherwise. On return server is the server that answered (if any did) and reply is what it
+// said about the transfer.
+//
+static int fetch(
     const char *file_name,
           int   socket_handle,
-    const struct sockaddr_in6 *server_address )
-{
-    // Allocate some memory.
-    const int REQUEST_LENGTH = (int)( 2 + strlen(file_name) + 1 + 5 + 1 );
-    const int DATA_LENGTH    = 512 + 4;
-    const int ACK_LENGTH     = 4;
-    char  buffer[516];
-
-    // Various other data objects needed.
-    struct      sockaddr_in6 incoming_address; // Source address of incoming packet.
-    socklen_t   address_size;       // Size of incoming address structure.
-    FILE       *output = NULL;      // Refers to the output file.
-    const char *simple_file_name;   // The file name without the path.
-    int         recv_count;         // Number of bytes actually received.
-    int         op_code;            // Operation code in incoming packet.
-    unsigned short block_number;    // Block number in incoming packet.
-    long        block_count =  0;   // The total number of blocks received.
-    long        byte_count  =  0;   // The total number of data bytes received.
+    ServerSet  *servers,
+          int  *server,
+    const tftp_options *request_options,
+    TftpSink   *sink,
+    tftp_reply *reply,
+    prefetch_state *prefetch )
+{
+    tftp_options options = *request_options;
+    request_race race;              // The sessions started for this transfer.
+    TftpSession *session = NULL;    // The session of the server sending the file.
+    struct pollfd waiting[MAX_RACE];  // Sockets a packet may arrive on.
+    int         pinned = *server >= 0;  // Non-zero if only the given server may be used.
+    int         winner = -1;        // The entry in race of the server sending the file.
+    int         refused = -1;       // The entry of a server that answered with an error.
+    int         timeouts = 0;       // Races in which nothing answered.
+    int         timeout;            // How long (ms) to wait for the next packet.
     int         return_code = -1;   // Assume we have an error unless proven otherwise.
+    size_t      count;
+    size_t      i;
+    long long   now;
+    long long   deadline;
+    tftp_session_status status;
 
     // Used to time the transfer.
     Timer stopwatch;
     long  total_time;
-    Timer_initialize( &stopwatch );
+    long  next_display = 0;  // Time at which the progress display is next updated.
 
-    // Fill in the request packet
-    buffer[0] = 0;  // RRQ op-code.
-    buffer[1] = 1;
-    strcpy( &buffer[2], file_name );     // TODO: Make sure file_name is not too long.
-    strcpy( &buffer[2 + strlen(file_name) + 1], "octet");
+    // Identifies the packet history of this transfer, if it is kept.
+    static unsigned transfer_count = 0;
+    struct sockaddr_in6 local_address;
+    socklen_t local_length = sizeof( local_address );
 
+    memset( reply, 0, sizeof( *reply ) );
+    reply->tsize = -1;
+    options.resend_request = 0;
+    options.max_timeouts   = MAX_TIMEOUTS;
+    Timer_initialize( &stopwatch );
     Timer_start( &stopwatch );
-    // Send the request.
-    // TODO: Check return value.
-    sendto(
-        socket_handle,
-        buffer,
-        REQUEST_LENGTH,
-        0,
-        (const struct sockaddr *)server_address,
-        sizeof(*server_address));
-
-    // Now go into a loop to retrieve the data blocks.
+    ++transfer_count;
+    if( prefetch != NULL ) options.stale_tid = prefetch->stale_tid;
+
+    // The request may have been sent already, near the end of the previous transfer.
+    if( prefetch != NULL && prefetch->session != NULL ) {
+        race.count       = 1;
+        race.servers[0]  = prefetch->next_server;
+        race.sessions[0] = prefetch->session;
+        race.answered[0] = 0;
+        race.sent_at     = prefetch->session->statistics.started;
+        TftpSession_attach( prefetch->session, sink );
+        prefetch->session = NULL;
+    }
+    else if( start_race(
+                 &race, file_name, socket_handle, servers, *server, &options, sink ) == -1 ) {
+        return -1;
+    }
+
     while( 1 ) {
 
-        // Receive a packet from the server.
-        // TODO: Time out receive operation.
-        address_size = sizeof( incoming_address );
-        recv_count = recvfrom(
-            socket_handle,
-            buffer,
-            DATA_LENGTH,
-            0,
-            (struct sockaddr *)&incoming_address,
-            &address_size );
-
-        // Make sure the receive was successful.
-        if( recv_count == -1 ) {
-            perror( "recvfrom failed" );
-            continue;  // Do we really want to do this?
-        }
-
-        // Make sure the received packet is a data packet.
-        // TODO: Deal with unexpected packet types.
-        // TODO: Verify that the error packet is really long enough.
-        op_code = (buffer[0] << 8) | buffer[1];
-        if( op_code == 5 ) {
-            printf( "Error from server: %s\n", &buffer[4] );
-            break;  // Do we really want to do this?
-        }
-
-        // Assume we have a DATA packet.
-        block_number = (buffer[2] << 8) | (buffer[3] & 0x00FF);
-
-        // Strip paths off file name. Be sure the output file is open.
-        if( output == NULL ) {
-            // TODO: This doesn't handle trailing slash characters very well but presumably they would cause errors anyway.
-            simple_file_name = strrchr( file_name, '/' );
-            if( simple_file_name == NULL )
-                simple_file_name = file_name;
-            else
-                simple_file_name = simple_file_name + 1;
-
-            output = fopen( simple_file_name, "w" );
-            if( output == NULL ) {
-                printf( "Unable to open %s (after receiving block #%u)", simple_file_name, block_number );
+        // Wait for a packet or for the next deadline. Until a server has answered, a packet may
+        // come to any raced session still waiting for one.
+        count    = 0;
+        deadline = LLONG_MAX;
+        for( i = 0; i < race.count; ++i ) {
+            if( winner == -1 ? race.answered[i] : (int)i != winner ) continue;
+            waiting[count].fd     = race.sessions[i]->socket_handle;
+            waiting[count].events = POLLIN;
+            if( TftpSession_deadline( race.sessions[i] ) < deadline ) {
+                deadline = TftpSession_deadline( race.sessions[i] );
             }
+            ++count;
+        }
+        now = TftpSession_now( );
+        timeout = deadline <= now ? 0 : (int)( ( deadline - now + 999 ) / 1000 );
+        if( poll( waiting, count, timeout ) == -1 ) {
+            if( errno == EINTR ) continue;
+            perror( "poll failed" );
+            break;
+        }
+        now = TftpSession_now( );
+
+        if( winner != -1 ) {
+            TftpSession_process( session, now );
+        }
+        else {
+            // The first server to answer sends the file. Servers that don't answer in time
+            // are counted as failed.
+            for( i = 0, count = 0; i < race.count && winner == -1; ++i ) {
+                if( race.answered[i] ) continue;
+                if( waiting[count++].revents == 0 &&
+                    now < TftpSession_deadline( race.sessions[i] ) ) continue;
+                status = TftpSession_process( race.sessions[i], now );
+                if( status == TFTP_SESSION_REQUESTED ) continue;
+
+                count_reply( &race, servers, i );
+                if( !race.answered[i] ) {
+                    if( race.sessions[i]->failure == TFTP_FAILURE_TIMED_OUT ) {
+                        printf( "No reply from %s\n", servers->servers[race.servers[i]].name );
+                    }
+                    ServerSet_failed( servers, race.servers[i], ServerSet_now( ) );
+                    race.answered[i] = 1;
+                }
+                else if( status == TFTP_SESSION_FAILED &&
+                         race.sessions[i]->failure == TFTP_FAILURE_SERVER ) {
+                    refused = (int)i;
+                }
+                else {
+                    winner = (int)i;
+                }
+            }
+
+            // An error from one server is only accepted if every other server has failed too.
+            // If none answered at all, the request goes to the next choice of servers.
+            if( winner == -1 ) {
+                for( i = 0; i < race.count && race.answered[i]; ++i ) ;
+                if( i < race.count ) continue;
+                if( refused == -1 ) {
+                    end_race( &race, servers, -1 );
+                    if( ++timeouts > MAX_TIMEOUTS || start_race(
+                            &race, file_name, socket_handle, servers, pinned ? *server : -1,
+                            &options, sink ) == -1 ) {
+                        return_code = FETCH_TIMED_OUT;
+                        break;
+                    }
+                    continue;
+                }
+                winner = refused;
+            }
+            session = race.sessions[winner];
+            *server = (int)race.servers[winner];
+            cancel_losers( &race, servers, winner );
+        }
+
+        // Provide user feedback. The display is refreshed at a fixed rate rather than once per
+        // block so the terminal doesn't cost a system call for every packet.
+        if( session->statistics.blocks > 0 && Timer_time( &stopwatch ) >= next_display ) {
+            printf( "\rReceived: %llu bytes",
+                    (unsigned long long)session->statistics.bytes_received );
+            fflush( stdout );
+            next_display = Timer_time( &stopwatch ) + PROGRESS_INTERVAL;
         }
 
-        // If there was data in this packet and it's a new block...
-        // BUG: If the file contains more than 2^16 blocks this logic gets confused.
-        if( (recv_count > 4) && (block_number == block_count + 1) ) {
-            block_count++;
-            byte_count += (recv_count - 4);
-            fwrite( &buffer[4], 1, recv_count - 4, output );
-       }
-
-        // Send acknowledgements for the "current" block or for duplicates of the previous block.
-        // TODO: Check return value.
-        buffer[0] = 0;  // ACK op-code.
-        buffer[1] = 4;
-        sendto(
-            socket_handle,
-            buffer,
-            ACK_LENGTH,
-            0,
-            (const struct sockaddr *)&incoming_address,
-            sizeof(incoming_address));
-
-        // Provide user feedback.
-        printf( "\rReceived: %ld bytes", byte_count );
-        fflush( stdout );
-
-
-        // If this was the final packet, I am done. Indicate success.
-        if( recv_count - 4 < 512 ) {
+        if( session->status == TFTP_SESSION_DONE ||
+            ( session->reply.tsize >= 0 &&
+              session->reply.tsize - (long long)session->statistics.bytes_received <=
+              PREFETCH_DISTANCE ) ) {
+            start_next( prefetch, servers, *server, &options );
+        }
+        if( session->status == TFTP_SESSION_DONE ) {
             return_code = 0;
             break;
         }
+        if( session->status == TFTP_SESSION_FAILED ) break;
     }
 
-    // Clean up (close output file if appropriate, etc).
-    if( output != NULL ) {
-        printf( "\n" );
-        fclose( output );
+    if( session != NULL ) {
+        *reply = session->reply;
+        if( prefetch != NULL ) prefetch->server_tid = session->server_tid;
+        if( session->statistics.blocks > 0 ) {
+            printf( "\rReceived: %llu bytes",
+                    (unsigned long long)session->statistics.bytes_received );
+            if( session->reply.compressed ) {
+                printf( " (%llu bytes expanded)",
+                        (unsigned long long)session->statistics.bytes_delivered );
+            }
+            printf( "\n" );
+        }
+        switch( session->status == TFTP_SESSION_FAILED ? session->failure : TFTP_FAILURE_NONE ) {
+        case TFTP_FAILURE_NONE:
+        case TFTP_FAILURE_CANCELLED:
+            break;
+
+        case TFTP_FAILURE_SERVER:
+            printf( "Error from server: %s\n", session->error_message );
+            break;
+
+        case TFTP_FAILURE_TIMED_OUT:
+            printf( "%s stopped answering\n", servers->servers[*server].name );
+            ServerSet_failed( servers, (size_t)*server, ServerSet_now( ) );
+            return_code = FETCH_TIMED_OUT;
+            break;
+
+        case TFTP_FAILURE_DIGEST:
+            printf( "%s\n", session->error_message );
+            return_code = FETCH_DIGEST_MISMATCH;
+            break;
+
+        default:
+            printf( "%s\n", session->error_message );
+            break;
+        }
+    }
+
+    // Keep the packet history of failed transfers, or of any transfer if asked with SIGUSR2.
+    if( race.count > 0 ) {
+        if( session == NULL ) session = race.sessions[0];
+        if( return_code != 0 || FlightRecorder_dump_pending( &session->recorder ) ) {
+            getsockname( session->socket_handle,
+                         (struct sockaddr *)&local_address, &local_length );
+            if( FlightRecorder_dump( &session->recorder, transfer_count,
+                                     &local_address, &session->server_tid ) == -1 ) {
+                perror( "Unable to write flight recording" );
+            }
+        }
+        end_race( &race, servers, winner );
     }
+
     Timer_stop( &stopwatch );
     total_time = Timer_time( &stopwatch );
-    if( total_time > 1 ) {
+    if( total_time > 1 && session != NULL ) {
         printf( "Transfer time: %ld.%03ld seconds; Transfer rate: %.3e bytes/s\n",
-                total_time / 1000, total_time % 1000, ((double)byte_count * 1000) / total_time );
+                total_time / 1000, total_time % 1000,
+                ( (double)session->statistics.bytes_received * 1000 ) / total_time );
     }
 
     return return_code;
 }
+
+
+//
+// Report on the digest of a whole file received with verification asked for. A damaged file
+// is removed so it can't be mistaken for a good one.
+//
+static int check_digest( int status, const tftp_reply *reply, const char *output_name )
+{
+    if( status == FETCH_DIGEST_MISMATCH ) {
+        remove( output_name );
+        return -1;
+    }
+    if( status == 0 && !reply->have_digest ) {
+        printf( "The server did not send a digest; the file was not verified\n" );
+    }
+    return status;
+}
+
+
+//
+// Receive a whole file into the output file.
+//
+static int fetch_file(
+    const char *file_name,
+          int   socket_handle,
+    ServerSet  *servers,
+    const char *output_name,
+    const transfer_options *options,
+    prefetch_state *prefetch )
+{
+    tftp_options request_options;
+    int          server = -1;
+    int          status;
+    TftpSink     sink;
+    tftp_reply   reply;
+
+    TftpSink_file( &sink, output_name );
+    TftpSession_initialize_options( &request_options );
+    if( options->verify_digest ) {
+        TftpSession_add_option( &request_options, "digest", "crc32c" );
+        request_options.verify_digest = 1;
+    }
+    if( options->compress ) TftpSession_add_option( &request_options, "compress", "zlib" );
+    if( prefetch != NULL && prefetch->next_file != NULL ) {
+        TftpSession_add_option( &request_options, "tsize", "0" );
+    }
+
+    status = fetch( file_name, socket_handle, servers, &server,
+                    &request_options, &sink, &reply, prefetch );
+    if( !options->verify_digest ) return status;
+    return check_digest( status, &reply, output_name );
+}
+
+
+//
+// Compute the CRC-32C of part of a file. Returns -1 if the file ends before the part does.
+//
+static long long local_digest( int handle, off_t offset, off_t length )
+{
+    unsigned char buffer[65536];
+    uint32_t crc = 0;
+    ssize_t  count;
+
+    while( length > 0 ) {
+        count = pread( handle, buffer,
+                       length < (off_t)sizeof( buffer ) ? (size_t)length : sizeof( buffer ),
+                       offset );
+        if( count <= 0 ) return -1;
+        crc = crc32c( crc, buffer, (size_t)count );
+        offset += count;
+        length -= count;
+    }
+    return crc;
+}
+
+
+//
+// Compare the server's signature list with the local file and list the parts that differ.
+// Runs of neighbouring blocks are merged into one part. Returns the number of parts, or -1 if
+// memory ran out.
+//
+static long find_changes(
+    int handle, const TftpSink *signatures, const tftp_reply *reply, patch_range **changes )
+{
+    const unsigned char *signature;
+    long   block_count = (long)( signatures->written / 4 );
+    long   change_count = 0;
+    long   block;
+    off_t  offset;
+    off_t  length;
+    uint32_t expected;
+
+    if( (*changes = malloc( ( block_count + 1 ) * sizeof( patch_range ) )) == NULL ) return -1;
+    for( block = 0; block < block_count; ++block ) {
+        signature = signatures->memory + 4 * block;
+        expected  = ( (uint32_t)signature[0] << 24 ) | ( (uint32_t)signature[1] << 16 ) |
+                    ( (uint32_t)signature[2] <<  8 ) |   (uint32_t)signature[3];
+        offset = (off_t)block * reply->block_size;
+        length = reply->file_size - offset < reply->block_size ?
+                 reply->file_size - offset : reply->block_size;
+        if( local_digest( handle, offset, length ) == (long long)expected ) continue;
+
+        if( change_count > 0 &&
+            (*changes)[change_count - 1].offset + (*changes)[change_count - 1].length == offset ) {
+            (*changes)[change_count - 1].length += length;
+        }
+        else {
+            (*changes)[change_count].offset = offset;
+            (*changes)[change_count].length = length;
+            ++change_count;
+        }
+    }
+    return change_count;
+}
+
+
+//
+// Fetch the changed parts of a file into the local copy, as many parts per request as fit, from
+// the server that sent the signatures. Returns 0 if successful; -1 or FETCH_TIMED_OUT if a
+// transfer failed; 1 if the server answered with the whole file or the file changed on the
+// server since its signatures were fetched.
+//
+static int fetch_changes(
+    const char *file_name,
+          int   socket_handle,
+    ServerSet  *servers,
+          int  *server,
+          int   handle,
+    const char *output_name,
+    const patch_range *changes,
+          long  change_count,
+    const tftp_reply *signed_reply )
+{
+    tftp_options request_options;
+    char  ranges[TFTP_MAX_REQUEST_LENGTH];
+    int   ranges_length;
+    int   written;
+    long  first = 0;
+    long  last;
+    long  block_size = signed_reply->block_size;
+    int   status;
+    update_sink  patch;
+    TftpSink     sink;
+    tftp_reply   reply;
+
+    while( first < change_count ) {
+        // The request has room for the name, the mode, the digest option, and the ranges.
+        ranges_length = snprintf( ranges, sizeof( ranges ), "%ld:", block_size );
+        for( last = first; last < change_count; ++last ) {
+            written = snprintf( ranges + ranges_length, sizeof( ranges ) - ranges_length,
+                                "%s%lld-%lld",
+                                last == first ? "" : ",",
+                                (long long)( changes[last].offset / block_size ),
+                                (long long)( ( changes[last].offset + changes[last].length - 1 ) /
+                                             block_size ) );
+            if( 2 + strlen( file_name ) + 1 + 6 + 14 + 7 + ranges_length + written + 1 >
+                TFTP_MAX_REQUEST_LENGTH ) break;
+            ranges_length += written;
+        }
+        ranges[ranges_length] = '\0';
+        if( last == first ) return -1;
+
+        TftpSession_initialize_options( &request_options );
+        TftpSession_add_option( &request_options, "digest", "crc32c" );
+        TftpSession_add_option( &request_options, "ranges", ranges );
+
+        open_update( &patch, SINK_PATCH, output_name, &sink );
+        patch.handle = handle;
+        patch.ranges = changes + first;
+        patch.range_count = (size_t)( last - first );
+        status = fetch( file_name, socket_handle, servers, server,
+                        &request_options, &sink, &reply, NULL );
+        TftpSink_close( &patch.file );
+        if( status != 0 ) return status;
+        if( !reply.ranges || reply.file_size != signed_reply->file_size ||
+            !reply.have_digest || reply.digest != signed_reply->digest ) return 1;
+        if( patch.range_index != patch.range_count ) {
+            printf( "The server sent less data than was asked for\n" );
+            return -1;
+        }
+        first = last;
+    }
+    return 0;
+}
+
+
+//
+// Bring an existing local copy of a file up to date. Returns 1 if there is no local copy to
+// update, otherwise as receive_file().
+//
+static int update_file(
+    const char *file_name,
+          int   socket_handle,
+    ServerSet  *servers,
+    const char *output_name,
+    const transfer_options *options )
+{
+    tftp_options request_options;
+    int   server = -1;
+    int   handle;
+    int   status = -1;
+    long  change_count;
+    long  changed_bytes = 0;
+    long  i;
+    patch_range  *changes = NULL;
+    update_sink   signatures;
+    TftpSink      sink;
+    tftp_reply    reply;
+
+    if( (handle = open( output_name, O_RDWR )) == -1 ) return 1;
+
+    TftpSession_initialize_options( &request_options );
+    TftpSession_add_option( &request_options, "signatures", "crc32c" );
+    TftpSession_add_option( &request_options, "digest", "crc32c" );
+    request_options.verify_digest = 1;
+    open_update( &signatures, SINK_MEMORY, output_name, &sink );
+    status = fetch( file_name, socket_handle, servers, &server,
+                    &request_options, &sink, &reply, NULL );
+    TftpSink_close( &signatures.file );
+
+    // A server that doesn't offer signatures has sent the whole file.
+    if( signatures.mode == SINK_FILE ) {
+        status = check_digest( status, &reply, output_name );
+        goto done;
+    }
+    if( status != 0 ) goto done;
+    status = -1;
+    if( !reply.have_digest || (off_t)( signatures.memory.written / 4 ) !=
+        ( reply.file_size + reply.block_size - 1 ) / reply.block_size ) {
+        printf( "The server sent an unusable signature list\n" );
+        goto done;
+    }
+    if( (change_count = find_changes( handle, &signatures.memory, &reply, &changes )) == -1 ) {
+        printf( "Out of memory\n" );
+        goto done;
+    }
+    for( i = 0; i < change_count; ++i ) changed_bytes += (long)changes[i].length;
+
+    // The result must match the digest the server sent with the signatures.
+    status = fetch_changes( file_name, socket_handle, servers, &server,
+                            handle, output_name, changes, change_count, &reply );
+    if( status == 0 &&
+        ( ftruncate( handle, reply.file_size ) == -1 ||
+          local_digest( handle, 0, reply.file_size ) != (long long)reply.digest ) ) {
+        status = 1;
+    }
+    if( status == 0 ) {
+        printf( "Updated %s: %ld of %lld bytes changed\n",
+                output_name, changed_bytes, (long long)reply.file_size );
+    }
+    else if( status == 1 ) {
+        printf( "The update of %s failed; fetching the whole file\n", output_name );
+        status = fetch_file( file_name, socket_handle, servers, output_name, options, NULL );
+    }
+
+done:
+    free( changes );
+    free( signatures.memory.memory );
+    close( handle );
+    return status;
+}
+
+
+//! Receive a file from the server.
+/*!
+ * If the server stops answering, the file is fetched again from another server.
+ *
+ * \param file_name The name of the file to receive from the server.
+ * \param socket_handle The UDP socket to use for communication with the server.
+ * \param servers The servers to choose from.
+ * \param options The options to ask the server for.
+ * \param prefetch How this transfer overlaps with the next one in a batch, or NULL. It is not
+ * used when updating files. A session sent ahead for this file is used (or closed) and cleared.
+ *
+ * \return 0 if the transfer is successful; -1 otherwise.
+ */
+int receive_file(
+    const char *file_name,
+          int   socket_handle,
+    ServerSet  *servers,
+    const transfer_options *options,
+    prefetch_state *prefetch )
+{
+    const char *simple_file_name;
+    char   output_name[PATH_MAX];
+    int    status;
+    size_t attempt;
+
+    // Strip paths off file name.
+    // TODO: This doesn't handle trailing slash characters very well but presumably they would cause errors anyway.
+    simple_file_name = strrchr( file_name, '/' );
+    if( simple_file_name == NULL )
+        simple_file_name = file_name;
+    else
+        simple_file_name = simple_file_name + 1;
+
+    if( options->output_directory != NULL ) {
+        if( snprintf( output_name, sizeof( output_name ), "%s/%s",
+                      options->output_directory, simple_file_name ) >=
+            (int)sizeof( output_name ) ) {
+            printf( "The output path is too long: %s/%s\n",
+                    options->output_directory, simple_file_name );
+
+            // A request sent ahead of time for this file is not needed.
+            if( prefetch != NULL && prefetch->session != NULL ) {
+                TftpSession_close( prefetch->session );
+                prefetch->session = NULL;
+            }
+            return -1;
+        }
+        simple_file_name = output_name;
+    }
+
+    for( attempt = 0; attempt < servers->count; ++attempt ) {
+        status = 1;
+        if( options->update ) {
+            status = update_file( file_name, socket_handle, servers, simple_file_name, options );
+        }
+        if( status == 1 ) {
+            status = fetch_file(
+                file_name, socket_handle, servers, simple_file_name, options, prefetch );
+        }
+        if( status != FETCH_TIMED_OUT ) break;
+    }
+    return status == 0 ? 0 : -1;
+}
@@ -0,0 +1,192 @@
+/*!
+ * \file server_set.c
+ * \author Peter C. Chapin
+ * \brief Implementation of the set of servers files may be fetched from.
+ *
+ * Times to first reply are smoothed as TCP smooths round trip times (RFC 6298): the estimate
+ * moves an eighth of the way toward each sample and the deviation a quarter of the way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "server_set.h"
+
+// How long (us) a server is left out after its first failure. This doubles with each further
+// failure, up to MAX_BACKOFF.
+#define INITIAL_BACKOFF 1000000L
+#define MAX_BACKOFF    60000000L
+
+// Bounds (ms) on the time to wait for a measured server before sending again.
+#define MIN_TIMEOUT   50
+#define MAX_TIMEOUT 1000
+
+
+long long ServerSet_now( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+//
+// Add every address of one host to the set, skipping addresses already present.
+//
+static int add_host( ServerSet *object, const char *host, unsigned short port )
+{
+    struct addrinfo  hints;
+    struct addrinfo *results;
+    struct addrinfo *result;
+    struct sockaddr_in6 address;
+    server_entry *larger;
+    char   text[INET6_ADDRSTRLEN];
+    size_t i;
+
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family   = AF_INET6;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags    = AI_V4MAPPED | AI_ALL;
+    if( getaddrinfo( host, NULL, &hints, &results ) != 0 ) {
+        printf( "Can't find IP address for host name: %s!\n", host );
+        return -1;
+    }
+    for( result = results; result != NULL; result = result->ai_next ) {
+        address = *(struct sockaddr_in6 *)result->ai_addr;
+        address.sin6_port = htons( port );
+        for( i = 0; i < object->count; ++i ) {
+            if( memcmp( &object->servers[i].address.sin6_addr,
+                        &address.sin6_addr, sizeof( address.sin6_addr ) ) == 0 ) break;
+        }
+        if( i < object->count ) continue;
+
+        if( (larger = realloc(
+                 object->servers, ( object->count + 1 ) * sizeof( server_entry ) )) == NULL ) {
+            freeaddrinfo( results );
+            return -1;
+        }
+        object->servers = larger;
+        memset( &object->servers[object->count], 0, sizeof( server_entry ) );
+        object->servers[object->count].address = address;
+        object->servers[object->count].srtt    = -1;
+        inet_ntop( AF_INET6, &address.sin6_addr, text, sizeof( text ) );
+        snprintf( object->servers[object->count].name,
+                  sizeof( object->servers[object->count].name ), "%s (%s)", host, text );
+        ++object->count;
+    }
+    freeaddrinfo( results );
+    return 0;
+}
+
+
+int ServerSet_initialize( ServerSet *object, const char *host_list, unsigned short port )
+{
+    char  *hosts;
+    char  *host;
+    char  *next;
+
+    object->servers = NULL;
+    object->count   = 0;
+    if( (hosts = strdup( host_list )) == NULL ) return -1;
+    for( host = hosts; host != NULL; host = next ) {
+        if( (next = strchr( host, ',' )) != NULL ) *next++ = '\0';
+        if( *host == '\0' ) continue;
+
+        // A mirror that can't be resolved is skipped, as long as some other one can be.
+        add_host( object, host, port );
+    }
+    free( hosts );
+    return object->count > 0 ? 0 : -1;
+}
+
+
+void ServerSet_destroy( ServerSet *object )
+{
+    free( object->servers );
+    object->servers = NULL;
+    object->count   = 0;
+}
+
+
+size_t ServerSet_choose( const ServerSet *object, long long now, size_t targets[MAX_RACE] )
+{
+    size_t count = 0;
+    size_t best  = 0;
+    int    unmeasured = 0;
+    int    all = 1;
+    size_t i;
+
+    // If every server is being left out, try them all rather than give up.
+    for( i = 0; i < object->count; ++i ) {
+        if( object->servers[i].retry_at <= now ) all = 0;
+    }
+    for( i = 0; i < object->count && count < MAX_RACE; ++i ) {
+        if( !all && object->servers[i].retry_at > now ) continue;
+        if( object->servers[i].srtt < 0 ) unmeasured = 1;
+        if( count == 0 || ( object->servers[i].srtt >= 0 &&
+                            ( object->servers[targets[best]].srtt < 0 ||
+                              object->servers[i].srtt < object->servers[targets[best]].srtt ) ) ) {
+            best = count;
+        }
+        targets[count++] = i;
+    }
+    if( !unmeasured ) {
+        targets[0] = targets[best];
+        count = 1;
+    }
+    return count;
+}
+
+
+int ServerSet_timeout( const ServerSet *object, size_t index )
+{
+    const server_entry *server = &object->servers[index];
+    long timeout;
+
+    if( server->srtt < 0 ) return MAX_TIMEOUT;
+    timeout = ( server->srtt + 4 * server->rttvar ) / 1000;
+    if( timeout < MIN_TIMEOUT ) timeout = MIN_TIMEOUT;
+    if( timeout > MAX_TIMEOUT ) timeout = MAX_TIMEOUT;
+    return (int)timeout;
+}
+
+
+void ServerSet_answered( ServerSet *object, size_t index, long elapsed )
+{
+    server_entry *server = &object->servers[index];
+    long deviation;
+
+    if( server->srtt < 0 ) {
+        server->srtt   = elapsed;
+        server->rttvar = elapsed / 2;
+    }
+    else {
+        deviation = server->srtt > elapsed ? server->srtt - elapsed : elapsed - server->srtt;
+        server->rttvar += ( deviation - server->rttvar ) / 4;
+        server->srtt   += ( elapsed - server->srtt ) / 8;
+    }
+    server->failures = 0;
+    server->retry_at = 0;
+}
+
+
+void ServerSet_failed( ServerSet *object, size_t index, long long now )
+{
+    server_entry *server = &object->servers[index];
+    long backoff = INITIAL_BACKOFF;
+    int  i;
+
+    for( i = 0; i < server->failures && backoff < MAX_BACKOFF; ++i ) backoff *= 2;
+    if( backoff > MAX_BACKOFF ) backoff = MAX_BACKOFF;
+    ++server->failures;
+    server->retry_at = now + backoff;
+
+    // The server is measured again when it returns.
+    server->srtt = -1;
+}
@@ -0,0 +1,79 @@
+/*!
+ * \file server_set.h
+ * \author Peter C. Chapin
+ * \brief Interface to the set of servers (mirrors) files may be fetched from.
+ *
+ * The host names given to the client are resolved once, when the program starts, and every
+ * address found becomes a candidate server. Each transfer goes to the candidate with the
+ * lowest smoothed time to first reply. Candidates that have not been measured yet are raced:
+ * the request is sent to all of them at once and the first to answer serves the file. A
+ * server that stops answering is left out for a while, doubling each time it fails again, and
+ * is raced once more when it comes back.
+ */
+
+#ifndef SERVER_SET_H_INCLUDED
+#define SERVER_SET_H_INCLUDED
+
+#include <stddef.h>
+
+#include <arpa/inet.h>
+
+//! Largest number of servers a request is raced between.
+#define MAX_RACE 8
+
+//! One candidate server.
+typedef struct {
+    struct sockaddr_in6 address;  //!< Where requests are sent.
+    char      name[128];          //!< Host name and address, for messages.
+    long      srtt;               //!< Smoothed time to first reply (us), or -1 if not measured.
+    long      rttvar;             //!< Smoothed deviation of the time to first reply (us).
+    int       failures;           //!< Consecutive times the server did not answer.
+    long long retry_at;           //!< Time (us) before which the server is not used.
+} server_entry;
+
+//! The candidate servers.
+typedef struct {
+    server_entry *servers;  //!< The candidates, in the order given.
+    size_t        count;    //!< Number of candidates.
+} ServerSet;
+
+//! Return the current monotonic time in microseconds.
+long long ServerSet_now( void );
+
+//! Resolve a comma separated list of host names.
+/*!
+ * \param object The set to initialize.
+ * \param host_list Host names or addresses separated by commas.
+ * \param port The port every server listens on.
+ *
+ * \return 0 if at least one address was found; -1 otherwise (a message has been printed).
+ */
+int ServerSet_initialize( ServerSet *object, const char *host_list, unsigned short port );
+
+//! Release the memory held by a set.
+void ServerSet_destroy( ServerSet *object );
+
+//! Choose the servers to send a request to.
+/*!
+ * This is the fastest server that is not being left out, or all of those servers (up to
+ * MAX_RACE) if any of them has not been measured. If every server is being left out they are
+ * all tried.
+ *
+ * \param object The set to choose from.
+ * \param now The current time (us).
+ * \param targets Receives the indices of the chosen servers.
+ *
+ * \return The number of servers chosen (at least one).
+ */
+size_t ServerSet_choose( const ServerSet *object, long long now, size_t targets[MAX_RACE] );
+
+//! Return how long (ms) to wait for a server before sending again.
+int ServerSet_timeout( const ServerSet *object, size_t index );
+
+//! Note that a server answered a request after the given time (us).
+void ServerSet_answered( ServerSet *object, size_t index, long elapsed );
+
+//! Note that a server did not answer; it is left out for a while.
+void ServerSet_failed( ServerSet *object, size_t index, long long now );
+
+#endif // SERVER_SET_H_INCLUDED
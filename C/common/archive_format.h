@@ -0,0 +1,76 @@
+/*!
+ * \file archive_format.h
+ * \author Peter C. Chapin
+ * \brief Layout of the packed, read only archives the server can serve files from.
+ *
+ * An archive holds many files in one file so that serving one costs no open(), stat(), or
+ * close(), and no directory lookup in the kernel. It is written by mkarchive and mapped into
+ * memory whole by the server. It has four parts, each starting on an 8 byte boundary:
+ *
+ * - A header (archive_header).
+ * - The index: the hash of each file's path (archive_hash()), as entry_count + 1 64 bit keys
+ *   laid out in Eytzinger order. Slot 0 is unused and slot k has its children in slots 2k and
+ *   2k + 1, so a search walks down the array and the top levels of the tree, visited by every
+ *   search, share a handful of cache lines. Keys that are equal (different paths with the same
+ *   hash) are adjacent in the order of an in-order walk.
+ * - The entries (archive_entry), one per key and in the same slots.
+ * - The paths, without terminating nulls, followed by the contents of the files, one after the
+ *   other in path order.
+ *
+ * Integers are in the byte order of the machine that built the archive; the version doesn't
+ * match on a machine of the other order. Offsets are from the start of the archive.
+ */
+
+#ifndef ARCHIVE_FORMAT_H_INCLUDED
+#define ARCHIVE_FORMAT_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+//! The first eight bytes of every archive.
+#define ARCHIVE_MAGIC "TFTPPACK"
+
+//! The version of the layout described here.
+#define ARCHIVE_VERSION 1
+
+//! The start of an archive.
+typedef struct {
+    char     magic[8];        //!< ARCHIVE_MAGIC, without a terminating null.
+    uint32_t version;         //!< ARCHIVE_VERSION.
+    uint32_t reserved;        //!< Zero.
+    uint64_t entry_count;     //!< Number of files.
+    uint64_t keys_offset;     //!< Where the index starts.
+    uint64_t entries_offset;  //!< Where the entries start.
+    uint64_t names_offset;    //!< Where the paths start.
+    uint64_t data_offset;     //!< Where the contents of the files start.
+    uint64_t archive_size;    //!< Size of the whole archive.
+} archive_header;
+
+//! One file in an archive.
+typedef struct {
+    uint64_t offset;          //!< Where the file's contents start.
+    uint64_t size;            //!< Number of bytes in the file.
+    uint64_t name_offset;     //!< Where the file's path starts.
+    uint32_t name_length;     //!< Number of bytes in the path.
+    uint32_t digest;          //!< CRC-32C of the file.
+} archive_entry;
+
+//! Hash a path for the index (64 bit FNV-1a).
+/*!
+ * \param path A path relative to the archived directory, with components separated by single
+ * '/' characters and no "." or ".." components.
+ * \param length The number of bytes in the path.
+ */
+static inline uint64_t archive_hash( const char *path, size_t length )
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for( i = 0; i < length; ++i ) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+#endif // ARCHIVE_FORMAT_H_INCLUDED
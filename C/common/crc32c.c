@@ -0,0 +1,66 @@
+/*!
+ * \file crc32c.c
+ * \author Peter C. Chapin
+ * \brief Implementation of the CRC-32C checksum.
+ *
+ */
+
+#include <string.h>
+
+#include "crc32c.h"
+
+// The CRC of each possible nibble, for the reflected polynomial 0x82F63B78.
+static const uint32_t nibble_table[16] = {
+    0x00000000, 0x105EC76F, 0x20BD8EDE, 0x30E349B1, 0x417B1DBC, 0x5125DAD3, 0x61C69362, 0x7198540D,
+    0x82F63B78, 0x92A8FC17, 0xA24BB5A6, 0xB21572C9, 0xC38D26C4, 0xD3D3E1AB, 0xE330A81A, 0xF36E6F75
+};
+
+
+static uint32_t crc32c_software( uint32_t crc, const unsigned char *data, size_t length )
+{
+    while( length-- > 0 ) {
+        crc ^= *data++;
+        crc = ( crc >> 4 ) ^ nibble_table[crc & 0x0F];
+        crc = ( crc >> 4 ) ^ nibble_table[crc & 0x0F];
+    }
+    return crc;
+}
+
+
+#if defined( __x86_64__ ) && defined( __GNUC__ )
+
+//
+// Eight bytes per instruction. The CRC32 instruction has a latency of three cycles, which a
+// single dependency chain can't hide, but even so this is an order of magnitude faster than
+// the table.
+//
+__attribute__(( target( "sse4.2" ) ))
+static uint32_t crc32c_hardware( uint32_t crc, const unsigned char *data, size_t length )
+{
+    uint64_t wide = crc;
+    uint64_t word;
+
+    while( length >= 8 ) {
+        memcpy( &word, data, 8 );
+        wide = __builtin_ia32_crc32di( wide, word );
+        data   += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)wide;
+    while( length-- > 0 ) {
+        crc = __builtin_ia32_crc32qi( crc, *data++ );
+    }
+    return crc;
+}
+
+#endif
+
+
+uint32_t crc32c( uint32_t crc, const void *data, size_t length )
+{
+    crc = ~crc;
+#if defined( __x86_64__ ) && defined( __GNUC__ )
+    if( __builtin_cpu_supports( "sse4.2" ) ) return ~crc32c_hardware( crc, data, length );
+#endif
+    return ~crc32c_software( crc, data, length );
+}
@@ -0,0 +1,28 @@
+/*!
+ * \file crc32c.h
+ * \author Peter C. Chapin
+ * \brief Interface to the CRC-32C (Castagnoli) checksum used for transfer digests.
+ *
+ */
+
+#ifndef CRC32C_H_INCLUDED
+#define CRC32C_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+//! Extend a CRC-32C with more data.
+/*!
+ * Start with a crc of zero. The result of one call may be passed to the next, so a digest can
+ * be computed incrementally as data arrives. On x86-64 processors with SSE 4.2 the CRC32
+ * instruction is used; elsewhere a small table is used.
+ *
+ * \param crc The CRC of the data so far.
+ * \param data The next bytes.
+ * \param length The number of bytes at data.
+ *
+ * \return The CRC of all the data.
+ */
+uint32_t crc32c( uint32_t crc, const void *data, size_t length );
+
+#endif // CRC32C_H_INCLUDED
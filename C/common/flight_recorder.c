@@ -0,0 +1,203 @@
+/*!
+ * \file flight_recorder.c
+ * \author Peter C. Chapin
+ * \brief Implementation of a per-transfer packet event recorder.
+ *
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "flight_recorder.h"
+
+// The number of events kept per transfer. At 16 bytes each this is 64 KiB.
+#define RECORDER_CAPACITY 4096
+
+// Link type for raw IPv6 packets in pcap files.
+#define LINKTYPE_IPV6 229
+
+// Bytes of synthesized header written for each packet in pcap output.
+#define PCAP_HEADER_LENGTH ( 40 + 8 + 4 )
+
+volatile sig_atomic_t flight_dump_requests = 0;
+
+static int           enabled = 0;
+static flight_format format  = FLIGHT_JSON;
+static char          directory[256];
+
+static const char *packet_names[] = { "?", "RRQ", "WRQ", "DATA", "ACK", "ERROR", "OACK" };
+
+
+static long long monotonic_microseconds( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+int FlightRecorder_configure( const char *specification )
+{
+    if( strncmp( specification, "pcap:", 5 ) == 0 ) {
+        format = FLIGHT_PCAP;
+        specification += 5;
+    }
+    else if( strncmp( specification, "json:", 5 ) == 0 ) {
+        format = FLIGHT_JSON;
+        specification += 5;
+    }
+    if( *specification == '\0' || strlen( specification ) >= sizeof( directory ) ) return -1;
+    strcpy( directory, specification );
+    enabled = 1;
+    return 0;
+}
+
+
+void FlightRecorder_initialize( FlightRecorder *object )
+{
+    object->events = enabled ? malloc( RECORDER_CAPACITY * sizeof( flight_event ) ) : NULL;
+    object->mask   = RECORDER_CAPACITY - 1;
+    object->count  = 0;
+    object->dump_generation = (unsigned)flight_dump_requests;
+}
+
+
+void FlightRecorder_destroy( FlightRecorder *object )
+{
+    free( object->events );
+    object->events = NULL;
+}
+
+
+void FlightRecorder_append(
+    FlightRecorder *object, flight_packet type, unsigned flags, uint32_t block, size_t length )
+{
+    flight_event *event = &object->events[object->count++ & object->mask];
+
+    event->timestamp = monotonic_microseconds( );
+    event->block     = block;
+    event->length    = length > 0xFFFF ? 0xFFFF : (uint16_t)length;
+    event->type      = (uint8_t)type;
+    event->flags     = (uint8_t)flags;
+}
+
+
+static void write_json( FILE *output, const FlightRecorder *object, size_t first )
+{
+    const flight_event *event;
+    size_t i;
+
+    fprintf( output, "{\"events\":%zu,\"overwritten\":%zu}\n", object->count - first, first );
+    for( i = first; i < object->count; ++i ) {
+        event = &object->events[i & object->mask];
+        fprintf( output,
+                 "{\"t_us\":%lld,\"dir\":\"%s\",\"type\":\"%s\",\"block\":%u,"
+                 "\"length\":%u,\"retransmit\":%s}\n",
+                 event->timestamp,
+                 ( event->flags & FLIGHT_SENT ) ? "tx" : "rx",
+                 event->type < sizeof( packet_names ) / sizeof( packet_names[0] ) ?
+                     packet_names[event->type] : "?",
+                 event->block,
+                 event->length,
+                 ( event->flags & FLIGHT_RETRANSMIT ) ? "true" : "false" );
+    }
+}
+
+
+static void put16( unsigned char *where, unsigned value )
+{
+    where[0] = (unsigned char)( value >> 8 );
+    where[1] = (unsigned char)( value & 0xFF );
+}
+
+
+//
+// Write a pcap file holding one truncated IPv6/UDP/TFTP packet per event. Timestamps are
+// converted from the monotonic clock using the current offset to the real time clock.
+//
+static void write_pcap(
+    FILE *output,
+    const FlightRecorder *object,
+    size_t first,
+    const struct sockaddr_in6 *local,
+    const struct sockaddr_in6 *remote )
+{
+    struct timespec now;
+    uint32_t global_header[6] = { 0xA1B2C3D4, 0x00040002, 0, 0, 65535, LINKTYPE_IPV6 };
+    uint32_t record_header[4];
+    unsigned char packet[PCAP_HEADER_LENGTH];
+    const flight_event *event;
+    const struct sockaddr_in6 *source;
+    const struct sockaddr_in6 *destination;
+    long long offset;
+    long long stamp;
+    size_t i;
+
+    clock_gettime( CLOCK_REALTIME, &now );
+    offset = (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000 - monotonic_microseconds( );
+
+    fwrite( global_header, sizeof( global_header ), 1, output );
+    for( i = first; i < object->count; ++i ) {
+        event = &object->events[i & object->mask];
+        source      = ( event->flags & FLIGHT_SENT ) ? local : remote;
+        destination = ( event->flags & FLIGHT_SENT ) ? remote : local;
+
+        memset( packet, 0, sizeof( packet ) );
+        packet[0] = 0x60;                                  // IPv6.
+        put16( &packet[4], 8u + event->length );           // Payload length.
+        packet[6] = IPPROTO_UDP;
+        packet[7] = 64;                                    // Hop limit.
+        memcpy( &packet[8],  &source->sin6_addr, 16 );
+        memcpy( &packet[24], &destination->sin6_addr, 16 );
+        put16( &packet[40], ntohs( source->sin6_port ) );
+        put16( &packet[42], ntohs( destination->sin6_port ) );
+        put16( &packet[44], 8u + event->length );          // UDP length. No checksum.
+        put16( &packet[48], event->type );
+        put16( &packet[50], event->block & 0xFFFF );
+
+        stamp = event->timestamp + offset;
+        record_header[0] = (uint32_t)( stamp / 1000000 );
+        record_header[1] = (uint32_t)( stamp % 1000000 );
+        record_header[2] = PCAP_HEADER_LENGTH;
+        record_header[3] = 40u + 8u + event->length;
+        fwrite( record_header, sizeof( record_header ), 1, output );
+        fwrite( packet, sizeof( packet ), 1, output );
+    }
+}
+
+
+int FlightRecorder_dump(
+    FlightRecorder *object,
+    unsigned identifier,
+    const struct sockaddr_in6 *local,
+    const struct sockaddr_in6 *remote )
+{
+    char   path[sizeof( directory ) + 64];
+    FILE  *output;
+    size_t first;
+
+    if( object->events == NULL ) return 0;
+    object->dump_generation = (unsigned)flight_dump_requests;
+
+    snprintf( path, sizeof( path ), "%s/flight-%ld-%u.%s",
+              directory, (long)getpid( ), identifier, format == FLIGHT_PCAP ? "pcap" : "jsonl" );
+    if( (output = fopen( path, "wb" )) == NULL ) return -1;
+
+    first = object->count > object->mask + 1 ? object->count - ( object->mask + 1 ) : 0;
+    if( format == FLIGHT_PCAP ) {
+        write_pcap( output, object, first, local, remote );
+    }
+    else {
+        write_json( output, object, first );
+    }
+    return fclose( output ) == 0 ? 0 : -1;
+}
@@ -0,0 +1,113 @@
+/*!
+ * \file flight_recorder.h
+ * \author Peter C. Chapin
+ * \brief Interface to a per-transfer packet event recorder shared by the client and server.
+ *
+ */
+
+#ifndef FLIGHT_RECORDER_H_INCLUDED
+#define FLIGHT_RECORDER_H_INCLUDED
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+//! Kinds of packets the recorder notes.
+typedef enum {
+    FLIGHT_RRQ   = 1,
+    FLIGHT_DATA  = 3,
+    FLIGHT_ACK   = 4,
+    FLIGHT_ERROR = 5,
+    FLIGHT_OACK  = 6
+} flight_packet;
+
+//! Flags describing a recorded packet.
+enum {
+    FLIGHT_SENT       = 0x01,  //!< The packet was sent rather than received.
+    FLIGHT_RETRANSMIT = 0x02   //!< The packet is a retransmission.
+};
+
+//! Formats a recording can be written in.
+typedef enum {
+    FLIGHT_JSON,  //!< One JSON object per line.
+    FLIGHT_PCAP   //!< A pcap capture of synthesized IPv6/UDP/TFTP headers.
+} flight_format;
+
+//! One recorded packet.
+typedef struct {
+    long long timestamp;  //!< Monotonic time in microseconds.
+    uint32_t  block;      //!< Block number (32 bit internal numbering where known).
+    uint16_t  length;     //!< Length of the TFTP packet in bytes.
+    uint8_t   type;       //!< A flight_packet.
+    uint8_t   flags;      //!< FLIGHT_SENT and/or FLIGHT_RETRANSMIT.
+} flight_event;
+
+//! A bounded ring of packet events for one transfer.
+/*!
+ * When recording is disabled the ring has no storage and FlightRecorder_record() returns after
+ * a single test. When enabled, each transfer holds a fixed number of events; older events are
+ * overwritten so memory stays bounded no matter how long the transfer runs.
+ */
+typedef struct {
+    flight_event *events;     //!< Event storage, or NULL if recording is disabled.
+    size_t        mask;       //!< Capacity minus one. Capacity is a power of two.
+    size_t        count;      //!< Number of events ever recorded.
+    unsigned      dump_generation;  //!< Value of flight_dump_requests at the last dump.
+} FlightRecorder;
+
+//! Incremented (by a signal handler, for example) to ask every recorder to dump itself.
+extern volatile sig_atomic_t flight_dump_requests;
+
+//! Enable recording for transfers set up after this call.
+/*!
+ * \param specification A directory for the recordings, optionally preceded by "json:" or
+ * "pcap:" to choose the format. JSON lines are the default.
+ *
+ * \return 0 if successful; -1 if the specification is unusable.
+ */
+int FlightRecorder_configure( const char *specification );
+
+//! Prepare a recorder. Storage is allocated only if recording has been configured.
+void FlightRecorder_initialize( FlightRecorder *object );
+
+//! Release a recorder's storage.
+void FlightRecorder_destroy( FlightRecorder *object );
+
+//! Add an event to an enabled recorder. Use FlightRecorder_record() instead.
+void FlightRecorder_append(
+    FlightRecorder *object, flight_packet type, unsigned flags, uint32_t block, size_t length );
+
+//! Note one packet. Costs a single test when recording is disabled.
+static inline void FlightRecorder_record(
+    FlightRecorder *object, flight_packet type, unsigned flags, uint32_t block, size_t length )
+{
+    if( object->events != NULL ) FlightRecorder_append( object, type, flags, block, length );
+}
+
+//! Return non-zero if a dump has been requested since this recorder last dumped.
+static inline int FlightRecorder_dump_pending( const FlightRecorder *object )
+{
+    return object->events != NULL && object->dump_generation != (unsigned)flight_dump_requests;
+}
+
+//! Write the recorded events to the configured directory.
+/*!
+ * The file is named after the process and the given identifier and is replaced if it exists,
+ * so repeated dumps of one transfer leave only the latest snapshot.
+ *
+ * \param object The recorder to dump.
+ * \param identifier Distinguishes transfers within one process.
+ * \param local Local address of the transfer's socket (used in pcap output).
+ * \param remote Address of the peer.
+ *
+ * \return 0 if the dump was written (or recording is disabled); -1 otherwise.
+ */
+int FlightRecorder_dump(
+    FlightRecorder *object,
+    unsigned identifier,
+    const struct sockaddr_in6 *local,
+    const struct sockaddr_in6 *remote );
+
+#endif // FLIGHT_RECORDER_H_INCLUDED
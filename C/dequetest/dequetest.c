@@ -0,0 +1,235 @@
+/*!
+ * \file dequetest.c
+ * \author Peter C. Chapin
+ * \brief Check the server's work stealing deque, alone and under concurrent stealing.
+ *
+ * Usage: dequetest [thieves [items [rounds]]]
+ *
+ * The program first checks the deque's ordering and capacity from a single thread. It then
+ * runs the pattern the thread pool uses: one owner pushes items and pops some of them back
+ * (running an item itself when the deque is full) while the thief threads steal from the other
+ * end. The deque is kept small so that the owner and the thieves meet often, including on the
+ * last item, and indices wrap many times. Every item must be taken exactly once. Defaults are
+ * three thieves, a million items and ten rounds. The exit status is zero if every check passed.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include "work_deque.h"
+
+// Capacity of the deque under stress. Small, so that it is often full and often empty.
+#define STRESS_CAPACITY 64
+
+typedef struct {
+    WorkDeque     deque;
+    size_t        item_count;
+    atomic_uchar *taken;           // Number of times each item was taken.
+    atomic_int    owner_done;      // Non-zero once the owner has pushed and popped its last.
+    atomic_size_t stolen;          // Number of items taken by thieves.
+} stress_state;
+
+static int failures = 0;
+
+
+static void check( int condition, const char *description )
+{
+    if( !condition ) {
+        fprintf( stderr, "FAILED: %s\n", description );
+        ++failures;
+    }
+}
+
+
+// A small, fast generator. Each thread keeps its own state.
+static uint32_t next_random( uint32_t *state )
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+
+// ================
+// Single thread checks
+// ================
+
+static void check_sequential( void )
+{
+    WorkDeque deque;
+    int  values[8];
+    int  i;
+    long long size;
+
+    if( WorkDeque_initialize( &deque, 5 ) == -1 ) {
+        check( 0, "initialize" );
+        return;
+    }
+    check( WorkDeque_pop( &deque ) == NULL, "pop from an empty deque returns NULL" );
+    check( WorkDeque_steal( &deque ) == NULL, "steal from an empty deque returns NULL" );
+
+    // The capacity is rounded up to eight.
+    for( i = 0; i < 8; ++i ) {
+        values[i] = i;
+        check( WorkDeque_push( &deque, &values[i] ) == 0, "push into a deque with room" );
+    }
+    check( WorkDeque_push( &deque, &values[0] ) == -1, "push into a full deque fails" );
+    size = WorkDeque_size( &deque );
+    check( size == 8, "size of a full deque" );
+
+    // The owner takes the newest item and thieves take the oldest.
+    check( WorkDeque_pop( &deque ) == &values[7], "pop returns the newest item" );
+    check( WorkDeque_steal( &deque ) == &values[0], "steal returns the oldest item" );
+    check( WorkDeque_steal( &deque ) == &values[1], "steals are in push order" );
+    check( WorkDeque_pop( &deque ) == &values[6], "pops are in reverse push order" );
+
+    // Pushing after the steals reuses the slots the thieves freed.
+    check( WorkDeque_push( &deque, &values[6] ) == 0, "push after a steal" );
+    check( WorkDeque_push( &deque, &values[7] ) == 0, "push after a pop" );
+    check( WorkDeque_push( &deque, &values[0] ) == 0, "push into a wrapped slot" );
+    check( WorkDeque_push( &deque, &values[1] ) == 0, "push into the last free slot" );
+    check( WorkDeque_push( &deque, &values[2] ) == -1, "push into a full wrapped deque fails" );
+    for( i = 2; i < 7; ++i ) {
+        check( WorkDeque_steal( &deque ) == &values[i], "steal across the wrap" );
+    }
+    check( WorkDeque_pop( &deque ) == &values[1], "pop the last push" );
+    check( WorkDeque_pop( &deque ) == &values[0], "pop across the wrap" );
+    check( WorkDeque_pop( &deque ) == &values[7], "pop the last item" );
+    check( WorkDeque_pop( &deque ) == NULL, "pop after the deque drains" );
+    check( WorkDeque_steal( &deque ) == NULL, "steal after the deque drains" );
+    check( WorkDeque_size( &deque ) == 0, "size of a drained deque" );
+    WorkDeque_destroy( &deque );
+}
+
+
+// ================
+// Stress
+// ================
+
+static void take( stress_state *state, void *item )
+{
+    size_t index = (size_t)( (atomic_uchar *)item - state->taken );
+
+    if( index >= state->item_count ) {
+        check( 0, "a taken item is one that was pushed" );
+        return;
+    }
+    atomic_fetch_add_explicit( &state->taken[index], 1, memory_order_relaxed );
+}
+
+
+static void *thief_thread( void *raw )
+{
+    stress_state *state = raw;
+    void *item;
+    size_t stolen = 0;
+
+    for( ;; ) {
+        if( (item = WorkDeque_steal( &state->deque )) != NULL ) {
+            take( state, item );
+            ++stolen;
+            continue;
+        }
+        // A steal that loses a race also returns NULL, so only an empty deque ends the loop.
+        if( atomic_load( &state->owner_done ) && WorkDeque_size( &state->deque ) == 0 ) break;
+    }
+    atomic_fetch_add( &state->stolen, stolen );
+    return NULL;
+}
+
+
+static void run_owner( stress_state *state, uint32_t seed )
+{
+    size_t next = 0;
+    void  *item;
+    int    pops;
+
+    while( next < state->item_count ) {
+        // Push a burst, running items ourselves when the deque is full as the thread pool does.
+        int burst = 1 + next_random( &seed ) % 8;
+        while( burst-- > 0 && next < state->item_count ) {
+            item = &state->taken[next++];
+            if( WorkDeque_push( &state->deque, item ) == -1 ) take( state, item );
+        }
+        for( pops = next_random( &seed ) % 8; pops > 0; --pops ) {
+            if( (item = WorkDeque_pop( &state->deque )) == NULL ) break;
+            take( state, item );
+        }
+    }
+    // Race the thieves for whatever is left.
+    while( WorkDeque_size( &state->deque ) > 0 ) {
+        if( (item = WorkDeque_pop( &state->deque )) != NULL ) take( state, item );
+    }
+    atomic_store( &state->owner_done, 1 );
+}
+
+
+static void check_stress( int thieves, size_t items, int round )
+{
+    static stress_state state;
+    pthread_t *threads = malloc( thieves * sizeof( pthread_t ) );
+    size_t i;
+    size_t missing    = 0;
+    size_t duplicated = 0;
+    int    t;
+
+    state.item_count = items;
+    state.taken      = calloc( items, sizeof( atomic_uchar ) );
+    if( threads == NULL || state.taken == NULL ||
+        WorkDeque_initialize( &state.deque, STRESS_CAPACITY ) == -1 ) {
+        fprintf( stderr, "Out of memory\n" );
+        exit( EXIT_FAILURE );
+    }
+    atomic_store( &state.owner_done, 0 );
+    atomic_store( &state.stolen, 0 );
+
+    for( t = 0; t < thieves; ++t ) {
+        pthread_create( &threads[t], NULL, thief_thread, &state );
+    }
+    run_owner( &state, 2463534242u + round );
+    for( t = 0; t < thieves; ++t ) pthread_join( threads[t], NULL );
+
+    for( i = 0; i < items; ++i ) {
+        unsigned count = atomic_load( &state.taken[i] );
+        if( count == 0 ) ++missing;
+        if( count > 1 ) ++duplicated;
+    }
+    printf( "round %d: %zu items, %zu stolen, %zu missing, %zu taken more than once\n",
+            round, items, atomic_load( &state.stolen ), missing, duplicated );
+    check( missing == 0, "every item is taken" );
+    check( duplicated == 0, "no item is taken twice" );
+
+    WorkDeque_destroy( &state.deque );
+    free( (void *)state.taken );
+    free( threads );
+}
+
+
+int main( int argc, char **argv )
+{
+    int  thieves = argc > 1 ? atoi( argv[1] ) : 3;
+    long items   = argc > 2 ? atol( argv[2] ) : 1000000;
+    int  rounds  = argc > 3 ? atoi( argv[3] ) : 10;
+    int  round;
+
+    if( thieves < 1 || items < 1 || rounds < 1 ) {
+        fprintf( stderr, "Usage: %s [thieves [items [rounds]]]\n", argv[0] );
+        return EXIT_FAILURE;
+    }
+
+    check_sequential( );
+    for( round = 0; round < rounds; ++round ) {
+        check_stress( thieves, (size_t)items, round );
+    }
+    if( failures > 0 ) {
+        fprintf( stderr, "%d check(s) failed\n", failures );
+        return EXIT_FAILURE;
+    }
+    printf( "All checks passed\n" );
+    return EXIT_SUCCESS;
+}
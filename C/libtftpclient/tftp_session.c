@@ -0,0 +1,610 @@
+/*!
+ * \file tftp_session.c
+ * \author Peter C. Chapin
+ * \brief Implementation of non-blocking client sessions, each fetching one file.
+ *
+ * Packets are received into a buffer on the stack of TftpSession_process(), big enough for the
+ * largest block size, so an idle session holds no buffer of its own. With a window of one
+ * block, each block is acknowledged as it arrives and a repeated block is acknowledged again,
+ * as in RFC 1350. With a larger window (RFC 7440) the last block of each window is
+ * acknowledged, and a block that arrives ahead of its turn is answered with the acknowledgement
+ * of the last block received in order so the server goes back to it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "crc32c.h"
+#include "tftp_session.h"
+
+// TFTP operation codes.
+#define OPCODE_RRQ   1
+#define OPCODE_DATA  3
+#define OPCODE_ACK   4
+#define OPCODE_ERROR 5
+#define OPCODE_OACK  6
+
+// TFTP error codes sent to servers.
+#define ERROR_UNDEFINED      0
+#define ERROR_DISK_FULL      3
+#define ERROR_UNKNOWN_TID    5
+
+#define DEFAULT_BLOCK_SIZE   512
+#define MAX_BLOCK_SIZE       65464
+#define DEFAULT_TIMEOUT      1000
+#define DEFAULT_MAX_TIMEOUTS 5
+
+
+long long TftpSession_now( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+void TftpSession_initialize_options( tftp_options *options )
+{
+    memset( options, 0, sizeof( *options ) );
+    options->timeout        = DEFAULT_TIMEOUT;
+    options->max_timeouts   = DEFAULT_MAX_TIMEOUTS;
+    options->resend_request = 1;
+}
+
+
+int TftpSession_add_option( tftp_options *options, const char *name, const char *value )
+{
+    size_t name_length  = strlen( name ) + 1;
+    size_t value_length = strlen( value ) + 1;
+
+    if( options->length + name_length + value_length > TFTP_MAX_REQUEST_LENGTH ) return -1;
+    memcpy( options->block + options->length, name, name_length );
+    memcpy( options->block + options->length + name_length, value, value_length );
+    options->length += (int)( name_length + value_length );
+    return 0;
+}
+
+
+// ===============
+// Sending packets
+// ===============
+
+static void send_packet(
+    TftpSession *object, const void *packet, size_t length, const struct sockaddr_in6 *address )
+{
+    // A failed send is treated like a lost packet; the timeout recovers.
+    sendto( object->socket_handle, packet, length, 0,
+            (const struct sockaddr *)address, sizeof( *address ) );
+}
+
+
+//
+// Send an ERROR packet. The message is short enough that the packet always fits.
+//
+static void send_error( TftpSession *object, const struct sockaddr_in6 *address,
+                        unsigned code, const char *message )
+{
+    unsigned char packet[64];
+    size_t length = strlen( message ) + 1;
+
+    packet[0] = 0;
+    packet[1] = OPCODE_ERROR;
+    packet[2] = (unsigned char)( code >> 8 );
+    packet[3] = (unsigned char)( code & 0xFF );
+    memcpy( packet + 4, message, length );
+    send_packet( object, packet, 4 + length, address );
+    FlightRecorder_record( &object->recorder, FLIGHT_ERROR, FLIGHT_SENT, 0, 4 + length );
+}
+
+
+//
+// Acknowledge a block (or the OACK, as block zero).
+//
+static void send_ack( TftpSession *object, unsigned block, unsigned flags )
+{
+    object->ack[0] = 0;
+    object->ack[1] = OPCODE_ACK;
+    object->ack[2] = (unsigned char)( ( block >> 8 ) & 0xFF );
+    object->ack[3] = (unsigned char)( block & 0xFF );
+    send_packet( object, object->ack, sizeof( object->ack ), &object->server_tid );
+    FlightRecorder_record( &object->recorder, FLIGHT_ACK, FLIGHT_SENT | flags,
+                           block & 0xFFFF, sizeof( object->ack ) );
+    object->unacknowledged = 0;
+}
+
+
+// ==================
+// Ending the session
+// ==================
+
+//
+// End a session. A successful session is checked first: a compressed stream must be complete,
+// and a whole file must match the server's digest if it was to be verified.
+//
+static void finish( TftpSession *object, tftp_failure failure, const char *message )
+{
+    if( failure == TFTP_FAILURE_NONE && object->inflating && !object->expanded ) {
+        failure = TFTP_FAILURE_DAMAGED;
+        message = "The compressed data was incomplete";
+    }
+    if( failure == TFTP_FAILURE_NONE && object->verify_digest && object->reply.have_digest &&
+        !object->reply.signatures && !object->reply.ranges &&
+        object->digest != object->reply.digest ) {
+        failure = TFTP_FAILURE_DIGEST;
+        snprintf( object->error_message, sizeof( object->error_message ),
+                  "Digest mismatch: expected crc32c:%08x, received crc32c:%08x",
+                  (unsigned)object->reply.digest, (unsigned)object->digest );
+        message = NULL;
+    }
+    if( object->inflating ) {
+        inflateEnd( &object->inflater );
+        object->inflating = 0;
+    }
+    if( object->block_count > 0 && TftpSink_close( object->sink ) == -1 &&
+        failure == TFTP_FAILURE_NONE ) {
+        failure = TFTP_FAILURE_SINK;
+        message = "The received data could not be stored";
+    }
+    if( message != NULL ) {
+        snprintf( object->error_message, sizeof( object->error_message ), "%s", message );
+    }
+    object->failure = failure;
+    object->status  = failure == TFTP_FAILURE_NONE ? TFTP_SESSION_DONE : TFTP_SESSION_FAILED;
+    object->statistics.finished = TftpSession_now( );
+}
+
+
+//
+// End a session that the server is still sending to, and tell the server to stop.
+//
+static void abandon( TftpSession *object, tftp_failure failure, unsigned code, const char *message )
+{
+    send_error( object, &object->server_tid, code, message );
+    finish( object, failure, message );
+}
+
+
+// =================
+// Receiving packets
+// =================
+
+//
+// Return non-zero if two addresses are the same transfer ID (address and port).
+//
+static int same_tid( const struct sockaddr_in6 *first, const struct sockaddr_in6 *second )
+{
+    return first->sin6_port == second->sin6_port &&
+           memcmp( &first->sin6_addr, &second->sin6_addr, sizeof( struct in6_addr ) ) == 0;
+}
+
+
+//
+// Return how long (us) after the request was sent the packet just received arrived. The
+// kernel's receive timestamp is used when there is one, so a reply that waited in the socket
+// (such as the reply to a request sent ahead of time) is measured correctly.
+//
+static long reply_time( const TftpSession *object )
+{
+    long elapsed;
+#ifdef SIOCGSTAMP
+    struct timeval arrival;
+
+    if( ioctl( object->socket_handle, SIOCGSTAMP, &arrival ) == 0 ) {
+        elapsed = ( arrival.tv_sec - object->sent_clock.tv_sec ) * 1000000L +
+                  ( arrival.tv_usec - object->sent_clock.tv_usec );
+        if( elapsed >= 0 ) return elapsed;
+    }
+#endif
+    elapsed = (long)( TftpSession_now( ) - object->statistics.started );
+    return elapsed;
+}
+
+
+//
+// Pick out the options the server accepted in an OACK. The server never sends options that
+// weren't asked for.
+//
+static void read_oack( TftpSession *object, const unsigned char *packet, size_t length )
+{
+    tftp_reply *reply = &object->reply;
+    const char *name  = (const char *)packet + 2;
+    const char *end   = (const char *)packet + length;
+    const char *value;
+    char *end_ptr;
+    long  number;
+
+    while( name < end && (value = memchr( name, '\0', (size_t)( end - name ) )) != NULL ) {
+        ++value;
+        if( value >= end || memchr( value, '\0', (size_t)( end - value ) ) == NULL ) break;
+        if( strcasecmp( name, "blksize" ) == 0 &&
+            (number = strtol( value, NULL, 10 )) >= 8 && number <= MAX_BLOCK_SIZE ) {
+            object->block_size = (unsigned)number;
+        }
+        if( strcasecmp( name, "windowsize" ) == 0 &&
+            (number = strtol( value, NULL, 10 )) >= 1 && number <= 65535 ) {
+            object->window_size = (unsigned)number;
+        }
+        if( strcasecmp( name, "digest" ) == 0 && strncmp( value, "crc32c:", 7 ) == 0 ) {
+            reply->digest = (uint32_t)strtoul( value + 7, NULL, 16 );
+            reply->have_digest = 1;
+        }
+        if( strcasecmp( name, "compress" ) == 0 && strcmp( value, "zlib" ) == 0 ) {
+            reply->compressed = 1;
+        }
+        if( strcasecmp( name, "signatures" ) == 0 && strncmp( value, "crc32c:", 7 ) == 0 ) {
+            reply->block_size = strtol( value + 7, &end_ptr, 10 );
+            if( *end_ptr == ':' && reply->block_size > 0 ) {
+                reply->file_size  = (off_t)strtoll( end_ptr + 1, NULL, 10 );
+                reply->signatures = 1;
+            }
+        }
+        if( strcasecmp( name, "tsize" ) == 0 ) {
+            reply->tsize = strtoll( value, NULL, 10 );
+        }
+        if( strcasecmp( name, "ranges" ) == 0 ) {
+            reply->file_size = (off_t)strtoll( value, NULL, 10 );
+            reply->ranges    = 1;
+        }
+        name = value + strlen( value ) + 1;
+    }
+}
+
+
+//
+// Pass the data from one block to the sink, expanding it first if the transfer is compressed.
+// The digest covers the data as delivered, so it is checked against the original file either
+// way. Returns -1 if the session was ended.
+//
+static int deliver( TftpSession *object, const unsigned char *data, size_t length )
+{
+    unsigned char expanded[16384];
+    size_t count;
+    int    status;
+
+    if( !object->inflating ) {
+        if( TftpSink_write( object->sink, data, length ) == -1 ) {
+            abandon( object, TFTP_FAILURE_SINK, ERROR_DISK_FULL, "Unable to store the data" );
+            return -1;
+        }
+        object->digest = crc32c( object->digest, data, length );
+        object->statistics.bytes_delivered += length;
+        return 0;
+    }
+
+    object->inflater.next_in  = (unsigned char *)data;
+    object->inflater.avail_in = (uInt)length;
+    while( !object->expanded ) {
+        object->inflater.next_out  = expanded;
+        object->inflater.avail_out = sizeof( expanded );
+        status = inflate( &object->inflater, Z_NO_FLUSH );
+        if( status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR ) {
+            abandon( object, TFTP_FAILURE_DAMAGED, ERROR_UNDEFINED,
+                     "The compressed data was damaged" );
+            return -1;
+        }
+        count = sizeof( expanded ) - object->inflater.avail_out;
+        if( TftpSink_write( object->sink, expanded, count ) == -1 ) {
+            abandon( object, TFTP_FAILURE_SINK, ERROR_DISK_FULL, "Unable to store the data" );
+            return -1;
+        }
+        object->digest = crc32c( object->digest, expanded, count );
+        object->statistics.bytes_delivered += count;
+        if( status == Z_STREAM_END ) object->expanded = 1;
+        if( object->inflater.avail_in == 0 && object->inflater.avail_out > 0 ) break;
+    }
+    return 0;
+}
+
+
+static void handle_oack( TftpSession *object, const unsigned char *packet, size_t length )
+{
+    FlightRecorder_record( &object->recorder, FLIGHT_OACK, 0, 0, length );
+
+    // A repeated OACK means the acknowledgement of the first was lost.
+    if( object->block_count > 0 ) return;
+    if( object->oack_seen ) {
+        send_ack( object, 0, FLIGHT_RETRANSMIT );
+        return;
+    }
+    object->oack_seen = 1;
+    read_oack( object, packet, length );
+    if( object->reply.compressed ) {
+        memset( &object->inflater, 0, sizeof( object->inflater ) );
+        if( inflateInit( &object->inflater ) != Z_OK ) {
+            abandon( object, TFTP_FAILURE_SYSTEM, ERROR_UNDEFINED,
+                     "Unable to start decompression" );
+            return;
+        }
+        object->inflating = 1;
+    }
+    send_ack( object, 0, 0 );
+}
+
+
+static void handle_data( TftpSession *object, const unsigned char *packet, size_t length )
+{
+    unsigned block    = ( (unsigned)packet[2] << 8 ) | packet[3];
+    unsigned expected = ( object->block_count + 1 ) & 0xFFFF;
+    size_t   data_length = length - 4;
+
+    // Anything but the next block is a repeat or a sign that blocks were lost.
+    if( block != expected ) {
+        FlightRecorder_record( &object->recorder, FLIGHT_DATA, FLIGHT_RETRANSMIT, block, length );
+        ++object->statistics.duplicates;
+        if( object->window_size == 1 ) {
+            send_ack( object, block, FLIGHT_RETRANSMIT );
+        }
+        else if( ( ( block - expected ) & 0xFFFF ) < 0x8000 && !object->gap_reported ) {
+            // One acknowledgement per gap restarts the server's window. The rest of the window
+            // would only send more of the same, which the server ignores anyway.
+            send_ack( object, object->block_count, FLIGHT_RETRANSMIT );
+            object->gap_reported = 1;
+        }
+        return;
+    }
+    object->gap_reported = 0;
+    FlightRecorder_record( &object->recorder, FLIGHT_DATA, 0, block, length );
+
+    // The sink is started by the first block, even if it is empty, so an empty file is made.
+    if( object->block_count == 0 &&
+        ( object->sink == NULL || TftpSink_start( object->sink, object ) == -1 ) ) {
+        abandon( object, TFTP_FAILURE_SINK, ERROR_DISK_FULL, "Unable to store the data" );
+        return;
+    }
+    ++object->block_count;
+    ++object->statistics.blocks;
+    object->statistics.bytes_received += data_length;
+    if( deliver( object, packet + 4, data_length ) == -1 ) return;
+
+    ++object->unacknowledged;
+    if( data_length < object->block_size || object->unacknowledged >= object->window_size ) {
+        send_ack( object, object->block_count, 0 );
+    }
+    if( data_length < object->block_size ) finish( object, TFTP_FAILURE_NONE, NULL );
+}
+
+
+//
+// Deal with one packet received on the session's socket.
+//
+static void handle_packet( TftpSession *object, const unsigned char *packet, size_t length,
+                           const struct sockaddr_in6 *source )
+{
+    unsigned char ack[4];
+    unsigned op_code;
+
+    // A reused socket may still hear from the server of its last transfer. That transfer
+    // succeeded, so the server can only be resending its final block because the last
+    // acknowledgement was lost. It is acknowledged again; anything else is ignored.
+    if( object->stale_tid.sin6_port != 0 && same_tid( source, &object->stale_tid ) ) {
+        if( length >= 4 && packet[0] == 0 && packet[1] == OPCODE_DATA ) {
+            ack[0] = 0;
+            ack[1] = OPCODE_ACK;
+            ack[2] = packet[2];
+            ack[3] = packet[3];
+            send_packet( object, ack, sizeof( ack ), source );
+        }
+        return;
+    }
+    if( length < 4 ) return;
+
+    // The first packet to arrive makes its source the server's transfer ID. Packets from
+    // anywhere else (for example, late retransmissions from an earlier transfer on this
+    // socket) are refused.
+    if( object->status == TFTP_SESSION_REQUESTED ) {
+        object->statistics.reply_time = reply_time( object );
+        object->server_tid = *source;
+        object->status     = TFTP_SESSION_RECEIVING;
+    }
+    else if( !same_tid( source, &object->server_tid ) ) {
+        send_error( object, source, ERROR_UNKNOWN_TID, "Unknown transfer ID" );
+        return;
+    }
+    object->timeouts = 0;
+    object->deadline = TftpSession_now( ) + 1000LL * object->timeout;
+
+    op_code = ( (unsigned)packet[0] << 8 ) | packet[1];
+    switch( op_code ) {
+    case OPCODE_ERROR:
+        FlightRecorder_record( &object->recorder, FLIGHT_ERROR, 0, 0, length );
+        snprintf( object->error_message, sizeof( object->error_message ), "%.*s",
+                  (int)strnlen( (const char *)packet + 4, length - 4 ), packet + 4 );
+        finish( object, TFTP_FAILURE_SERVER, NULL );
+        break;
+
+    case OPCODE_OACK:
+        handle_oack( object, packet, length );
+        break;
+
+    case OPCODE_DATA:
+        handle_data( object, packet, length );
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+//
+// Send the request or the last acknowledgement again, or give up.
+//
+static void handle_timeout( TftpSession *object, long long now )
+{
+    if( ++object->timeouts > object->max_timeouts ||
+        ( object->status == TFTP_SESSION_REQUESTED && !object->resend_request ) ) {
+        if( object->status == TFTP_SESSION_RECEIVING ) {
+            finish( object, TFTP_FAILURE_TIMED_OUT, "The server stopped answering" );
+        }
+        else {
+            finish( object, TFTP_FAILURE_TIMED_OUT, "No reply from the server" );
+        }
+        return;
+    }
+    if( object->status == TFTP_SESSION_REQUESTED ) {
+        send_packet( object, object->request, object->request_length, &object->server_address );
+        FlightRecorder_record( &object->recorder, FLIGHT_RRQ, FLIGHT_SENT | FLIGHT_RETRANSMIT, 0,
+                               object->request_length );
+        ++object->statistics.requests;
+    }
+    else {
+        send_packet( object, object->ack, sizeof( object->ack ), &object->server_tid );
+        FlightRecorder_record( &object->recorder, FLIGHT_ACK, FLIGHT_SENT | FLIGHT_RETRANSMIT,
+                               ( (unsigned)object->ack[2] << 8 ) | object->ack[3],
+                               sizeof( object->ack ) );
+        ++object->statistics.resent_acks;
+    }
+    object->deadline = now + 1000LL * object->timeout;
+}
+
+
+// ==========
+// Public API
+// ==========
+
+int TftpSession_open(
+    TftpSession *object,
+    int socket_handle,
+    const struct sockaddr_in6 *server,
+    const char *file_name,
+    const tftp_options *options,
+    TftpSink *sink )
+{
+    size_t name_length = strlen( file_name ) + 1;
+
+    memset( object, 0, sizeof( *object ) );
+    object->request_length = 2 + name_length + 6 + (size_t)options->length;
+    if( object->request_length > TFTP_MAX_REQUEST_LENGTH ) {
+        snprintf( object->error_message, sizeof( object->error_message ),
+                  "The file name is too long" );
+        return -1;
+    }
+    object->request[0] = 0;
+    object->request[1] = OPCODE_RRQ;
+    memcpy( object->request + 2, file_name, name_length );
+    memcpy( object->request + 2 + name_length, "octet", 6 );
+    memcpy( object->request + 2 + name_length + 6, options->block, (size_t)options->length );
+
+    if( socket_handle == -1 ) {
+        if( (socket_handle = socket( PF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0 )) == -1 ) {
+            snprintf( object->error_message, sizeof( object->error_message ),
+                      "Unable to create socket: %s", strerror( errno ) );
+            return -1;
+        }
+        object->owns_socket = 1;
+    }
+    fcntl( socket_handle, F_SETFL, fcntl( socket_handle, F_GETFL ) | O_NONBLOCK );
+
+    object->status         = TFTP_SESSION_REQUESTED;
+    object->socket_handle  = socket_handle;
+    object->server_address = *server;
+    object->stale_tid      = options->stale_tid;
+    object->sink           = sink;
+    object->reply.tsize    = -1;
+    object->block_size     = DEFAULT_BLOCK_SIZE;
+    object->window_size    = 1;
+    object->timeout        = options->timeout > 0 ? options->timeout : DEFAULT_TIMEOUT;
+    object->max_timeouts   = options->max_timeouts;
+    object->resend_request = options->resend_request;
+    object->verify_digest  = options->verify_digest;
+    object->statistics.reply_time = -1;
+    FlightRecorder_initialize( &object->recorder );
+
+    object->statistics.started = TftpSession_now( );
+    gettimeofday( &object->sent_clock, NULL );
+    object->deadline = object->statistics.started + 1000LL * object->timeout;
+    send_packet( object, object->request, object->request_length, server );
+    FlightRecorder_record( &object->recorder, FLIGHT_RRQ, FLIGHT_SENT, 0, object->request_length );
+    ++object->statistics.requests;
+    return 0;
+}
+
+
+void TftpSession_attach( TftpSession *object, TftpSink *sink )
+{
+    object->sink = sink;
+}
+
+
+long long TftpSession_deadline( const TftpSession *object )
+{
+    return object->deadline;
+}
+
+
+tftp_session_status TftpSession_process( TftpSession *object, long long now )
+{
+    unsigned char packet[MAX_BLOCK_SIZE + 4];
+    struct sockaddr_in6 source;
+    socklen_t source_size;
+    ssize_t   count;
+
+    while( object->status == TFTP_SESSION_REQUESTED || object->status == TFTP_SESSION_RECEIVING ) {
+        source_size = sizeof( source );
+        count = recvfrom( object->socket_handle, packet, sizeof( packet ), MSG_DONTWAIT,
+                          (struct sockaddr *)&source, &source_size );
+        if( count == -1 ) {
+            if( errno == EINTR ) continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK ) break;
+            snprintf( object->error_message, sizeof( object->error_message ),
+                      "Unable to receive: %s", strerror( errno ) );
+            finish( object, TFTP_FAILURE_SYSTEM, NULL );
+            break;
+        }
+        handle_packet( object, packet, (size_t)count, &source );
+    }
+    if( ( object->status == TFTP_SESSION_REQUESTED || object->status == TFTP_SESSION_RECEIVING ) &&
+        now >= object->deadline ) {
+        handle_timeout( object, now );
+    }
+    return object->status;
+}
+
+
+void TftpSession_cancel( TftpSession *object )
+{
+    unsigned char packet[4];
+    struct sockaddr_in6 source;
+    socklen_t source_size = sizeof( source );
+    ssize_t   count;
+
+    while( (count = recvfrom( object->socket_handle, packet, sizeof( packet ), MSG_DONTWAIT,
+                              (struct sockaddr *)&source, &source_size )) != -1 ) {
+        if( object->statistics.reply_time == -1 ) {
+            object->statistics.reply_time = reply_time( object );
+        }
+        if( count < 2 || packet[1] != OPCODE_ERROR ) {
+            send_error( object, &source, ERROR_UNKNOWN_TID, "Unknown transfer ID" );
+        }
+        source_size = sizeof( source );
+    }
+    if( object->status == TFTP_SESSION_RECEIVING ) {
+        send_error( object, &object->server_tid, ERROR_UNKNOWN_TID, "Unknown transfer ID" );
+    }
+    if( object->status == TFTP_SESSION_REQUESTED || object->status == TFTP_SESSION_RECEIVING ) {
+        finish( object, TFTP_FAILURE_CANCELLED, "Cancelled" );
+    }
+}
+
+
+void TftpSession_close( TftpSession *object )
+{
+    if( object->status == TFTP_SESSION_REQUESTED || object->status == TFTP_SESSION_RECEIVING ) {
+        TftpSession_cancel( object );
+    }
+    FlightRecorder_destroy( &object->recorder );
+    if( object->owns_socket ) close( object->socket_handle );
+    object->owns_socket = 0;
+}
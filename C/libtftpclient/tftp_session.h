@@ -0,0 +1,203 @@
+/*!
+ * \file tftp_session.h
+ * \author Peter C. Chapin
+ * \brief Interface to non-blocking client sessions, each fetching one file.
+ *
+ * A session sends a read request when it is opened and from then on does nothing unless it is
+ * processed. The caller waits, in its own event loop, for the session's socket to become
+ * readable or for its deadline to pass, and then calls TftpSession_process(), which handles
+ * every packet waiting and any timeout without blocking. Sessions share nothing, so one thread
+ * can run as many as it has descriptors for; each costs a socket and about a kilobyte, plus a
+ * zlib stream while a compressed transfer is expanded.
+ *
+ *     TftpSession_initialize_options( &options );
+ *     TftpSession_add_option( &options, "digest", "crc32c" );
+ *     options.verify_digest = 1;
+ *     TftpSink_file( &sink, "boot.img" );
+ *     if( TftpSession_open( &session, -1, &server, "boot.img", &options, &sink ) == 0 ) {
+ *         while( TftpSession_process( &session, TftpSession_now( ) ) <= TFTP_SESSION_RECEIVING )
+ *             ... wait for session.socket_handle or TftpSession_deadline( &session ) ...
+ *         TftpSession_close( &session );
+ *     }
+ *
+ * Received data goes to a sink (see tftp_sink.h). Options are passed to the server as given;
+ * those the session understands in the server's OACK are blksize, windowsize, tsize, digest,
+ * and compress (zlib data is expanded before it reaches the sink). The server's answers to the
+ * signatures and ranges options are reported but the data is delivered as it is.
+ */
+
+#ifndef TFTP_SESSION_H_INCLUDED
+#define TFTP_SESSION_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "flight_recorder.h"
+#include "tftp_sink.h"
+
+//! Largest request datagram servers are expected to accept.
+#define TFTP_MAX_REQUEST_LENGTH 512
+
+//! What a session is doing.
+typedef enum {
+    TFTP_SESSION_REQUESTED,  //!< The request was sent; nothing has come back yet.
+    TFTP_SESSION_RECEIVING,  //!< A server answered and the file is arriving.
+    TFTP_SESSION_DONE,       //!< The whole file was delivered to the sink.
+    TFTP_SESSION_FAILED      //!< The session ended without the whole file (see failure).
+} tftp_session_status;
+
+//! Why a session failed.
+typedef enum {
+    TFTP_FAILURE_NONE,       //!< It didn't.
+    TFTP_FAILURE_TIMED_OUT,  //!< The server didn't answer, or stopped answering.
+    TFTP_FAILURE_SERVER,     //!< The server sent an ERROR packet.
+    TFTP_FAILURE_SINK,       //!< The sink could not store the data.
+    TFTP_FAILURE_DAMAGED,    //!< Compressed data could not be expanded or was incomplete.
+    TFTP_FAILURE_DIGEST,     //!< The data does not match the server's digest.
+    TFTP_FAILURE_SYSTEM,     //!< A system call failed (see error_message).
+    TFTP_FAILURE_CANCELLED   //!< TftpSession_cancel() was called.
+} tftp_failure;
+
+//! How a session is run. Prepare with TftpSession_initialize_options().
+typedef struct {
+    char   block[TFTP_MAX_REQUEST_LENGTH];  //!< Request options, as name and value strings.
+    int    length;          //!< Bytes used in block.
+    int    timeout;         //!< How long (ms) to wait for a packet before sending again.
+    int    max_timeouts;    //!< Consecutive timeouts after which the session fails.
+    int    resend_request;  //!< Non-zero to resend an unanswered request; otherwise the session
+                            //!< fails at the first timeout, so another server can be asked.
+    int    verify_digest;   //!< Check a whole file against the digest the server sends, if any.
+    struct sockaddr_in6 stale_tid;  //!< A server whose final DATA packets are acknowledged
+                                    //!< again, for sockets reused after a transfer (port 0 if
+                                    //!< none).
+} tftp_options;
+
+//! What the server said about a transfer in its OACK.
+typedef struct {
+    uint32_t  digest;       //!< CRC-32C of the file according to the server.
+    int       have_digest;  //!< Non-zero if the server sent a digest.
+    int       compressed;   //!< Non-zero if the data is a zlib stream.
+    int       signatures;   //!< Non-zero if the data is the file's signature list.
+    int       ranges;       //!< Non-zero if the data is the requested ranges of the file.
+    long      block_size;   //!< Size of the blocks described by the signature list.
+    off_t     file_size;    //!< Size of the file on the server, if signatures or ranges is set.
+    long long tsize;        //!< Number of bytes the server will send, or -1 if not known.
+} tftp_reply;
+
+//! Counters kept for each session.
+typedef struct {
+    long long started;          //!< Monotonic time (us) the request was sent.
+    long long finished;         //!< Monotonic time (us) the session ended, or 0.
+    long      reply_time;       //!< Time (us) from the request to the first reply, or -1.
+    uint64_t  bytes_received;   //!< Data bytes received in new blocks.
+    uint64_t  bytes_delivered;  //!< Bytes delivered to the sink (more if expanded).
+    uint32_t  blocks;           //!< New blocks received.
+    uint32_t  duplicates;       //!< Blocks received again or out of order.
+    uint32_t  requests;         //!< Requests sent.
+    uint32_t  resent_acks;      //!< Acknowledgements resent after a timeout.
+} tftp_statistics;
+
+//! One file being fetched.
+typedef struct TftpSession {
+    tftp_session_status status;  //!< What the session is doing.
+    tftp_failure failure;        //!< Why it failed, if it did.
+    char      error_message[128];  //!< The server's ERROR message or a local reason.
+    int       socket_handle;     //!< The socket; wait for it to be readable.
+    int       owns_socket;       //!< Non-zero if the session made the socket and closes it.
+    struct sockaddr_in6 server_address;  //!< Where the request was sent.
+    struct sockaddr_in6 server_tid;      //!< Where the server is sending from, once it has.
+    struct sockaddr_in6 stale_tid;       //!< See tftp_options.
+    TftpSink *sink;              //!< Where the data goes.
+    tftp_reply reply;            //!< What the server accepted.
+    tftp_statistics statistics;  //!< Counters.
+    FlightRecorder recorder;     //!< Packet history (empty unless recording is enabled).
+
+    // Protocol state.
+    unsigned  block_size;        //!< Negotiated block size.
+    unsigned  window_size;       //!< Negotiated window size.
+    int       timeout;           //!< See tftp_options.
+    int       max_timeouts;      //!< See tftp_options.
+    int       resend_request;    //!< See tftp_options.
+    int       verify_digest;     //!< See tftp_options.
+    int       timeouts;          //!< Consecutive timeouts.
+    int       oack_seen;         //!< Non-zero once an OACK was accepted.
+    uint32_t  block_count;       //!< Blocks received in order (32 bit, so it doesn't wrap).
+    unsigned  unacknowledged;    //!< Blocks received since the last acknowledgement.
+    int       gap_reported;      //!< Non-zero once a gap after block_count was acknowledged.
+    long long deadline;          //!< Monotonic time (us) at which to send again.
+    struct timeval sent_clock;   //!< Wall clock time of the request, for kernel timestamps.
+    unsigned char ack[4];        //!< The last acknowledgement, resent after a timeout.
+    size_t    request_length;    //!< Length of the request.
+    unsigned char request[TFTP_MAX_REQUEST_LENGTH];  //!< The request, kept for resending.
+
+    // Delivery.
+    int       inflating;         //!< Non-zero while inflater is in use.
+    int       expanded;          //!< Non-zero once the end of the zlib stream was seen.
+    z_stream  inflater;          //!< Decoder state for compressed transfers.
+    uint32_t  digest;            //!< CRC-32C of the data delivered so far.
+} TftpSession;
+
+//! Return the monotonic time (us) sessions measure deadlines with.
+long long TftpSession_now( void );
+
+//! Prepare options: none for the server, a 1 s timeout, five timeouts, the request resent.
+void TftpSession_initialize_options( tftp_options *options );
+
+//! Add an option for the server to a set of options.
+/*!
+ * \return 0 if successful; -1 if the options would no longer fit in a request.
+ */
+int TftpSession_add_option( tftp_options *options, const char *name, const char *value );
+
+//! Send a read request and start a session.
+/*!
+ * \param object The session.
+ * \param socket_handle A UDP (IPv6) socket for the session, or -1 to have one made. A socket
+ * given is not closed by the session. It is made non-blocking.
+ * \param server The address of the server.
+ * \param file_name The file to ask for.
+ * \param options How to run the session. They are copied.
+ * \param sink Where the data goes, or NULL if it is attached later (see TftpSession_attach()).
+ *
+ * \return 0 if the request was sent; -1 otherwise (nothing needs to be closed).
+ */
+int TftpSession_open(
+    TftpSession *object,
+    int socket_handle,
+    const struct sockaddr_in6 *server,
+    const char *file_name,
+    const tftp_options *options,
+    TftpSink *sink );
+
+//! Give a session opened without one its sink. This must be done before it is processed.
+void TftpSession_attach( TftpSession *object, TftpSink *sink );
+
+//! Return when (monotonic us) the session must be processed if no packet arrives first.
+long long TftpSession_deadline( const TftpSession *object );
+
+//! Handle the packets waiting on a session's socket and a timeout if its deadline has passed.
+/*!
+ * \param object The session.
+ * \param now The current time, from TftpSession_now().
+ *
+ * \return The session's status. Once it is TFTP_SESSION_DONE or TFTP_SESSION_FAILED the sink
+ * has been closed (if the session started it) and the session only needs to be closed.
+ */
+tftp_session_status TftpSession_process( TftpSession *object, long long now );
+
+//! Stop a session and tell every server that answered it to stop sending.
+/*!
+ * This may be called again later, after the session has ended, to turn away replies that
+ * arrive late (for instance from servers that lost a race).
+ */
+void TftpSession_cancel( TftpSession *object );
+
+//! Release what a session holds.
+void TftpSession_close( TftpSession *object );
+
+#endif // TFTP_SESSION_H_INCLUDED
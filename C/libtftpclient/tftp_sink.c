@@ -0,0 +1,138 @@
+/*!
+ * \file tftp_sink.c
+ * \author Peter C. Chapin
+ * \brief Implementation of the destinations a client session delivers received data to.
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "tftp_sink.h"
+
+
+void TftpSink_file( TftpSink *object, const char *path )
+{
+    memset( object, 0, sizeof( *object ) );
+    object->type   = TFTP_SINK_FILE;
+    object->path   = path;
+    object->handle = -1;
+}
+
+
+void TftpSink_memory( TftpSink *object )
+{
+    memset( object, 0, sizeof( *object ) );
+    object->type   = TFTP_SINK_MEMORY;
+    object->handle = -1;
+}
+
+
+void TftpSink_descriptor( TftpSink *object, int handle )
+{
+    memset( object, 0, sizeof( *object ) );
+    object->type   = TFTP_SINK_DESCRIPTOR;
+    object->handle = handle;
+}
+
+
+void TftpSink_callback(
+    TftpSink *object, tftp_sink_function function, tftp_sink_start start, void *context )
+{
+    memset( object, 0, sizeof( *object ) );
+    object->type     = TFTP_SINK_CALLBACK;
+    object->handle   = -1;
+    object->function = function;
+    object->start    = start;
+    object->context  = context;
+}
+
+
+int TftpSink_start( TftpSink *object, const struct TftpSession *session )
+{
+    if( object->type == TFTP_SINK_FILE && object->output == NULL ) {
+        if( (object->output = fopen( object->path, "w" )) == NULL ) return -1;
+    }
+    if( object->type == TFTP_SINK_CALLBACK && object->start != NULL ) {
+        return object->start( object->context, session );
+    }
+    return 0;
+}
+
+
+//
+// Write all of a block of data to a descriptor, waiting for it if it is non-blocking and full.
+//
+static int write_all( int handle, const unsigned char *data, size_t length )
+{
+    struct pollfd waiting;
+    ssize_t count;
+
+    while( length > 0 ) {
+        if( (count = write( handle, data, length )) == -1 ) {
+            if( errno == EINTR ) continue;
+            if( errno != EAGAIN && errno != EWOULDBLOCK ) return -1;
+            waiting.fd     = handle;
+            waiting.events = POLLOUT;
+            poll( &waiting, 1, -1 );
+            continue;
+        }
+        data   += count;
+        length -= (size_t)count;
+    }
+    return 0;
+}
+
+
+int TftpSink_write( TftpSink *object, const unsigned char *data, size_t length )
+{
+    unsigned char *larger;
+
+    switch( object->type ) {
+    case TFTP_SINK_FILE:
+        if( object->output == NULL && (object->output = fopen( object->path, "w" )) == NULL ) {
+            return -1;
+        }
+        if( length > 0 && fwrite( data, 1, length, object->output ) != length ) return -1;
+        break;
+
+    case TFTP_SINK_MEMORY:
+        if( object->written + length > object->capacity ) {
+            if( (larger = realloc( object->memory, 2 * object->capacity + length )) == NULL ) {
+                return -1;
+            }
+            object->memory   = larger;
+            object->capacity = 2 * object->capacity + length;
+        }
+        if( length > 0 ) memcpy( object->memory + object->written, data, length );
+        break;
+
+    case TFTP_SINK_DESCRIPTOR:
+        if( write_all( object->handle, data, length ) == -1 ) return -1;
+        break;
+
+    case TFTP_SINK_CALLBACK:
+        if( object->function( object->context, data, length ) == -1 ) return -1;
+        break;
+    }
+    object->written += length;
+    return 0;
+}
+
+
+int TftpSink_close( TftpSink *object )
+{
+    int status = 0;
+
+    if( object->type == TFTP_SINK_FILE && object->output != NULL ) {
+        if( fclose( object->output ) == EOF ) status = -1;
+        object->output = NULL;
+    }
+    return status;
+}
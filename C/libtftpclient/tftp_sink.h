@@ -0,0 +1,99 @@
+/*!
+ * \file tftp_sink.h
+ * \author Peter C. Chapin
+ * \brief Interface to the destinations a client session delivers received data to.
+ *
+ * A sink is filled in by one of the TftpSink_* constructors and handed to a session (see
+ * tftp_session.h). When the first block arrives the session starts the sink, then writes the
+ * file's data to it in order, expanded if the transfer was compressed, and closes it when the
+ * session ends. A session that receives no data leaves its sink alone, so the sessions raced
+ * for one file can share a sink. The caller owns the sink and keeps it until the session is
+ * closed; sinks can also be used directly, so a callback may pass data on to another sink.
+ */
+
+#ifndef TFTP_SINK_H_INCLUDED
+#define TFTP_SINK_H_INCLUDED
+
+#include <stddef.h>
+#include <stdio.h>
+
+struct TftpSession;
+
+//! Kinds of sink.
+typedef enum {
+    TFTP_SINK_FILE,        //!< A file, created (or truncated) when the first block arrives.
+    TFTP_SINK_MEMORY,      //!< A buffer that grows as data arrives.
+    TFTP_SINK_DESCRIPTOR,  //!< An open descriptor: a file, pipe, or socket.
+    TFTP_SINK_CALLBACK     //!< A function of the caller's.
+} tftp_sink_type;
+
+//! Receives data for a callback sink.
+/*!
+ * \param context The context given to TftpSink_callback().
+ * \param data The next part of the file.
+ * \param length The number of bytes in data, which may be 0.
+ *
+ * \return 0 if the data was taken; -1 to fail the transfer.
+ */
+typedef int (*tftp_sink_function)( void *context, const unsigned char *data, size_t length );
+
+//! Told, for a callback sink, that data is about to arrive.
+/*!
+ * \param context The context given to TftpSink_callback().
+ * \param session The session, whose reply member says what the server accepted.
+ *
+ * \return 0 to go on; -1 to fail the transfer.
+ */
+typedef int (*tftp_sink_start)( void *context, const struct TftpSession *session );
+
+//! A destination for received data.
+typedef struct {
+    tftp_sink_type type;      //!< What kind of sink this is.
+    const char    *path;      //!< File sinks: the file.
+    FILE          *output;    //!< File sinks: the open file, or NULL before the first block.
+    int            handle;    //!< Descriptor sinks: the descriptor (not closed by the sink).
+    unsigned char *memory;    //!< Memory sinks: the data. Released by the caller with free().
+    size_t         capacity;  //!< Memory sinks: the size of the buffer.
+    tftp_sink_function function;  //!< Callback sinks: the function.
+    tftp_sink_start start;        //!< Callback sinks: told when data starts, or NULL.
+    void          *context;   //!< Callback sinks: passed to the function.
+    size_t         written;   //!< Bytes written to the sink so far.
+} TftpSink;
+
+//! Make a sink that writes a file. The path must stay valid until the sink is closed.
+void TftpSink_file( TftpSink *object, const char *path );
+
+//! Make a sink that collects the data in memory.
+void TftpSink_memory( TftpSink *object );
+
+//! Make a sink that writes to an open descriptor.
+/*!
+ * The data is written as it arrives. A descriptor that can't take it at once (a full pipe, for
+ * instance) blocks the caller, even if it is non-blocking; use a callback to queue the data
+ * instead if that matters.
+ */
+void TftpSink_descriptor( TftpSink *object, int handle );
+
+//! Make a sink that passes the data to a function.
+void TftpSink_callback(
+    TftpSink *object, tftp_sink_function function, tftp_sink_start start, void *context );
+
+//! Get a sink ready for a session's data. A file sink creates its file.
+/*!
+ * \return 0 if successful; -1 if the sink can't take the data.
+ */
+int TftpSink_start( TftpSink *object, const struct TftpSession *session );
+
+//! Write data to a sink.
+/*!
+ * \return 0 if successful; -1 if the data could not be stored.
+ */
+int TftpSink_write( TftpSink *object, const unsigned char *data, size_t length );
+
+//! Finish with a sink. A file sink's file is closed; a memory sink keeps its data.
+/*!
+ * \return 0 if successful; -1 if buffered data could not be written.
+ */
+int TftpSink_close( TftpSink *object );
+
+#endif // TFTP_SINK_H_INCLUDED
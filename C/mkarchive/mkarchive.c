@@ -0,0 +1,343 @@
+/*!
+ * \file mkarchive.c
+ * \author Peter C. Chapin
+ * \brief Build a packed archive of a directory for the server to serve from.
+ *
+ * Usage: mkarchive directory archive
+ *
+ * Every regular file beneath the directory goes into the archive under its path relative to
+ * the directory (see archive_format.h). Symbolic links and special files are left out with a
+ * warning, as the server would refuse them anyway. The archive is written under a temporary
+ * name beside the one given and renamed over it once it is complete and on disk, so a server
+ * reloading its policy sees either the old archive or the new one, never part of one.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "archive_format.h"
+#include "crc32c.h"
+
+// The longest path kept. The server can't be asked for anything longer.
+#define MAX_PATH_LENGTH 512
+
+// Size of the buffer files are copied through.
+#define COPY_BUFFER_SIZE 65536
+
+typedef struct {
+    char    *path;
+    size_t   length;
+    uint64_t hash;
+    uint64_t size;
+    uint64_t offset;        // Where the file's contents go.
+    uint64_t name_offset;   // Where the file's path goes.
+    uint32_t digest;
+} member;
+
+static member *members      = NULL;
+static size_t  member_count = 0;
+static size_t  member_space = 0;
+
+
+static uint64_t align( uint64_t offset )
+{
+    return ( offset + 7 ) & ~(uint64_t)7;
+}
+
+
+//
+// Remember a file found beneath the directory. Returns -1 if there is no memory for it.
+//
+static int add_member( const char *path, size_t length, off_t size )
+{
+    member *bigger;
+
+    if( member_count == member_space ) {
+        member_space = member_space == 0 ? 1024 : 2 * member_space;
+        if( (bigger = realloc( members, member_space * sizeof( member ) )) == NULL ) return -1;
+        members = bigger;
+    }
+    if( (members[member_count].path = malloc( length + 1 )) == NULL ) return -1;
+    memcpy( members[member_count].path, path, length + 1 );
+    members[member_count].length = length;
+    members[member_count].hash   = archive_hash( path, length );
+    members[member_count].size   = (uint64_t)size;
+    ++member_count;
+    return 0;
+}
+
+
+//
+// Find the regular files in a directory and its subdirectories. The path of the directory,
+// relative to the top, is in path[0 .. length - 1]. Returns -1 if the directory can't be read.
+//
+static int scan_directory( int directory_handle, char *path, size_t length )
+{
+    DIR *directory;
+    struct dirent *entry;
+    struct stat information;
+    size_t name_length;
+    int    handle;
+    int    result = 0;
+
+    if( (directory = fdopendir( directory_handle )) == NULL ) {
+        perror( length == 0 ? "." : path );
+        close( directory_handle );
+        return -1;
+    }
+    while( result == 0 && (entry = readdir( directory )) != NULL ) {
+        if( strcmp( entry->d_name, "." ) == 0 || strcmp( entry->d_name, ".." ) == 0 ) continue;
+        name_length = strlen( entry->d_name );
+        if( length + 1 + name_length >= MAX_PATH_LENGTH ) {
+            fprintf( stderr, "Skipping %.*s/%s: path too long\n",
+                     (int)length, path, entry->d_name );
+            continue;
+        }
+        if( length > 0 ) path[length] = '/';
+        memcpy( path + length + ( length > 0 ), entry->d_name, name_length + 1 );
+        name_length += length + ( length > 0 );
+
+        if( fstatat( dirfd( directory ), entry->d_name, &information, AT_SYMLINK_NOFOLLOW ) ) {
+            perror( path );
+            result = -1;
+        }
+        else if( S_ISDIR( information.st_mode ) ) {
+            handle = openat( dirfd( directory ), entry->d_name,
+                             O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC );
+            if( handle == -1 ) {
+                perror( path );
+                result = -1;
+            }
+            else {
+                result = scan_directory( handle, path, name_length );
+            }
+        }
+        else if( S_ISREG( information.st_mode ) ) {
+            if( add_member( path, name_length, information.st_size ) == -1 ) {
+                fprintf( stderr, "Out of memory\n" );
+                result = -1;
+            }
+        }
+        else {
+            fprintf( stderr, "Skipping %s: not a regular file\n", path );
+        }
+        path[length] = '\0';
+    }
+    closedir( directory );
+    return result;
+}
+
+
+static int compare_paths( const void *left, const void *right )
+{
+    const member *a = *(const member * const *)left;
+    const member *b = *(const member * const *)right;
+
+    return strcmp( a->path, b->path );
+}
+
+
+static int compare_keys( const void *left, const void *right )
+{
+    const member *a = left;
+    const member *b = right;
+
+    if( a->hash != b->hash ) return a->hash < b->hash ? -1 : 1;
+    return strcmp( a->path, b->path );
+}
+
+
+//
+// Put the members, sorted by key, into the slots of the index in Eytzinger order: an in-order
+// walk of the tree rooted at slot k visits the slots in sorted order. Returns the index of the
+// next member to place.
+//
+static size_t place( member **slots, size_t k, size_t next )
+{
+    if( k > member_count ) return next;
+    next = place( slots, 2 * k, next );
+    slots[k] = &members[next++];
+    return place( slots, 2 * k + 1, next );
+}
+
+
+//
+// Copy a member's contents into the archive at its offset, computing its digest. Returns -1 if
+// the file can't be read or has changed size since it was found.
+//
+static int copy_member( int root_handle, int output_handle, member *item, unsigned char *buffer )
+{
+    uint64_t copied = 0;
+    ssize_t  count;
+    int      handle;
+
+    if( (handle = openat( root_handle, item->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC )) == -1 ) {
+        perror( item->path );
+        return -1;
+    }
+    item->digest = 0;
+    while( (count = read( handle, buffer, COPY_BUFFER_SIZE )) > 0 ) {
+        if( copied + (uint64_t)count > item->size ) break;
+        if( pwrite( output_handle, buffer, (size_t)count, (off_t)( item->offset + copied ) ) !=
+            count ) {
+            perror( "write" );
+            close( handle );
+            return -1;
+        }
+        item->digest = crc32c( item->digest, buffer, (size_t)count );
+        copied += (uint64_t)count;
+    }
+    if( count == -1 ) perror( item->path );
+    close( handle );
+    if( count != 0 || copied != item->size ) {
+        if( count != -1 ) fprintf( stderr, "%s changed while it was being archived\n", item->path );
+        return -1;
+    }
+    return 0;
+}
+
+
+//
+// Write the archive to an open file. Returns -1 if something could not be read or written.
+//
+static int write_archive( int root_handle, int output_handle )
+{
+    archive_header header;
+    archive_entry *entries = NULL;
+    uint64_t *keys    = NULL;
+    member  **by_path = NULL;
+    member  **slots   = NULL;
+    unsigned char *buffer = NULL;
+    uint64_t offset;
+    size_t   i;
+    int      result = -1;
+
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, ARCHIVE_MAGIC, sizeof( header.magic ) );
+    header.version        = ARCHIVE_VERSION;
+    header.entry_count    = member_count;
+    header.keys_offset    = align( sizeof( header ) );
+    header.entries_offset = header.keys_offset + ( member_count + 1 ) * sizeof( uint64_t );
+    header.names_offset   = header.entries_offset + ( member_count + 1 ) * sizeof( archive_entry );
+
+    if( (by_path = malloc( ( member_count + 1 ) * sizeof( member * ) )) == NULL ||
+        (slots   = calloc( member_count + 1, sizeof( member * ) )) == NULL ||
+        (keys    = calloc( member_count + 1, sizeof( uint64_t ) )) == NULL ||
+        (entries = calloc( member_count + 1, sizeof( archive_entry ) )) == NULL ||
+        (buffer  = malloc( COPY_BUFFER_SIZE )) == NULL ) {
+        fprintf( stderr, "Out of memory\n" );
+        goto done;
+    }
+
+    // Paths and contents are laid out in path order, so the files of a directory are together.
+    for( i = 0; i < member_count; ++i ) by_path[i] = &members[i];
+    qsort( by_path, member_count, sizeof( member * ), compare_paths );
+    offset = header.names_offset;
+    for( i = 0; i < member_count; ++i ) {
+        by_path[i]->name_offset = offset;
+        offset += by_path[i]->length;
+    }
+    header.data_offset = align( offset );
+    offset = header.data_offset;
+    for( i = 0; i < member_count; ++i ) {
+        by_path[i]->offset = offset;
+        offset += by_path[i]->size;
+    }
+    header.archive_size = offset;
+
+    for( i = 0; i < member_count; ++i ) {
+        if( pwrite( output_handle, by_path[i]->path, by_path[i]->length,
+                    (off_t)by_path[i]->name_offset ) != (ssize_t)by_path[i]->length ) {
+            perror( "write" );
+            goto done;
+        }
+        if( copy_member( root_handle, output_handle, by_path[i], buffer ) == -1 ) goto done;
+    }
+
+    // The index is sorted with the digests known, and written last.
+    qsort( members, member_count, sizeof( member ), compare_keys );
+    place( slots, 1, 0 );
+    for( i = 1; i <= member_count; ++i ) {
+        keys[i] = slots[i]->hash;
+        entries[i].offset      = slots[i]->offset;
+        entries[i].size        = slots[i]->size;
+        entries[i].name_offset = slots[i]->name_offset;
+        entries[i].name_length = (uint32_t)slots[i]->length;
+        entries[i].digest      = slots[i]->digest;
+    }
+    if( pwrite( output_handle, keys, ( member_count + 1 ) * sizeof( uint64_t ),
+                (off_t)header.keys_offset ) == -1 ||
+        pwrite( output_handle, entries, ( member_count + 1 ) * sizeof( archive_entry ),
+                (off_t)header.entries_offset ) == -1 ||
+        ftruncate( output_handle, (off_t)header.archive_size ) == -1 ||
+        pwrite( output_handle, &header, sizeof( header ), 0 ) != sizeof( header ) ||
+        fsync( output_handle ) == -1 ) {
+        perror( "write" );
+        goto done;
+    }
+    result = 0;
+
+done:
+    free( buffer );
+    free( entries );
+    free( keys );
+    free( slots );
+    free( by_path );
+    return result;
+}
+
+
+int main( int argc, char **argv )
+{
+    char  path[MAX_PATH_LENGTH];
+    char *temporary_name;
+    int   root_handle;
+    int   output_handle;
+    int   result;
+
+    if( argc != 3 ) {
+        fprintf( stderr, "Usage: %s directory archive\n", argv[0] );
+        return EXIT_FAILURE;
+    }
+    if( (root_handle = open( argv[1], O_RDONLY | O_DIRECTORY | O_CLOEXEC )) == -1 ) {
+        perror( argv[1] );
+        return EXIT_FAILURE;
+    }
+    path[0] = '\0';
+    if( scan_directory( dup( root_handle ), path, 0 ) == -1 ) return EXIT_FAILURE;
+
+    if( (temporary_name = malloc( strlen( argv[2] ) + 8 )) == NULL ) {
+        fprintf( stderr, "Out of memory\n" );
+        return EXIT_FAILURE;
+    }
+    sprintf( temporary_name, "%s.XXXXXX", argv[2] );
+    if( (output_handle = mkstemp( temporary_name )) == -1 ) {
+        perror( temporary_name );
+        return EXIT_FAILURE;
+    }
+    result = write_archive( root_handle, output_handle );
+    if( result == 0 && fchmod( output_handle, 0644 ) == -1 ) {
+        perror( temporary_name );
+        result = -1;
+    }
+    close( output_handle );
+    if( result == 0 && rename( temporary_name, argv[2] ) == -1 ) {
+        perror( argv[2] );
+        result = -1;
+    }
+    if( result == -1 ) {
+        unlink( temporary_name );
+        return EXIT_FAILURE;
+    }
+    printf( "%lu files archived in %s\n", (unsigned long)member_count, argv[2] );
+    return EXIT_SUCCESS;
+}
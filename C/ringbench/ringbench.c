@@ -0,0 +1,303 @@
+/*!
+ * \file ringbench.c
+ * \author Peter C. Chapin
+ * \brief Compare the server's lock-free Ring with a mutex protected queue.
+ *
+ * Usage: ringbench [producers [consumers [batch [items]]]]
+ *
+ * Each producer thread pushes the given number of items through the queue in batches and the
+ * consumer threads take them off in batches of the same size, sleeping when the queue is empty
+ * the way the server's workers do. The same run is timed twice: once through a Ring, sleeping
+ * in Ring_wait(), and once through a circular buffer guarded by a mutex with condition
+ * variables. The program reports the rate each queue sustained and checks that every item came
+ * out exactly once. Defaults are four producers, four consumers, batches of 16 (the server's
+ * dispatch batch size) and one million items per producer.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "ring.h"
+
+// Capacity of both queues. Small enough that producers sometimes find them full.
+#define QUEUE_CAPACITY 1024
+
+// The largest batch accepted on the command line.
+#define MAX_BATCH 256
+
+// Circular buffer guarded by a mutex. Producers wait while it is full; consumers while empty.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+    size_t          items[QUEUE_CAPACITY];
+    size_t          head;          // Index of the oldest item.
+    size_t          count;         // Number of items held.
+    int             closed;        // Non-zero once every producer has finished.
+} LockedQueue;
+
+typedef enum { USE_RING, USE_LOCKED } queue_kind;
+
+// State shared by every thread of one run.
+typedef struct {
+    queue_kind    kind;
+    Ring          ring;
+    LockedQueue   locked;
+    atomic_int    producers_done;
+    size_t        batch;
+    size_t        items_per_producer;
+    atomic_size_t consumed;
+    atomic_size_t checksum;        // Sum of every item consumed.
+} bench_state;
+
+typedef struct {
+    bench_state *state;
+    size_t       first_item;       // Items first_item .. first_item + items_per_producer - 1.
+} producer_argument;
+
+
+// ================
+// LockedQueue
+// ================
+
+static void LockedQueue_initialize( LockedQueue *object )
+{
+    pthread_mutex_init( &object->lock, NULL );
+    pthread_cond_init( &object->not_empty, NULL );
+    pthread_cond_init( &object->not_full, NULL );
+    object->head   = 0;
+    object->count  = 0;
+    object->closed = 0;
+}
+
+
+static void LockedQueue_destroy( LockedQueue *object )
+{
+    pthread_cond_destroy( &object->not_full );
+    pthread_cond_destroy( &object->not_empty );
+    pthread_mutex_destroy( &object->lock );
+}
+
+
+// Add up to count items, waiting while the queue is full. Returns the number added.
+static size_t LockedQueue_enqueue_batch( LockedQueue *object, const size_t *items, size_t count )
+{
+    size_t i;
+
+    pthread_mutex_lock( &object->lock );
+    while( object->count == QUEUE_CAPACITY ) {
+        pthread_cond_wait( &object->not_full, &object->lock );
+    }
+    if( count > QUEUE_CAPACITY - object->count ) count = QUEUE_CAPACITY - object->count;
+    for( i = 0; i < count; ++i ) {
+        object->items[( object->head + object->count + i ) % QUEUE_CAPACITY] = items[i];
+    }
+    object->count += count;
+    pthread_cond_broadcast( &object->not_empty );
+    pthread_mutex_unlock( &object->lock );
+    return count;
+}
+
+
+// Remove up to count items, waiting while the queue is empty. Returns zero once it is closed
+// and drained.
+static size_t LockedQueue_dequeue_batch( LockedQueue *object, size_t *items, size_t count )
+{
+    size_t i;
+
+    pthread_mutex_lock( &object->lock );
+    while( object->count == 0 && !object->closed ) {
+        pthread_cond_wait( &object->not_empty, &object->lock );
+    }
+    if( count > object->count ) count = object->count;
+    for( i = 0; i < count; ++i ) {
+        items[i] = object->items[( object->head + i ) % QUEUE_CAPACITY];
+    }
+    object->head   = ( object->head + count ) % QUEUE_CAPACITY;
+    object->count -= count;
+    if( count > 0 ) pthread_cond_broadcast( &object->not_full );
+    pthread_mutex_unlock( &object->lock );
+    return count;
+}
+
+
+static void LockedQueue_close( LockedQueue *object )
+{
+    pthread_mutex_lock( &object->lock );
+    object->closed = 1;
+    pthread_cond_broadcast( &object->not_empty );
+    pthread_mutex_unlock( &object->lock );
+}
+
+
+// ================
+// Threads
+// ================
+
+static void *producer_thread( void *raw )
+{
+    producer_argument *argument = raw;
+    bench_state *state = argument->state;
+    size_t items[MAX_BATCH];
+    size_t next = argument->first_item;
+    size_t last = argument->first_item + state->items_per_producer;
+    size_t count;
+    size_t sent;
+    size_t i;
+
+    while( next < last ) {
+        count = last - next < state->batch ? last - next : state->batch;
+        for( i = 0; i < count; ++i ) items[i] = next + i;
+        for( sent = 0; sent < count; ) {
+            if( state->kind == USE_RING ) {
+                size_t added = Ring_enqueue_batch( &state->ring, items + sent, count - sent );
+                // The server drops requests when its ring is full; here just let a consumer in.
+                if( added == 0 ) sched_yield( );
+                sent += added;
+            }
+            else {
+                sent += LockedQueue_enqueue_batch( &state->locked, items + sent, count - sent );
+            }
+        }
+        next += count;
+    }
+    return NULL;
+}
+
+
+static void *consumer_thread( void *raw )
+{
+    bench_state *state = raw;
+    size_t items[MAX_BATCH];
+    size_t count;
+    size_t sum;
+    size_t i;
+
+    for( ;; ) {
+        if( state->kind == USE_RING ) {
+            count = Ring_dequeue_batch( &state->ring, items, state->batch );
+            if( count == 0 ) {
+                // Producers are joined before producers_done is set, so an empty ring is final.
+                if( atomic_load( &state->producers_done ) && Ring_is_empty( &state->ring ) ) {
+                    break;
+                }
+                Ring_wait( &state->ring );
+                continue;
+            }
+        }
+        else {
+            count = LockedQueue_dequeue_batch( &state->locked, items, state->batch );
+            if( count == 0 ) break;
+        }
+        for( sum = 0, i = 0; i < count; ++i ) sum += items[i];
+        atomic_fetch_add_explicit( &state->checksum, sum, memory_order_relaxed );
+        atomic_fetch_add_explicit( &state->consumed, count, memory_order_relaxed );
+    }
+    return NULL;
+}
+
+
+static double now_seconds( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return now.tv_sec + now.tv_nsec / 1.0e9;
+}
+
+
+// Push every item through one kind of queue and report the rate. Returns 0 if every item was
+// consumed exactly once; -1 otherwise.
+static int run( bench_state *state, queue_kind kind, int producers, int consumers )
+{
+    pthread_t         *threads   = malloc( ( producers + consumers ) * sizeof( pthread_t ) );
+    producer_argument *arguments = malloc( producers * sizeof( producer_argument ) );
+    size_t total = (size_t)producers * state->items_per_producer;
+    size_t expected_checksum = total * ( total - 1 ) / 2;
+    double start;
+    double elapsed;
+    int    i;
+
+    if( threads == NULL || arguments == NULL ) {
+        fprintf( stderr, "Out of memory\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    state->kind = kind;
+    atomic_store( &state->producers_done, 0 );
+    atomic_store( &state->consumed, 0 );
+    atomic_store( &state->checksum, 0 );
+    if( kind == USE_RING ) {
+        if( Ring_initialize( &state->ring, QUEUE_CAPACITY, sizeof( size_t ) ) == -1 ) {
+            fprintf( stderr, "Unable to initialize the ring\n" );
+            exit( EXIT_FAILURE );
+        }
+    }
+    else {
+        LockedQueue_initialize( &state->locked );
+    }
+
+    start = now_seconds( );
+    for( i = 0; i < consumers; ++i ) {
+        pthread_create( &threads[producers + i], NULL, consumer_thread, state );
+    }
+    for( i = 0; i < producers; ++i ) {
+        arguments[i].state      = state;
+        arguments[i].first_item = (size_t)i * state->items_per_producer;
+        pthread_create( &threads[i], NULL, producer_thread, &arguments[i] );
+    }
+    for( i = 0; i < producers; ++i ) pthread_join( threads[i], NULL );
+    atomic_store( &state->producers_done, 1 );
+    if( kind == USE_RING ) Ring_close( &state->ring );
+    else LockedQueue_close( &state->locked );
+    for( i = 0; i < consumers; ++i ) pthread_join( threads[producers + i], NULL );
+    elapsed = now_seconds( ) - start;
+
+    if( kind == USE_RING ) Ring_destroy( &state->ring );
+    else LockedQueue_destroy( &state->locked );
+    free( arguments );
+    free( threads );
+
+    printf( "%-6s %8.3f s %12.0f items/s\n",
+            kind == USE_RING ? "ring" : "mutex", elapsed, total / elapsed );
+    if( atomic_load( &state->consumed ) != total ||
+        atomic_load( &state->checksum ) != expected_checksum ) {
+        fprintf( stderr, "%s: consumed %zu of %zu items (checksum %zu, expected %zu)\n",
+                 kind == USE_RING ? "ring" : "mutex", atomic_load( &state->consumed ), total,
+                 atomic_load( &state->checksum ), expected_checksum );
+        return -1;
+    }
+    return 0;
+}
+
+
+int main( int argc, char **argv )
+{
+    static bench_state state;
+    int producers = argc > 1 ? atoi( argv[1] ) : 4;
+    int consumers = argc > 2 ? atoi( argv[2] ) : 4;
+    long batch    = argc > 3 ? atol( argv[3] ) : 16;
+    long items    = argc > 4 ? atol( argv[4] ) : 1000000;
+    int  status   = EXIT_SUCCESS;
+
+    if( producers < 1 || consumers < 1 || batch < 1 || batch > MAX_BATCH || items < 1 ) {
+        fprintf( stderr,
+                 "Usage: %s [producers [consumers [batch (1-%d) [items per producer]]]]\n",
+                 argv[0], MAX_BATCH );
+        return EXIT_FAILURE;
+    }
+    state.batch              = (size_t)batch;
+    state.items_per_producer = (size_t)items;
+
+    printf( "%d producers, %d consumers, batches of %ld, %ld items per producer\n",
+            producers, consumers, batch, items );
+    if( run( &state, USE_RING, producers, consumers ) == -1 ) status = EXIT_FAILURE;
+    if( run( &state, USE_LOCKED, producers, consumers ) == -1 ) status = EXIT_FAILURE;
+    return status;
+}
@@ -0,0 +1,192 @@
+/*!
+ * \file admission.c
+ * \author Peter C. Chapin
+ * \brief Implementation of the admission stage.
+ *
+ * Token buckets are kept in a fixed table of four way sets, each one cache line, indexed by a
+ * hash of the source network. A source new to its set replaces the bucket used least recently
+ * and inherits the tokens that bucket has left rather than a full burst. Sources that keep
+ * evicting each other therefore share one bucket's rate instead of escaping the limit, and a
+ * flood from a few sources, which is what the rate limit is for, keeps its buckets. The table is
+ * lossy, but it never allocates, and a flood from many sources can't grow it.
+ *
+ * A pre-forked worker marks a transfer as its own while it serves it, so that if the worker
+ * dies the listener can release the transfer for it. Whichever of them clears the mark does
+ * the release, so the count can't be released twice.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "admission.h"
+
+// log2 of the number of token buckets. 4096 buckets of 16 bytes fill 64 KiB.
+#define BUCKET_BITS 12
+
+// log2 of the number of buckets in a set. Four buckets of 16 bytes fill a cache line.
+#define WAY_BITS 2
+#define WAYS ( 1 << WAY_BITS )
+
+// Token counts are kept in thousandths so that refills are exact in milliseconds.
+#define TOKEN 1000
+
+typedef struct {
+    uint64_t key;      // Source network, or zero if the slot is unused.
+    uint32_t tokens;   // Thousandths of a request.
+    uint32_t stamp;    // Low 32 bits of the time (ms) tokens was last brought up to date.
+} token_bucket;
+
+static token_bucket *buckets = NULL;
+static unsigned   rate_limit  = 0;
+static uint32_t   burst_limit = 0;
+static int        transfer_limit = 0;
+static atomic_int *active_transfers = NULL;
+static atomic_int *holding = NULL;   // Per holder, 1 while it serves a transfer it must release.
+static int holder = -1;              // This process's holder, or -1.
+
+
+int Admission_initialize( unsigned rate, unsigned burst, int limit, int holders )
+{
+    void *memory;
+
+    rate_limit  = rate;
+    burst_limit = ( burst > 0 ? burst : ( rate > 0 ? rate : 1 ) ) * TOKEN;
+    transfer_limit = limit;
+
+    if( rate_limit > 0 ) {
+        buckets = aligned_alloc( 64, ( (size_t)1 << BUCKET_BITS ) * sizeof( token_bucket ) );
+        if( buckets == NULL ) return -1;
+        memset( buckets, 0, ( (size_t)1 << BUCKET_BITS ) * sizeof( token_bucket ) );
+    }
+    if( transfer_limit > 0 ) {
+        memory = mmap( NULL, ( 1 + (size_t)holders ) * sizeof( atomic_int ),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+        if( memory == MAP_FAILED ) {
+            perror( "Unable to allocate transfer count" );
+            return -1;
+        }
+        active_transfers = memory;
+        holding = active_transfers + 1;
+        atomic_init( active_transfers, 0 );
+    }
+    return 0;
+}
+
+
+//
+// Return the source network of an address: the /24 of an IPv4 (mapped) address or the /64 of
+// an IPv6 address. The IPv4 keys are tagged so they can't collide with IPv6 prefixes.
+//
+static uint64_t source_network( const struct sockaddr_in6 *client_address )
+{
+    const unsigned char *address = client_address->sin6_addr.s6_addr;
+    uint64_t key = 0;
+    int i;
+
+    if( IN6_IS_ADDR_V4MAPPED( &client_address->sin6_addr ) ) {
+        return 0xFFFF000000000000ULL |
+            ( (uint64_t)address[12] << 16 ) | ( (uint64_t)address[13] << 8 ) | address[14];
+    }
+    for( i = 0; i < 8; ++i ) key = ( key << 8 ) | address[i];
+    return key;
+}
+
+
+//
+// Bring a bucket's tokens up to date. A rate of r requests per second refills r thousandths
+// per millisecond.
+//
+static void refill( token_bucket *bucket, uint32_t stamp )
+{
+    uint64_t tokens = bucket->tokens + (uint64_t)( stamp - bucket->stamp ) * rate_limit;
+
+    bucket->tokens = tokens > burst_limit ? burst_limit : (uint32_t)tokens;
+}
+
+
+admission_decision Admission_check( const struct sockaddr_in6 *client_address, long long now )
+{
+    token_bucket *set;
+    token_bucket *bucket;
+    uint64_t key;
+    uint32_t stamp = (uint32_t)now;
+    int way;
+
+    if( rate_limit > 0 ) {
+        key = source_network( client_address );
+        set = &buckets[( ( key * 0x9E3779B97F4A7C15ULL ) >> ( 64 - BUCKET_BITS + WAY_BITS ) )
+                       << WAY_BITS];
+        for( way = 0; way < WAYS && set[way].key != key; ++way ) ;
+        if( way < WAYS ) {
+            bucket = &set[way];
+            refill( bucket, stamp );
+        }
+        else {
+            // Take an unused bucket, or else the one used least recently.
+            bucket = set;
+            for( way = 1; way < WAYS && bucket->key != 0; ++way ) {
+                if( set[way].key == 0 ||
+                    (uint32_t)( stamp - set[way].stamp ) > (uint32_t)( stamp - bucket->stamp ) ) {
+                    bucket = &set[way];
+                }
+            }
+            if( bucket->key == 0 ) bucket->tokens = burst_limit;
+            else refill( bucket, stamp );
+            bucket->key = key;
+        }
+        bucket->stamp = stamp;
+
+        if( bucket->tokens < TOKEN ) return ADMISSION_DROP;
+        bucket->tokens -= TOKEN;
+    }
+
+    if( transfer_limit > 0 ) {
+        if( atomic_load_explicit( active_transfers, memory_order_relaxed ) >= transfer_limit ) {
+            return ADMISSION_BUSY;
+        }
+        atomic_fetch_add_explicit( active_transfers, 1, memory_order_relaxed );
+    }
+    return ADMISSION_ACCEPT;
+}
+
+
+void Admission_release( void )
+{
+    if( transfer_limit > 0 ) {
+        if( holder >= 0 && atomic_exchange( &holding[holder], 0 ) == 0 ) return;
+        atomic_fetch_sub_explicit( active_transfers, 1, memory_order_relaxed );
+    }
+}
+
+
+void Admission_attach( int slot )
+{
+    holder = slot;
+}
+
+
+void Admission_hold( void )
+{
+    if( transfer_limit > 0 && holder >= 0 ) atomic_store( &holding[holder], 1 );
+}
+
+
+void Admission_reclaim( int slot )
+{
+    if( transfer_limit > 0 && atomic_exchange( &holding[slot], 0 ) == 1 ) {
+        atomic_fetch_sub_explicit( active_transfers, 1, memory_order_relaxed );
+    }
+}
+
+
+void Admission_adopt( void )
+{
+    if( transfer_limit > 0 ) {
+        atomic_fetch_add_explicit( active_transfers, 1, memory_order_relaxed );
+    }
+}
@@ -0,0 +1,79 @@
+/*!
+ * \file admission.h
+ * \author Peter C. Chapin
+ * \brief Interface to the admission stage that protects the server from request floods.
+ *
+ * Every request the listener accepts costs a process or a transfer, a socket, and a file. The
+ * admission stage runs in the listener before any of that. It limits the request rate of each
+ * source network with a token bucket and caps the number of transfers in progress. Checking a
+ * request touches one cache line and makes no system calls.
+ */
+
+#ifndef ADMISSION_H_INCLUDED
+#define ADMISSION_H_INCLUDED
+
+#include <netinet/in.h>
+
+//! What to do with a request.
+typedef enum {
+    ADMISSION_ACCEPT,  //!< Start a transfer. Admission_release() must follow when it ends.
+    ADMISSION_BUSY,    //!< Too many transfers in progress. Tell the client to try later.
+    ADMISSION_DROP     //!< The source is over its rate. Ignore the request without a reply.
+} admission_decision;
+
+//! Configure the admission stage.
+/*!
+ * This must be called before any worker is created. The count of transfers in progress is kept
+ * in shared memory so workers in other processes can release their transfers.
+ *
+ * \param rate Requests per second allowed from each source network (0 = no limit). A source
+ * network is an IPv4 /24 or an IPv6 /64.
+ * \param burst Requests a source network may send at once after being idle.
+ * \param transfer_limit Largest number of transfers in progress (0 = no limit).
+ * \param holders Number of pre-forked workers, each of which holds its transfers (see
+ * Admission_attach()).
+ *
+ * \return 0 if successful; -1 if memory could not be allocated.
+ */
+int Admission_initialize( unsigned rate, unsigned burst, int transfer_limit, int holders );
+
+//! Decide whether to serve a request.
+/*!
+ * Only the listener calls this.
+ *
+ * \param client_address The source of the request.
+ * \param now The current monotonic time in milliseconds.
+ */
+admission_decision Admission_check( const struct sockaddr_in6 *client_address, long long now );
+
+//! Note that a transfer accepted by Admission_check() has ended (or could not be started).
+void Admission_release( void );
+
+//! Make the calling process (a pre-forked worker) the given holder.
+/*!
+ * Each transfer the worker serves is marked as held by it with Admission_hold() and unmarked
+ * by Admission_release(). If the worker dies, Admission_reclaim() releases the transfer it
+ * held.
+ *
+ * \param slot The holder, from zero up to one less than the holders given to
+ * Admission_initialize().
+ */
+void Admission_attach( int slot );
+
+//! Mark the transfer the calling worker is about to serve as held by it.
+void Admission_hold( void );
+
+//! Release the transfer a worker that has exited still held, if it held one.
+/*!
+ * The listener calls this for every worker it reaps, before it forks another for the slot.
+ */
+void Admission_reclaim( int slot );
+
+//! Count a transfer (or request) handed over by another server process as in progress.
+/*!
+ * The transfer is over the limit if the limit is lower here; it is served all the same.
+ * Admission_release() must follow when it ends.
+ */
+void Admission_adopt( void );
+
+#endif // ADMISSION_H_INCLUDED
@@ -0,0 +1,166 @@
+/*!
+ * \file archive.c
+ * \author Peter C. Chapin
+ * \brief Implementation of packed archives of the files served.
+ *
+ * The header and the sizes of the index and entries are checked when the archive is mapped;
+ * each entry is checked against the mapping when it is found, so a damaged archive can cost a
+ * request but not the server. Only the index is read ahead. The rest is faulted in as it is
+ * served and left to the page cache.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "archive.h"
+
+
+//
+// Check that a section of count items of the given size at offset lies in an archive of size
+// bytes, and is aligned for its items.
+//
+static int section_fits( uint64_t offset, uint64_t count, uint64_t item_size, uint64_t size )
+{
+    if( offset % 8 != 0 || offset > size ) return 0;
+    if( count > ( size - offset ) / item_size ) return 0;
+    return 1;
+}
+
+
+Archive *Archive_open( const char *file_name )
+{
+    Archive *object;
+    const archive_header *header;
+    struct stat file_information;
+    void *base;
+    uint64_t slots;
+    int file_handle;
+
+    if( (file_handle = open( file_name, O_RDONLY | O_CLOEXEC )) == -1 ) {
+        perror( file_name );
+        return NULL;
+    }
+    if( fstat( file_handle, &file_information ) == -1 ) {
+        perror( file_name );
+        close( file_handle );
+        return NULL;
+    }
+    if( (size_t)file_information.st_size < sizeof( archive_header ) ) {
+        fprintf( stderr, "%s: not an archive\n", file_name );
+        close( file_handle );
+        return NULL;
+    }
+    base = mmap( NULL,
+                 (size_t)file_information.st_size, PROT_READ, MAP_SHARED, file_handle, 0 );
+    close( file_handle );
+    if( base == MAP_FAILED ) {
+        perror( file_name );
+        return NULL;
+    }
+
+    header = (const archive_header *)base;
+    slots  = header->entry_count + 1;
+    if( memcmp( header->magic, ARCHIVE_MAGIC, sizeof( header->magic ) ) != 0 ) {
+        fprintf( stderr, "%s: not an archive\n", file_name );
+        goto failed;
+    }
+    if( header->version != ARCHIVE_VERSION ) {
+        fprintf( stderr, "%s: unsupported archive version %u\n",
+                 file_name, (unsigned)header->version );
+        goto failed;
+    }
+    if( header->archive_size != (uint64_t)file_information.st_size ||
+        header->entry_count >= header->archive_size ||
+        !section_fits( header->keys_offset, slots, sizeof( uint64_t ), header->archive_size ) ||
+        !section_fits(
+            header->entries_offset, slots, sizeof( archive_entry ), header->archive_size ) ) {
+        fprintf( stderr, "%s: archive is truncated or damaged\n", file_name );
+        goto failed;
+    }
+
+    if( (object = malloc( sizeof( Archive ) )) == NULL ) {
+        fprintf( stderr, "%s: out of memory\n", file_name );
+        goto failed;
+    }
+    object->base        = base;
+    object->size        = (size_t)file_information.st_size;
+    object->entry_count = (size_t)header->entry_count;
+    object->keys        = (const uint64_t *)( object->base + header->keys_offset );
+    object->entries     = (const archive_entry *)( object->base + header->entries_offset );
+
+    // Every search starts at the top of the index, so have it read in now, in the background.
+    madvise( base, header->keys_offset + slots * sizeof( uint64_t ), MADV_WILLNEED );
+    return object;
+
+failed:
+    munmap( base, (size_t)file_information.st_size );
+    return NULL;
+}
+
+
+void Archive_close( Archive *object )
+{
+    if( object == NULL ) return;
+    munmap( (void *)object->base, object->size );
+    free( object );
+}
+
+
+//
+// Return the slot that follows slot k in an in-order walk of the index, or 0 if there is none.
+//
+static size_t next_slot( size_t k, size_t n )
+{
+    if( 2 * k + 1 <= n ) {
+        k = 2 * k + 1;
+        while( 2 * k <= n ) k = 2 * k;
+        return k;
+    }
+    while( k & 1 ) k >>= 1;
+    return k >> 1;
+}
+
+
+int Archive_find(
+    const Archive *object,
+    const char *path,
+    size_t length,
+    const unsigned char **data,
+    off_t *size,
+    uint32_t *digest )
+{
+    const archive_entry *entry;
+    uint64_t hash = archive_hash( path, length );
+    size_t n = object->entry_count;
+    size_t k = 1;
+
+    // Descend to the first key not less than the hash. The path taken is recorded in the bits
+    // of k; the trailing 1 bits are the steps right after the last step left, where it was.
+    while( k <= n ) k = 2 * k + ( object->keys[k] < hash );
+    k >>= __builtin_ffsll( (long long)~k );
+
+    for( ; k != 0 && object->keys[k] == hash; k = next_slot( k, n ) ) {
+        entry = &object->entries[k];
+        if( entry->name_length != length ||
+            entry->name_offset > object->size ||
+            length > object->size - entry->name_offset ) continue;
+        if( memcmp( object->base + entry->name_offset, path, length ) != 0 ) continue;
+
+        if( entry->offset > object->size || entry->size > object->size - entry->offset ) {
+            return -1;
+        }
+        *data   = object->base + entry->offset;
+        *size   = (off_t)entry->size;
+        *digest = entry->digest;
+        return 0;
+    }
+    return -1;
+}
@@ -0,0 +1,67 @@
+/*!
+ * \file archive.h
+ * \author Peter C. Chapin
+ * \brief Interface to packed archives of the files served.
+ *
+ * With a repository of millions of small files, the open(), stat(), and close() of every
+ * request, and the pressure on the kernel's directory cache, cost more than sending the file. A
+ * policy may instead name an archive built with mkarchive (see archive_format.h). The archive
+ * is mapped into memory when the policy is loaded, which takes no time whatever its size, and
+ * a file is found with one search of its index. DATA packets are copied straight from the
+ * mapping.
+ *
+ * To publish a new version, build it under another name, rename it over the old one, and have
+ * the server reload its policy (SIGHUP). Transfers that started under the old policy keep
+ * the old archive mapped until they finish.
+ */
+
+#ifndef ARCHIVE_H_INCLUDED
+#define ARCHIVE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "archive_format.h"
+
+//! A mapped archive.
+typedef struct Archive {
+    const unsigned char *base;        //!< The mapping.
+    size_t               size;        //!< Size of the mapping.
+    size_t               entry_count; //!< Number of files.
+    const uint64_t      *keys;        //!< The index (see archive_format.h).
+    const archive_entry *entries;     //!< Entries, in the same slots as the keys.
+} Archive;
+
+//! Map an archive and check its header.
+/*!
+ * \param file_name The archive.
+ *
+ * \return The archive, or NULL if it can't be opened or is not a valid archive (a reason has
+ * been printed).
+ */
+Archive *Archive_open( const char *file_name );
+
+//! Unmap an archive.
+void Archive_close( Archive *object );
+
+//! Find a file in an archive.
+/*!
+ * \param object The archive.
+ * \param path The file's path in the form normalized by the policy (see archive_hash()).
+ * \param length The number of bytes in the path.
+ * \param data Receives the file's contents.
+ * \param size Receives the file's size.
+ * \param digest Receives the file's CRC-32C.
+ *
+ * \return 0 if the file was found; -1 otherwise.
+ */
+int Archive_find(
+    const Archive *object,
+    const char *path,
+    size_t length,
+    const unsigned char **data,
+    off_t *size,
+    uint32_t *digest );
+
+#endif // ARCHIVE_H_INCLUDED
@@ -0,0 +1,377 @@
+/*!
+ * \file event_log.c
+ * \author Peter C. Chapin
+ * \brief Implementation of the server's asynchronous structured event log.
+ *
+ * Every thread that logs owns a single-producer, single-consumer ring of fixed size records.
+ * The only consumer of all the rings is a formatter thread that wakes periodically, turns the
+ * records into text lines, and writes them with one system call per batch. The formatter uses
+ * only write() and send() on plain descriptors (no stdio, no syslog(3)) so a fork() taken while
+ * it is busy can't leave a lock held in the child.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "event_log.h"
+#include "ring.h"
+
+// The maximum number of threads in one process that may log.
+#define MAX_LOG_WRITERS 256
+
+// The number of records each thread can buffer.
+#define WRITER_CAPACITY 1024
+
+// How long (ms) the formatter sleeps when it finds nothing to do.
+#define DRAIN_INTERVAL 50
+
+// The number of records the formatter takes from a ring at once.
+#define DRAIN_BATCH_SIZE 64
+
+// Syslog priorities: facility daemon with severity info or warning.
+#define SYSLOG_INFO    ( ( 3 << 3 ) | 6 )
+#define SYSLOG_WARNING ( ( 3 << 3 ) | 4 )
+
+typedef struct {
+    SpscRing      records;
+    atomic_ullong dropped;           // Written only by the producer.
+    unsigned long long reported;     // Drops already reported. Used only by the formatter.
+} log_writer;
+
+static log_writer *writers[MAX_LOG_WRITERS];
+static atomic_int  writer_count;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local log_writer *current_writer = NULL;
+static _Thread_local int         writer_unavailable = 0;
+
+static atomic_uint next_transfer_id = 1;
+
+static int output_handle = 2;
+static int use_syslog    = 0;
+
+static pthread_t   formatter;
+static int         formatter_running = 0;
+static atomic_int  formatter_stopping;
+
+// Output is collected here and written a batch at a time.
+static char   output_buffer[65536];
+static size_t output_length = 0;
+
+static const char *event_names[] = {
+    "start", "rejected", "timeout", "done", "failed", "dropped", "error", "handed_off", "resumed"
+};
+
+
+static long long realtime_microseconds( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_REALTIME, &now );
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+//
+// Create and register the calling thread's ring. Returns NULL if that isn't possible, in which
+// case the thread's records are dropped from then on.
+//
+static log_writer *attach_writer( void )
+{
+    log_writer *writer;
+    int count;
+
+    if( writer_unavailable ) return NULL;
+    writer_unavailable = 1;
+
+    if( (writer = calloc( 1, sizeof( log_writer ) )) == NULL ) return NULL;
+    if( SpscRing_initialize( &writer->records, WRITER_CAPACITY, sizeof( log_record ) ) == -1 ) {
+        free( writer );
+        return NULL;
+    }
+
+    pthread_mutex_lock( &registry_lock );
+    count = atomic_load_explicit( &writer_count, memory_order_relaxed );
+    if( count < MAX_LOG_WRITERS ) {
+        writers[count] = writer;
+        atomic_store_explicit( &writer_count, count + 1, memory_order_release );
+    }
+    pthread_mutex_unlock( &registry_lock );
+
+    if( count >= MAX_LOG_WRITERS ) {
+        SpscRing_destroy( &writer->records );
+        free( writer );
+        return NULL;
+    }
+    writer_unavailable = 0;
+    return current_writer = writer;
+}
+
+
+void EventLog_write( log_record *record )
+{
+    log_writer *writer = current_writer;
+
+    if( writer == NULL && (writer = attach_writer( )) == NULL ) return;
+
+    record->timestamp = realtime_microseconds( );
+    if( SpscRing_enqueue_batch( &writer->records, record, 1 ) == 0 ) {
+        atomic_store_explicit(
+            &writer->dropped,
+            atomic_load_explicit( &writer->dropped, memory_order_relaxed ) + 1,
+            memory_order_relaxed );
+    }
+}
+
+
+void EventLog_system_error( const char *what, int error_number )
+{
+    log_record record;
+
+    memset( &record, 0, sizeof( record ) );
+    record.event = LOG_SYSTEM_ERROR;
+    record.code  = (uint16_t)error_number;
+    strncpy( record.text, what, sizeof( record.text ) - 1 );
+    EventLog_write( &record );
+}
+
+
+uint32_t EventLog_transfer_id( void )
+{
+    return atomic_fetch_add_explicit( &next_transfer_id, 1, memory_order_relaxed );
+}
+
+
+static void flush_output( void )
+{
+    size_t  offset = 0;
+    ssize_t count;
+
+    while( offset < output_length ) {
+        count = write( output_handle, output_buffer + offset, output_length - offset );
+        if( count == -1 ) {
+            if( errno == EINTR ) continue;
+            break;  // Nowhere left to complain; the records are lost.
+        }
+        offset += (size_t)count;
+    }
+    output_length = 0;
+}
+
+
+//
+// Format one line. For syslog each line is sent as its own datagram; otherwise lines are
+// collected in the output buffer.
+//
+static void emit_line( int warning, const char *format, ... )
+    __attribute__(( format( printf, 2, 3 ) ));
+
+static void emit_line( int warning, const char *format, ... )
+{
+    char    line[256];
+    int     prefix = 0;
+    int     length;
+    va_list arguments;
+
+    if( use_syslog ) {
+        prefix = snprintf( line, sizeof( line ), "<%d>tftp[%ld]: ",
+                           warning ? SYSLOG_WARNING : SYSLOG_INFO, (long)getpid( ) );
+    }
+    va_start( arguments, format );
+    length = vsnprintf( line + prefix, sizeof( line ) - (size_t)prefix - 1, format, arguments );
+    va_end( arguments );
+    if( length < 0 ) return;
+    length += prefix;
+    if( length > (int)sizeof( line ) - 2 ) length = (int)sizeof( line ) - 2;
+    line[length++] = '\n';
+
+    if( use_syslog ) {
+        send( output_handle, line, (size_t)length - 1, MSG_DONTWAIT | MSG_NOSIGNAL );
+        return;
+    }
+    if( output_length + (size_t)length > sizeof( output_buffer ) ) flush_output( );
+    memcpy( output_buffer + output_length, line, (size_t)length );
+    output_length += (size_t)length;
+}
+
+
+static void format_record( const log_record *record )
+{
+    char      stamp[32];
+    struct tm broken_down;
+    time_t    seconds = (time_t)( record->timestamp / 1000000 );
+    const char *name  = record->event < sizeof( event_names ) / sizeof( event_names[0] ) ?
+        event_names[record->event] : "unknown";
+
+    gmtime_r( &seconds, &broken_down );
+    strftime( stamp, sizeof( stamp ), "%Y-%m-%dT%H:%M:%S", &broken_down );
+
+#define PREFIX "%s.%06lldZ pid=%ld transfer=%u event=%s"
+#define PREFIX_ARGUMENTS \
+    stamp, record->timestamp % 1000000, (long)getpid( ), record->transfer_id, name
+
+    switch( record->event ) {
+    case LOG_TRANSFER_START:
+        emit_line( 0, PREFIX " file=\"%s\" size=%llu blksize=%u windowsize=%u",
+                   PREFIX_ARGUMENTS, record->text, record->value, record->block, record->extra );
+        break;
+
+    case LOG_TRANSFER_REJECTED:
+        emit_line( 1, PREFIX " file=\"%s\" error=%u",
+                   PREFIX_ARGUMENTS, record->text, record->code );
+        break;
+
+    case LOG_TIMEOUT:
+        emit_line( 0, PREFIX " block=%u retry=%u",
+                   PREFIX_ARGUMENTS, record->block, record->code );
+        break;
+
+    case LOG_TRANSFER_DONE:
+    case LOG_TRANSFER_FAILED:
+    case LOG_TRANSFER_HANDED_OFF:
+        emit_line( record->event == LOG_TRANSFER_FAILED,
+                   PREFIX " block=%u bytes=%llu retransmissions=%u duration_ms=%u",
+                   PREFIX_ARGUMENTS, record->block, record->value, record->code, record->extra );
+        break;
+
+    case LOG_TRANSFER_RESUMED:
+        emit_line( 0, PREFIX " file=\"%s\" block=%u previous_transfer=%llu",
+                   PREFIX_ARGUMENTS, record->text, record->block, record->value );
+        break;
+
+    case LOG_REQUESTS_DROPPED:
+        emit_line( 1, PREFIX " requests=%llu", PREFIX_ARGUMENTS, record->value );
+        break;
+
+    case LOG_SYSTEM_ERROR:
+        emit_line( 1, PREFIX " what=\"%s\" errno=%u message=\"%s\"",
+                   PREFIX_ARGUMENTS, record->text, record->code, strerror( record->code ) );
+        break;
+
+    default:
+        emit_line( 1, PREFIX, PREFIX_ARGUMENTS );
+        break;
+    }
+
+#undef PREFIX
+#undef PREFIX_ARGUMENTS
+}
+
+
+//
+// Format everything currently buffered. Returns the number of records formatted.
+//
+static size_t drain( void )
+{
+    log_record batch[DRAIN_BATCH_SIZE];
+    unsigned long long dropped;
+    size_t total = 0;
+    size_t count;
+    size_t i;
+    int    writer_total = atomic_load_explicit( &writer_count, memory_order_acquire );
+    int    w;
+
+    for( w = 0; w < writer_total; ++w ) {
+        log_writer *writer = writers[w];
+
+        while( (count = SpscRing_dequeue_batch(
+                    &writer->records, batch, DRAIN_BATCH_SIZE )) > 0 ) {
+            for( i = 0; i < count; ++i ) format_record( &batch[i] );
+            total += count;
+        }
+        dropped = atomic_load_explicit( &writer->dropped, memory_order_relaxed );
+        if( dropped != writer->reported ) {
+            emit_line( 1, "event log overflow: %llu records dropped", dropped - writer->reported );
+            writer->reported = dropped;
+        }
+    }
+    flush_output( );
+    return total;
+}
+
+
+static void *formatter_thread( void *argument )
+{
+    struct timespec interval = { 0, DRAIN_INTERVAL * 1000000L };
+
+    while( !atomic_load( &formatter_stopping ) ) {
+        if( drain( ) == 0 ) nanosleep( &interval, NULL );
+    }
+    drain( );
+    return NULL;
+}
+
+
+int EventLog_open( const char *destination )
+{
+    struct sockaddr_un address;
+    int handle;
+
+    if( destination == NULL || strcmp( destination, "-" ) == 0 ) {
+        output_handle = 2;
+        use_syslog = 0;
+        return 0;
+    }
+
+    if( strcmp( destination, "syslog" ) == 0 ) {
+        memset( &address, 0, sizeof( address ) );
+        address.sun_family = AF_UNIX;
+        strcpy( address.sun_path, "/dev/log" );
+        if( (handle = socket( PF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0 )) == -1 ) return -1;
+        if( connect( handle, (struct sockaddr *)&address, sizeof( address ) ) == -1 ) {
+            close( handle );
+            return -1;
+        }
+        output_handle = handle;
+        use_syslog = 1;
+        return 0;
+    }
+
+    handle = open( destination, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+    if( handle == -1 ) return -1;
+    output_handle = handle;
+    use_syslog = 0;
+    return 0;
+}
+
+
+int EventLog_start( void )
+{
+    // In a child process the parent's rings belong to threads that no longer exist. Forget
+    // them (their memory is not worth the risk of freeing) and start afresh.
+    pthread_mutex_init( &registry_lock, NULL );
+    atomic_store( &writer_count, 0 );
+    current_writer     = NULL;
+    writer_unavailable = 0;
+    output_length      = 0;
+
+    atomic_store( &formatter_stopping, 0 );
+    if( pthread_create( &formatter, NULL, formatter_thread, NULL ) != 0 ) {
+        formatter_running = 0;
+        return -1;
+    }
+    formatter_running = 1;
+    return 0;
+}
+
+
+void EventLog_stop( void )
+{
+    if( !formatter_running ) return;
+    atomic_store( &formatter_stopping, 1 );
+    pthread_join( formatter, NULL );
+    formatter_running = 0;
+}
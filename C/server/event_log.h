@@ -0,0 +1,81 @@
+/*!
+ * \file event_log.h
+ * \author Peter C. Chapin
+ * \brief Interface to the server's asynchronous structured event log.
+ *
+ */
+
+#ifndef EVENT_LOG_H_INCLUDED
+#define EVENT_LOG_H_INCLUDED
+
+#include <stdint.h>
+
+//! Things worth logging.
+typedef enum {
+    LOG_TRANSFER_START,     //!< A transfer opened its file. value = file size, text = name.
+    LOG_TRANSFER_REJECTED,  //!< A request was refused. code = TFTP error, text = file name.
+    LOG_TIMEOUT,            //!< Retransmission timer expired. block = first unacked block.
+    LOG_TRANSFER_DONE,      //!< A transfer completed. See below.
+    LOG_TRANSFER_FAILED,    //!< A transfer was abandoned. See below.
+    LOG_REQUESTS_DROPPED,   //!< Requests discarded because every worker was busy.
+    LOG_SYSTEM_ERROR,       //!< A system call failed. code = errno, text = what was attempted.
+    LOG_TRANSFER_HANDED_OFF,  //!< A transfer was given to a new server process. See below.
+    LOG_TRANSFER_RESUMED    //!< A transfer was taken over from an old server process. See below.
+} log_event;
+
+//! One fixed size log record.
+/*!
+ * Records are formatted only by the background thread, so producers just fill in numbers. For
+ * LOG_TRANSFER_DONE and LOG_TRANSFER_FAILED, block is the last block acknowledged, value is the
+ * number of bytes sent, extra is the duration in milliseconds, and code is the number of
+ * retransmissions. For LOG_TRANSFER_START, block is the block size and extra is the window size.
+ * LOG_TRANSFER_HANDED_OFF is like LOG_TRANSFER_DONE. For LOG_TRANSFER_RESUMED, block is the last
+ * block acknowledged, value is the transfer's ID in the old process, and text is the file name.
+ */
+typedef struct {
+    long long          timestamp;     //!< Microseconds since the epoch. Set by EventLog_write().
+    unsigned long long value;         //!< Event specific.
+    uint32_t           transfer_id;   //!< Zero if the event isn't about a transfer.
+    uint32_t           block;         //!< Event specific.
+    uint32_t           extra;         //!< Event specific.
+    uint16_t           event;         //!< A log_event.
+    uint16_t           code;          //!< Event specific.
+    char               text[32];      //!< Null terminated; may be truncated.
+} log_record;
+
+//! Choose where formatted records go.
+/*!
+ * \param destination NULL or "-" for the standard error stream, "syslog" for the local syslog
+ * daemon, or the name of a file to append to.
+ *
+ * \return 0 if the destination was opened; -1 otherwise.
+ */
+int EventLog_open( const char *destination );
+
+//! Start the formatter thread for this process.
+/*!
+ * Call this once in the main process and again in any forked child that logs; threads do not
+ * survive fork(). Records written before this call are discarded.
+ *
+ * \return 0 if the thread was started; -1 otherwise.
+ */
+int EventLog_start( void );
+
+//! Format any remaining records and stop the formatter thread.
+void EventLog_stop( void );
+
+//! Append a record to the calling thread's buffer. The timestamp is filled in.
+/*!
+ * Each thread has its own single-producer, single-consumer buffer, created on the thread's
+ * first call. Appending is a copy and an index update; it never blocks or takes a lock. If the
+ * buffer is full the record is counted and dropped.
+ */
+void EventLog_write( log_record *record );
+
+//! Log a failed system call. Call this instead of perror() on the server's hot paths.
+void EventLog_system_error( const char *what, int error_number );
+
+//! Return a new transfer identifier for use in log records.
+uint32_t EventLog_transfer_id( void );
+
+#endif // EVENT_LOG_H_INCLUDED
@@ -0,0 +1,390 @@
+/*!
+ * \file handoff.c
+ * \author Peter C. Chapin
+ * \brief Implementation of the handing over of a running server to a new server process.
+ *
+ * The processes exchange fixed size messages over a SOCK_SEQPACKET socket, so each message
+ * arrives whole and in order together with the descriptor it carries. The new process sends
+ * HELLO; the running one answers with LISTENER and then sends a REQUEST or a TRANSFER for each
+ * piece of work, followed by END. Both processes come from builds of the same source, but the
+ * version in every message keeps a build with a different layout from misreading it.
+ */
+
+#ifndef _GNU_SOURCE   // Needed for accept4().
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "handoff.h"
+#include "transfer.h"
+
+#define HANDOFF_MAGIC   0x54465448u  // "TFTH"
+#define HANDOFF_VERSION 2
+
+// How long (seconds) the new process waits for the running server to answer its HELLO. The
+// running server may miss a SIGIO that arrives just before it blocks for a request, so the
+// new process connects again, up to MAX_ATTEMPTS times.
+#define ANSWER_TIMEOUT 2
+#define MAX_ATTEMPTS 3
+
+// How long (seconds) either process waits for the other once the handoff is under way.
+#define MESSAGE_TIMEOUT 10
+
+enum handoff_type {
+    MESSAGE_HELLO = 1,   // From the new process: will it take transfers?
+    MESSAGE_LISTENER,    // The listening socket.
+    MESSAGE_REQUEST,     // A request not yet started.
+    MESSAGE_TRANSFER,    // A transfer in progress, with its socket.
+    MESSAGE_END          // Nothing more is coming.
+};
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t type;
+    union {
+        uint32_t accepts_transfers;
+        struct {
+            struct sockaddr_in6 client_address;
+            int64_t  received_time;
+            uint32_t request_count;
+            unsigned char request_buffer[REQUEST_BUFFER_LENGTH];
+        } request;
+        transfer_snapshot transfer;
+    } body;
+} handoff_message;
+
+volatile sig_atomic_t handoff_requests = 0;
+
+static struct sockaddr_un handoff_address;
+static int handoff_configured = 0;
+static int listen_handle_unix = -1;   // The handoff socket, in the running server.
+static int successor = -1;            // The connection to the new process.
+
+// What the new process was handed.
+static request_descriptor *resumed = NULL;
+static size_t resumed_count = 0;
+static size_t resumed_size  = 0;
+
+
+int Handoff_configure( const char *path )
+{
+    if( strlen( path ) >= sizeof( handoff_address.sun_path ) ) return -1;
+    memset( &handoff_address, 0, sizeof( handoff_address ) );
+    handoff_address.sun_family = AF_UNIX;
+    strcpy( handoff_address.sun_path, path );
+    handoff_configured = 1;
+    return 0;
+}
+
+
+//
+// Send a message of the given type with its body already filled in, and with a descriptor if
+// descriptor isn't -1.
+//
+static int send_message( int handle, handoff_message *message, int type, int descriptor )
+{
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE( sizeof( int ) )];
+    } control;
+    struct cmsghdr *part;
+    struct iovec  data;
+    struct msghdr header;
+
+    message->magic   = HANDOFF_MAGIC;
+    message->version = HANDOFF_VERSION;
+    message->type    = (uint16_t)type;
+    data.iov_base = message;
+    data.iov_len  = sizeof( *message );
+    memset( &header, 0, sizeof( header ) );
+    header.msg_iov    = &data;
+    header.msg_iovlen = 1;
+    if( descriptor != -1 ) {
+        memset( &control, 0, sizeof( control ) );
+        header.msg_control    = control.space;
+        header.msg_controllen = sizeof( control.space );
+        part = CMSG_FIRSTHDR( &header );
+        part->cmsg_level = SOL_SOCKET;
+        part->cmsg_type  = SCM_RIGHTS;
+        part->cmsg_len   = CMSG_LEN( sizeof( int ) );
+        memcpy( CMSG_DATA( part ), &descriptor, sizeof( int ) );
+    }
+    return sendmsg( handle, &header, MSG_NOSIGNAL ) == (ssize_t)sizeof( *message ) ? 0 : -1;
+}
+
+
+//
+// Receive one message and the descriptor that came with it, if any (else -1). Returns the
+// message type, or -1 if the connection failed, timed out, or carried something malformed.
+//
+static int receive_message( int handle, handoff_message *message, int *descriptor )
+{
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE( sizeof( int ) )];
+    } control;
+    struct cmsghdr *part;
+    struct iovec  data;
+    struct msghdr header;
+    ssize_t received;
+
+    *descriptor = -1;
+    data.iov_base = message;
+    data.iov_len  = sizeof( *message );
+    memset( &header, 0, sizeof( header ) );
+    header.msg_iov        = &data;
+    header.msg_iovlen     = 1;
+    header.msg_control    = control.space;
+    header.msg_controllen = sizeof( control.space );
+
+    while( (received = recvmsg( handle, &header, MSG_CMSG_CLOEXEC )) == -1 && errno == EINTR ) ;
+    for( part = received > 0 ? CMSG_FIRSTHDR( &header ) : NULL;
+         part != NULL; part = CMSG_NXTHDR( &header, part ) ) {
+        if( part->cmsg_level == SOL_SOCKET && part->cmsg_type == SCM_RIGHTS ) {
+            memcpy( descriptor, CMSG_DATA( part ), sizeof( int ) );
+        }
+    }
+    if( received != (ssize_t)sizeof( *message ) || ( header.msg_flags & MSG_TRUNC ) ||
+        message->magic != HANDOFF_MAGIC || message->version != HANDOFF_VERSION ) {
+        if( *descriptor != -1 ) close( *descriptor );
+        *descriptor = -1;
+        return -1;
+    }
+    return message->type;
+}
+
+
+static void set_timeout( int handle, int seconds )
+{
+    struct timeval timeout = { seconds, 0 };
+
+    setsockopt( handle, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+    setsockopt( handle, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof( timeout ) );
+}
+
+
+//
+// Keep a request or transfer handed to this process. Returns -1 if memory ran out.
+//
+static int keep( const request_descriptor *descriptor )
+{
+    request_descriptor *larger;
+    size_t size = resumed_size == 0 ? 64 : 2 * resumed_size;
+
+    if( resumed_count == resumed_size ) {
+        if( (larger = realloc( resumed, size * sizeof( request_descriptor ) )) == NULL ) return -1;
+        resumed      = larger;
+        resumed_size = size;
+    }
+    resumed[resumed_count++] = *descriptor;
+    return 0;
+}
+
+
+//
+// Connect to the running server and say hello. Returns the connection with its listening
+// socket in listen_handle, or -1.
+//
+static int greet( int accepts_transfers, int *listen_handle )
+{
+    handoff_message message;
+    int handle;
+    int attempt;
+
+    for( attempt = 0; attempt < MAX_ATTEMPTS; ++attempt ) {
+        if( (handle = socket( PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 )) == -1 ) return -1;
+        if( connect( handle,
+                     (struct sockaddr *)&handoff_address, sizeof( handoff_address ) ) == -1 ) {
+            // Nothing is running (or it died without removing its socket).
+            close( handle );
+            return -1;
+        }
+        set_timeout( handle, ANSWER_TIMEOUT );
+        memset( &message, 0, sizeof( message ) );
+        message.body.accepts_transfers = (uint32_t)( accepts_transfers != 0 );
+        if( send_message( handle, &message, MESSAGE_HELLO, -1 ) == 0 &&
+            receive_message( handle, &message, listen_handle ) == MESSAGE_LISTENER &&
+            *listen_handle != -1 ) {
+            set_timeout( handle, MESSAGE_TIMEOUT );
+            return handle;
+        }
+        if( *listen_handle != -1 ) close( *listen_handle );
+        close( handle );
+    }
+    fprintf( stderr, "The server at %s did not answer; starting afresh\n",
+             handoff_address.sun_path );
+    return -1;
+}
+
+
+int Handoff_take_over( int accepts_transfers )
+{
+    handoff_message     message;
+    request_descriptor  descriptor;
+    transfer_snapshot  *snapshot;
+    int handle;
+    int listen_handle;
+    int descriptor_handle;
+    int type;
+
+    if( !handoff_configured ) return -1;
+    if( (handle = greet( accepts_transfers, &listen_handle )) == -1 ) return -1;
+
+    while( (type = receive_message( handle, &message, &descriptor_handle )) != MESSAGE_END ) {
+        memset( &descriptor, 0, sizeof( descriptor ) );
+        if( type == MESSAGE_REQUEST ) {
+            descriptor.client_address = message.body.request.client_address;
+            descriptor.received_time  = message.body.request.received_time;
+            descriptor.request_count  = message.body.request.request_count;
+            if( descriptor.request_count > REQUEST_BUFFER_LENGTH ) {
+                descriptor.request_count = REQUEST_BUFFER_LENGTH;
+            }
+            memcpy( descriptor.request_buffer,
+                    message.body.request.request_buffer, descriptor.request_count );
+            if( keep( &descriptor ) == -1 ) {
+                // The client retransmits the request; this process just won't have seen it.
+                fprintf( stderr, "Handoff dropped a request: out of memory\n" );
+            }
+        }
+        else if( type == MESSAGE_TRANSFER && descriptor_handle != -1 ) {
+            if( (snapshot = malloc( sizeof( *snapshot ) )) == NULL ) {
+                close( descriptor_handle );
+                continue;
+            }
+            *snapshot = message.body.transfer;
+            snapshot->socket_handle   = descriptor_handle;
+            descriptor.client_address = snapshot->client_address;
+            descriptor.received_time  = snapshot->received_time;
+            descriptor.resume         = snapshot;
+            if( keep( &descriptor ) == -1 ) {
+                fprintf( stderr, "Handoff dropped a transfer: out of memory\n" );
+                close( descriptor_handle );
+                free( snapshot );
+            }
+        }
+        else if( type == -1 ) {
+            // The old process is gone or stuck. What it handed over so far is still good.
+            fprintf( stderr, "Handoff ended early: %s\n", strerror( errno ) );
+            break;
+        }
+        else if( descriptor_handle != -1 ) {
+            close( descriptor_handle );
+        }
+    }
+    close( handle );
+    return listen_handle;
+}
+
+
+size_t Handoff_resumed( const request_descriptor **requests )
+{
+    *requests = resumed;
+    return resumed_count;
+}
+
+
+void Handoff_release_resumed( void )
+{
+    free( resumed );
+    resumed = NULL;
+    resumed_count = 0;
+    resumed_size  = 0;
+}
+
+
+int Handoff_listen( void )
+{
+    if( !handoff_configured ) return 0;
+    if( (listen_handle_unix = socket( PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 )) == -1 ) {
+        return -1;
+    }
+    unlink( handoff_address.sun_path );
+    if( bind( listen_handle_unix,
+              (struct sockaddr *)&handoff_address, sizeof( handoff_address ) ) == -1 ||
+        listen( listen_handle_unix, 4 ) == -1 ||
+        fcntl( listen_handle_unix, F_SETOWN, getpid( ) ) == -1 ||
+        fcntl( listen_handle_unix, F_SETFL, O_ASYNC | O_NONBLOCK ) == -1 ) {
+        close( listen_handle_unix );
+        listen_handle_unix = -1;
+        return -1;
+    }
+    return 0;
+}
+
+
+int Handoff_begin( int listen_handle )
+{
+    handoff_message message;
+    int descriptor_handle;
+    int accepts_transfers;
+
+    if( listen_handle_unix == -1 ) return -1;
+
+    // A connection whose process gave up waiting is closed by now and fails here.
+    while( (successor = accept4( listen_handle_unix, NULL, NULL, SOCK_CLOEXEC )) != -1 ) {
+        set_timeout( successor, MESSAGE_TIMEOUT );
+        if( receive_message( successor, &message, &descriptor_handle ) == MESSAGE_HELLO ) {
+            accepts_transfers = message.body.accepts_transfers != 0;
+            memset( &message.body, 0, sizeof( message.body ) );
+            if( send_message( successor, &message, MESSAGE_LISTENER, listen_handle ) == 0 ) {
+                return accepts_transfers;
+            }
+        }
+        if( descriptor_handle != -1 ) close( descriptor_handle );
+        close( successor );
+    }
+    successor = -1;
+    return -1;
+}
+
+
+int Handoff_send( const request_descriptor *request )
+{
+    handoff_message message;
+
+    if( successor == -1 ) return -1;
+    memset( &message, 0, sizeof( message ) );
+    if( request->resume != NULL ) {
+        message.body.transfer = *request->resume;
+        message.body.transfer.socket_handle = -1;
+        return send_message(
+            successor, &message, MESSAGE_TRANSFER, request->resume->socket_handle );
+    }
+    message.body.request.client_address = request->client_address;
+    message.body.request.received_time  = request->received_time;
+    message.body.request.request_count  = (uint32_t)request->request_count;
+    memcpy( message.body.request.request_buffer,
+            request->request_buffer, sizeof( message.body.request.request_buffer ) );
+    return send_message( successor, &message, MESSAGE_REQUEST, -1 );
+}
+
+
+void Handoff_finish( void )
+{
+    handoff_message message;
+
+    if( successor != -1 ) {
+        memset( &message, 0, sizeof( message ) );
+        send_message( successor, &message, MESSAGE_END, -1 );
+        close( successor );
+        successor = -1;
+    }
+    if( listen_handle_unix != -1 ) {
+        close( listen_handle_unix );
+        listen_handle_unix = -1;
+    }
+}
@@ -0,0 +1,100 @@
+/*!
+ * \file handoff.h
+ * \author Peter C. Chapin
+ * \brief Interface to the handing over of a running server to a new server process.
+ *
+ * A new version of the server (or the same one with new options) is started with the handoff
+ * socket of the running one. Instead of binding the listening port, it connects to that socket
+ * and the running server gives it, over a Unix domain socket with SCM_RIGHTS,
+ *
+ * - the listening socket itself, so requests that arrive in the meantime wait in its queue
+ *   rather than being refused,
+ * - each transfer in progress, with the transfer's socket (its transfer ID) and its state (see
+ *   transfer_snapshot), if the new process runs worker threads, and
+ * - the requests it received but did not yet start.
+ *
+ * The old process then stops serving its metrics and releases its transfer socket pool and
+ * AF_XDP socket, so the new process can have them, and says it is done. A transfer handed over
+ * is resumed where it was left: the new process waits for the client's next ACK or for the
+ * transfer's retransmission deadline as the old process would have, so the client sees nothing
+ * but a slightly longer pause. The page cache holds the files for both processes; cached
+ * compressed copies and signature lists are made again on demand.
+ *
+ * Only the threaded server hands over transfers. Pre-forked workers, and children forked per
+ * request, finish the transfers they have before the old process exits; until they do, the
+ * pool ports and AF_XDP queues they hold aren't available to the new process.
+ *
+ * The socket is made ready to accept a new process once the server is running. The running
+ * server notices a connection through SIGIO, which sets handoff_requests.
+ */
+
+#ifndef HANDOFF_H_INCLUDED
+#define HANDOFF_H_INCLUDED
+
+#include <signal.h>
+#include <stddef.h>
+
+#include "server.h"
+
+//! Incremented (by the SIGIO handler) when a new process may be waiting to take over.
+extern volatile sig_atomic_t handoff_requests;
+
+//! Set the path of the handoff socket.
+/*!
+ * \return 0 if successful; -1 if the path is too long.
+ */
+int Handoff_configure( const char *path );
+
+//! Take over from a server running with the same handoff socket, if there is one.
+/*!
+ * This blocks until the running server has handed over everything it will. The requests and
+ * transfers received are then available from Handoff_resumed().
+ *
+ * \param accepts_transfers Non-zero if this process can resume transfers.
+ *
+ * \return The listening socket of the running server, or -1 if no server answered.
+ */
+int Handoff_take_over( int accepts_transfers );
+
+//! Return the requests and transfers handed over by Handoff_take_over().
+/*!
+ * \param requests Receives the array of descriptors. Those with a non-NULL resume member are
+ * transfers to resume, with the transfer's socket in a snapshot allocated with malloc(). Whoever
+ * starts such a transfer frees its snapshot. The array stays valid until
+ * Handoff_release_resumed().
+ *
+ * \return The number of descriptors.
+ */
+size_t Handoff_resumed( const request_descriptor **requests );
+
+//! Free the array returned by Handoff_resumed() once its descriptors have been copied elsewhere.
+void Handoff_release_resumed( void );
+
+//! Create the handoff socket, replacing anything at its path, and wait for a new process.
+/*!
+ * The socket is set to raise SIGIO when a new process connects, so the caller should have a
+ * handler for it. Nothing is done if no path was configured.
+ *
+ * \return 0 if successful; -1 otherwise.
+ */
+int Handoff_listen( void );
+
+//! Accept a new process and give it the listening socket.
+/*!
+ * \param listen_handle The listening socket.
+ *
+ * \return 1 if the new process will resume transfers, 0 if it won't, or -1 if no new process
+ * is waiting (after a spurious SIGIO, for instance).
+ */
+int Handoff_begin( int listen_handle );
+
+//! Give the new process a request or, if its resume member is set, a transfer.
+/*!
+ * \return 0 if successful; -1 otherwise.
+ */
+int Handoff_send( const request_descriptor *request );
+
+//! Tell the new process that nothing more is coming and close the handoff socket.
+void Handoff_finish( void );
+
+#endif // HANDOFF_H_INCLUDED
@@ -0,0 +1,379 @@
+/*!
+ * \file metrics.c
+ * \author Peter C. Chapin
+ * \brief Implementation of the server's operational counters and their exporter.
+ *
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "event_log.h"
+#include "metrics.h"
+
+// Size of the buffer holding one formatted scrape.
+#define SCRAPE_BUFFER_SIZE 8192
+
+// How long (seconds) the exporter waits for a scraper to send its request.
+#define SCRAPE_TIMEOUT 2
+
+static const struct {
+    const char *name;
+    const char *help;
+} metric_descriptions[METRIC_COUNT] = {
+    { "tftp_requests_received_total",   "Request datagrams received." },
+    { "tftp_requests_dropped_total",    "Requests dropped because every worker was busy." },
+    { "tftp_transfers_started_total",   "Transfers started." },
+    { "tftp_transfers_completed_total", "Transfers acknowledged in full by the client." },
+    { "tftp_transfers_failed_total",    "Transfers abandoned after an error or timeout." },
+    { "tftp_data_packets_sent_total",   "DATA packets sent, including retransmissions." },
+    { "tftp_bytes_sent_total",          "File bytes sent, including retransmissions." },
+    { "tftp_retransmissions_total",     "Packets sent again after a timeout." },
+    { "tftp_timeouts_total",            "Retransmission timer expirations." },
+    { "tftp_errors_sent_total",         "ERROR packets sent to clients." },
+    { "tftp_requests_limited_total",    "Requests ignored because their source sent too many." },
+    { "tftp_requests_busy_total",
+      "Requests refused because the transfer limit was reached." },
+    { "tftp_xdp_packets_sent_total",    "DATA packets sent through AF_XDP." }
+};
+
+// Upper bounds (microseconds) of the time to first block buckets.
+static const long long first_block_bounds[FIRST_BLOCK_BUCKETS] = {
+    10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000
+};
+
+// NULL until the thread attaches, and always with metrics disabled, so updates are skipped.
+_Thread_local metrics_shard *metrics_current_shard = NULL;
+
+// Counts for a thread attached with Metrics_attach_private().
+static _Thread_local metrics_shard private_shard;
+
+// Shared memory holding shard_total shards. The last one receives flushed private counts.
+static metrics_shard *shards = NULL;
+static int shard_total = 0;
+
+static int exporter_handle = -1;
+static atomic_int exporter_stopping = 0;  // Set by Metrics_stop(); quiets the exporter's exit.
+
+
+//
+// Add to a counter in a shard with a single writer.
+//
+static void bump( atomic_ullong *value, unsigned long long amount )
+{
+    atomic_store_explicit(
+        value, atomic_load_explicit( value, memory_order_relaxed ) + amount, memory_order_relaxed );
+}
+
+
+void Metrics_observe_first_block( long long microseconds )
+{
+    int bucket = 0;
+
+    if( metrics_current_shard == NULL ) return;
+    if( microseconds < 0 ) microseconds = 0;
+    while( bucket < FIRST_BLOCK_BUCKETS && microseconds > first_block_bounds[bucket] ) ++bucket;
+    bump( &metrics_current_shard->first_block[bucket], 1 );
+    bump( &metrics_current_shard->first_block_sum, (unsigned long long)microseconds );
+}
+
+
+//
+// Move one of the private shard's counts to the shared shard for flushed counts.
+//
+static void flush_value( atomic_ullong *private_value, atomic_ullong *shared_value )
+{
+    unsigned long long value;
+
+    value = atomic_exchange_explicit( private_value, 0, memory_order_relaxed );
+    if( value != 0 ) atomic_fetch_add_explicit( shared_value, value, memory_order_relaxed );
+}
+
+
+int Metrics_initialize( int shard_count )
+{
+    void *memory;
+
+    shard_total = shard_count + 1;
+    memory = mmap( NULL,
+                   (size_t)shard_total * sizeof( metrics_shard ),
+                   PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS,
+                   -1,
+                   0 );
+    if( memory == MAP_FAILED ) {
+        perror( "Unable to allocate metrics" );
+        shard_total = 0;
+        return -1;
+    }
+    shards = memory;  // Anonymous mappings are zero filled.
+    metrics_current_shard = &shards[0];
+    return 0;
+}
+
+
+void Metrics_attach( int shard )
+{
+    if( shards != NULL && shard >= 0 && shard < shard_total - 1 ) {
+        metrics_current_shard = &shards[shard];
+    }
+}
+
+
+void Metrics_attach_private( void )
+{
+    if( shards == NULL ) return;
+    memset( &private_shard, 0, sizeof( private_shard ) );
+    metrics_current_shard = &private_shard;
+}
+
+
+void Metrics_flush( void )
+{
+    metrics_shard *flushed;
+    int id;
+
+    if( shards == NULL ) return;
+    flushed = &shards[shard_total - 1];
+    for( id = 0; id < METRIC_COUNT; ++id ) {
+        flush_value( &private_shard.values[id], &flushed->values[id] );
+    }
+    for( id = 0; id <= FIRST_BLOCK_BUCKETS; ++id ) {
+        flush_value( &private_shard.first_block[id], &flushed->first_block[id] );
+    }
+    flush_value( &private_shard.first_block_sum, &flushed->first_block_sum );
+}
+
+
+//
+// Write the time to first block histogram. Prometheus buckets are cumulative.
+//
+static size_t format_first_block( char *buffer, size_t size )
+{
+    unsigned long long buckets[FIRST_BLOCK_BUCKETS + 1] = { 0 };
+    unsigned long long sum = 0;
+    unsigned long long count = 0;
+    size_t length;
+    int    written;
+    int shard;
+    int i;
+
+    for( shard = 0; shard < shard_total; ++shard ) {
+        for( i = 0; i <= FIRST_BLOCK_BUCKETS; ++i ) {
+            buckets[i] +=
+                atomic_load_explicit( &shards[shard].first_block[i], memory_order_relaxed );
+        }
+        sum += atomic_load_explicit( &shards[shard].first_block_sum, memory_order_relaxed );
+    }
+
+    written = snprintf( buffer, size,
+                        "# HELP tftp_first_block_seconds "
+                        "Time from receiving a request to sending its first DATA or OACK.\n"
+                        "# TYPE tftp_first_block_seconds histogram\n" );
+    if( written < 0 ) return 0;
+    length = (size_t)written;
+    for( i = 0; i <= FIRST_BLOCK_BUCKETS && length < size; ++i ) {
+        count += buckets[i];
+        if( i < FIRST_BLOCK_BUCKETS ) {
+            written = snprintf( buffer + length, size - length,
+                                "tftp_first_block_seconds_bucket{le=\"%g\"} %llu\n",
+                                first_block_bounds[i] / 1e6, count );
+        }
+        else {
+            written = snprintf( buffer + length, size - length,
+                                "tftp_first_block_seconds_bucket{le=\"+Inf\"} %llu\n"
+                                "tftp_first_block_seconds_sum %.6f\n"
+                                "tftp_first_block_seconds_count %llu\n",
+                                count, sum / 1e6, count );
+        }
+        if( written < 0 ) break;
+        length += (size_t)written;
+    }
+    return length;
+}
+
+
+size_t Metrics_format( char *buffer, size_t size )
+{
+    unsigned long long totals[METRIC_COUNT] = { 0 };
+    unsigned long long active;
+    size_t length = 0;
+    int    written;
+    int shard;
+    int id;
+
+    for( shard = 0; shard < shard_total; ++shard ) {
+        for( id = 0; id < METRIC_COUNT; ++id ) {
+            totals[id] += atomic_load_explicit( &shards[shard].values[id], memory_order_relaxed );
+        }
+    }
+
+    for( id = 0; id < METRIC_COUNT && length < size; ++id ) {
+        written = snprintf( buffer + length, size - length,
+                            "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                            metric_descriptions[id].name,
+                            metric_descriptions[id].help,
+                            metric_descriptions[id].name,
+                            metric_descriptions[id].name,
+                            totals[id] );
+        if( written < 0 ) break;
+        length += (size_t)written;
+    }
+
+    // The shards are read without synchronization so the difference can be briefly negative.
+    active = totals[METRIC_TRANSFERS_COMPLETED] + totals[METRIC_TRANSFERS_FAILED];
+    active = totals[METRIC_TRANSFERS_STARTED] > active ?
+        totals[METRIC_TRANSFERS_STARTED] - active : 0;
+    if( length < size ) {
+        written = snprintf( buffer + length, size - length,
+                            "# HELP tftp_transfers_active Transfers in progress.\n"
+                            "# TYPE tftp_transfers_active gauge\n"
+                            "tftp_transfers_active %llu\n",
+                            active );
+        if( written > 0 ) length += (size_t)written;
+    }
+    if( length < size ) length += format_first_block( buffer + length, size - length );
+    return length < size ? length : size - 1;
+}
+
+
+//
+// Answer one scrape. The request itself is read only so the client isn't reset by an unread
+// request when the connection closes; its contents don't matter.
+//
+static void answer_scrape( int connection_handle )
+{
+    char request[1024];
+    char body[SCRAPE_BUFFER_SIZE];
+    char header[128];
+    struct timeval timeout = { SCRAPE_TIMEOUT, 0 };
+    size_t body_length;
+    int    header_length;
+
+    setsockopt( connection_handle, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+    if( recv( connection_handle, request, sizeof( request ), 0 ) == -1 ) return;
+
+    body_length = Metrics_format( body, sizeof( body ) );
+    header_length = snprintf( header, sizeof( header ),
+                              "HTTP/1.0 200 OK\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n\r\n",
+                              body_length );
+    if( send( connection_handle, header, (size_t)header_length, MSG_NOSIGNAL ) != -1 ) {
+        send( connection_handle, body, body_length, MSG_NOSIGNAL );
+    }
+}
+
+
+static void *exporter_thread( void *argument )
+{
+    int connection_handle;
+
+    while( 1 ) {
+        if( (connection_handle = accept( exporter_handle, NULL, NULL )) == -1 ) {
+            if( atomic_load( &exporter_stopping ) ) return NULL;
+            if( errno != EINTR && errno != ECONNABORTED ) {
+                EventLog_system_error( "Metrics exporter unable to accept", errno );
+                return NULL;
+            }
+            continue;
+        }
+        answer_scrape( connection_handle );
+        close( connection_handle );
+    }
+}
+
+
+//
+// Create the exporter's listening socket. A numeric endpoint is a loopback port; anything else
+// is the path of a Unix domain socket.
+//
+static int open_endpoint( const char *endpoint )
+{
+    struct sockaddr_in inet_address;
+    struct sockaddr_un unix_address;
+    const char *digit = endpoint;
+    int handle;
+    int one = 1;
+
+    while( isdigit( (unsigned char)*digit ) ) ++digit;
+
+    if( *endpoint != '\0' && *digit == '\0' ) {
+        if( (handle = socket( PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 )) == -1 ) return -1;
+        setsockopt( handle, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+        memset( &inet_address, 0, sizeof( inet_address ) );
+        inet_address.sin_family      = AF_INET;
+        inet_address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+        inet_address.sin_port        = htons( (unsigned short)atoi( endpoint ) );
+        if( bind( handle, (struct sockaddr *)&inet_address, sizeof( inet_address ) ) == -1 ) {
+            close( handle );
+            return -1;
+        }
+    }
+    else {
+        if( strlen( endpoint ) >= sizeof( unix_address.sun_path ) ) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if( (handle = socket( PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 )) == -1 ) return -1;
+        memset( &unix_address, 0, sizeof( unix_address ) );
+        unix_address.sun_family = AF_UNIX;
+        strcpy( unix_address.sun_path, endpoint );
+        unlink( endpoint );
+        if( bind( handle, (struct sockaddr *)&unix_address, sizeof( unix_address ) ) == -1 ) {
+            close( handle );
+            return -1;
+        }
+    }
+
+    if( listen( handle, 16 ) == -1 ) {
+        close( handle );
+        return -1;
+    }
+    return handle;
+}
+
+
+int Metrics_serve( const char *endpoint )
+{
+    pthread_t thread;
+
+    if( shards == NULL ) return -1;
+    if( (exporter_handle = open_endpoint( endpoint )) == -1 ) {
+        perror( "Unable to open metrics endpoint" );
+        return -1;
+    }
+    if( pthread_create( &thread, NULL, exporter_thread, NULL ) != 0 ) {
+        fprintf( stderr, "Unable to create metrics thread\n" );
+        close( exporter_handle );
+        exporter_handle = -1;
+        return -1;
+    }
+    pthread_detach( thread );
+    return 0;
+}
+
+
+void Metrics_stop( void )
+{
+    if( exporter_handle == -1 ) return;
+
+    // Shutting the socket down wakes the exporter from accept().
+    atomic_store( &exporter_stopping, 1 );
+    shutdown( exporter_handle, SHUT_RDWR );
+    close( exporter_handle );
+    exporter_handle = -1;
+}
@@ -0,0 +1,134 @@
+/*!
+ * \file metrics.h
+ * \author Peter C. Chapin
+ * \brief Interface to the server's operational counters and their exporter.
+ *
+ */
+
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "ring.h"
+
+//! The counters kept by the server.
+typedef enum {
+    METRIC_REQUESTS_RECEIVED,     //!< Request datagrams read from the listening socket.
+    METRIC_REQUESTS_DROPPED,      //!< Requests discarded because no worker could take them.
+    METRIC_TRANSFERS_STARTED,     //!< Transfers that passed validation and opened their file.
+    METRIC_TRANSFERS_COMPLETED,   //!< Transfers acknowledged in full by the client.
+    METRIC_TRANSFERS_FAILED,      //!< Transfers abandoned after an error or timeout.
+    METRIC_DATA_PACKETS_SENT,     //!< DATA packets sent, including retransmissions.
+    METRIC_BYTES_SENT,            //!< File bytes sent in DATA packets, including retransmissions.
+    METRIC_RETRANSMISSIONS,       //!< Packets sent again after a timeout.
+    METRIC_TIMEOUTS,              //!< Retransmission timer expirations.
+    METRIC_ERRORS_SENT,           //!< ERROR packets sent to clients.
+    METRIC_REQUESTS_LIMITED,      //!< Requests ignored because their source exceeded its rate.
+    METRIC_REQUESTS_BUSY,         //!< Requests refused because the transfer limit was reached.
+    METRIC_XDP_PACKETS_SENT,      //!< DATA packets sent through AF_XDP (see xdp_path.h).
+    METRIC_COUNT
+} metric_id;
+
+//! Number of finite buckets in the time to first block histogram (see Metrics_format()).
+#define FIRST_BLOCK_BUCKETS 12
+
+//! One set of counters with a single writer.
+/*!
+ * Each thread (or worker process) that updates counters writes only to its own shard. Updates
+ * are therefore plain relaxed loads and stores with no read-modify-write and no cache line
+ * shared with another writer. The exporter sums the shards when it is scraped.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_ullong values[METRIC_COUNT];
+    atomic_ullong first_block[FIRST_BLOCK_BUCKETS + 1];  //!< Transfers by time to first block.
+    atomic_ullong first_block_sum;  //!< Total time to first block (microseconds).
+} metrics_shard;
+
+//! The shard written by the calling thread. Do not use directly; see Metrics_count().
+extern _Thread_local metrics_shard *metrics_current_shard;
+
+//! Add to a counter in the calling thread's shard.
+/*!
+ * This is the only operation on the hot path. If metrics are not enabled, or the calling
+ * thread has not attached to a shard, the update is skipped without touching memory another
+ * thread writes.
+ */
+static inline void Metrics_count( metric_id id, unsigned long long amount )
+{
+    atomic_ullong *value;
+
+    if( metrics_current_shard == NULL ) return;
+    value = &metrics_current_shard->values[id];
+    atomic_store_explicit(
+        value, atomic_load_explicit( value, memory_order_relaxed ) + amount, memory_order_relaxed );
+}
+
+//! Add a transfer's time to first block to the calling thread's histogram.
+/*!
+ * \param microseconds The time from receiving the request to sending the first DATA or OACK.
+ */
+void Metrics_observe_first_block( long long microseconds );
+
+//! Allocate the shards.
+/*!
+ * The shards live in shared memory so that counters updated by forked children remain visible
+ * to the exporter in the parent. This must be called before any worker is created.
+ *
+ * \param shard_count The number of single writer shards. Shard 0 is attached to the calling
+ * thread. One further shard is always allocated for Metrics_flush().
+ *
+ * \return 0 if successful; -1 otherwise.
+ */
+int Metrics_initialize( int shard_count );
+
+//! Direct the calling thread's updates to the given shard.
+/*!
+ * At most one thread or process may be attached to a shard at once. A pre-forked worker that
+ * replaces an exited one may attach to the same shard and continue its counts. This function
+ * does nothing if metrics are not enabled.
+ */
+void Metrics_attach( int shard );
+
+//! Direct the calling thread's updates to a private shard.
+/*!
+ * This is for short lived processes, such as a child forked for one request, which can't be
+ * given a shard of their own. The counts are published by Metrics_flush().
+ */
+void Metrics_attach_private( void );
+
+//! Add the private shard's counts to the shared totals and clear it.
+/*!
+ * Flushes from different processes are combined with atomic additions. This happens once per
+ * transfer, not once per packet.
+ */
+void Metrics_flush( void );
+
+//! Write the current totals in the Prometheus text exposition format.
+/*!
+ * The time to first block is a histogram, tftp_first_block_seconds, with buckets from 10 us
+ * to 100 ms.
+ *
+ * \return The number of characters written, not including the terminating null.
+ */
+size_t Metrics_format( char *buffer, size_t size );
+
+//! Start a thread that serves the totals to scrapers.
+/*!
+ * \param endpoint Either a port number, in which case the exporter listens on the loopback
+ * address only, or the path of a Unix domain socket. Any existing socket at that path is
+ * replaced. Scrapers receive a minimal HTTP/1.0 response, so both curl and Prometheus work.
+ *
+ * \return 0 if the exporter is running; -1 otherwise.
+ */
+int Metrics_serve( const char *endpoint );
+
+//! Stop serving the totals, so another process can serve from the same endpoint.
+/*!
+ * A scrape being answered is finished. The counting itself goes on. Does nothing if the
+ * exporter isn't running.
+ */
+void Metrics_stop( void );
+
+#endif // METRICS_H_INCLUDED
@@ -0,0 +1,1141 @@
+/*!
+ * \file policy.c
+ * \author Peter C. Chapin
+ * \brief Implementation of the compiled access policy.
+ *
+ * Old policies are not freed the moment they are replaced. A worker may have loaded the
+ * current policy pointer but not yet counted its reference when the swap happens. So each thread
+ * publishes the pointer it loaded in a hazard slot of its own, checks that the pointer is still
+ * current, and only then counts its reference. A retired policy is freed once no slot holds it
+ * and it has no references, however long a thread was delayed in between. Freeing happens in
+ * Policy_refresh(), on the thread that reloads.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <linux/openat2.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "crc32c.h"
+#include "policy.h"
+#include "server.h"
+#include "topology.h"
+
+// The number of hash buckets for resolved files. A power of two.
+#define BUCKET_COUNT 4096
+
+// The maximum number of files a policy keeps open. Requests beyond this are served from a
+// descriptor opened (and closed) by the transfer, so a flood of distinct names can't exhaust
+// the process's descriptors.
+#define MAX_CACHED_FILES 4096
+
+// The largest file for which a compressed copy is kept in memory.
+#define MAX_COMPRESSED_SIZE ( 256L * 1024 * 1024 )
+
+// The zlib level compressed copies are made with. Higher levels gain a few percent at several
+// times the cost.
+#define COMPRESSION_LEVEL 6
+
+// The largest file for which a signature list (4 bytes per block) is kept in memory.
+#define MAX_SIGNED_SIZE ( (off_t)SIGNATURE_BLOCK_SIZE * 1024 * 1024 )
+
+// How much of each file is read into the page cache when a policy is warmed.
+#define WARM_LENGTH ( 64 * 1024 )
+
+// How deep beneath the root a policy is warmed.
+#define MAX_WARM_DEPTH 16
+
+// A copy on another NUMA node is replicated onto the requester's node once the file has been
+// asked for this many times. Copies of files used less often are read remotely.
+#define REPLICATE_AFTER 8
+
+typedef struct acl_node {
+    struct acl_node *child[2];
+    int action;                  // -1 if no rule ends here, otherwise 0 (deny) or 1 (allow).
+} acl_node;
+
+typedef struct path_entry {
+    struct path_entry *next;     // Immutable once the entry is published.
+    uint64_t hash;
+    int      file_handle;
+    off_t    file_size;
+    _Atomic(uint64_t) digest;    // Bit 32 set once the CRC-32C in the low bits is known.
+    atomic_uint uses;            // Number of requests for the file.
+    _Atomic(VirtualContent *) compressed[MAX_NODES];  // Compressed copy on each NUMA node.
+    _Atomic(VirtualContent *) signatures[MAX_NODES];  // Signature list on each NUMA node.
+    size_t   length;
+    char     path[];
+} path_entry;
+
+// The policy a thread is counting a reference to, if any. Slots are never freed, so a thread
+// that exits leaves an empty one behind.
+typedef struct policy_hazard {
+    struct policy_hazard *next;  // Immutable once the slot is published.
+    _Atomic(Policy *) policy;
+} policy_hazard;
+
+// A compressed copy waiting to be made by the compressor thread.
+typedef struct compression_job {
+    struct compression_job *next;
+    Policy     *policy;          // Holds a reference so the entry outlives the job.
+    path_entry *entry;
+    int         node;            // The slot claimed for the copy.
+} compression_job;
+
+volatile sig_atomic_t policy_reload_requests = 0;
+
+// Stands in for a compressed copy or signature list that can't be made (for example, because
+// the file doesn't compress).
+static VirtualContent unavailable;
+
+// Stands in for a compressed copy the compressor thread is still making.
+static VirtualContent pending;
+
+// Compressed copies are made one at a time by a thread of their own, started when the first is
+// needed. Only processes that serve transfers ask for them, and those never fork.
+static pthread_mutex_t  compression_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   compression_ready = PTHREAD_COND_INITIALIZER;
+static compression_job *compression_queue = NULL;
+static compression_job **compression_tail = &compression_queue;
+static int compressor_started = 0;
+
+static _Atomic(Policy *) current_policy = NULL;
+static Policy *retired_policies = NULL;
+
+// Every thread's hazard slot. A thread that can't allocate a slot of its own shares the first
+// under a lock.
+static policy_hazard shared_hazard;
+static pthread_mutex_t shared_hazard_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(policy_hazard *) hazards = &shared_hazard;
+static _Thread_local policy_hazard *thread_hazard = NULL;
+
+static char   *policy_file_name = NULL;
+static sig_atomic_t reload_generation = 0;
+static int warm_policies = 0;
+static int compression_enabled = 0;
+
+
+// =======================
+// Client address matching
+// =======================
+
+static acl_node *new_node( void )
+{
+    acl_node *node = calloc( 1, sizeof( acl_node ) );
+
+    if( node != NULL ) node->action = -1;
+    return node;
+}
+
+
+static void free_nodes( acl_node *node )
+{
+    if( node == NULL ) return;
+    free_nodes( node->child[0] );
+    free_nodes( node->child[1] );
+    free( node );
+}
+
+
+static int address_bit( const unsigned char *address, int index )
+{
+    return ( address[index / 8] >> ( 7 - index % 8 ) ) & 1;
+}
+
+
+//
+// Parse "address[/bits]". IPv4 prefixes are stored as IPv4-mapped IPv6 prefixes, which is how
+// IPv4 clients appear on the server's IPv6 socket. Returns the prefix length or -1.
+//
+static int parse_prefix( char *text, unsigned char address[16] )
+{
+    struct in_addr ipv4;
+    char *slash = strchr( text, '/' );
+    char *end;
+    long  bits;
+    int   maximum;
+    int   offset = 0;
+
+    if( slash != NULL ) *slash = '\0';
+    if( inet_pton( AF_INET6, text, address ) == 1 ) {
+        maximum = 128;
+    }
+    else if( inet_pton( AF_INET, text, &ipv4 ) == 1 ) {
+        memset( address, 0, 10 );
+        address[10] = 0xFF;
+        address[11] = 0xFF;
+        memcpy( address + 12, &ipv4, 4 );
+        maximum = 32;
+        offset  = 96;
+    }
+    else {
+        return -1;
+    }
+
+    if( slash == NULL ) return maximum + offset;
+    bits = strtol( slash + 1, &end, 10 );
+    if( *end != '\0' || end == slash + 1 || bits < 0 || bits > maximum ) return -1;
+    return (int)bits + offset;
+}
+
+
+static int add_rule( Policy *object, const unsigned char address[16], int bits, int allow )
+{
+    acl_node *node = object->acl;
+    int bit;
+    int i;
+
+    for( i = 0; i < bits; ++i ) {
+        bit = address_bit( address, i );
+        if( node->child[bit] == NULL && (node->child[bit] = new_node( )) == NULL ) return -1;
+        node = node->child[bit];
+    }
+    node->action = allow;
+    return 0;
+}
+
+
+int Policy_admit( const Policy *object, const struct sockaddr_in6 *client_address )
+{
+    const unsigned char *address = client_address->sin6_addr.s6_addr;
+    const acl_node *node = object->acl;
+    int action = object->default_allow;
+    int i;
+
+    for( i = 0; node != NULL; ++i ) {
+        if( node->action != -1 ) action = node->action;
+        if( i == 128 ) break;
+        node = node->child[address_bit( address, i )];
+    }
+    return action;
+}
+
+
+// ==============
+// Path resolution
+// ==============
+
+//
+// Reduce a request path to a canonical relative form: empty and "." components are dropped.
+// Absolute paths and ".." components are refused. Returns the length or -1.
+//
+static int normalize_path( const char *request_path, char *result, size_t size )
+{
+    const char *component = request_path;
+    const char *end;
+    size_t component_length;
+    size_t length = 0;
+
+    if( *request_path == '/' ) return -1;
+    while( *component != '\0' ) {
+        end = strchr( component, '/' );
+        if( end == NULL ) end = component + strlen( component );
+        component_length = (size_t)( end - component );
+
+        if( component_length == 2 && component[0] == '.' && component[1] == '.' ) return -1;
+        if( component_length > 0 && !( component_length == 1 && component[0] == '.' ) ) {
+            if( length + component_length + 2 > size ) return -1;
+            if( length > 0 ) result[length++] = '/';
+            memcpy( result + length, component, component_length );
+            length += component_length;
+        }
+        component = *end == '/' ? end + 1 : end;
+    }
+    if( length == 0 ) return -1;
+    result[length] = '\0';
+    return (int)length;
+}
+
+
+static uint64_t hash_path( const char *path, size_t length )
+{
+    uint64_t hash = 14695981039346656037ULL;   // FNV-1a.
+    size_t i;
+
+    for( i = 0; i < length; ++i ) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+static path_entry *find_entry(
+    path_entry *entry, uint64_t hash, const char *path, size_t length )
+{
+    for( ; entry != NULL; entry = entry->next ) {
+        if( entry->hash == hash && entry->length == length &&
+            memcmp( entry->path, path, length ) == 0 ) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+//
+// Open a path beneath the root. The kernel refuses any resolution (including through symbolic
+// links) that would leave the root. On kernels without openat2() the lexical checks made by
+// normalize_path() are all that stand in the way, and symbolic links are only refused as the
+// final component.
+//
+static int open_beneath( int root_handle, const char *path )
+{
+    struct open_how how;
+    int handle;
+
+    memset( &how, 0, sizeof( how ) );
+    how.flags   = O_RDONLY | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    handle = (int)syscall( SYS_openat2, root_handle, path, &how, sizeof( how ) );
+    if( handle == -1 && errno == ENOSYS ) {
+        handle = openat( root_handle, path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW );
+    }
+    return handle;
+}
+
+
+int Policy_render(
+    Policy *object,
+    const char *request_path,
+    const struct sockaddr_in6 *client_address,
+    VirtualContent **content )
+{
+    char path[REQUEST_BUFFER_LENGTH];
+
+    *content = NULL;
+    if( object->virtuals.patterns == NULL ) return 0;
+    if( normalize_path( request_path, path, sizeof( path ) ) == -1 ) return ERROR_ACCESS_VIOLATION;
+    if( VirtualTable_render( &object->virtuals, path, client_address, content ) == -1 ) {
+        return ERROR_UNDEFINED;
+    }
+    return 0;
+}
+
+
+//
+// Compute the CRC-32C of a whole file. Returns -1 if the file can't be read.
+//
+static long long file_digest( int handle, off_t file_size )
+{
+    unsigned char buffer[65536];
+    uint32_t crc = 0;
+    off_t    offset = 0;
+    ssize_t  count;
+
+    while( offset < file_size ) {
+        if( (count = pread( handle, buffer, sizeof( buffer ), offset )) <= 0 ) return -1;
+        crc = crc32c( crc, buffer, (size_t)count );
+        offset += count;
+    }
+    return crc;
+}
+
+
+//
+// Make a zlib compressed copy of a whole file. Returns NULL if the file can't be read or does
+// not get smaller.
+//
+static VirtualContent *compress_file( path_entry *entry )
+{
+    unsigned char   buffer[65536];
+    unsigned char  *scratch;
+    VirtualContent *content = NULL;
+    z_stream stream;
+    off_t    offset = 0;
+    ssize_t  count;
+    size_t   capacity = (size_t)entry->file_size;
+    int      status = Z_STREAM_ERROR;
+
+    if( entry->file_size == 0 || entry->file_size > MAX_COMPRESSED_SIZE ) return NULL;
+    if( (scratch = malloc( capacity )) == NULL ) return NULL;
+    memset( &stream, 0, sizeof( stream ) );
+    if( deflateInit( &stream, COMPRESSION_LEVEL ) != Z_OK ) {
+        free( scratch );
+        return NULL;
+    }
+
+    // The output may be no larger than the file, or there is no point. It goes to scratch
+    // memory first so that the copy kept is no larger than the stream.
+    stream.next_out  = scratch;
+    stream.avail_out = (uInt)capacity;
+    do {
+        if( (count = pread( entry->file_handle, buffer, sizeof( buffer ), offset )) < 0 ) break;
+        offset += count;
+        stream.next_in  = buffer;
+        stream.avail_in = (uInt)count;
+        status = deflate(
+            &stream, offset >= entry->file_size || count == 0 ? Z_FINISH : Z_NO_FLUSH );
+    } while( status == Z_OK && stream.avail_out > 0 && count > 0 );
+    deflateEnd( &stream );
+
+    if( status == Z_STREAM_END &&
+        (content = VirtualContent_allocate( stream.total_out )) != NULL ) {
+        memcpy( content->data, scratch, stream.total_out );
+    }
+    free( scratch );
+    return content;
+}
+
+
+//
+// Make the compressed copies asked for, one at a time. Each copy is filed under the node the
+// compressor runs on, where its memory is, and the slot claimed for it is cleared if that is a
+// different node. Requests on that node then read or replicate it like any other remote copy.
+//
+static void *compressor_thread( void *argument )
+{
+    compression_job *job;
+    VirtualContent  *made;
+    VirtualContent  *expected;
+    int node;
+
+    (void)argument;
+    for( ;; ) {
+        pthread_mutex_lock( &compression_lock );
+        while( compression_queue == NULL ) {
+            pthread_cond_wait( &compression_ready, &compression_lock );
+        }
+        job = compression_queue;
+        if( (compression_queue = job->next) == NULL ) compression_tail = &compression_queue;
+        pthread_mutex_unlock( &compression_lock );
+
+        if( (made = compress_file( job->entry )) == NULL ) made = &unavailable;
+        node     = Topology_current_node( );
+        expected = node == job->node ? &pending : NULL;
+        if( !atomic_compare_exchange_strong_explicit(
+                &job->entry->compressed[node], &expected, made,
+                memory_order_acq_rel, memory_order_acquire ) && made != &unavailable ) {
+            VirtualContent_release( made );
+        }
+        if( node != job->node ) {
+            atomic_store_explicit( &job->entry->compressed[job->node], NULL, memory_order_release );
+        }
+        Policy_release( job->policy );
+        free( job );
+    }
+    return NULL;
+}
+
+
+//
+// Queue a compressed copy of the entry for the compressor thread, starting the thread if need
+// be. The caller has claimed the node's slot by putting pending in it. If the job can't be
+// queued the slot is marked unavailable.
+//
+static void request_compression( Policy *object, path_entry *entry, int node )
+{
+    compression_job *job;
+    pthread_t compressor;
+
+    if( (job = malloc( sizeof( compression_job ) )) == NULL ) {
+        atomic_store_explicit( &entry->compressed[node], &unavailable, memory_order_release );
+        return;
+    }
+    atomic_fetch_add_explicit( &object->references, 1, memory_order_relaxed );
+    job->policy = object;
+    job->entry  = entry;
+    job->node   = node;
+
+    pthread_mutex_lock( &compression_lock );
+    if( !compressor_started ) {
+        if( pthread_create( &compressor, NULL, compressor_thread, NULL ) != 0 ) {
+            pthread_mutex_unlock( &compression_lock );
+            atomic_store_explicit( &entry->compressed[node], &unavailable, memory_order_release );
+            Policy_release( object );
+            free( job );
+            return;
+        }
+        pthread_detach( compressor );
+        compressor_started = 1;
+    }
+    job->next = NULL;
+    *compression_tail = job;
+    compression_tail  = &job->next;
+    pthread_cond_signal( &compression_ready );
+    pthread_mutex_unlock( &compression_lock );
+}
+
+
+//
+// Make the signature list of a whole file: the CRC-32C of each SIGNATURE_BLOCK_SIZE block, most
+// significant byte first. The digest of the file falls out of the same pass and is kept too.
+// Returns NULL if the file can't be read or is too large.
+//
+static VirtualContent *sign_file( path_entry *entry )
+{
+    unsigned char   buffer[SIGNATURE_BLOCK_SIZE];
+    VirtualContent *content;
+    unsigned char  *signature;
+    uint32_t block_crc;
+    uint32_t file_crc = 0;
+    off_t    offset = 0;
+    ssize_t  count;
+    size_t   size = (size_t)( ( entry->file_size + SIGNATURE_BLOCK_SIZE - 1 ) /
+                              SIGNATURE_BLOCK_SIZE ) * 4;
+
+    if( entry->file_size > MAX_SIGNED_SIZE ) return NULL;
+    if( (content = VirtualContent_allocate( size )) == NULL ) return NULL;
+    for( signature = content->data; offset < entry->file_size; signature += 4 ) {
+        if( (count = pread( entry->file_handle, buffer, sizeof( buffer ), offset )) <= 0 ) {
+            VirtualContent_release( content );
+            return NULL;
+        }
+        block_crc = crc32c( 0, buffer, (size_t)count );
+        file_crc  = crc32c( file_crc, buffer, (size_t)count );
+        signature[0] = (unsigned char)( block_crc >> 24 );
+        signature[1] = (unsigned char)( block_crc >> 16 );
+        signature[2] = (unsigned char)( block_crc >>  8 );
+        signature[3] = (unsigned char)( block_crc );
+        offset += count;
+    }
+    content->digest = file_crc;
+    atomic_store_explicit(
+        &entry->digest, ( (uint64_t)1 << 32 ) | file_crc, memory_order_release );
+    return content;
+}
+
+
+//
+// Copy a copy made on another NUMA node into memory on this one.
+//
+static VirtualContent *replicate( const VirtualContent *original )
+{
+    VirtualContent *copy;
+
+    if( (copy = VirtualContent_allocate( original->size )) == NULL ) return NULL;
+    memcpy( copy->data, original->data, original->size );
+    copy->digest = original->digest;
+    return copy;
+}
+
+
+//
+// Return a reference to a copy of a file kept in the entry's slots, one per NUMA node, making
+// the copy if this is the first request for it. A copy already made on another node is read
+// from there until the file has been asked for REPLICATE_AFTER times; after that each node
+// that asks gets a replica of its own. Two threads may make a node's replica at once; only one
+// is kept. Returns NULL if no copy can be made.
+//
+// If make_copy is NULL the copy is a compressed one. The first request to find none claims
+// the work and queues it for the compressor thread; it, and any request that comes before the
+// copy is ready, gets NULL and sends the file as it is.
+//
+static VirtualContent *cached_copy(
+    Policy *object,
+    path_entry *entry,
+    _Atomic(VirtualContent *) slots[MAX_NODES],
+    VirtualContent *( *make_copy )( path_entry * ) )
+{
+    VirtualContent *copy;
+    VirtualContent *made;
+    VirtualContent *remote = NULL;
+    VirtualContent *expected = NULL;
+    int node = Topology_current_node( );
+    int i;
+
+    copy = atomic_load_explicit( &slots[node], memory_order_acquire );
+    if( copy == NULL ) {
+        for( i = 0; i < Topology_node_count( ) && remote == NULL; ++i ) {
+            if( i != node ) remote = atomic_load_explicit( &slots[i], memory_order_acquire );
+        }
+        if( remote != NULL &&
+            ( remote == &unavailable || remote == &pending ||
+              atomic_load_explicit( &entry->uses, memory_order_relaxed ) < REPLICATE_AFTER ) ) {
+            copy = remote;
+        }
+        else if( remote == NULL && make_copy == NULL ) {
+            if( compression_enabled && atomic_compare_exchange_strong_explicit(
+                    &slots[node], &expected, &pending,
+                    memory_order_acq_rel, memory_order_acquire ) ) {
+                request_compression( object, entry, node );
+            }
+            return NULL;
+        }
+        else {
+            made = remote != NULL ? replicate( remote ) : make_copy( entry );
+            if( made == NULL && remote == NULL ) made = &unavailable;
+
+            // If there is no memory for a replica, the remote copy still serves.
+            if( made == NULL ) {
+                copy = remote;
+            }
+            else if( !atomic_compare_exchange_strong_explicit(
+                         &slots[node], &expected, made,
+                         memory_order_acq_rel, memory_order_acquire ) ) {
+                if( made != &unavailable ) VirtualContent_release( made );
+                copy = expected;
+            }
+            else {
+                copy = made;
+            }
+        }
+    }
+    if( copy == &unavailable || copy == &pending ) return NULL;
+    atomic_fetch_add_explicit( &copy->references, 1, memory_order_relaxed );
+    return copy;
+}
+
+
+//
+// Hand out a cached file. Its digest, compressed copy, and signature list are made the first
+// time a client asks for them and kept with the entry.
+//
+static int use_entry(
+    Policy *object,
+    path_entry *entry,
+    int *file_handle,
+    off_t *file_size,
+    int *shared,
+    long long *digest,
+    VirtualContent **compressed,
+    VirtualContent **signatures )
+{
+    uint64_t state;
+
+    *file_handle = entry->file_handle;
+    *file_size   = entry->file_size;
+    *shared      = 1;
+    atomic_fetch_add_explicit( &entry->uses, 1, memory_order_relaxed );
+
+    // The signature list is made first since it leaves the digest behind.
+    if( signatures != NULL ) {
+        *signatures = cached_copy( object, entry, entry->signatures, sign_file );
+    }
+    if( digest != NULL ) {
+        state = atomic_load_explicit( &entry->digest, memory_order_acquire );
+        if( state == 0 && (*digest = file_digest( entry->file_handle, entry->file_size )) != -1 ) {
+            state = ( (uint64_t)1 << 32 ) | (uint64_t)*digest;
+            atomic_store_explicit( &entry->digest, state, memory_order_release );
+        }
+        if( state != 0 ) *digest = (long long)( state & 0xFFFFFFFF );
+    }
+    if( compressed != NULL ) {
+        *compressed = cached_copy( object, entry, entry->compressed, NULL );
+    }
+    return 0;
+}
+
+
+int Policy_open(
+    Policy *object,
+    const char *request_path,
+    int *file_handle,
+    const unsigned char **mapped,
+    off_t *file_size,
+    int *shared,
+    long long *digest,
+    VirtualContent **compressed,
+    VirtualContent **signatures )
+{
+    char path[REQUEST_BUFFER_LENGTH];
+    struct stat file_information;
+    _Atomic(path_entry *) *bucket;
+    path_entry *head;
+    path_entry *entry;
+    path_entry *existing;
+    uint64_t hash;
+    uint32_t archived_digest;
+    int length;
+    int handle;
+    int node;
+
+    if( digest != NULL ) *digest = -1;
+    if( compressed != NULL ) *compressed = NULL;
+    if( signatures != NULL ) *signatures = NULL;
+    *mapped = NULL;
+    if( (length = normalize_path( request_path, path, sizeof( path ) )) == -1 ) {
+        return ERROR_ACCESS_VIOLATION;
+    }
+    if( object->archive != NULL ) {
+        if( Archive_find( object->archive,
+                          path, (size_t)length, mapped, file_size, &archived_digest ) == -1 ) {
+            return ERROR_FILE_NOT_FOUND;
+        }
+        *file_handle = -1;
+        *shared      = 1;
+        if( digest != NULL ) *digest = archived_digest;
+        return 0;
+    }
+    hash   = hash_path( path, (size_t)length );
+    bucket = &object->buckets[hash & object->bucket_mask];
+
+    // The common case: the file was opened by an earlier request.
+    head = atomic_load_explicit( bucket, memory_order_acquire );
+    if( (entry = find_entry( head, hash, path, (size_t)length )) != NULL ) {
+        return use_entry(
+            object, entry, file_handle, file_size, shared, digest, compressed, signatures );
+    }
+
+    if( (handle = open_beneath( object->root_handle, path )) == -1 ) {
+        return errno == ENOENT ? ERROR_FILE_NOT_FOUND : ERROR_ACCESS_VIOLATION;
+    }
+    if( fstat( handle, &file_information ) == -1 || !S_ISREG( file_information.st_mode ) ) {
+        close( handle );
+        return ERROR_ACCESS_VIOLATION;
+    }
+
+    // Keep the descriptor for later requests if there is room. Otherwise no digest, compressed
+    // copy, or signature list is offered, since each would cost a pass over the file for every
+    // request.
+    if( atomic_fetch_add( &object->entry_count, 1 ) >= MAX_CACHED_FILES ||
+        (entry = malloc( sizeof( path_entry ) + (size_t)length + 1 )) == NULL ) {
+        atomic_fetch_sub( &object->entry_count, 1 );
+        *file_handle = handle;
+        *file_size   = file_information.st_size;
+        *shared      = 0;
+        return 0;
+    }
+    entry->hash        = hash;
+    entry->file_handle = handle;
+    entry->file_size   = file_information.st_size;
+    entry->length      = (size_t)length;
+    atomic_init( &entry->digest, 0 );
+    atomic_init( &entry->uses, 0 );
+    for( node = 0; node < MAX_NODES; ++node ) {
+        atomic_init( &entry->compressed[node], NULL );
+        atomic_init( &entry->signatures[node], NULL );
+    }
+    memcpy( entry->path, path, (size_t)length + 1 );
+
+    do {
+        // Another thread may have opened the same file meanwhile. Use its entry.
+        if( (existing = find_entry( head, hash, path, (size_t)length )) != NULL ) {
+            atomic_fetch_sub( &object->entry_count, 1 );
+            free( entry );
+            close( handle );
+            return use_entry( object, existing,
+                              file_handle, file_size, shared, digest, compressed, signatures );
+        }
+        entry->next = head;
+    } while( !atomic_compare_exchange_weak_explicit(
+                 bucket, &head, entry, memory_order_release, memory_order_acquire ) );
+    return use_entry(
+        object, entry, file_handle, file_size, shared, digest, compressed, signatures );
+}
+
+
+int Policy_compress( Policy *object, const char *request_path, VirtualContent **compressed )
+{
+    struct timespec pause = { 0, 1000000 };
+    char path[REQUEST_BUFFER_LENGTH];
+    path_entry *entry;
+    VirtualContent *copy;
+    VirtualContent *expected;
+    uint64_t hash;
+    int length;
+    int node = Topology_current_node( );
+
+    *compressed = NULL;
+    if( object->archive != NULL ||
+        (length = normalize_path( request_path, path, sizeof( path ) )) == -1 ) {
+        return -1;
+    }
+    hash  = hash_path( path, (size_t)length );
+    entry = find_entry(
+        atomic_load_explicit( &object->buckets[hash & object->bucket_mask], memory_order_acquire ),
+        hash, path, (size_t)length );
+    if( entry == NULL ) return -1;
+
+    // Claim an empty slot and make the copy here, or wait for whoever claimed it: another
+    // resumed transfer, or the compressor thread. The compressor may file its copy under
+    // another node and clear this slot, in which case the slot is claimed again.
+    while( (copy = atomic_load_explicit( &entry->compressed[node], memory_order_acquire )) ==
+               NULL || copy == &pending ) {
+        expected = NULL;
+        if( copy == NULL && atomic_compare_exchange_strong_explicit(
+                &entry->compressed[node], &expected, &pending,
+                memory_order_acq_rel, memory_order_acquire ) ) {
+            if( (copy = compress_file( entry )) == NULL ) copy = &unavailable;
+            atomic_store_explicit( &entry->compressed[node], copy, memory_order_release );
+            break;
+        }
+        if( copy == &pending ) nanosleep( &pause, NULL );
+    }
+    if( copy == &unavailable ) return -1;
+    atomic_fetch_add_explicit( &copy->references, 1, memory_order_relaxed );
+    *compressed = copy;
+    return 0;
+}
+
+
+// ==================
+// Loading and reload
+// ==================
+
+static void destroy_policy( Policy *object )
+{
+    VirtualContent *copies[2];
+    path_entry *entry;
+    path_entry *next;
+    size_t i;
+    int    j;
+    int    node;
+
+    if( object->buckets != NULL ) {
+        for( i = 0; i <= object->bucket_mask; ++i ) {
+            for( entry = atomic_load( &object->buckets[i] ); entry != NULL; entry = next ) {
+                next = entry->next;
+                for( node = 0; node < MAX_NODES; ++node ) {
+                    copies[0] = atomic_load( &entry->compressed[node] );
+                    copies[1] = atomic_load( &entry->signatures[node] );
+                    for( j = 0; j < 2; ++j ) {
+                        if( copies[j] != NULL && copies[j] != &unavailable &&
+                            copies[j] != &pending ) {
+                            VirtualContent_release( copies[j] );
+                        }
+                    }
+                }
+                close( entry->file_handle );
+                free( entry );
+            }
+        }
+        free( object->buckets );
+    }
+    free_nodes( object->acl );
+    VirtualTable_destroy( &object->virtuals );
+    if( object->root_handle != -1 ) close( object->root_handle );
+    Archive_close( object->archive );
+    free( object );
+}
+
+
+//
+// Read and compile a policy file. Problems are reported on stderr with their line number.
+//
+static Policy *compile_policy( const char *file_name )
+{
+    Policy *object;
+    FILE   *input = NULL;
+    char    line[512];
+    char   *directive;
+    char   *argument;
+    char   *second = NULL;
+    char   *end;
+    char   *root = NULL;
+    char   *archive = NULL;
+    unsigned char address[16];
+    int     line_number = 0;
+    int     bits;
+    int     argument_count;
+    int     seconds;
+    size_t  i;
+
+    if( (object = calloc( 1, sizeof( Policy ) )) == NULL ) return NULL;
+    if( VirtualTable_initialize( &object->virtuals ) == -1 ) {
+        free( object );
+        return NULL;
+    }
+    atomic_init( &object->references, 1 );
+    atomic_init( &object->entry_count, 0 );
+    object->root_handle   = -1;
+    object->default_allow = 1;
+    object->bucket_mask   = BUCKET_COUNT - 1;
+    if( (object->acl = new_node( )) == NULL ||
+        (object->buckets = malloc( BUCKET_COUNT * sizeof( *object->buckets ) )) == NULL ) {
+        destroy_policy( object );
+        return NULL;
+    }
+    for( i = 0; i < BUCKET_COUNT; ++i ) atomic_init( &object->buckets[i], NULL );
+
+    if( file_name != NULL && (input = fopen( file_name, "r" )) == NULL ) {
+        perror( file_name );
+        destroy_policy( object );
+        return NULL;
+    }
+
+    while( input != NULL && fgets( line, sizeof( line ), input ) != NULL ) {
+        ++line_number;
+        if( (end = strchr( line, '#' )) != NULL ) *end = '\0';
+        directive = strtok( line, " \t\r\n" );
+        if( directive == NULL ) continue;
+        argument_count =
+            strcmp( directive, "virtual" ) == 0 || strcmp( directive, "set" ) == 0 ? 2 : 1;
+        argument = strtok( NULL, " \t\r\n" );
+        if( argument_count == 2 ) second = strtok( NULL, " \t\r\n" );
+
+        if( argument == NULL || ( argument_count == 2 && second == NULL ) ||
+            strtok( NULL, " \t\r\n" ) != NULL ) {
+            fprintf( stderr, "%s:%d: expected %s\n", file_name, line_number,
+                     argument_count == 2 ? "two arguments" : "one argument" );
+            goto failed;
+        }
+        if( strcmp( directive, "root" ) == 0 ) {
+            free( root );
+            if( (root = strdup( argument )) == NULL ) goto failed;
+        }
+        else if( strcmp( directive, "archive" ) == 0 ) {
+            free( archive );
+            if( (archive = strdup( argument )) == NULL ) goto failed;
+        }
+        else if( strcmp( directive, "default" ) == 0 &&
+                 ( strcmp( argument, "allow" ) == 0 || strcmp( argument, "deny" ) == 0 ) ) {
+            object->default_allow = strcmp( argument, "allow" ) == 0;
+        }
+        else if( strcmp( directive, "allow" ) == 0 || strcmp( directive, "deny" ) == 0 ) {
+            if( (bits = parse_prefix( argument, address )) == -1 ) {
+                fprintf( stderr, "%s:%d: bad address prefix\n", file_name, line_number );
+                goto failed;
+            }
+            if( add_rule( object, address, bits, strcmp( directive, "allow" ) == 0 ) == -1 ) {
+                goto failed;
+            }
+        }
+        else if( strcmp( directive, "virtual" ) == 0 ) {
+            if( VirtualTable_add_pattern( &object->virtuals, argument, second ) == -1 ) {
+                fprintf( stderr, "%s:%d: bad pattern or unreadable template %s\n",
+                         file_name, line_number, second );
+                goto failed;
+            }
+        }
+        else if( strcmp( directive, "set" ) == 0 ) {
+            if( VirtualTable_add_value( &object->virtuals, argument, second ) == -1 ) {
+                fprintf( stderr, "%s:%d: expected name=value\n", file_name, line_number );
+                goto failed;
+            }
+        }
+        else if( strcmp( directive, "virtual-ttl" ) == 0 ) {
+            if( (seconds = atoi( argument )) < 0 ) {
+                fprintf( stderr, "%s:%d: bad time to live\n", file_name, line_number );
+                goto failed;
+            }
+            VirtualTable_set_time_to_live( &object->virtuals, seconds );
+        }
+        else {
+            fprintf( stderr, "%s:%d: unknown directive %s\n", file_name, line_number, directive );
+            goto failed;
+        }
+    }
+
+    if( archive != NULL ) {
+        if( root != NULL ) {
+            fprintf( stderr, "%s: root and archive can't both be given\n", file_name );
+            goto failed;
+        }
+        if( (object->archive = Archive_open( archive )) == NULL ) goto failed;
+    }
+    else {
+        object->root_handle =
+            open( root != NULL ? root : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+        if( object->root_handle == -1 ) {
+            perror( root != NULL ? root : "." );
+            goto failed;
+        }
+    }
+    free( root );
+    free( archive );
+    if( input != NULL ) fclose( input );
+    return object;
+
+failed:
+    free( root );
+    free( archive );
+    if( input != NULL ) fclose( input );
+    destroy_policy( object );
+    return NULL;
+}
+
+
+//
+// Open the regular files in a directory beneath the root, and those in its subdirectories,
+// stopping once the table of resolved files is full. Symbolic links and special files (a FIFO
+// would block the open) are left for requests to find. Returns -1 once the table is full.
+//
+static int warm_directory( Policy *object, int directory_handle, char *path, size_t length,
+                           int depth )
+{
+    DIR *directory;
+    struct dirent *entry;
+    struct stat information;
+    const unsigned char *mapped;
+    size_t name_length;
+    off_t  file_size;
+    int    handle;
+    int    shared;
+    int    result = 0;
+    int    type;
+
+    if( (directory = fdopendir( directory_handle )) == NULL ) {
+        close( directory_handle );
+        return 0;
+    }
+    while( result == 0 && (entry = readdir( directory )) != NULL ) {
+        if( strcmp( entry->d_name, "." ) == 0 || strcmp( entry->d_name, ".." ) == 0 ) continue;
+        name_length = strlen( entry->d_name );
+        if( length + name_length + 2 > REQUEST_BUFFER_LENGTH ) continue;
+        type = entry->d_type;
+        if( type == DT_UNKNOWN ) {
+            if( fstatat( dirfd( directory ), entry->d_name, &information,
+                         AT_SYMLINK_NOFOLLOW ) == -1 ) {
+                continue;
+            }
+            type = S_ISDIR( information.st_mode ) ? DT_DIR :
+                   S_ISREG( information.st_mode ) ? DT_REG : DT_UNKNOWN;
+        }
+        if( type != DT_DIR && type != DT_REG ) continue;
+
+        path[length] = '/';
+        memcpy( path + length + 1, entry->d_name, name_length + 1 );
+        if( type == DT_DIR ) {
+            handle = openat( dirfd( directory ), entry->d_name,
+                             O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC );
+            if( handle != -1 && depth < MAX_WARM_DEPTH ) {
+                result = warm_directory( object, handle, path, length + 1 + name_length,
+                                         depth + 1 );
+            }
+            else if( handle != -1 ) {
+                close( handle );
+            }
+        }
+        else if( Policy_open( object, path + 1, &handle, &mapped, &file_size, &shared,
+                              NULL, NULL, NULL ) == 0 ) {
+            if( !shared ) {
+                close( handle );
+                result = -1;
+            }
+            else {
+                posix_fadvise( handle, 0, WARM_LENGTH, POSIX_FADV_WILLNEED );
+            }
+        }
+    }
+    path[length] = '\0';
+    closedir( directory );
+    return result;
+}
+
+
+void Policy_configure_warming( int enabled )
+{
+    warm_policies = enabled;
+}
+
+
+void Policy_configure_compression( int enabled )
+{
+    compression_enabled = enabled;
+}
+
+
+int Policy_load( const char *file_name )
+{
+    Policy *object;
+    Policy *previous;
+    char   *saved_name = NULL;
+    char    path[REQUEST_BUFFER_LENGTH];
+    int     handle;
+
+    if( file_name != NULL && file_name != policy_file_name &&
+        (saved_name = strdup( file_name )) == NULL ) {
+        return -1;
+    }
+    if( (object = compile_policy( file_name )) == NULL ) {
+        free( saved_name );
+        return -1;
+    }
+    if( saved_name != NULL ) {
+        free( policy_file_name );
+        policy_file_name = saved_name;
+    }
+    if( warm_policies && object->root_handle != -1 &&
+        (handle = openat( object->root_handle, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC )) != -1 ) {
+        path[0] = '\0';
+        warm_directory( object, handle, path, 0, 0 );
+    }
+
+    previous = atomic_exchange( &current_policy, object );
+    if( previous != NULL ) {
+        previous->next_retired = retired_policies;
+        retired_policies = previous;
+        Policy_release( previous );
+    }
+    return 0;
+}
+
+
+//
+// Return non-zero if some thread has published the policy in its hazard slot.
+//
+static int hazardous( const Policy *object )
+{
+    policy_hazard *hazard;
+
+    for( hazard = atomic_load( &hazards ); hazard != NULL; hazard = hazard->next ) {
+        if( atomic_load( &hazard->policy ) == object ) return 1;
+    }
+    return 0;
+}
+
+
+void Policy_refresh( void )
+{
+    Policy **link = &retired_policies;
+    Policy  *object;
+
+    if( reload_generation != policy_reload_requests ) {
+        reload_generation = policy_reload_requests;
+        if( Policy_load( policy_file_name ) == -1 ) {
+            fprintf( stderr, "Unable to reload policy; the previous policy remains in force\n" );
+        }
+    }
+
+    // The slots are checked before the count. A thread that has left its slot counted its
+    // reference first, so the count seen afterward includes it.
+    while( (object = *link) != NULL ) {
+        if( !hazardous( object ) && atomic_load( &object->references ) == 0 ) {
+            *link = object->next_retired;
+            destroy_policy( object );
+        }
+        else {
+            link = &object->next_retired;
+        }
+    }
+}
+
+
+Policy *Policy_acquire( void )
+{
+    policy_hazard *hazard = thread_hazard;
+    Policy *object;
+
+    if( hazard == NULL && (hazard = calloc( 1, sizeof( policy_hazard ) )) != NULL ) {
+        hazard->next = atomic_load( &hazards );
+        while( !atomic_compare_exchange_weak( &hazards, &hazard->next, hazard ) ) ;
+        thread_hazard = hazard;
+    }
+    if( hazard == NULL ) {
+        pthread_mutex_lock( &shared_hazard_lock );
+        hazard = &shared_hazard;
+    }
+
+    // Once the slot is seen to hold the current policy, a reload that retires it comes after
+    // the slot was filled, so Policy_refresh() sees the slot and keeps the policy.
+    do {
+        object = atomic_load( &current_policy );
+        atomic_store( &hazard->policy, object );
+    } while( object != atomic_load( &current_policy ) );
+    atomic_fetch_add( &object->references, 1 );
+    atomic_store_explicit( &hazard->policy, NULL, memory_order_release );
+
+    if( hazard == &shared_hazard ) pthread_mutex_unlock( &shared_hazard_lock );
+    return object;
+}
+
+
+void Policy_release( Policy *object )
+{
+    atomic_fetch_sub_explicit( &object->references, 1, memory_order_release );
+}
@@ -0,0 +1,181 @@
+/*!
+ * \file policy.h
+ * \author Peter C. Chapin
+ * \brief Interface to the compiled access policy: client address rules and resolved files.
+ *
+ */
+
+#ifndef POLICY_H_INCLUDED
+#define POLICY_H_INCLUDED
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+#include <sys/types.h>
+
+#include "archive.h"
+#include "virtual_file.h"
+
+struct acl_node;
+struct path_entry;
+
+//! A compiled policy.
+/*!
+ * A policy is built from a policy file and never changes afterwards, except that its table of
+ * resolved files fills in as files are requested. Client addresses are matched against a
+ * binary trie of prefixes (longest match wins), so admission costs at most 128 steps whatever
+ * the number of rules. Request paths are normalized, hashed, and looked up in a table of files
+ * already opened beneath the served root; a hit costs time proportional to the path length and
+ * makes no system calls. A policy may instead serve the files of a packed archive (see
+ * archive.h), where every file is found without a system call.
+ *
+ * Reloading builds a complete new policy and swaps a single pointer. Transfers that started
+ * under the old policy keep a reference to it (and to its open files or archive) until they
+ * finish.
+ */
+typedef struct Policy {
+    atomic_int  references;      //!< Transfers using this policy, plus one while it is current.
+    int         root_handle;     //!< Directory descriptor of the served root, or -1.
+    Archive    *archive;         //!< Archive files are served from, or NULL.
+    int         default_allow;   //!< Action for addresses no rule covers.
+    struct acl_node   *acl;      //!< Root of the address trie.
+    _Atomic(struct path_entry *) *buckets;  //!< Hash table of resolved files.
+    size_t      bucket_mask;     //!< Number of buckets minus one.
+    atomic_int  entry_count;     //!< Number of files in the table.
+    VirtualTable virtuals;       //!< Templated files rendered in memory.
+    struct Policy *next_retired; //!< Link in the list of retired policies.
+} Policy;
+
+//! Incremented (by the SIGHUP handler) to ask for the policy file to be read again.
+extern volatile sig_atomic_t policy_reload_requests;
+
+//! Compile a policy file and make it current.
+/*!
+ * The file contains one directive per line; '#' starts a comment.
+ *
+ *     root <directory>       Directory files are served from (default: current directory).
+ *     archive <file>         Serve the files of a packed archive (built by mkarchive) instead.
+ *     default allow|deny     Action for clients no rule matches (default: allow).
+ *     allow <address>/<bits> Admit clients in this prefix. IPv4 and IPv6 are both accepted.
+ *     deny <address>/<bits>  Refuse clients in this prefix.
+ *     virtual <pattern> <template>  Render paths matching pattern from a template.
+ *     set <key> <name>=<value>      Define a template value for a match text or client address.
+ *     virtual-ttl <seconds>  How long rendered files are reused (default: 60; 0 disables).
+ *
+ * See virtual_file.h for the template syntax. An archive is mapped each time the policy is
+ * loaded, so reloading after renaming a new archive over the old one publishes it.
+ *
+ * \param file_name The policy file, or NULL for the default policy (serve the current
+ * directory to everyone). The name is remembered for later reloads.
+ *
+ * \return 0 if the policy was installed; -1 if it could not be read or compiled, in which case
+ * the previous policy (if any) remains current.
+ */
+int Policy_load( const char *file_name );
+
+//! Open the files beneath the served root whenever a policy is loaded.
+/*!
+ * Each policy then starts with its table of resolved files filled (up to its limit) and with
+ * the start of every file read into the page cache, so the first request for a file neither
+ * searches the directory tree nor waits for the disk. Forked children inherit the open files.
+ * This should be called before Policy_load().
+ */
+void Policy_configure_warming( int enabled );
+
+//! Offer compressed copies of files (see Policy_open()).
+/*!
+ * Compressed copies are made in the background and kept with the policy, so they are only
+ * worth offering in a process that serves many requests. A child forked for one transfer would
+ * exit before its copy was ready. Compressed copies are not offered until this is called.
+ */
+void Policy_configure_compression( int enabled );
+
+//! Reload the policy if a reload was requested, and free retired policies no longer in use.
+/*!
+ * Only one thread in each process (the one that receives requests) calls this.
+ */
+void Policy_refresh( void );
+
+//! Return the current policy with an extra reference. Release it with Policy_release().
+Policy *Policy_acquire( void );
+
+//! Drop a reference taken by Policy_acquire().
+void Policy_release( Policy *object );
+
+//! Return non-zero if the client may use the server.
+int Policy_admit( const Policy *object, const struct sockaddr_in6 *client_address );
+
+//! Render a requested file if it matches a virtual path pattern.
+/*!
+ * \param object The policy to use.
+ * \param request_path The file name from the request.
+ * \param client_address The address of the client.
+ * \param content Receives the rendering, with a reference for the caller, or NULL if the path
+ * is not virtual.
+ *
+ * \return 0 if successful (whether or not the path is virtual), or the TFTP error code to send
+ * to the client.
+ */
+int Policy_render(
+    Policy *object,
+    const char *request_path,
+    const struct sockaddr_in6 *client_address,
+    VirtualContent **content );
+
+//! Open a requested file beneath the served root or find it in the archive.
+/*!
+ * \param object The policy to use.
+ * \param request_path The file name from the request.
+ * \param file_handle Receives a descriptor for the file. It may be shared with other transfers,
+ * so it must only be read with pread(). It is -1 for a file in the archive.
+ * \param mapped Receives the contents of a file in the archive, which stay mapped as long as
+ * the policy, or NULL for other files.
+ * \param file_size Receives the size of the file.
+ * \param shared Receives non-zero if the descriptor belongs to the policy (and must not be
+ * closed by the caller).
+ * \param digest If not NULL, receives the CRC-32C of the file, or -1 if it is not available.
+ * \param compressed If not NULL, receives a zlib compressed copy of the file with a reference for
+ * the caller, or NULL if the file doesn't compress or its copy is not ready yet.
+ * \param signatures If not NULL, receives the file's signature list with a reference for the
+ * caller, or NULL if it is not available. The list holds the CRC-32C of each block of
+ * SIGNATURE_BLOCK_SIZE bytes as four bytes, most significant first; its digest member is the
+ * CRC-32C of the whole file.
+ *
+ * Digests, compressed copies, and signature lists are only kept for files the policy holds
+ * open. The first request that asks for one makes it, except that compressed copies are made
+ * by a thread of their own so that no request waits for one. Files in an archive have a digest
+ * (it is in the archive's index) but no compressed copy or signature list.
+ *
+ * \return 0 if the file was opened, or the TFTP error code to send to the client.
+ */
+int Policy_open(
+    Policy *object,
+    const char *request_path,
+    int *file_handle,
+    const unsigned char **mapped,
+    off_t *file_size,
+    int *shared,
+    long long *digest,
+    VirtualContent **compressed,
+    VirtualContent **signatures );
+
+//! Return the compressed copy of a file the policy holds open, making it now if need be.
+/*!
+ * This is for a compressed transfer handed over by another process (see Transfer_resume()),
+ * which can't be sent the file as it is while the compressor thread makes the copy. If another
+ * thread is making the copy already, this waits for it; otherwise the copy is made here and
+ * kept for later requests.
+ *
+ * \param object The policy to use.
+ * \param request_path The file name from the request. The file must have been opened already
+ * with Policy_open().
+ * \param compressed Receives the copy with a reference for the caller, or NULL.
+ *
+ * eturn 0 if successful; -1 if the file isn't held open or doesn't compress.
+ */
+int Policy_compress( Policy *object, const char *request_path, VirtualContent **compressed );
+
+#endif // POLICY_H_INCLUDED
@@ -0,0 +1,201 @@
+/*!
+ * \file request.c
+ * \author Peter C. Chapin
+ * \brief Functions for parsing requests and reporting errors to clients.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/socket.h>
+
+#include "metrics.h"
+#include "server.h"
+
+//
+// Return a pointer to the null terminated string starting at offset in the request, or NULL
+// if the string is not terminated before the end of the request. On success offset is moved
+// past the terminator.
+//
+static const char *next_string(
+    const unsigned char *request_buffer, size_t request_count, size_t *offset )
+{
+    const char *start = (const char *)request_buffer + *offset;
+    const void *terminator;
+
+    if( *offset >= request_count ) return NULL;
+    terminator = memchr( start, '\0', request_count - *offset );
+    if( terminator == NULL ) return NULL;
+    *offset += (size_t)( (const char *)terminator - start ) + 1;
+    return start;
+}
+
+
+//
+// Convert an option value to an unsigned integer. Returns 0 if the value is not a number.
+//
+static unsigned option_value( const char *text )
+{
+    char *end_ptr;
+    unsigned long value = strtoul( text, &end_ptr, 10 );
+
+    if( *text == '\0' || *end_ptr != '\0' || value > 0xFFFFFFFFUL ) return 0;
+    return (unsigned)value;
+}
+
+
+//
+// Return non-zero if a comma separated list contains the given item (ignoring case).
+//
+static int list_contains( const char *list, const char *item )
+{
+    size_t item_length = strlen( item );
+    const char *end;
+
+    while( *list != '\0' ) {
+        end = strchr( list, ',' );
+        if( end == NULL ) end = list + strlen( list );
+        if( (size_t)( end - list ) == item_length && strncasecmp( list, item, item_length ) == 0 ) {
+            return 1;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+
+//
+// Read the value of the ranges option: a block size, a colon, and a comma separated list of
+// block indices or index ranges ("65536:0-3,17,40-41") in increasing order. A malformed value
+// is ignored like an unknown option, so the whole file is sent.
+//
+static void parse_ranges( const char *text, tftp_request *request )
+{
+    unsigned long unit;
+    unsigned long long first;
+    unsigned long long last;
+    char *end_ptr;
+
+    request->range_count = 0;
+    unit = strtoul( text, &end_ptr, 10 );
+    if( *end_ptr != ':' || unit < 512 || unit > 16UL * 1024 * 1024 ) return;
+    text = end_ptr + 1;
+
+    while( *text != '\0' && request->range_count < MAX_RANGES ) {
+        first = last = strtoull( text, &end_ptr, 10 );
+        if( end_ptr == text ) break;
+        if( *end_ptr == '-' ) {
+            text = end_ptr + 1;
+            last = strtoull( text, &end_ptr, 10 );
+            if( end_ptr == text ) break;
+        }
+        if( last < first || last > 0xFFFFFFFFULL ||
+            ( request->range_count > 0 &&
+              first <= request->ranges[request->range_count - 1].last ) ) break;
+        request->ranges[request->range_count].first = (uint32_t)first;
+        request->ranges[request->range_count].last  = (uint32_t)last;
+        ++request->range_count;
+
+        if( *end_ptr == '\0' ) {
+            request->range_unit = (unsigned)unit;
+            return;
+        }
+        if( *end_ptr != ',' ) break;
+        text = end_ptr + 1;
+    }
+    request->range_count = 0;
+}
+
+
+int parse_request(
+    const unsigned char *request_buffer, size_t request_count, tftp_request *request )
+{
+    size_t offset = 2;
+    const char *file_name;
+    const char *mode;
+    const char *option;
+    const char *value;
+
+    memset( request, 0, sizeof( *request ) );
+
+    if( request_count < 2 ) return ERROR_ILLEGAL_OPERATION;
+    if( request_buffer[0] != 0 || request_buffer[1] != OPCODE_RRQ ) {
+        // This server is read only. Write requests are refused with a proper error.
+        return request_buffer[1] == OPCODE_WRQ ? ERROR_ACCESS_VIOLATION : ERROR_ILLEGAL_OPERATION;
+    }
+
+    if( (file_name = next_string( request_buffer, request_count, &offset )) == NULL ||
+        (mode      = next_string( request_buffer, request_count, &offset )) == NULL ) {
+        return ERROR_ILLEGAL_OPERATION;
+    }
+    if( *file_name == '\0' ) return ERROR_FILE_NOT_FOUND;
+    if( strcasecmp( mode, "octet" ) != 0 && strcasecmp( mode, "netascii" ) != 0 ) {
+        return ERROR_ILLEGAL_OPERATION;
+    }
+    strcpy( request->file_name, file_name );
+    strncpy( request->mode, mode, sizeof( request->mode ) - 1 );
+
+    // Options come in name/value pairs. Unknown options are ignored (RFC 2347).
+    while( (option = next_string( request_buffer, request_count, &offset )) != NULL &&
+           (value  = next_string( request_buffer, request_count, &offset )) != NULL ) {
+
+        if( strcasecmp( option, "blksize" ) == 0 ) {
+            request->block_size = option_value( value );
+        }
+        else if( strcasecmp( option, "windowsize" ) == 0 ) {
+            request->window_size = option_value( value );
+        }
+        else if( strcasecmp( option, "timeout" ) == 0 ) {
+            request->timeout = option_value( value );
+        }
+        else if( strcasecmp( option, "tsize" ) == 0 ) {
+            request->tsize_requested = 1;
+        }
+        else if( strcasecmp( option, "digest" ) == 0 && strcasecmp( value, "crc32c" ) == 0 ) {
+            request->digest_requested = 1;
+        }
+        else if( strcasecmp( option, "compress" ) == 0 ) {
+            request->compress_requested = list_contains( value, "zlib" );
+        }
+        else if( strcasecmp( option, "signatures" ) == 0 && strcasecmp( value, "crc32c" ) == 0 ) {
+            request->signatures_requested = 1;
+        }
+        else if( strcasecmp( option, "ranges" ) == 0 ) {
+            parse_ranges( value, request );
+        }
+    }
+    return 0;
+}
+
+
+void send_error(
+    int socket_handle,
+    const struct sockaddr_in6 *client_address,
+    int error_code,
+    const char *message )
+{
+    unsigned char error_datagram[4 + 128];
+    size_t message_length = strlen( message );
+
+    if( message_length > sizeof( error_datagram ) - 5 ) {
+        message_length = sizeof( error_datagram ) - 5;
+    }
+    error_datagram[0] = 0x00;
+    error_datagram[1] = OPCODE_ERROR;
+    error_datagram[2] = (unsigned char)( error_code >> 8 );
+    error_datagram[3] = (unsigned char)( error_code & 0xFF );
+    memcpy( &error_datagram[4], message, message_length );
+    error_datagram[4 + message_length] = '\0';
+
+    // Send it to the client. Don't worry about if the send succeeds for fails.
+    Metrics_count( METRIC_ERRORS_SENT, 1 );
+    sendto(
+        socket_handle,
+        error_datagram,
+        4 + message_length + 1,
+        0,
+        (const struct sockaddr *)client_address,
+        sizeof( struct sockaddr_in6 ) );
+}
@@ -0,0 +1,287 @@
+/*!
+ * \file ring.c
+ * \author Peter C. Chapin
+ * \brief Implementation of lock-free ring buffers.
+ *
+ * The multi-producer, multi-consumer ring follows Dmitry Vyukov's bounded queue design. Each
+ * slot holds a sequence number. A slot at position p is free for a producer when its sequence
+ * number equals p and full for a consumer when its sequence number equals p + 1. Consuming a
+ * slot sets its sequence number to p + capacity, which makes it free for the next lap.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "ring.h"
+
+// The number of times a consumer polls an empty ring before it goes to sleep.
+#define SPIN_LIMIT 128
+
+// Slot header. The element data follows the header in the same cache line(s).
+typedef struct {
+    atomic_size_t sequence;
+} slot_header;
+
+
+static size_t round_up_power_of_two( size_t value )
+{
+    size_t result = 1;
+
+    while( result < value ) result <<= 1;
+    return result;
+}
+
+
+static slot_header *slot_at( const Ring *object, size_t position )
+{
+    return (slot_header *)( object->slots + ( position & object->mask ) * object->slot_stride );
+}
+
+
+static void *slot_data( slot_header *slot )
+{
+    return (unsigned char *)slot + sizeof( slot_header );
+}
+
+
+static void cpu_relax( void )
+{
+    #if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause( );
+    #endif
+}
+
+
+// ================
+// Ring (MPMC)
+// ================
+
+int Ring_initialize( Ring *object, size_t capacity, size_t element_size )
+{
+    size_t position;
+
+    capacity = round_up_power_of_two( capacity );
+    object->mask         = capacity - 1;
+    object->element_size = element_size;
+    object->slot_stride  = sizeof( slot_header ) + element_size + CACHE_LINE_SIZE - 1;
+    object->slot_stride &= ~(size_t)( CACHE_LINE_SIZE - 1 );
+
+    object->slots = aligned_alloc( CACHE_LINE_SIZE, capacity * object->slot_stride );
+    if( object->slots == NULL ) return -1;
+
+    for( position = 0; position < capacity; ++position ) {
+        atomic_init( &slot_at( object, position )->sequence, position );
+    }
+    atomic_init( &object->tail, 0 );
+    atomic_init( &object->head, 0 );
+    atomic_init( &object->event_count, 0 );
+    atomic_init( &object->sleepers, 0 );
+    atomic_init( &object->closed, 0 );
+    return 0;
+}
+
+
+void Ring_destroy( Ring *object )
+{
+    free( object->slots );
+    object->slots = NULL;
+}
+
+
+size_t Ring_enqueue_batch( Ring *object, const void *elements, size_t count )
+{
+    const unsigned char *source = elements;
+    size_t tail;
+    size_t available;
+    size_t i;
+
+    tail = atomic_load_explicit( &object->tail, memory_order_relaxed );
+    for( ;; ) {
+        // Count the run of free slots starting at tail. A slot that is free for this lap stays
+        // free until a producer claims its position, so the count remains valid if the
+        // compare-and-swap below succeeds.
+        for( available = 0; available < count; ++available ) {
+            size_t sequence = atomic_load_explicit(
+                &slot_at( object, tail + available )->sequence, memory_order_acquire );
+            if( sequence != tail + available ) break;
+        }
+        if( available == 0 ) {
+            // Either the ring is full or another producer moved the tail. Distinguish.
+            size_t current = atomic_load_explicit( &object->tail, memory_order_relaxed );
+            if( current == tail ) return 0;
+            tail = current;
+            continue;
+        }
+        if( atomic_compare_exchange_weak_explicit(
+                &object->tail, &tail, tail + available,
+                memory_order_relaxed, memory_order_relaxed ) ) break;
+    }
+
+    for( i = 0; i < available; ++i ) {
+        slot_header *slot = slot_at( object, tail + i );
+        memcpy( slot_data( slot ), source + i * object->element_size, object->element_size );
+        atomic_store_explicit( &slot->sequence, tail + i + 1, memory_order_release );
+    }
+
+    // Wake sleeping consumers. The fence pairs with the one in Ring_wait() so that either the
+    // consumer sees the new elements or this producer sees the consumer's sleeper count.
+    atomic_thread_fence( memory_order_seq_cst );
+    if( atomic_load_explicit( &object->sleepers, memory_order_relaxed ) > 0 ) {
+        atomic_fetch_add_explicit( &object->event_count, 1, memory_order_relaxed );
+        syscall( SYS_futex, &object->event_count, FUTEX_WAKE_PRIVATE,
+                 available < INT_MAX ? (int)available : INT_MAX, NULL, NULL, 0 );
+    }
+    return available;
+}
+
+
+size_t Ring_dequeue_batch( Ring *object, void *elements, size_t count )
+{
+    unsigned char *destination = elements;
+    size_t head;
+    size_t ready;
+    size_t i;
+
+    head = atomic_load_explicit( &object->head, memory_order_relaxed );
+    for( ;; ) {
+        for( ready = 0; ready < count; ++ready ) {
+            size_t sequence = atomic_load_explicit(
+                &slot_at( object, head + ready )->sequence, memory_order_acquire );
+            if( sequence != head + ready + 1 ) break;
+        }
+        if( ready == 0 ) {
+            size_t current = atomic_load_explicit( &object->head, memory_order_relaxed );
+            if( current == head ) return 0;
+            head = current;
+            continue;
+        }
+        if( atomic_compare_exchange_weak_explicit(
+                &object->head, &head, head + ready,
+                memory_order_relaxed, memory_order_relaxed ) ) break;
+    }
+
+    for( i = 0; i < ready; ++i ) {
+        slot_header *slot = slot_at( object, head + i );
+        memcpy( destination + i * object->element_size, slot_data( slot ), object->element_size );
+        atomic_store_explicit( &slot->sequence, head + i + object->mask + 1, memory_order_release );
+    }
+    return ready;
+}
+
+
+int Ring_is_empty( Ring *object )
+{
+    size_t head = atomic_load_explicit( &object->head, memory_order_relaxed );
+    size_t sequence =
+        atomic_load_explicit( &slot_at( object, head )->sequence, memory_order_acquire );
+    return sequence != head + 1;
+}
+
+
+void Ring_wait( Ring *object )
+{
+    unsigned observed;
+    int spin;
+
+    for( spin = 0; spin < SPIN_LIMIT; ++spin ) {
+        if( !Ring_is_empty( object ) ) return;
+        cpu_relax( );
+    }
+
+    atomic_fetch_add_explicit( &object->sleepers, 1, memory_order_relaxed );
+    observed = atomic_load_explicit( &object->event_count, memory_order_relaxed );
+    atomic_thread_fence( memory_order_seq_cst );
+    if( Ring_is_empty( object ) &&
+        !atomic_load_explicit( &object->closed, memory_order_relaxed ) ) {
+        // If a producer bumps event_count after we read it, the kernel refuses to sleep.
+        syscall( SYS_futex, &object->event_count, FUTEX_WAIT_PRIVATE, observed, NULL, NULL, 0 );
+    }
+    atomic_fetch_sub_explicit( &object->sleepers, 1, memory_order_relaxed );
+}
+
+
+void Ring_close( Ring *object )
+{
+    atomic_store_explicit( &object->closed, 1, memory_order_relaxed );
+    atomic_fetch_add_explicit( &object->event_count, 1, memory_order_seq_cst );
+    syscall( SYS_futex, &object->event_count, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0 );
+}
+
+
+// ================
+// SpscRing
+// ================
+
+int SpscRing_initialize( SpscRing *object, size_t capacity, size_t element_size )
+{
+    capacity = round_up_power_of_two( capacity );
+    object->mask         = capacity - 1;
+    object->element_size = element_size;
+    object->slots        = malloc( capacity * element_size );
+    if( object->slots == NULL ) return -1;
+
+    atomic_init( &object->tail, 0 );
+    atomic_init( &object->head, 0 );
+    object->cached_head = 0;
+    object->cached_tail = 0;
+    return 0;
+}
+
+
+void SpscRing_destroy( SpscRing *object )
+{
+    free( object->slots );
+    object->slots = NULL;
+}
+
+
+size_t SpscRing_enqueue_batch( SpscRing *object, const void *elements, size_t count )
+{
+    const unsigned char *source = elements;
+    size_t capacity = object->mask + 1;
+    size_t tail = atomic_load_explicit( &object->tail, memory_order_relaxed );
+    size_t i;
+
+    if( tail + count - object->cached_head > capacity ) {
+        object->cached_head = atomic_load_explicit( &object->head, memory_order_acquire );
+        if( tail + count - object->cached_head > capacity ) {
+            count = capacity - ( tail - object->cached_head );
+        }
+    }
+    for( i = 0; i < count; ++i ) {
+        memcpy( object->slots + ( ( tail + i ) & object->mask ) * object->element_size,
+                source + i * object->element_size,
+                object->element_size );
+    }
+    atomic_store_explicit( &object->tail, tail + count, memory_order_release );
+    return count;
+}
+
+
+size_t SpscRing_dequeue_batch( SpscRing *object, void *elements, size_t count )
+{
+    unsigned char *destination = elements;
+    size_t head = atomic_load_explicit( &object->head, memory_order_relaxed );
+    size_t i;
+
+    if( object->cached_tail - head < count ) {
+        object->cached_tail = atomic_load_explicit( &object->tail, memory_order_acquire );
+        if( object->cached_tail - head < count ) {
+            count = object->cached_tail - head;
+        }
+    }
+    for( i = 0; i < count; ++i ) {
+        memcpy( destination + i * object->element_size,
+                object->slots + ( ( head + i ) & object->mask ) * object->element_size,
+                object->element_size );
+    }
+    atomic_store_explicit( &object->head, head + count, memory_order_release );
+    return count;
+}
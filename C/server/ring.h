@@ -0,0 +1,122 @@
+/*!
+ * \file ring.h
+ * \author Peter C. Chapin
+ * \brief Interface to lock-free ring buffers used to pass work between threads.
+ *
+ * Two ring types are provided. A Ring supports any number of producers and consumers (MPMC).
+ * It is used to dispatch requests from the listener to a pool of worker threads. A SpscRing
+ * supports exactly one producer and one consumer and is correspondingly cheaper. Both rings
+ * are bounded, store fixed size elements by value, and never allocate after initialization.
+ */
+
+#ifndef RING_H_INCLUDED
+#define RING_H_INCLUDED
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+//! Assumed size of a cache line. Shared indices are padded to this size to avoid false sharing.
+#define CACHE_LINE_SIZE 64
+
+//! Bounded multi-producer, multi-consumer ring.
+/*!
+ * Each slot carries a sequence number that tells producers and consumers whether the slot is
+ * free or full for the current lap around the ring. Producers and consumers claim runs of
+ * consecutive slots with a single compare-and-swap on the tail or head index, so batched
+ * operations cost one atomic read-modify-write regardless of batch size.
+ *
+ * Consumers that find the ring empty may block in Ring_wait(). Blocking uses a futex on an
+ * event counter. Producers only touch the futex when a consumer is actually asleep, so the
+ * wake up path costs nothing while workers are busy.
+ *
+ * The server's thread pool doesn't use Ring_wait(). Its idle workers also watch their transfer
+ * sockets, so they sleep in epoll_wait() and are woken through an eventfd instead (see
+ * thread_pool.c). The futex path serves consumers that only wait for the ring, such as
+ * ringbench.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;         //!< Next position to fill.
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;         //!< Next position to drain.
+    _Alignas(CACHE_LINE_SIZE) atomic_uint   event_count;  //!< Futex word; bumped to wake.
+    atomic_int     sleepers;      //!< Number of consumers blocked in Ring_wait().
+    atomic_int     closed;        //!< Non-zero once Ring_close() has been called.
+    _Alignas(CACHE_LINE_SIZE) unsigned char *slots;       //!< Slot storage.
+    size_t         mask;          //!< Capacity minus one. Capacity is a power of two.
+    size_t         element_size;  //!< Size of one element in bytes.
+    size_t         slot_stride;   //!< Distance between slots; a multiple of CACHE_LINE_SIZE.
+} Ring;
+
+//! Initialize a ring.
+/*!
+ * \param object The ring to initialize.
+ * \param capacity The number of elements the ring can hold. Rounded up to a power of two.
+ * \param element_size The size of each element in bytes.
+ *
+ * \return 0 if successful; -1 if memory could not be allocated.
+ */
+int Ring_initialize( Ring *object, size_t capacity, size_t element_size );
+
+//! Release the memory held by a ring.
+void Ring_destroy( Ring *object );
+
+//! Add up to count elements to the ring.
+/*!
+ * The elements are copied from the array at elements. Fewer than count elements are added
+ * if the ring does not have room for all of them. Consumers blocked in Ring_wait() are woken.
+ *
+ * \return The number of elements actually added (possibly zero).
+ */
+size_t Ring_enqueue_batch( Ring *object, const void *elements, size_t count );
+
+//! Remove up to count elements from the ring.
+/*!
+ * The elements are copied into the array at elements. This function never blocks.
+ *
+ * \return The number of elements actually removed (possibly zero).
+ */
+size_t Ring_dequeue_batch( Ring *object, void *elements, size_t count );
+
+//! Return non-zero if the ring appears to be empty. The answer may be stale on return.
+int Ring_is_empty( Ring *object );
+
+//! Wait until the ring is probably not empty.
+/*!
+ * The caller spins briefly and then sleeps on a futex until a producer adds elements. Because
+ * other consumers may run first, the caller must be prepared to find the ring empty again.
+ * Once the ring is closed this function returns immediately.
+ */
+void Ring_wait( Ring *object );
+
+//! Close the ring and wake every consumer blocked in Ring_wait(). Used during shutdown.
+void Ring_close( Ring *object );
+
+
+//! Bounded single-producer, single-consumer ring.
+/*!
+ * The producer and consumer each keep a private copy of the other side's index and refresh it
+ * only when the ring appears full (or empty). In the common case neither side reads a cache
+ * line written by the other.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;  //!< Written by the producer.
+    size_t cached_head;                            //!< Producer's copy of head.
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;  //!< Written by the consumer.
+    size_t cached_tail;                            //!< Consumer's copy of tail.
+    _Alignas(CACHE_LINE_SIZE) unsigned char *slots;
+    size_t mask;
+    size_t element_size;
+} SpscRing;
+
+//! Initialize a single-producer, single-consumer ring. See Ring_initialize().
+int SpscRing_initialize( SpscRing *object, size_t capacity, size_t element_size );
+
+//! Release the memory held by a single-producer, single-consumer ring.
+void SpscRing_destroy( SpscRing *object );
+
+//! Add up to count elements. Must only be called by the producer thread.
+size_t SpscRing_enqueue_batch( SpscRing *object, const void *elements, size_t count );
+
+//! Remove up to count elements. Must only be called by the consumer thread.
+size_t SpscRing_dequeue_batch( SpscRing *object, void *elements, size_t count );
+
+#endif // RING_H_INCLUDED
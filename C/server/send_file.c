@@ -5,13 +5,39 @@
  *
  */
 
- #include "server.h"
+#include <poll.h>
+
+#include "server.h"
+#include "transfer.h"
 
 //! Send a file to the client.
 /*!
+ * This is the blocking driver for a transfer. It waits for the transfer's socket to become
+ * readable or for its retransmission deadline to pass, and services the transfer each time.
+ * It is used when each transfer has a process of its own.
+ *
+ * \param transfer A transfer prepared with Transfer_open(). It is not closed.
+ *
  * \return 0 if the transfer is successful; -1 otherwise.
  */
-int send_file( int socket_handle, struct sockaddr_in6 *client_address, const char *file_name )
+int send_file( Transfer *transfer )
 {
-    return 0;
+    struct pollfd   watched;
+    transfer_status status;
+    long long       now = monotonic_milliseconds( );
+    long long       wait_time;
+
+    watched.fd     = transfer->socket_handle;
+    watched.events = POLLIN;
+
+    status = Transfer_start( transfer, now );
+    while( status == TRANSFER_ACTIVE ) {
+        wait_time = transfer->deadline - now;
+        if( wait_time < 0 ) wait_time = 0;
+        poll( &watched, 1, (int)wait_time );
+
+        now = monotonic_milliseconds( );
+        status = Transfer_service( transfer, now );
+    }
+    return status == TRANSFER_DONE ? 0 : -1;
 }
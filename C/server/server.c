@@ -1,52 +1,402 @@
 /*!
  * \file server.c
  * \author Peter C. Chapin
- * \brief Trivial FTP client
+ * \brief Trivial FTP server
  *
- * \todo Error messages should be logged rather than sent to the console.
+ * Problems found while starting up are reported on the console. Once the server is running,
+ * events and errors go to the event log (see event_log.h).
  */
 
+#ifndef _GNU_SOURCE   // Needed for recvmmsg().
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #ifndef S_SPLIT_S     // Workaround for splint.
 #include <unistd.h>
 #endif
 
+#include "admission.h"
+#include "event_log.h"
+#include "flight_recorder.h"
+#include "handoff.h"
+#include "metrics.h"
+#include "policy.h"
 #include "server.h"
+#include "socket_pool.h"
+#include "thread_pool.h"
+#include "topology.h"
+#include "transfer.h"
+#include "worker_pool.h"
+#include "xdp_path.h"
+
+// The maximum number of requests the threaded listener receives with one system call.
+#define LISTEN_BATCH_SIZE 16
+
+// Not yet in every C library's headers (Linux 5.11).
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+// How long (us) the listener polls for a request before blocking (0 = block at once).
+static long spin_time = 0;
+
+// Set by the SIGCHLD handler when a pre-forked worker exits.
+static volatile sig_atomic_t worker_exited = 0;
+
+// Set by the SIGUSR1 handler to request a utilization report from the thread pool.
+static volatile sig_atomic_t report_requested = 0;
+
+static void sigchld_handler( int signal_number )
+{
+    worker_exited = 1;
+}
+
+static void sigusr1_handler( int signal_number )
+{
+    report_requested = 1;
+}
+
+// SIGHUP asks for the policy file to be read again.
+static void sighup_handler( int signal_number )
+{
+    ++policy_reload_requests;
+}
+
+// SIGUSR2 asks every transfer in progress to dump its flight recording.
+static void sigusr2_handler( int signal_number )
+{
+    ++flight_dump_requests;
+}
+
+// SIGIO says a new server process may be waiting on the handoff socket.
+static void sigio_handler( int signal_number )
+{
+    ++handoff_requests;
+}
+
+
+//! Service a single request.
+/*!
+ * This function runs in a child process (either a process forked for this request or a
+ * pre-forked worker). It creates a fresh socket for the transfer, sends the file, and cleans up.
+ *
+ * \param request_buffer The raw request datagram.
+ * \param request_count The number of bytes in the request datagram.
+ * \param client_address The address of the client that sent the request.
+ * \param received_time When the listener received the request.
+ */
+static void handle_request(
+    unsigned char *request_buffer,
+    size_t request_count,
+    struct sockaddr_in6 *client_address,
+    long long received_time )
+{
+    int socket_handle;  // Handle for bulk client communication.
+    Transfer transfer;
+
+    // A pre-forked worker picks up a reload before serving its next request.
+    Policy_refresh( );
 
-#define REQUEST_BUFFER_LENGTH 512
+    // Get a fresh socket to communicate with the client.
+    if( (socket_handle = Transfer_socket( client_address )) == -1 ) {
+        EventLog_system_error( "Unable to create socket", errno );
+        Admission_release( );
+        return;
+    }
 
-static char *extract_file_name( unsigned char *request_buffer )
+    // Parse the request and open the file. The client has been told if this fails.
+    if( Transfer_open( &transfer, socket_handle, client_address,
+                       request_buffer, request_count, received_time ) == -1 ) {
+        Transfer_discard_socket( socket_handle, client_address );
+        Admission_release( );
+        return;
+    }
+
+    // Send the file!
+    send_file( &transfer );
+    Transfer_close( &transfer );
+    Admission_release( );
+}
+
+
+//
+// Reap the children forked per request. A child that didn't exit normally may have died
+// before releasing its transfer, so the listener releases it instead.
+//
+static void reap_children( void )
 {
-    // TODO: Implement me!
-    return NULL;
+    int status;
+
+    while( waitpid( -1, &status, WNOHANG ) > 0 ) {
+        if( !WIFEXITED( status ) || WEXITSTATUS( status ) != EXIT_SUCCESS ) {
+            Admission_release( );
+        }
+    }
+}
+
+
+//
+// Note in the event log that requests were discarded because no worker could take them.
+//
+static void log_dropped_requests( size_t count )
+{
+    log_record record;
+
+    memset( &record, 0, sizeof( record ) );
+    record.event = LOG_REQUESTS_DROPPED;
+    record.value = count;
+    EventLog_write( &record );
 }
 
 
-static void send_error_message( int socket_handle, struct sockaddr_in6 *client_address )
+//
+// Pass a request through the admission stage. Returns non-zero if it should be served. Sources
+// over their rate get no reply, so a spoofed flood is not reflected at its victims. A source
+// within its rate that finds the server full is told so.
+//
+static int admit_request(
+    int listen_handle, const struct sockaddr_in6 *client_address, long long now )
 {
-    char error_datagram[20 + 1];
+    switch( Admission_check( client_address, now ) ) {
+    case ADMISSION_DROP:
+        Metrics_count( METRIC_REQUESTS_LIMITED, 1 );
+        return 0;
+    case ADMISSION_BUSY:
+        Metrics_count( METRIC_REQUESTS_BUSY, 1 );
+        send_error( listen_handle, client_address, ERROR_UNDEFINED, "Server busy" );
+        return 0;
+    default:
+        return 1;
+    }
+}
 
-    error_datagram[0] = 0x00;  // Opcode == 5.
-    error_datagram[1] = 0x05;
-    error_datagram[2] = 0x00;  // ErrorCode == 0 (not defined).
-    error_datagram[3] = 0x00;
-    strcpy( &error_datagram[4], "Not implemented!" );
 
-    // Send it to the client. Don't worry about if the send succeeds for fails.
-    sendto(
-        socket_handle,   // The socket for client communications.
-        error_datagram,  // Datagram to send.
-        21,              // Length of the datagram.
-        0,               // Flags (none selected).
-        (struct sockaddr *)client_address,  // Destination address.
-        sizeof(struct sockaddr_in6)         // Size of the distination address structure.
-    );
+//
+// In low latency mode, poll the listening socket for a while before the caller blocks on it.
+// A request that arrives meanwhile is read without waiting for the scheduler to wake the
+// listener. Returns at once if a request is already waiting.
+//
+static void spin_for_request( int listen_handle )
+{
+    long long give_up;
+    char probe;
+
+    if( spin_time == 0 ) return;
+    give_up = monotonic_microseconds( ) + spin_time;
+    do {
+        if( recv( listen_handle, &probe, 1, MSG_PEEK | MSG_DONTWAIT ) != -1 ||
+            ( errno != EAGAIN && errno != EWOULDBLOCK ) ) {
+            return;
+        }
+    } while( monotonic_microseconds( ) < give_up );
+}
+
+
+//
+// Ask the kernel to busy poll the device queue of the listening socket rather than wait for an
+// interrupt. Only drivers with NAPI support it and raising the poll time beyond the system
+// default (net.core.busy_read) needs CAP_NET_ADMIN, so failures just leave the spin above.
+//
+static void prefer_busy_polling( int listen_handle )
+{
+    int microseconds = spin_time > 1000000 ? 1000000 : (int)spin_time;
+    int one = 1;
+
+    if( setsockopt( listen_handle, SOL_SOCKET, SO_BUSY_POLL,
+                    &microseconds, sizeof( microseconds ) ) == -1 ) {
+        perror( "Unable to set SO_BUSY_POLL; polling in the listener only" );
+        return;
+    }
+    setsockopt( listen_handle, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof( one ) );
+}
+
+
+//
+// Allow SIGIO in the calling thread, or block it. It is blocked before any thread is created
+// so that only the listener is interrupted by it.
+//
+static void allow_handoff_signal( int allow )
+{
+    sigset_t signals;
+
+    sigemptyset( &signals );
+    sigaddset( &signals, SIGIO );
+    pthread_sigmask( allow ? SIG_UNBLOCK : SIG_BLOCK, &signals, NULL );
+}
+
+
+//
+// Give the pool the requests and transfers handed over by the server this one replaced. The
+// ring may hold fewer than that, so the workers are given time to make room.
+//
+static void dispatch_resumed( ThreadPool *pool )
+{
+    struct timespec pause = { 0, 1000000 };
+    const request_descriptor *resumed;
+    size_t count = Handoff_resumed( &resumed );
+    size_t queued;
+
+    for( queued = 0; queued < count; ++queued ) Admission_adopt( );
+    for( queued = 0; queued < count; ) {
+        queued += ThreadPool_dispatch_batch( pool, resumed + queued, count - queued );
+        if( queued < count ) nanosleep( &pause, NULL );
+    }
+    // The ring holds copies; the workers free the snapshots as they start the transfers.
+    Handoff_release_resumed( );
+}
+
+
+//! Listen for requests and hand them to a pool of worker threads.
+/*!
+ * Requests are received in batches with recvmmsg() directly into an array of descriptors. The
+ * whole batch is then handed to the pool with a single ring operation. Sending SIGUSR1 to the
+ * server prints the pool's per-thread utilization counters.
+ *
+ * When a new server process connects to the handoff socket, the listener stops. If the new
+ * process runs worker threads, the transfers in progress and the requests not yet started are
+ * handed to it; otherwise they are finished here first.
+ *
+ * \param listen_handle The bound listening socket.
+ * \param thread_count The number of worker threads to start.
+ *
+ * \return 0 after handing over to a new process; -1 if the pool cannot be created.
+ */
+static int threaded_listen_loop( int listen_handle, int thread_count )
+{
+    ThreadPool pool;
+    request_descriptor batch[LISTEN_BATCH_SIZE];
+    struct mmsghdr messages[LISTEN_BATCH_SIZE];
+    struct iovec   parts[LISTEN_BATCH_SIZE];
+    struct sigaction report_action;
+    int    request_total;
+    long long received_time;
+    size_t admitted;
+    size_t queued;
+    long long now;
+    int accepts_transfers;
+    int i;
+
+    if( ThreadPool_initialize( &pool, thread_count, 4096 ) == -1 ) {
+        fprintf( stderr, "Unable to create thread pool\n" );
+        return -1;
+    }
+    dispatch_resumed( &pool );
+
+    // Installed without SA_RESTART so that it interrupts recvmmsg() below.
+    memset( &report_action, 0, sizeof( report_action ) );
+    report_action.sa_handler = sigusr1_handler;
+    sigemptyset( &report_action.sa_mask );
+    sigaction( SIGUSR1, &report_action, NULL );
+    allow_handoff_signal( 1 );
+
+    while( 1 ) {
+        if( handoff_requests ) {
+            handoff_requests = 0;
+            if( (accepts_transfers = Handoff_begin( listen_handle )) != -1 ) break;
+        }
+        if( report_requested ) {
+            report_requested = 0;
+            ThreadPool_report( &pool, stderr );
+        }
+        Policy_refresh( );
+
+        memset( messages, 0, sizeof( messages ) );
+        for( i = 0; i < LISTEN_BATCH_SIZE; ++i ) {
+            parts[i].iov_base = batch[i].request_buffer;
+            parts[i].iov_len  = REQUEST_BUFFER_LENGTH;
+            batch[i].resume   = NULL;
+            messages[i].msg_hdr.msg_iov     = &parts[i];
+            messages[i].msg_hdr.msg_iovlen  = 1;
+            messages[i].msg_hdr.msg_name    = &batch[i].client_address;
+            messages[i].msg_hdr.msg_namelen = sizeof( batch[i].client_address );
+        }
+
+        // Block for the first request, then take whatever else is already queued.
+        spin_for_request( listen_handle );
+        request_total =
+            recvmmsg( listen_handle, messages, LISTEN_BATCH_SIZE, MSG_WAITFORONE, NULL );
+        received_time = monotonic_microseconds( );
+        if( request_total == -1 ) {
+            if( errno != EINTR ) {
+                EventLog_system_error( "Error receiving request", errno );
+            }
+            continue;
+        }
+        // Admitted requests are packed to the front of the batch.
+        now = monotonic_milliseconds( );
+        admitted = 0;
+        for( i = 0; i < request_total; ++i ) {
+            batch[i].request_count = messages[i].msg_len;
+            batch[i].received_time = received_time;
+            if( admit_request( listen_handle, &batch[i].client_address, now ) ) {
+                if( admitted != (size_t)i ) batch[admitted] = batch[i];
+                ++admitted;
+            }
+        }
+        queued = ThreadPool_dispatch_batch( &pool, batch, admitted );
+        Metrics_count( METRIC_REQUESTS_RECEIVED, (unsigned long long)request_total );
+        if( queued < admitted ) {
+            Metrics_count( METRIC_REQUESTS_DROPPED, admitted - queued );
+            log_dropped_requests( admitted - queued );
+            for( ; queued < admitted; ++queued ) Admission_release( );
+        }
+    }
+
+    // The new process has the listening socket. Whatever it doesn't take is finished here, and
+    // the sockets of the pool and the AF_XDP path stay here until then.
+    if( accepts_transfers ) {
+        ThreadPool_hand_off( &pool, Handoff_send );
+        SocketPool_close( );
+        XdpPath_close( );
+    }
+    Metrics_stop( );
+    Handoff_finish( );
+    if( !accepts_transfers ) ThreadPool_drain( &pool );
+    return 0;
+}
+
+
+//! Create the listening socket and bind it to the given port.
+/*!
+ * \return The socket, or -1 if it can't be had (an explanation has been printed).
+ */
+static int create_listener( unsigned short port )
+{
+    struct sockaddr_in6 server_address;
+    int listen_handle;
+
+    // Create the server socket.
+    if( (listen_handle = socket( PF_INET6, SOCK_DGRAM, 0) ) == -1 ) {
+        perror( "Unable to create socket" );
+        return -1;
+    }
+
+    // Prepare the server socket address structure.
+    memset( &server_address, 0, sizeof(server_address) );
+    server_address.sin6_family = AF_INET6;
+    server_address.sin6_addr = in6addr_any;
+    server_address.sin6_port = htons( port) ;
+
+    // Bind the server socket.
+    if (bind(listen_handle, (struct sockaddr *) &server_address, sizeof(server_address)) == -1) {
+        perror( "Unable to bind listening address" );
+        close( listen_handle );
+        return -1;
+    }
+    return listen_handle;
 }
 
 
@@ -57,47 +407,334 @@ static void send_error_message( int socket_handle, struct sockaddr_in6 *client_a
 int main( int argc, char **argv )
 {
     int listen_handle;  // Socket for incoming client requests.
-    int socket_handle;  // Handle for bulk client communication.
 
     struct sockaddr_in6 server_address;  // Listening address.
     struct sockaddr_in6 client_address;  // Address of client.
     socklen_t client_length;
+    socklen_t server_length;
 
     // Buffer to hold request message.
     unsigned char request_buffer[REQUEST_BUFFER_LENGTH];
     ssize_t request_count;
+    long long received_time;
 
     unsigned short port = 69;  // Port number to listen on.
     pid_t child_id;            // Child process ID.
-    const char *file_name;     // Name of file client wants to read.
 
+    int thread_count   = 0;    // Number of worker threads (0 = use processes).
+    int worker_count   = 0;    // Number of pre-forked workers (0 = fork per request).
+    int transfer_limit = 0;    // Transfers per worker before it is recycled (0 = never).
+    WorkerPool pool;           // Used only when pre-forking.
+    const char *metrics_endpoint = NULL;  // Where to serve metrics (NULL = disabled).
+    const char *log_destination  = NULL;  // Where to write the event log (NULL = stderr).
+    const char *policy_file      = NULL;  // Access policy (NULL = serve everything to everyone).
+    unsigned source_rate  = 0; // Requests per second from one source network (0 = unlimited).
+    unsigned source_burst = 0; // Requests one source network may send at once.
+    int active_limit      = 0; // Transfers in progress at once (0 = unlimited).
+    long readahead_limit  = 0; // Most MiB a transfer reads ahead (0 = leave to the kernel).
+    long drop_size        = 0; // MiB from which files are dropped from the cache (0 = never).
+    int pin_workers       = 0; // Non-zero to pin each worker to a CPU.
+    hugepage_mode hugepages = HUGEPAGES_TRANSPARENT;  // Backing of large cached copies.
+    int low_latency       = 0; // Non-zero to spin, busy poll, keep spare sockets, and warm files.
+    long first_pool_port  = 0; // Ports of the transfer socket pool (0 = no pool).
+    long last_pool_port   = 0;
+    const char *xdp_interface = NULL;  // Interface to send DATA through AF_XDP (NULL = none).
+    const request_descriptor *resumed;  // Work handed over by the server this one replaced.
+    size_t resumed_count;
+    size_t i;
+    char *end;
+    struct sigaction reload_action;
+    struct sigaction dump_action;
+    struct sigaction handoff_action;
+    int shard_count;           // Number of metrics shards needed.
+    struct sigaction child_action;
+    sigset_t listen_mask;      // Signals let through while the listener waits for a request.
+    struct pollfd waiting;     // The listening socket, waited on with ppoll().
+    int option;
+
+    // Process the command line options.
+    while( (option = getopt( argc, argv, "t:w:n:m:l:r:a:q:c:R:D:PH:L:S:X:Z:" )) != -1 ) {
+        switch( option ) {
+        case 't':
+            thread_count = atoi( optarg );
+            break;
+        case 'w':
+            worker_count = atoi( optarg );
+            break;
+        case 'n':
+            transfer_limit = atoi( optarg );
+            break;
+        case 'm':
+            metrics_endpoint = optarg;
+            break;
+        case 'l':
+            log_destination = optarg;
+            break;
+        case 'a':
+            policy_file = optarg;
+            break;
+        case 'q':
+            source_rate = (unsigned)strtoul( optarg, &end, 10 );
+            if( *end == '/' ) source_burst = (unsigned)strtoul( end + 1, NULL, 10 );
+            break;
+        case 'c':
+            active_limit = atoi( optarg );
+            break;
+        case 'R':
+            readahead_limit = atol( optarg );
+            break;
+        case 'D':
+            drop_size = atol( optarg );
+            break;
+        case 'P':
+            pin_workers = 1;
+            break;
+        case 'H':
+            if( strcmp( optarg, "none" ) == 0 ) hugepages = HUGEPAGES_NONE;
+            else if( strcmp( optarg, "transparent" ) == 0 ) hugepages = HUGEPAGES_TRANSPARENT;
+            else if( strcmp( optarg, "explicit" ) == 0 ) hugepages = HUGEPAGES_EXPLICIT;
+            else {
+                fprintf( stderr, "Huge pages must be none, transparent, or explicit\n" );
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'L':
+            low_latency = 1;
+            spin_time   = atol( optarg );
+            if( spin_time < 0 ) spin_time = 0;
+            break;
+        case 'S':
+            first_pool_port = strtol( optarg, &end, 10 );
+            last_pool_port  = *end == '-' ? strtol( end + 1, &end, 10 ) : first_pool_port;
+            if( *end != '\0' || first_pool_port < 1 || last_pool_port > 65535 ||
+                last_pool_port < first_pool_port ) {
+                fprintf( stderr, "Socket pool ports must be first-last, from 1 to 65535\n" );
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'X':
+            xdp_interface = optarg;
+            break;
+        case 'Z':
+            if( Handoff_configure( optarg ) == -1 ) {
+                fprintf( stderr, "Handoff socket path too long: %s\n", optarg );
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            if( FlightRecorder_configure( optarg ) == -1 ) {
+                fprintf( stderr, "Invalid flight recorder directory: %s\n", optarg );
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf( stderr,
+                     "Usage: %s [-t threads | -w workers [-n transfers-per-worker]]\n"
+                     "          [-m metrics-port | -m metrics-socket-path]\n"
+                     "          [-l log-file | -l syslog] [-r [json:|pcap:]recording-dir]\n"
+                     "          [-a policy-file] [-q requests-per-second[/burst]]\n"
+                     "          [-c max-transfers] [-R readahead-MiB] [-D drop-behind-MiB]\n"
+                     "          [-P] [-H none|transparent|explicit] [-L spin-microseconds]\n"
+                     "          [-S first-port-last-port] [-X interface[:queue]]\n"
+                     "          [-Z handoff-socket-path] [port]\n",
+                     argv[0] );
+            return EXIT_FAILURE;
+        }
+    }
 
     // Do I have an explicit port number?
-    if( argc == 2 ) {
-        port = atoi( argv[1] );
+    if( optind < argc ) {
+        port = atoi( argv[optind] );
     }
+    Transfer_configure_hints( (off_t)readahead_limit << 20, (off_t)drop_size << 20 );
+    Topology_initialize( pin_workers, hugepages );
+    Transfer_configure_spare_sockets( low_latency );
+    Policy_configure_warming( low_latency );
+    Policy_configure_compression( thread_count > 0 || worker_count > 0 );
 
-    // Create the server socket.
-    if( (listen_handle = socket( PF_INET6, SOCK_DGRAM, 0) ) == -1 ) {
-        perror( "Unable to create socket" );
+    // SIGIO (see Handoff_listen()) is for the listener alone, and is let through once every
+    // other thread has been created with it blocked. SIGCHLD stays blocked everywhere; the
+    // listener takes it only while it waits for a request (see listen_mask below).
+    allow_handoff_signal( 0 );
+    sigemptyset( &listen_mask );
+    sigaddset( &listen_mask, SIGCHLD );
+    pthread_sigmask( SIG_BLOCK, &listen_mask, NULL );
+
+    // Compile the access policy before accepting any requests.
+    if( Policy_load( policy_file ) == -1 ) {
+        fprintf( stderr, "Unable to load policy\n" );
         return EXIT_FAILURE;
     }
 
-    // Prepare the server socket address structure.
-    memset( &server_address, 0, sizeof(server_address) );
-    server_address.sin6_family = AF_INET6;
-    server_address.sin6_addr = in6addr_any;
-    server_address.sin6_port = htons( port) ;
+    // Take over from a server already running with the same handoff socket, if there is one.
+    // Otherwise make a listening socket of our own.
+    if( (listen_handle = Handoff_take_over( thread_count > 0 )) != -1 ) {
+        server_length = sizeof( server_address );
+        if( getsockname( listen_handle,
+                         (struct sockaddr *)&server_address, &server_length ) == -1 ||
+            ntohs( server_address.sin6_port ) != port ) {
+            fprintf( stderr, "The server being replaced listens on port %u, not %u\n",
+                     ntohs( server_address.sin6_port ), port );
+            return EXIT_FAILURE;
+        }
+    }
+    else if( (listen_handle = create_listener( port )) == -1 ) {
+        return EXIT_FAILURE;
+    }
 
-    // Bind the server socket.
-    if (bind(listen_handle, (struct sockaddr *) &server_address, sizeof(server_address)) == -1) {
-        perror( "Unable to bind listening address" );
+    // Spinning only pays if there is a core to spare; otherwise it delays the worker.
+    if( spin_time > 0 && sysconf( _SC_NPROCESSORS_ONLN ) < 2 ) {
+        fprintf( stderr, "Only one CPU; the listener will not spin\n" );
+        spin_time = 0;
+    }
+    if( spin_time > 0 ) prefer_busy_polling( listen_handle );
+
+    // Start the event log. From here on, errors while serving requests are logged.
+    if( EventLog_open( log_destination ) == -1 ) {
+        perror( "Unable to open event log" );
+        close( listen_handle );
+        return EXIT_FAILURE;
+    }
+    if( EventLog_start( ) == -1 ) {
+        fprintf( stderr, "Unable to start event log\n" );
+        close( listen_handle );
+        return EXIT_FAILURE;
+    }
+
+    // Let an operator ask for flight recordings of the transfers in progress. Forked children
+    // inherit the handler, so signalling the process group reaches every transfer.
+    memset( &dump_action, 0, sizeof( dump_action ) );
+    dump_action.sa_handler = sigusr2_handler;
+    dump_action.sa_flags   = SA_RESTART;
+    sigemptyset( &dump_action.sa_mask );
+    sigaction( SIGUSR2, &dump_action, NULL );
+
+    // SIGHUP reloads the policy. It is installed without SA_RESTART so that it interrupts the
+    // listener, which reloads at once. Pre-forked workers reload before their next request if
+    // the signal is sent to the process group.
+    memset( &reload_action, 0, sizeof( reload_action ) );
+    reload_action.sa_handler = sighup_handler;
+    sigemptyset( &reload_action.sa_mask );
+    sigaction( SIGHUP, &reload_action, NULL );
+
+    // Start the metrics exporter if requested. Every worker thread or process gets a shard.
+    if( metrics_endpoint != NULL ) {
+        shard_count = 1 + ( thread_count > worker_count ? thread_count : worker_count );
+        if( Metrics_initialize( shard_count ) == -1 || Metrics_serve( metrics_endpoint ) == -1 ) {
+            close( listen_handle );
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Requests are screened before any worker sees them.
+    if( Admission_initialize( source_rate, source_burst, active_limit, worker_count ) == -1 ) {
+        fprintf( stderr, "Unable to start admission control\n" );
         close( listen_handle );
         return EXIT_FAILURE;
     }
 
+    // The threads share one socket pool. Pre-forked workers each bind a share of the range.
+    if( first_pool_port > 0 ) {
+        SocketPool_configure(
+            (unsigned short)first_pool_port, (unsigned short)last_pool_port, port );
+        if( thread_count == 0 && worker_count == 0 ) {
+            fprintf( stderr, "The socket pool needs -t or -w; a socket is made per transfer\n" );
+        }
+        else if( thread_count > 0 && SocketPool_open( 0, 1 ) == -1 ) {
+            fprintf( stderr, "Unable to bind any port for the socket pool\n" );
+            close( listen_handle );
+            return EXIT_FAILURE;
+        }
+
+        // The sockets of transfers handed over hold their ports; they join the pool.
+        resumed_count = Handoff_resumed( &resumed );
+        for( i = 0; i < resumed_count; ++i ) {
+            if( resumed[i].resume != NULL ) SocketPool_adopt( resumed[i].resume->socket_handle );
+        }
+    }
+
+    // Likewise the threads share one AF_XDP socket, and each pre-forked worker binds a queue.
+    // Failing to bind only means that DATA goes through the sockets.
+    if( xdp_interface != NULL ) {
+        if( XdpPath_configure( xdp_interface ) == -1 ) {
+            fprintf( stderr, "Unable to send through AF_XDP on %s: no such Ethernet interface\n",
+                     xdp_interface );
+            close( listen_handle );
+            return EXIT_FAILURE;
+        }
+        if( thread_count == 0 && worker_count == 0 ) {
+            fprintf( stderr, "AF_XDP needs -t or -w; DATA is sent through sockets\n" );
+        }
+        else if( thread_count > 0 ) {
+            XdpPath_open( 0 );
+        }
+    }
+
+    // Let a new server process take over from this one. SIGIO is installed without SA_RESTART
+    // so that it interrupts the listener.
+    memset( &handoff_action, 0, sizeof( handoff_action ) );
+    handoff_action.sa_handler = sigio_handler;
+    sigemptyset( &handoff_action.sa_mask );
+    sigaction( SIGIO, &handoff_action, NULL );
+    if( Handoff_listen( ) == -1 ) {
+        perror( "Unable to create handoff socket" );
+    }
+
+    // Hand requests to worker threads if requested.
+    if( thread_count > 0 ) {
+        if( threaded_listen_loop( listen_handle, thread_count ) == -1 ) {
+            close( listen_handle );
+            return EXIT_FAILURE;
+        }
+        close( listen_handle );
+        EventLog_stop( );
+        return EXIT_SUCCESS;
+    }
+
+    // SIGCHLD interrupts the wait for a request below and gives the listener a chance to
+    // recycle pre-forked workers or, without them, to reap the children forked per request.
+    memset( &child_action, 0, sizeof( child_action ) );
+    child_action.sa_handler = sigchld_handler;
+    sigemptyset( &child_action.sa_mask );
+    sigaction( SIGCHLD, &child_action, NULL );
+
+    // Start the pre-forked workers if requested.
+    if( worker_count > 0 ) {
+        if( WorkerPool_initialize(
+                &pool, worker_count, transfer_limit, listen_handle, handle_request ) == -1 ) {
+            close( listen_handle );
+            return EXIT_FAILURE;
+        }
+    }
+    allow_handoff_signal( 1 );
+
+    // SIGCHLD is let through only inside ppoll(), atomically with going to sleep, so a worker
+    // that exits after worker_exited was checked still wakes the listener.
+    pthread_sigmask( SIG_BLOCK, NULL, &listen_mask );
+    sigdelset( &listen_mask, SIGCHLD );
+    waiting.fd     = listen_handle;
+    waiting.events = POLLIN;
+
     while( 1 ) {
-        // Call recvfrom() to get a request datagram from the client.
+        if( handoff_requests ) {
+            handoff_requests = 0;
+            if( Handoff_begin( listen_handle ) != -1 ) break;
+        }
+        if( worker_exited ) {
+            worker_exited = 0;
+            if( worker_count > 0 ) WorkerPool_reap( &pool );
+            else reap_children( );
+        }
+        Policy_refresh( );
+
+        // Wait for a request, then call recvfrom() to get the datagram from the client.
+        spin_for_request( listen_handle );
+        if( ppoll( &waiting, 1, NULL, &listen_mask ) == -1 ) {
+            if( errno != EINTR ) {
+                EventLog_system_error( "Error waiting for request", errno );
+            }
+            continue;
+        }
         client_length = sizeof( client_address );
         request_count = recvfrom(
             listen_handle,          // Socket for receiving request.
@@ -107,37 +744,53 @@ int main( int argc, char **argv )
             (struct sockaddr *)&client_address,  // Pointer to structure for client address.
             &client_length                       // Pointer to variable holding size of address.
         );
+        received_time = monotonic_microseconds( );
 
         if( request_count == -1 ) {
-            perror( "Error while receiving client request" );
+            if( errno != EINTR ) {
+                EventLog_system_error( "Error receiving request", errno );
+            }
+            continue;
+        }
+        Metrics_count( METRIC_REQUESTS_RECEIVED, 1 );
+        if( !admit_request( listen_handle, &client_address, monotonic_milliseconds( ) ) ) {
+            continue;
+        }
+
+        // If there are pre-forked workers, hand the request to one of them...
+        if( worker_count > 0 ) {
+            if( WorkerPool_dispatch( &pool, request_buffer, (size_t)request_count,
+                                     &client_address, received_time ) == -1 ) {
+                Metrics_count( METRIC_REQUESTS_DROPPED, 1 );
+                log_dropped_requests( 1 );
+                Admission_release( );
+            }
         }
         // Otherwise try to create a child process for this transfer...
         else if( (child_id = fork( )) == -1 ) {
-            perror( "Could not create child process for client" );
+            EventLog_system_error( "Unable to fork for request", errno );
+            Metrics_count( METRIC_REQUESTS_DROPPED, 1 );
+            Admission_release( );
         }
         // Otherwise if we are the child...
         else if( child_id == 0 ) {
             close( listen_handle );
-
-            // Create a fresh socket in the child to communicate with the client.
-            if( (socket_handle = socket( PF_INET6, SOCK_DGRAM, 0) ) == -1 ) {
-                perror( "Unable to create socket" );
-                exit( EXIT_FAILURE );
-            }
-
-            // Extract the file name from the request.
-            if( (file_name = extract_file_name( request_buffer )) == NULL ) {
-                send_error_message( socket_handle, &client_address );
-                close( socket_handle );
-                exit( EXIT_SUCCESS );
-            }
-
-            // Send the file!
-            send_file( socket_handle, &client_address, file_name );
-            close( socket_handle );
+            Metrics_attach_private( );
+            EventLog_start( );
+            handle_request(
+                request_buffer, (size_t)request_count, &client_address, received_time );
+            EventLog_stop( );
+            Metrics_flush( );
             exit( EXIT_SUCCESS );
         }
     }
 
+    // The new process has the listening socket. Transfers in progress are finished here: the
+    // pre-forked workers serve what they were given and exit, and forked children carry on.
+    Metrics_stop( );
+    Handoff_finish( );
+    if( worker_count > 0 ) WorkerPool_drain( &pool );
+    close( listen_handle );
+    EventLog_stop( );
     return EXIT_SUCCESS;
 }
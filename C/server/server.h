@@ -8,8 +8,130 @@
 #ifndef SERVER_H_INCLUDED
 #define SERVER_H_INCLUDED
 
+#include <stddef.h>
+#include <stdint.h>
 #include <netinet/in.h>
 
-int send_file( int socket_handle, struct sockaddr_in6 *client_address, const char *file_name );
+//! Size of the buffer used to receive requests. Longer requests are truncated.
+#define REQUEST_BUFFER_LENGTH 512
+
+//! Block size used when the client does not negotiate one (RFC 1350).
+#define DEFAULT_BLOCK_SIZE 512
+
+//! Largest block size the server will accept (RFC 2348).
+#define MAX_BLOCK_SIZE 65464
+
+//! Largest window size the server will accept (RFC 7440).
+#define MAX_WINDOW_SIZE 64
+
+//! Retransmission timeout in seconds when the client does not negotiate one (RFC 2349).
+#define DEFAULT_TIMEOUT 1
+
+//! Number of consecutive timeouts after which a transfer is abandoned.
+#define MAX_RETRIES 5
+
+//! Size of the blocks described by a file's signature list (see transfer.h).
+#define SIGNATURE_BLOCK_SIZE 65536
+
+//! Largest number of block ranges a request may ask for.
+#define MAX_RANGES 256
+
+//! TFTP operation codes.
+enum tftp_opcode {
+    OPCODE_RRQ   = 1,  //!< Read request.
+    OPCODE_WRQ   = 2,  //!< Write request.
+    OPCODE_DATA  = 3,  //!< Data block.
+    OPCODE_ACK   = 4,  //!< Acknowledgement.
+    OPCODE_ERROR = 5,  //!< Error.
+    OPCODE_OACK  = 6   //!< Option acknowledgement (RFC 2347).
+};
+
+//! TFTP error codes.
+enum tftp_error {
+    ERROR_UNDEFINED         = 0,  //!< Not defined, see error message.
+    ERROR_FILE_NOT_FOUND    = 1,  //!< File not found.
+    ERROR_ACCESS_VIOLATION  = 2,  //!< Access violation.
+    ERROR_DISK_FULL         = 3,  //!< Disk full or allocation exceeded.
+    ERROR_ILLEGAL_OPERATION = 4,  //!< Illegal TFTP operation.
+    ERROR_UNKNOWN_TID       = 5,  //!< Unknown transfer ID.
+    ERROR_FILE_EXISTS       = 6,  //!< File already exists.
+    ERROR_NO_SUCH_USER      = 7,  //!< No such user.
+    ERROR_BAD_OPTIONS       = 8   //!< Option negotiation failed (RFC 2347).
+};
+
+struct transfer_snapshot;
+
+//! A request as it is handed from the listener to whatever will service it.
+/*!
+ * A resume snapshot in a descriptor taken from the thread pool's ring was allocated with
+ * malloc() and is freed by the worker that takes the descriptor.
+ */
+typedef struct {
+    struct sockaddr_in6 client_address;                   //!< Address of the client.
+    size_t              request_count;                    //!< Bytes in request_buffer.
+    long long           received_time;                    //!< When it arrived (us, monotonic).
+    struct transfer_snapshot *resume;        //!< Transfer to carry on instead, or NULL.
+    unsigned char       request_buffer[REQUEST_BUFFER_LENGTH];  //!< The raw request datagram.
+} request_descriptor;
+
+//! A run of blocks asked for with the ranges option. Both ends are included.
+typedef struct {
+    uint32_t first;  //!< Index of the first block.
+    uint32_t last;   //!< Index of the last block.
+} block_range;
+
+//! A parsed read request.
+/*!
+ * Options the client did not send are zero. Options the server does not understand are
+ * ignored, as required by RFC 2347.
+ */
+typedef struct {
+    char     file_name[REQUEST_BUFFER_LENGTH];  //!< Name of the requested file.
+    char     mode[16];                          //!< Transfer mode ("octet" or "netascii").
+    unsigned block_size;                        //!< Requested blksize option.
+    unsigned window_size;                       //!< Requested windowsize option.
+    unsigned timeout;                           //!< Requested timeout option (seconds).
+    int      tsize_requested;                   //!< Non-zero if the tsize option was sent.
+    int      digest_requested;                  //!< Non-zero if a crc32c digest was asked for.
+    int      compress_requested;                //!< Non-zero if zlib compression was offered.
+    int      signatures_requested;              //!< Non-zero if the signature list was asked for.
+    unsigned range_unit;                        //!< Block size of ranges (0 if none were sent).
+    unsigned range_count;                       //!< Number of entries in ranges.
+    block_range ranges[MAX_RANGES];             //!< Parts of the file asked for, in order.
+} tftp_request;
+
+//! Function that services a single request.
+typedef void (*request_handler)(
+    unsigned char *request_buffer,
+    size_t request_count,
+    struct sockaddr_in6 *client_address,
+    long long received_time );
+
+struct Transfer;
+
+//! Parse a read request.
+/*!
+ * \param request_buffer The raw request datagram.
+ * \param request_count The number of bytes in the request datagram.
+ * \param request The structure to fill in.
+ *
+ * \return 0 if the request is a well formed RRQ; otherwise the TFTP error code that should be
+ * sent back to the client.
+ */
+int parse_request(
+    const unsigned char *request_buffer, size_t request_count, tftp_request *request );
+
+//! Send an ERROR packet. Failures are ignored; the client will time out.
+void send_error(
+    int socket_handle,
+    const struct sockaddr_in6 *client_address,
+    int error_code,
+    const char *message );
+
+//! Drive a transfer to completion, blocking the caller.
+/*!
+ * \return 0 if the transfer is successful; -1 otherwise.
+ */
+int send_file( struct Transfer *transfer );
 
 #endif // SERVER_H_INCLUDED
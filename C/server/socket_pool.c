@@ -0,0 +1,274 @@
+/*!
+ * \file socket_pool.c
+ * \author Peter C. Chapin
+ * \brief Implementation of the pool of pre-bound transfer sockets.
+ *
+ * Free sockets are kept on a stack so that the socket used most recently, whose kernel state
+ * is most likely still in the cache, is handed out next. A lock protects the stack; it is
+ * taken twice per transfer, which is nothing next to the system calls the pool saves.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "socket_pool.h"
+
+// How many free sockets are examined for one that may serve a client before giving up.
+#define MAX_PROBES 8
+
+typedef struct {
+    int       socket_handle;
+    struct in6_addr last_client;   // Address and port (transfer ID) of the client of the
+    in_port_t last_port;           // socket's last transfer.
+    long long quiet_until;         // Until when (ms) that client may not have the socket again.
+} pooled_socket;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned short  first_pool_port = 0;
+static unsigned short  last_pool_port  = 0;
+static unsigned short  skipped_port    = 0;
+static int share_first = 0;             // Ports of the calling process's share of the range.
+static int share_last  = -1;
+
+static pooled_socket *sockets = NULL;   // Every socket in the pool.
+static int   *free_stack  = NULL;       // Indexes of free sockets; the top is the last entry.
+static int    socket_count = 0;
+static int    free_count   = 0;
+static int   *index_of     = NULL;      // Index in sockets of each descriptor, or -1.
+static int    index_size   = 0;         // Number of entries in index_of.
+
+
+int SocketPool_configure(
+    unsigned short first_port, unsigned short last_port, unsigned short listen_port )
+{
+    if( first_port == 0 || last_port < first_port ) return -1;
+    first_pool_port = first_port;
+    last_pool_port  = last_port;
+    skipped_port    = listen_port;
+    return 0;
+}
+
+
+//
+// Discard every datagram waiting on a socket.
+//
+static void drain( int socket_handle )
+{
+    char packet[4];
+
+    while( recv( socket_handle, packet, sizeof( packet ), MSG_DONTWAIT ) != -1 ) ;
+}
+
+
+//
+// Create a socket bound to the given port. Returns -1 if the port can't be had. SO_REUSEADDR is
+// deliberately not set, so no other socket can share the port and see a transfer's packets.
+//
+static int bind_port( unsigned short port )
+{
+    struct sockaddr_in6 address;
+    socklen_t address_size = sizeof( address );
+    int socket_handle;
+
+    socket_handle = socket( PF_INET6, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0 );
+    if( socket_handle == -1 ) return -1;
+    memset( &address, 0, sizeof( address ) );
+    address.sin6_family = AF_INET6;
+    address.sin6_addr   = in6addr_any;
+    address.sin6_port   = htons( port );
+    if( bind( socket_handle, (struct sockaddr *)&address, sizeof( address ) ) == -1 ||
+        getsockname( socket_handle, (struct sockaddr *)&address, &address_size ) == -1 ||
+        ntohs( address.sin6_port ) != port ) {
+        close( socket_handle );
+        return -1;
+    }
+    return socket_handle;
+}
+
+
+int SocketPool_open( int share, int share_count )
+{
+    int range;
+    int first;
+    int last;
+    int port;
+    int socket_handle;
+    int i;
+
+    if( first_pool_port == 0 || share_count < 1 ) return 0;
+    range = last_pool_port - first_pool_port + 1;
+    first = first_pool_port + (int)( (long)range * share / share_count );
+    last  = first_pool_port + (int)( (long)range * ( share + 1 ) / share_count ) - 1;
+
+    SocketPool_close( );
+    share_first = first;
+    share_last  = last;
+    if( last < first ||
+        (sockets = malloc( (size_t)( last - first + 1 ) * sizeof( pooled_socket ) )) == NULL ||
+        (free_stack = malloc( (size_t)( last - first + 1 ) * sizeof( int ) )) == NULL ) {
+        SocketPool_close( );
+        return -1;
+    }
+
+    for( port = first; port <= last; ++port ) {
+        if( port == skipped_port || (socket_handle = bind_port( (unsigned short)port )) == -1 ) {
+            continue;
+        }
+        sockets[socket_count].socket_handle = socket_handle;
+        sockets[socket_count].last_client   = in6addr_any;
+        sockets[socket_count].last_port     = 0;
+        sockets[socket_count].quiet_until   = 0;
+        free_stack[free_count++] = socket_count;
+        ++socket_count;
+        if( socket_handle >= index_size ) index_size = socket_handle + 1;
+    }
+    if( socket_count < last - first + 1 ) {
+        fprintf( stderr, "Transfer socket pool: %d of ports %d-%d could be bound\n",
+                 socket_count, first, last );
+    }
+    if( socket_count == 0 || (index_of = malloc( (size_t)index_size * sizeof( int ) )) == NULL ) {
+        SocketPool_close( );
+        return -1;
+    }
+    for( i = 0; i < index_size; ++i ) index_of[i] = -1;
+    for( i = 0; i < socket_count; ++i ) index_of[sockets[i].socket_handle] = i;
+    return socket_count;
+}
+
+
+int SocketPool_take( const struct sockaddr_in6 *client_address, long long now )
+{
+    pooled_socket *candidate;
+    int probe;
+    int chosen = -1;
+
+    if( socket_count == 0 ) return -1;
+    pthread_mutex_lock( &pool_lock );
+    for( probe = free_count - 1; probe >= 0 && probe >= free_count - MAX_PROBES; --probe ) {
+        candidate = &sockets[free_stack[probe]];
+        if( now >= candidate->quiet_until ||
+            candidate->last_port != client_address->sin6_port ||
+            memcmp( &candidate->last_client, &client_address->sin6_addr,
+                    sizeof( struct in6_addr ) ) != 0 ) {
+            chosen = free_stack[probe];
+            free_stack[probe] = free_stack[--free_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock( &pool_lock );
+    if( chosen == -1 ) return -1;
+
+    // Connecting first means only the client's packets can arrive once the queue is drained.
+    if( connect( sockets[chosen].socket_handle, (const struct sockaddr *)client_address,
+                 sizeof( *client_address ) ) == -1 ) {
+        SocketPool_give_back( sockets[chosen].socket_handle, client_address, 0 );
+        return -1;
+    }
+    drain( sockets[chosen].socket_handle );
+    return sockets[chosen].socket_handle;
+}
+
+
+int SocketPool_give_back(
+    int socket_handle, const struct sockaddr_in6 *client_address, long long quiet_until )
+{
+    struct sockaddr unspecified;
+    int index;
+
+    if( socket_handle < 0 || socket_handle >= index_size ||
+        (index = index_of[socket_handle]) == -1 ) {
+        return -1;
+    }
+
+    // Dissolving the association lets the socket be connected to the next client. Being bound
+    // to its port explicitly, it keeps the port.
+    memset( &unspecified, 0, sizeof( unspecified ) );
+    unspecified.sa_family = AF_UNSPEC;
+    connect( socket_handle, &unspecified, sizeof( unspecified ) );
+    drain( socket_handle );
+
+    sockets[index].last_client = client_address->sin6_addr;
+    sockets[index].last_port   = client_address->sin6_port;
+    sockets[index].quiet_until = quiet_until;
+    pthread_mutex_lock( &pool_lock );
+    free_stack[free_count++] = index;
+    pthread_mutex_unlock( &pool_lock );
+    return 0;
+}
+
+
+void SocketPool_forget( int socket_handle )
+{
+    int index;
+
+    if( socket_handle < 0 || socket_handle >= index_size ||
+        (index = index_of[socket_handle]) == -1 ) {
+        return;
+    }
+    index_of[socket_handle] = -1;
+    sockets[index].socket_handle = -1;
+}
+
+
+int SocketPool_adopt( int socket_handle )
+{
+    struct sockaddr_in6 address;
+    socklen_t address_size = sizeof( address );
+    int *larger;
+    int  port;
+    int  i;
+
+    if( socket_count == 0 || socket_handle < 0 ||
+        getsockname( socket_handle, (struct sockaddr *)&address, &address_size ) == -1 ) {
+        return -1;
+    }
+    port = ntohs( address.sin6_port );
+
+    // Every port of the share has a slot, and this one's was left empty since it was held.
+    if( port < share_first || port > share_last || port == skipped_port ||
+        socket_count > share_last - share_first ) {
+        return -1;
+    }
+    if( socket_handle >= index_size ) {
+        larger = realloc( index_of, (size_t)( socket_handle + 1 ) * sizeof( int ) );
+        if( larger == NULL ) return -1;
+        for( i = index_size; i <= socket_handle; ++i ) larger[i] = -1;
+        index_of   = larger;
+        index_size = socket_handle + 1;
+    }
+    pthread_mutex_lock( &pool_lock );
+    sockets[socket_count].socket_handle = socket_handle;
+    sockets[socket_count].last_client   = in6addr_any;
+    sockets[socket_count].last_port     = 0;
+    sockets[socket_count].quiet_until   = 0;
+    index_of[socket_handle] = socket_count;
+    ++socket_count;
+    pthread_mutex_unlock( &pool_lock );
+    return 0;
+}
+
+
+void SocketPool_close( void )
+{
+    int i;
+
+    for( i = 0; i < socket_count; ++i ) {
+        if( sockets[i].socket_handle != -1 ) close( sockets[i].socket_handle );
+    }
+    free( sockets );
+    free( free_stack );
+    free( index_of );
+    sockets      = NULL;
+    free_stack   = NULL;
+    index_of     = NULL;
+    socket_count = 0;
+    free_count   = 0;
+    index_size   = 0;
+}
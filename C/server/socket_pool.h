@@ -0,0 +1,108 @@
+/*!
+ * \file socket_pool.h
+ * \author Peter C. Chapin
+ * \brief Interface to the pool of pre-bound transfer sockets.
+ *
+ * Every transfer needs a UDP socket of its own; its port is the server's transfer ID (RFC
+ * 1350). Creating one per transfer costs a socket() call, the kernel's search for a free
+ * ephemeral port, and the setup of a new socket. With a pool, sockets are created and bound
+ * once, one for each port of a configured range, and handed from transfer to transfer.
+ *
+ * A socket handed out is connected to its client and then drained, so nothing that arrived
+ * while it sat in the pool reaches the new transfer. A socket given back is disconnected and
+ * drained again. The client of the transfer that just ended may still have packets in flight,
+ * though, and a new transfer from the same client address and port (a client that reuses its
+ * socket) would have the very same pair of transfer IDs. A socket is therefore not handed to
+ * the address and port it last served until a quiet period has passed. Any other client,
+ * including the same host on another port, is kept apart by the connected socket's filter.
+ *
+ * The sockets belong to one process. The threaded server has one pool shared by its threads;
+ * each pre-forked worker has a pool of its own over its share of the range. A child forked per
+ * request does not use the pool.
+ *
+ * A socket handed to another server process along with its transfer (see handoff.h) leaves the
+ * pool for good. The new process adds it to its own pool, if its port belongs there, once the
+ * pool is made.
+ */
+
+#ifndef SOCKET_POOL_H_INCLUDED
+#define SOCKET_POOL_H_INCLUDED
+
+#include <netinet/in.h>
+
+//! Set the range of ports the pool binds.
+/*!
+ * \param first_port The first port of the range.
+ * \param last_port The last port of the range (included).
+ * \param listen_port The server's listening port, which is skipped if it is in the range.
+ *
+ * \return 0 if the range is usable; -1 if it is empty.
+ */
+int SocketPool_configure(
+    unsigned short first_port, unsigned short last_port, unsigned short listen_port );
+
+//! Create and bind the calling process's sockets.
+/*!
+ * The range is divided into share_count equal parts and the sockets of one part are made. Each
+ * socket is checked to be bound to exactly its port, and a port another program holds is left
+ * out (with a warning). Nothing is done if no range was configured. Calling this again, as a
+ * recycled worker does, replaces the pool.
+ *
+ * \param share The part of the range to bind (0 to share_count - 1).
+ * \param share_count The number of processes the range is divided between.
+ *
+ * \return The number of sockets in the pool, or -1 if a range was configured but no port in
+ * this share of it could be bound.
+ */
+int SocketPool_open( int share, int share_count );
+
+//! Take a socket for a transfer to the given client.
+/*!
+ * The socket is connected to the client and contains no datagrams. It is safe to call this
+ * from any thread.
+ *
+ * \param client_address The client the transfer is with.
+ * \param now The current monotonic time (ms).
+ *
+ * \return A socket, or -1 if the pool is empty (or not in use), in which case the caller makes
+ * a socket of its own.
+ */
+int SocketPool_take( const struct sockaddr_in6 *client_address, long long now );
+
+//! Return a socket to the pool when its transfer is over.
+/*!
+ * \param socket_handle A socket from SocketPool_take() or any other socket.
+ * \param client_address The client the transfer was with.
+ * \param quiet_until Monotonic time (ms) before which the socket is not given to the same
+ * client address and port again.
+ *
+ * \return 0 if the socket was returned; -1 if it did not come from the pool, in which case the
+ * caller closes it.
+ */
+int SocketPool_give_back(
+    int socket_handle, const struct sockaddr_in6 *client_address, long long quiet_until );
+
+//! Take a socket out of the pool without disturbing it.
+/*!
+ * This is for a socket another process now shares. It is neither disconnected nor drained, and
+ * the caller closes it.
+ *
+ * \param socket_handle A socket from SocketPool_take() or any other socket.
+ */
+void SocketPool_forget( int socket_handle );
+
+//! Add a socket handed over by another process to the pool.
+/*!
+ * The socket is in use; it joins the free sockets when SocketPool_give_back() is called at the
+ * end of its transfer. Call this after SocketPool_open() and before any transfer starts.
+ *
+ * \param socket_handle A socket bound to a port of this process's share of the range.
+ *
+ * \return 0 if the socket is now in the pool; -1 if its port doesn't belong in the pool.
+ */
+int SocketPool_adopt( int socket_handle );
+
+//! Close every socket in the pool.
+void SocketPool_close( void );
+
+#endif // SOCKET_POOL_H_INCLUDED
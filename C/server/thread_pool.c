@@ -0,0 +1,690 @@
+/*!
+ * \file thread_pool.c
+ * \author Peter C. Chapin
+ * \brief Implementation of a pool of worker threads that schedule transfers by work stealing.
+ *
+ * A transfer is "queued" from the moment it is pushed onto a deque until the thread servicing
+ * it has re-armed its socket. While a transfer is queued no other event can schedule it a second
+ * time, so exactly one thread touches a transfer at once. An event that arrives while the
+ * transfer is queued sets the transfer's "missed" flag; the servicing thread checks that flag
+ * after releasing the transfer and schedules it again if necessary.
+ *
+ * Only the owning worker frees a transfer, and only before it next calls epoll_wait(). This
+ * guarantees that no epoll event still in the owner's hands refers to freed memory.
+ *
+ * Each worker keeps the retransmission timers of the transfers it owns in a timing wheel that
+ * only it touches. When the owner services a transfer it re-arms the timer directly. When another
+ * worker services it, that worker only publishes the new deadline; the owner's timer then fires
+ * early, sees the later deadline, and re-arms itself. Deadlines only move forward, so a timer
+ * never fires late.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "admission.h"
+#include "event_log.h"
+#include "metrics.h"
+#include "thread_pool.h"
+#include "topology.h"
+#include "transfer.h"
+
+// The maximum number of descriptors a worker removes from the ring at once. Small batches
+// amortize the head update without letting one worker hoard requests others could service.
+#define WORKER_BATCH_SIZE 4
+
+// The capacity of each worker's deque of ready transfers.
+#define DEQUE_CAPACITY 1024
+
+// The maximum number of epoll events a worker collects at once.
+#define EVENT_BATCH_SIZE 64
+
+// A worker polls its sockets after servicing this many transfers even if it still has work.
+#define POLL_INTERVAL 16
+
+// The longest time (ms) a sleeping worker waits before re-examining its deadlines.
+#define MAX_SLEEP_TIME 1000
+
+// How often (ms) ThreadPool_drain() checks whether the workers are done.
+#define DRAIN_INTERVAL 100
+
+// Recover a task from its embedded timer.
+#define TASK_OF_TIMER( entry ) \
+    ( (pool_task *)( (char *)( entry ) - offsetof( pool_task, timer ) ) )
+
+typedef struct pool_task {
+    Transfer      transfer;   // Must be first.
+    PoolWorker   *owner;      // Worker whose epoll instance holds the socket.
+    atomic_int    queued;     // Non-zero while on a deque or being serviced.
+    atomic_int    missed;     // An event arrived while the transfer was queued.
+    atomic_llong  deadline;   // Copy of transfer.deadline readable by the owner.
+    TimerEntry    timer;      // In the owner's timing wheel. Touched only by the owner.
+    struct pool_task *next;
+    struct pool_task *previous;
+} pool_task;
+
+
+//
+// Add to a counter owned by the calling thread. No read-modify-write is needed.
+//
+static void bump( atomic_ullong *counter, unsigned long long amount )
+{
+    atomic_store_explicit(
+        counter, atomic_load_explicit( counter, memory_order_relaxed ) + amount,
+        memory_order_relaxed );
+}
+
+
+//
+// Wake one sleeping worker, if there is one.
+//
+static void wake_one_sleeper( ThreadPool *pool )
+{
+    uint64_t one = 1;
+    int expected;
+    int i;
+
+    atomic_thread_fence( memory_order_seq_cst );
+    for( i = 0; i < pool->thread_count; ++i ) {
+        expected = 1;
+        if( atomic_compare_exchange_strong( &pool->workers[i].sleeping, &expected, 0 ) ) {
+            if( write( pool->workers[i].wake_handle, &one, sizeof( one ) ) == -1 ) {
+                // The eventfd counter can't overflow in practice; nothing useful to do.
+            }
+            return;
+        }
+    }
+}
+
+
+static void run_task( PoolWorker *worker, pool_task *task, int stolen );
+
+//
+// Put a task on the worker's deque. If the deque is full, service the task immediately. If
+// the worker now has more than one task waiting, wake another worker to steal some.
+//
+static void push_ready( PoolWorker *worker, pool_task *task )
+{
+    if( WorkDeque_push( &worker->ready, task ) == -1 ) {
+        run_task( worker, task, 0 );
+        return;
+    }
+    if( WorkDeque_size( &worker->ready ) > 1 ) {
+        wake_one_sleeper( worker->pool );
+    }
+}
+
+
+//
+// Schedule a task in response to an event observed by the given worker.
+//
+static void schedule( PoolWorker *worker, pool_task *task )
+{
+    int expected = 0;
+
+    if( atomic_compare_exchange_strong( &task->queued, &expected, 1 ) ) {
+        push_ready( worker, task );
+        return;
+    }
+
+    // The transfer is already queued. Leave a note for the thread servicing it, then check
+    // again in case that thread released the transfer before it could see the note.
+    atomic_store( &task->missed, 1 );
+    expected = 0;
+    if( atomic_compare_exchange_strong( &task->queued, &expected, 1 ) ) {
+        atomic_store( &task->missed, 0 );
+        push_ready( worker, task );
+    }
+}
+
+
+//
+// Take a transfer's socket out of its owner's epoll instance. This must happen before the
+// socket leaves the worker. A pooled socket stays open and goes on to another transfer, maybe
+// on another worker, and its old registration would still carry a pointer to this task.
+//
+static void unwatch_socket( PoolWorker *owner, pool_task *task )
+{
+    if( epoll_ctl( owner->poll_handle,
+                   EPOLL_CTL_DEL, task->transfer.socket_handle, NULL ) == -1 ) {
+        EventLog_system_error( "Unable to stop watching a transfer socket", errno );
+    }
+}
+
+
+//
+// Finish servicing a task. Completed transfers are retired to their owner; others have their
+// sockets re-armed and are released.
+//
+static void release_task( PoolWorker *worker, pool_task *task, transfer_status status )
+{
+    PoolWorker *owner = task->owner;
+    struct epoll_event event;
+
+    if( status != TRANSFER_ACTIVE ) {
+        unwatch_socket( owner, task );
+        Transfer_close( &task->transfer );
+
+        pthread_mutex_lock( &owner->lock );
+        if( task->previous != NULL ) task->previous->next = task->next;
+        else owner->active = task->next;
+        if( task->next != NULL ) task->next->previous = task->previous;
+        task->next = owner->retired;
+        owner->retired = task;
+        pthread_mutex_unlock( &owner->lock );
+
+        bump( &worker->statistics.transfers_finished, 1 );
+        return;
+    }
+
+    atomic_store_explicit( &task->deadline, task->transfer.deadline, memory_order_relaxed );
+    if( worker == owner ) {
+        TimerWheel_arm( &owner->timers, &task->timer, task->transfer.deadline );
+    }
+
+    // Re-arm before releasing. The socket can't be closed and its descriptor reused while this
+    // thread still holds the transfer. If re-arming fails the transfer runs off its timer alone.
+    event.events   = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = task;
+    if( epoll_ctl( owner->poll_handle,
+                   EPOLL_CTL_MOD, task->transfer.socket_handle, &event ) == -1 ) {
+        EventLog_system_error( "Unable to watch a transfer socket", errno );
+    }
+
+    atomic_store( &task->queued, 0 );
+    if( atomic_exchange( &task->missed, 0 ) ) {
+        schedule( worker, task );
+    }
+}
+
+
+static void run_task( PoolWorker *worker, pool_task *task, int stolen )
+{
+    long long start = monotonic_microseconds( );
+    transfer_status status;
+
+    status = Transfer_service( &task->transfer, start / 1000 );
+    release_task( worker, task, status );
+
+    bump( &worker->statistics.busy_time,
+          (unsigned long long)( monotonic_microseconds( ) - start ) );
+    bump( &worker->statistics.events_run, 1 );
+    if( stolen ) bump( &worker->statistics.events_stolen, 1 );
+}
+
+
+//
+// Create a transfer for a request, or carry on with one handed over by another process. The
+// new transfer is owned by the calling worker.
+//
+static void start_transfer( PoolWorker *worker, request_descriptor *descriptor )
+{
+    struct epoll_event event;
+    pool_task *task;
+    int socket_handle;
+    int opened;
+    long long start = monotonic_microseconds( );
+
+    if( descriptor->resume != NULL ) {
+        socket_handle = descriptor->resume->socket_handle;
+    }
+    else if( (socket_handle = Transfer_socket( &descriptor->client_address )) == -1 ) {
+        EventLog_system_error( "Unable to create socket", errno );
+        Admission_release( );
+        return;
+    }
+    if( (task = calloc( 1, sizeof( pool_task ) )) == NULL ) {
+        Transfer_discard_socket( socket_handle, &descriptor->client_address );
+        Admission_release( );
+        return;
+    }
+    if( descriptor->resume != NULL ) {
+        opened = Transfer_resume( &task->transfer, descriptor->resume );
+    }
+    else {
+        opened = Transfer_open(
+            &task->transfer,
+            socket_handle,
+            &descriptor->client_address,
+            descriptor->request_buffer,
+            descriptor->request_count,
+            descriptor->received_time );
+    }
+    if( opened == -1 ) {
+        Transfer_discard_socket( socket_handle, &descriptor->client_address );
+        free( task );
+        Admission_release( );
+        return;
+    }
+    task->owner = worker;
+    atomic_init( &task->queued, 1 );
+    atomic_init( &task->missed, 0 );
+    TimerEntry_initialize( &task->timer );
+
+    // An event before the task is linked in only marks it missed (it is queued until released).
+    event.events   = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = task;
+    if( epoll_ctl( worker->poll_handle, EPOLL_CTL_ADD, socket_handle, &event ) == -1 ) {
+        EventLog_system_error( "Unable to watch a transfer socket", errno );
+        Transfer_close( &task->transfer );
+        free( task );
+        Admission_release( );
+        return;
+    }
+
+    pthread_mutex_lock( &worker->lock );
+    task->next = worker->active;
+    if( worker->active != NULL ) worker->active->previous = task;
+    worker->active = task;
+    pthread_mutex_unlock( &worker->lock );
+
+    // A resumed transfer waits for the client's ACK or its deadline, as it did before.
+    release_task( worker, task, descriptor->resume != NULL ?
+                  TRANSFER_ACTIVE : Transfer_start( &task->transfer, start / 1000 ) );
+
+    bump( &worker->statistics.transfers_started, 1 );
+    bump( &worker->statistics.busy_time,
+          (unsigned long long)( monotonic_microseconds( ) - start ) );
+}
+
+
+//
+// Called by the owner's timing wheel when a transfer's timer expires. If another worker has
+// pushed the deadline back in the meantime, the timer is simply re-armed.
+//
+static void expire_timer( TimerEntry *entry, void *context )
+{
+    PoolWorker *worker = context;
+    pool_task  *task   = TASK_OF_TIMER( entry );
+    long long   deadline = atomic_load_explicit( &task->deadline, memory_order_relaxed );
+
+    if( deadline > worker->timers.current ) {
+        TimerWheel_arm( &worker->timers, entry, deadline );
+        return;
+    }
+
+    // Keep the timer armed in case another worker ends up servicing the transfer. If this
+    // worker services it, release_task() re-arms the timer with the real deadline.
+    TimerWheel_arm( &worker->timers, entry, worker->timers.current + task->transfer.timeout );
+    schedule( worker, task );
+}
+
+
+//
+// Free the transfers that finished since the last call. Only the owner calls this.
+//
+static void free_retired( PoolWorker *worker )
+{
+    pool_task *task;
+    pool_task *next;
+
+    if( worker->retired == NULL ) return;
+
+    pthread_mutex_lock( &worker->lock );
+    task = worker->retired;
+    worker->retired = NULL;
+    pthread_mutex_unlock( &worker->lock );
+
+    for( ; task != NULL; task = next ) {
+        next = task->next;
+        TimerWheel_cancel( &worker->timers, &task->timer );
+        free( task );
+        Admission_release( );
+    }
+}
+
+
+//
+// Collect readiness events for the owned sockets. If block is non-zero and there is nothing
+// else to do, sleep until an event, a wake up, or the earliest deadline.
+//
+static void poll_events( PoolWorker *worker, int block )
+{
+    struct epoll_event events[EVENT_BATCH_SIZE];
+    uint64_t  wake_count;
+    long long now = monotonic_milliseconds( );
+    long long idle_start;
+    long long next_expiry;
+    int wait_time = 0;
+    int count;
+    int i;
+
+    TimerWheel_advance( &worker->timers, now, expire_timer, worker );
+
+    if( block ) {
+        atomic_store( &worker->sleeping, 1 );
+        if( !Ring_is_empty( &worker->pool->requests ) ||
+            WorkDeque_size( &worker->ready ) > 0 ||
+            atomic_load( &worker->pool->stopping ) ) {
+            atomic_store( &worker->sleeping, 0 );
+            return;
+        }
+        wait_time = MAX_SLEEP_TIME;
+        if( (next_expiry = TimerWheel_next_expiry( &worker->timers )) != -1 &&
+            next_expiry - now < MAX_SLEEP_TIME ) {
+            wait_time = next_expiry > now ? (int)( next_expiry - now ) : 0;
+        }
+    }
+
+    idle_start = monotonic_microseconds( );
+    count = epoll_wait( worker->poll_handle, events, EVENT_BATCH_SIZE, wait_time );
+    if( block ) {
+        atomic_store( &worker->sleeping, 0 );
+        bump( &worker->statistics.idle_time,
+              (unsigned long long)( monotonic_microseconds( ) - idle_start ) );
+    }
+
+    for( i = 0; i < count; ++i ) {
+        if( events[i].data.ptr == NULL ) {
+            if( read( worker->wake_handle, &wake_count, sizeof( wake_count ) ) == -1 ) {
+                // Another wake up already drained the counter.
+            }
+            continue;
+        }
+        schedule( worker, events[i].data.ptr );
+    }
+}
+
+
+//
+// Take a ready transfer from some other worker. Victims are tried in a random order, those on
+// the thief's own NUMA node first, since their transfers' cached copies are local to it.
+//
+static pool_task *steal( PoolWorker *worker )
+{
+    ThreadPool *pool = worker->pool;
+    pool_task  *task;
+    int start;
+    int pass;
+    int i;
+
+    if( pool->thread_count < 2 ) return NULL;
+
+    worker->random_state = worker->random_state * 1103515245 + 12345;
+    start = (int)( ( worker->random_state >> 16 ) % (unsigned)pool->thread_count );
+    for( pass = 0; pass < 2; ++pass ) {
+        for( i = 0; i < pool->thread_count; ++i ) {
+            PoolWorker *victim = &pool->workers[( start + i ) % pool->thread_count];
+            if( victim == worker || ( victim->node == worker->node ) != ( pass == 0 ) ) continue;
+            if( (task = WorkDeque_steal( &victim->ready )) != NULL ) return task;
+        }
+    }
+    return NULL;
+}
+
+
+static void *worker_thread( void *argument )
+{
+    PoolWorker *worker = argument;
+    ThreadPool *pool   = worker->pool;
+    request_descriptor batch[WORKER_BATCH_SIZE];
+    pool_task *task;
+    size_t count;
+    size_t i;
+    int    serviced = 0;
+
+    Metrics_attach( worker->index + 1 );
+    Topology_pin_worker( worker->index );
+    while( !atomic_load_explicit( &pool->stopping, memory_order_relaxed ) ) {
+        free_retired( worker );
+
+        // Service our own ready transfers first, newest first.
+        if( (task = WorkDeque_pop( &worker->ready )) != NULL ) {
+            run_task( worker, task, 0 );
+            if( ++serviced % POLL_INTERVAL == 0 ) poll_events( worker, 0 );
+            continue;
+        }
+
+        // Keep our sockets flowing before taking on new work.
+        poll_events( worker, 0 );
+        if( WorkDeque_size( &worker->ready ) > 0 ) continue;
+
+        if( (count = Ring_dequeue_batch( &pool->requests, batch, WORKER_BATCH_SIZE )) > 0 ) {
+            for( i = 0; i < count; ++i ) {
+                start_transfer( worker, &batch[i] );
+                free( batch[i].resume );
+            }
+            continue;
+        }
+
+        if( (task = steal( worker )) != NULL ) {
+            run_task( worker, task, 1 );
+            continue;
+        }
+
+        // Nothing to do, so get the next transfer's socket ready before sleeping.
+        Transfer_prepare_socket( );
+        poll_events( worker, 1 );
+    }
+    return NULL;
+}
+
+
+static int initialize_worker( ThreadPool *object, PoolWorker *worker, int index )
+{
+    struct epoll_event event;
+
+    memset( worker, 0, sizeof( *worker ) );
+    worker->pool  = object;
+    worker->index = index;
+    worker->node  = Topology_worker_node( index );
+    worker->random_state = (unsigned)index * 2654435761u + 1;
+    TimerWheel_initialize( &worker->timers, monotonic_milliseconds( ) );
+    atomic_init( &worker->sleeping, 0 );
+    pthread_mutex_init( &worker->lock, NULL );
+
+    if( WorkDeque_initialize( &worker->ready, DEQUE_CAPACITY ) == -1 ) return -1;
+    worker->poll_handle = epoll_create1( EPOLL_CLOEXEC );
+    worker->wake_handle = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if( worker->poll_handle == -1 || worker->wake_handle == -1 ) return -1;
+
+    event.events   = EPOLLIN;
+    event.data.ptr = NULL;
+    return epoll_ctl( worker->poll_handle, EPOLL_CTL_ADD, worker->wake_handle, &event );
+}
+
+
+int ThreadPool_initialize( ThreadPool *object, int thread_count, size_t queue_length )
+{
+    int i;
+
+    if( Ring_initialize( &object->requests, queue_length, sizeof( request_descriptor ) ) == -1 ) {
+        return -1;
+    }
+    if( (object->workers = aligned_alloc(
+             CACHE_LINE_SIZE, (size_t)thread_count * sizeof( PoolWorker ) )) == NULL ) {
+        Ring_destroy( &object->requests );
+        return -1;
+    }
+    object->thread_count = 0;
+    atomic_init( &object->stopping, 0 );
+
+    // All workers must exist before any of them starts stealing.
+    for( i = 0; i < thread_count; ++i ) {
+        if( initialize_worker( object, &object->workers[i], i ) == -1 ) {
+            perror( "Unable to initialize worker" );
+            ThreadPool_destroy( object );
+            return -1;
+        }
+        object->thread_count = i + 1;
+    }
+    for( i = 0; i < thread_count; ++i ) {
+        if( pthread_create(
+                &object->workers[i].thread, NULL, worker_thread, &object->workers[i] ) != 0 ) {
+            fprintf( stderr, "Unable to create worker thread\n" );
+            atomic_store( &object->stopping, 1 );
+            object->thread_count = i;
+            ThreadPool_destroy( object );
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+size_t ThreadPool_dispatch_batch(
+    ThreadPool *object, const request_descriptor *descriptors, size_t count )
+{
+    size_t queued = Ring_enqueue_batch( &object->requests, descriptors, count );
+
+    if( queued > 0 ) wake_one_sleeper( object );
+    return queued;
+}
+
+
+void ThreadPool_report( ThreadPool *object, FILE *output )
+{
+    int i;
+
+    fprintf( output, "%-6s %12s %10s %10s %10s %10s %6s\n",
+             "thread", "events", "stolen", "started", "finished", "busy(ms)", "util" );
+    for( i = 0; i < object->thread_count; ++i ) {
+        worker_statistics *statistics = &object->workers[i].statistics;
+        unsigned long long busy = atomic_load( &statistics->busy_time );
+        unsigned long long idle = atomic_load( &statistics->idle_time );
+
+        fprintf( output, "%-6d %12llu %10llu %10llu %10llu %10llu %5.1f%%\n",
+                 i,
+                 atomic_load( &statistics->events_run ),
+                 atomic_load( &statistics->events_stolen ),
+                 atomic_load( &statistics->transfers_started ),
+                 atomic_load( &statistics->transfers_finished ),
+                 busy / 1000,
+                 busy + idle > 0 ? 100.0 * busy / ( busy + idle ) : 0.0 );
+    }
+    fflush( output );
+}
+
+
+//
+// Ask the worker threads to exit and wait for them. Calling this again does nothing.
+//
+static void stop_workers( ThreadPool *object )
+{
+    uint64_t one = 1;
+    int i;
+
+    atomic_store( &object->stopping, 1 );
+    for( i = 0; i < object->thread_count; ++i ) {
+        if( object->workers[i].thread != 0 ) {
+            if( write( object->workers[i].wake_handle, &one, sizeof( one ) ) == -1 ) {
+                // Ignore; the worker will notice the stop flag within MAX_SLEEP_TIME.
+            }
+            pthread_join( object->workers[i].thread, NULL );
+            object->workers[i].thread = 0;
+        }
+    }
+}
+
+
+void ThreadPool_destroy( ThreadPool *object )
+{
+    request_descriptor descriptor;
+    pool_task *task;
+    pool_task *next;
+    int i;
+
+    stop_workers( object );
+    while( Ring_dequeue_batch( &object->requests, &descriptor, 1 ) == 1 ) {
+        if( descriptor.resume != NULL ) {
+            Transfer_discard_socket(
+                descriptor.resume->socket_handle, &descriptor.resume->client_address );
+            free( descriptor.resume );
+        }
+    }
+
+    for( i = 0; i < object->thread_count; ++i ) {
+        PoolWorker *worker = &object->workers[i];
+
+        free_retired( worker );
+        for( task = worker->active; task != NULL; task = next ) {
+            next = task->next;
+            unwatch_socket( worker, task );
+            Transfer_close( &task->transfer );
+            free( task );
+        }
+        close( worker->poll_handle );
+        close( worker->wake_handle );
+        WorkDeque_destroy( &worker->ready );
+        pthread_mutex_destroy( &worker->lock );
+    }
+    free( object->workers );
+    object->workers = NULL;
+    Ring_destroy( &object->requests );
+}
+
+
+void ThreadPool_hand_off( ThreadPool *object, int (*send)( const request_descriptor *request ) )
+{
+    request_descriptor descriptor;
+    transfer_snapshot  snapshot;
+    pool_task *task;
+    pool_task *next;
+    int i;
+
+    // With the workers stopped, nothing else touches the transfers.
+    stop_workers( object );
+    for( i = 0; i < object->thread_count; ++i ) {
+        PoolWorker *worker = &object->workers[i];
+
+        free_retired( worker );
+        for( task = worker->active; task != NULL; task = next ) {
+            next = task->next;
+            Transfer_snapshot( &task->transfer, &snapshot );
+            memset( &descriptor, 0, sizeof( descriptor ) );
+            descriptor.client_address = snapshot.client_address;
+            descriptor.received_time  = snapshot.received_time;
+            descriptor.resume         = &snapshot;
+            unwatch_socket( worker, task );
+            if( task->transfer.status == TRANSFER_ACTIVE && send( &descriptor ) == 0 ) {
+                Transfer_detach( &task->transfer );
+            }
+            else {
+                Transfer_close( &task->transfer );
+            }
+            TimerWheel_cancel( &worker->timers, &task->timer );
+            free( task );
+        }
+        worker->active = NULL;
+    }
+
+    // A request that can't be handed over is retransmitted by its client in any case.
+    while( Ring_dequeue_batch( &object->requests, &descriptor, 1 ) == 1 ) {
+        send( &descriptor );
+        free( descriptor.resume );
+    }
+    ThreadPool_destroy( object );
+}
+
+
+void ThreadPool_drain( ThreadPool *object )
+{
+    struct timespec interval = { 0, DRAIN_INTERVAL * 1000000L };
+    int busy = 1;
+    int i;
+
+    // A worker only sleeps once it has nothing queued, so a sleeping worker with no transfers
+    // is done, even with a request just taken from the ring.
+    while( busy ) {
+        nanosleep( &interval, NULL );
+        busy = !Ring_is_empty( &object->requests );
+        for( i = 0; !busy && i < object->thread_count; ++i ) {
+            PoolWorker *worker = &object->workers[i];
+
+            pthread_mutex_lock( &worker->lock );
+            busy = worker->active != NULL || !atomic_load( &worker->sleeping );
+            pthread_mutex_unlock( &worker->lock );
+        }
+    }
+    ThreadPool_destroy( object );
+}
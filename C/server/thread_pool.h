@@ -0,0 +1,121 @@
+/*!
+ * \file thread_pool.h
+ * \author Peter C. Chapin
+ * \brief Interface to a pool of worker threads that schedule transfers by work stealing.
+ *
+ */
+
+#ifndef THREAD_POOL_H_INCLUDED
+#define THREAD_POOL_H_INCLUDED
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "ring.h"
+#include "server.h"
+#include "timer_wheel.h"
+#include "work_deque.h"
+
+struct ThreadPool;
+struct pool_task;
+
+//! Utilization counters for one worker thread.
+/*!
+ * Each counter is written only by the worker that owns it, with plain (non read-modify-write)
+ * atomic stores, so keeping the counters costs nothing in contention. Readers may see values
+ * that are slightly out of date.
+ */
+typedef struct {
+    atomic_ullong events_run;          //!< Ready events serviced by this thread.
+    atomic_ullong events_stolen;       //!< Of those, events taken from another thread.
+    atomic_ullong transfers_started;   //!< Transfers created by this thread.
+    atomic_ullong transfers_finished;  //!< Transfers completed (or failed) on this thread.
+    atomic_ullong busy_time;           //!< Microseconds spent servicing transfers.
+    atomic_ullong idle_time;           //!< Microseconds spent waiting for work.
+} worker_statistics;
+
+//! One worker thread and the transfers it owns.
+/*!
+ * A worker owns the transfers it creates: their sockets are registered with the worker's
+ * epoll instance and their deadlines are tracked by the worker. When a transfer becomes ready
+ * (a packet arrived or its deadline passed) the owner pushes it onto its own deque. Any idle
+ * worker may steal it from there, so a worker stuck sending a large window does not delay the
+ * other transfers it owns.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) struct ThreadPool *pool;  //!< The pool this worker belongs to.
+    int        index;           //!< Position of this worker in the pool.
+    pthread_t  thread;          //!< The worker thread.
+    WorkDeque  ready;           //!< Transfers ready to be serviced.
+    int        poll_handle;     //!< Epoll instance for the sockets of owned transfers.
+    int        wake_handle;     //!< Eventfd used to wake this worker while it sleeps.
+    atomic_int sleeping;        //!< Non-zero while the worker is blocked in epoll_wait().
+    pthread_mutex_t   lock;     //!< Protects the active and retired lists.
+    struct pool_task *active;   //!< Transfers owned by this worker that are in progress.
+    struct pool_task *retired;  //!< Finished transfers waiting to be freed by this worker.
+    TimerWheel timers;          //!< Retransmission deadlines of owned transfers.
+    unsigned   random_state;    //!< Used to pick steal victims.
+    int        node;            //!< NUMA node the worker is placed on.
+    worker_statistics statistics;
+} PoolWorker;
+
+//! A pool of worker threads.
+/*!
+ * The listener hands batches of request descriptors to the pool through a multi-producer,
+ * multi-consumer ring. A worker with nothing else to do drains the ring, creates the transfers,
+ * and from then on owns them. Workers sleep in epoll_wait() when they have no work.
+ */
+typedef struct ThreadPool {
+    Ring        requests;       //!< Descriptors waiting for a worker.
+    PoolWorker *workers;        //!< The worker threads.
+    int         thread_count;   //!< Number of worker threads.
+    atomic_int  stopping;       //!< Set to ask the workers to exit.
+} ThreadPool;
+
+//! Create the ring and start the worker threads.
+/*!
+ * \param object The pool to initialize.
+ * \param thread_count The number of worker threads to start.
+ * \param queue_length The number of descriptors the ring can hold.
+ *
+ * \return 0 if the pool was created; -1 otherwise.
+ */
+int ThreadPool_initialize( ThreadPool *object, int thread_count, size_t queue_length );
+
+//! Hand a batch of requests to the workers.
+/*!
+ * This function never blocks. Requests that do not fit in the ring are dropped; the clients
+ * will retransmit their RRQs.
+ *
+ * \return The number of requests actually queued.
+ */
+size_t ThreadPool_dispatch_batch(
+    ThreadPool *object, const request_descriptor *descriptors, size_t count );
+
+//! Write a table of per-thread utilization counters.
+void ThreadPool_report( ThreadPool *object, FILE *output );
+
+//! Stop the worker threads and release the pool's resources.
+/*!
+ * Requests still in the ring are discarded and transfers in progress are abandoned.
+ */
+void ThreadPool_destroy( ThreadPool *object );
+
+//! Stop the worker threads, give their work to another process, and release the pool.
+/*!
+ * Each transfer in progress is passed to send as a descriptor whose resume member holds the
+ * transfer's snapshot (valid only during the call), and then each request still in the ring is
+ * passed as it is. A transfer that send takes (returns 0 for) is detached (see
+ * Transfer_detach()); any other is abandoned.
+ *
+ * \param object The pool.
+ * \param send The function that hands over one request or transfer. It returns 0 if successful
+ * and -1 otherwise.
+ */
+void ThreadPool_hand_off( ThreadPool *object, int (*send)( const request_descriptor *request ) );
+
+//! Wait for the requests in the ring and the transfers in progress to finish, then release the
+//! pool.
+void ThreadPool_drain( ThreadPool *object );
+
+#endif // THREAD_POOL_H_INCLUDED
@@ -0,0 +1,215 @@
+/*!
+ * \file timer_wheel.c
+ * \author Peter C. Chapin
+ * \brief Implementation of a hierarchical timing wheel.
+ *
+ */
+
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+
+// The farthest into the future a timer can be placed directly.
+#define MAX_DELTA ( ( 1LL << ( TIMER_SLOT_BITS * TIMER_LEVELS ) ) - 1 )
+
+
+static void link_entry( TimerWheel *object, TimerEntry *entry, int level, int slot )
+{
+    TimerEntry **head = &object->slots[level][slot];
+
+    entry->level    = level;
+    entry->slot     = slot;
+    entry->previous = NULL;
+    entry->next     = *head;
+    if( *head != NULL ) ( *head )->previous = entry;
+    *head = entry;
+    object->occupied[level] |= (uint64_t)1 << slot;
+    ++object->count;
+}
+
+
+static void unlink_entry( TimerWheel *object, TimerEntry *entry )
+{
+    TimerEntry **head = &object->slots[entry->level][entry->slot];
+
+    if( entry->previous != NULL ) entry->previous->next = entry->next;
+    else *head = entry->next;
+    if( entry->next != NULL ) entry->next->previous = entry->previous;
+    if( *head == NULL ) object->occupied[entry->level] &= ~( (uint64_t)1 << entry->slot );
+
+    entry->next     = NULL;
+    entry->previous = NULL;
+    entry->level    = -1;
+    --object->count;
+}
+
+
+//
+// Place an entry according to its expiry time relative to the wheel's current time.
+//
+static void place_entry( TimerWheel *object, TimerEntry *entry )
+{
+    long long expires = entry->expires;
+    long long delta;
+    int level;
+
+    if( expires <= object->current ) expires = object->current + 1;
+    delta = expires - object->current;
+
+    // Timers beyond the span of the wheel are parked in the top level and placed again when
+    // they come due. See TimerWheel_advance().
+    if( delta > MAX_DELTA ) expires = object->current + MAX_DELTA;
+
+    for( level = 0; level < TIMER_LEVELS - 1; ++level ) {
+        if( delta < ( 1LL << ( TIMER_SLOT_BITS * ( level + 1 ) ) ) ) break;
+    }
+    link_entry(
+        object, entry, level, (int)( ( expires >> ( TIMER_SLOT_BITS * level ) ) & SLOT_MASK ) );
+}
+
+
+//
+// Move every timer in the given slot down to the level where it now belongs. This happens at the
+// start of the slot, so a timer expiring on exactly that tick goes into the level zero slot about
+// to be processed.
+//
+static void cascade( TimerWheel *object, int level, int slot )
+{
+    TimerEntry *entry = object->slots[level][slot];
+    TimerEntry *next;
+
+    object->slots[level][slot] = NULL;
+    object->occupied[level] &= ~( (uint64_t)1 << slot );
+    for( ; entry != NULL; entry = next ) {
+        next = entry->next;
+        --object->count;
+        if( entry->expires <= object->current ) {
+            link_entry( object, entry, 0, (int)( object->current & SLOT_MASK ) );
+        }
+        else {
+            place_entry( object, entry );
+        }
+    }
+}
+
+
+void TimerEntry_initialize( TimerEntry *entry )
+{
+    entry->next     = NULL;
+    entry->previous = NULL;
+    entry->expires  = 0;
+    entry->level    = -1;
+    entry->slot     = 0;
+}
+
+
+int TimerEntry_armed( const TimerEntry *entry )
+{
+    return entry->level != -1;
+}
+
+
+void TimerWheel_initialize( TimerWheel *object, long long now )
+{
+    memset( object, 0, sizeof( *object ) );
+    object->current = now;
+}
+
+
+void TimerWheel_arm( TimerWheel *object, TimerEntry *entry, long long expires )
+{
+    if( entry->level != -1 ) unlink_entry( object, entry );
+    entry->expires = expires;
+    place_entry( object, entry );
+}
+
+
+void TimerWheel_cancel( TimerWheel *object, TimerEntry *entry )
+{
+    if( entry->level != -1 ) unlink_entry( object, entry );
+}
+
+
+void TimerWheel_advance(
+    TimerWheel *object, long long now, timer_callback expire, void *context )
+{
+    TimerEntry *entry;
+    TimerEntry *next;
+    long long   tick;
+    int level;
+    int slot;
+
+    while( object->current < now ) {
+        if( object->count == 0 ) {
+            object->current = now;
+            break;
+        }
+        tick = ++object->current;
+
+        // At the start of each higher level slot, cascade its timers downward. Higher levels
+        // go first so their timers can land in the lower level slots cascaded next.
+        for( level = TIMER_LEVELS - 1; level > 0; --level ) {
+            if( ( tick & ( ( 1LL << ( TIMER_SLOT_BITS * level ) ) - 1 ) ) == 0 ) {
+                slot = (int)( ( tick >> ( TIMER_SLOT_BITS * level ) ) & SLOT_MASK );
+                if( object->occupied[level] & ( (uint64_t)1 << slot ) ) {
+                    cascade( object, level, slot );
+                }
+            }
+        }
+
+        slot = (int)( tick & SLOT_MASK );
+        if( ( object->occupied[0] & ( (uint64_t)1 << slot ) ) == 0 ) continue;
+
+        // Detach the whole slot first so the callback may re-arm timers freely.
+        entry = object->slots[0][slot];
+        object->slots[0][slot] = NULL;
+        object->occupied[0] &= ~( (uint64_t)1 << slot );
+        for( ; entry != NULL; entry = next ) {
+            next = entry->next;
+            entry->next     = NULL;
+            entry->previous = NULL;
+            entry->level    = -1;
+            --object->count;
+
+            // A timer parked beyond the wheel's span is placed again rather than expired.
+            if( entry->expires > tick ) {
+                place_entry( object, entry );
+                continue;
+            }
+            expire( entry, context );
+        }
+    }
+}
+
+
+long long TimerWheel_next_expiry( const TimerWheel *object )
+{
+    long long earliest = -1;
+    long long candidate;
+    long long position;
+    uint64_t  occupied;
+    uint64_t  rotated;
+    int level;
+    int shift;
+    int start;
+    int distance;
+
+    if( object->count == 0 ) return -1;
+
+    for( level = 0; level < TIMER_LEVELS; ++level ) {
+        if( (occupied = object->occupied[level]) == 0 ) continue;
+
+        // Find the first occupied slot after the current one, wrapping around. A distance of
+        // TIMER_SLOTS means the current slot index one full lap later.
+        shift    = TIMER_SLOT_BITS * level;
+        position = object->current >> shift;
+        start    = (int)( ( position + 1 ) & SLOT_MASK );
+        rotated  = ( occupied >> start ) | ( start == 0 ? 0 : occupied << ( TIMER_SLOTS - start ) );
+        distance = __builtin_ctzll( rotated ) + 1;
+        candidate = ( position + distance ) << shift;
+        if( earliest == -1 || candidate < earliest ) earliest = candidate;
+    }
+    return earliest;
+}
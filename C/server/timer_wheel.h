@@ -0,0 +1,90 @@
+/*!
+ * \file timer_wheel.h
+ * \author Peter C. Chapin
+ * \brief Interface to a hierarchical timing wheel.
+ *
+ */
+
+#ifndef TIMER_WHEEL_H_INCLUDED
+#define TIMER_WHEEL_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+//! Number of bits of the expiry time resolved by each level of the wheel.
+#define TIMER_SLOT_BITS 6
+
+//! Number of slots in each level of the wheel.
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+//! Number of levels in the wheel. With 1 ms ticks the wheel spans about 4.6 hours.
+#define TIMER_LEVELS 4
+
+//! A timer. Embed this in the object that needs a deadline.
+typedef struct TimerEntry {
+    struct TimerEntry *next;      //!< Next entry in the same slot.
+    struct TimerEntry *previous;  //!< Previous entry in the same slot.
+    long long expires;            //!< Time (ms) at which the timer expires.
+    int       level;              //!< Level holding the entry, or -1 if not armed.
+    int       slot;               //!< Slot holding the entry.
+} TimerEntry;
+
+//! Function called for each timer that expires.
+typedef void (*timer_callback)( TimerEntry *entry, void *context );
+
+//! A hierarchical timing wheel.
+/*!
+ * Timers are kept in one of TIMER_LEVELS levels of TIMER_SLOTS slots each. Level zero has one
+ * slot per millisecond; each higher level has slots TIMER_SLOTS times coarser than the one
+ * below. A timer is placed in the lowest level whose span covers its expiry time, and is moved
+ * ("cascaded") to a lower level when the wheel reaches the start of its slot.
+ *
+ * Arming, re-arming, and cancelling a timer are O(1): each is an insertion into or removal
+ * from a doubly linked list. This matters because a transfer's retransmission timer is re-armed
+ * on nearly every ACK and nearly never expires. A bitmap of occupied slots per level lets the
+ * wheel skip empty slots quickly and compute the next expiry for the event loop's wait timeout.
+ *
+ * The wheel is not thread safe. All operations on one wheel must be made by the same thread.
+ */
+typedef struct {
+    long long   current;                              //!< Time (ms) the wheel has reached.
+    size_t      count;                                //!< Number of armed timers.
+    uint64_t    occupied[TIMER_LEVELS];               //!< One bit per non-empty slot.
+    TimerEntry *slots[TIMER_LEVELS][TIMER_SLOTS];     //!< Lists of timers.
+} TimerWheel;
+
+//! Initialize a timer entry. The entry is not armed.
+void TimerEntry_initialize( TimerEntry *entry );
+
+//! Return non-zero if the entry is armed.
+int TimerEntry_armed( const TimerEntry *entry );
+
+//! Initialize a wheel. The wheel starts at time now (ms).
+void TimerWheel_initialize( TimerWheel *object, long long now );
+
+//! Arm (or re-arm) a timer to expire at the given time (ms).
+/*!
+ * If the timer is already armed it is first removed from its current slot. An expiry time in
+ * the past is treated as the next tick.
+ */
+void TimerWheel_arm( TimerWheel *object, TimerEntry *entry, long long expires );
+
+//! Disarm a timer. Does nothing if the timer is not armed.
+void TimerWheel_cancel( TimerWheel *object, TimerEntry *entry );
+
+//! Advance the wheel to time now (ms), calling expire for each timer that expires.
+/*!
+ * Expired timers are disarmed before expire is called. The callback may re-arm or cancel any
+ * timer, including the one passed to it.
+ */
+void TimerWheel_advance(
+    TimerWheel *object, long long now, timer_callback expire, void *context );
+
+//! Return the time (ms) at which the wheel next needs to be advanced, or -1 if it is empty.
+/*!
+ * The returned time is never later than the earliest expiry. It may be earlier if timers in a
+ * higher level must be cascaded first.
+ */
+long long TimerWheel_next_expiry( const TimerWheel *object );
+
+#endif // TIMER_WHEEL_H_INCLUDED
@@ -0,0 +1,289 @@
+/*!
+ * \file topology.c
+ * \author Peter C. Chapin
+ * \brief Implementation of the NUMA topology and node-local cache memory.
+ *
+ * Memory is bound to a node with the mbind() system call directly rather than through libnuma,
+ * which the server would otherwise not need.
+ */
+
+#ifndef _GNU_SOURCE   // Needed for the CPU affinity calls.
+#define _GNU_SOURCE
+#endif
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "topology.h"
+
+// Blocks at least this large get a mapping of their own.
+#define MIN_MAPPED_SIZE ( 256 * 1024 )
+
+// Used if the kernel doesn't say how large its huge pages are.
+#define DEFAULT_HUGE_PAGE_SIZE ( 2 * 1024 * 1024 )
+
+static int node_count = 1;
+static int node_ids[MAX_NODES];     // The kernel's number of each node.
+static int cpu_nodes[CPU_SETSIZE];  // Node of each CPU, or -1 if the process may not use it.
+static int worker_cpus[CPU_SETSIZE];  // Usable CPUs in the order workers are given them.
+static int worker_nodes[CPU_SETSIZE]; // Node of each entry in worker_cpus.
+static int worker_cpu_count = 0;
+static int pinning = 0;
+static hugepage_mode hugepages = HUGEPAGES_TRANSPARENT;
+static size_t huge_page_size = DEFAULT_HUGE_PAGE_SIZE;
+
+
+//
+// Parse a sysfs CPU or node list such as "0-3,8-11" and call the action for each number in it.
+// Returns the number of entries found.
+//
+static int parse_list(
+    const char *text, void ( *action )( int number, void *context ), void *context )
+{
+    char *end;
+    long  first;
+    long  last;
+    long  i;
+    int   count = 0;
+
+    while( *text != '\0' && *text != '\n' ) {
+        first = strtol( text, &end, 10 );
+        if( end == text || first < 0 ) break;
+        last = first;
+        if( *end == '-' ) {
+            text = end + 1;
+            last = strtol( text, &end, 10 );
+            if( end == text || last < first ) break;
+        }
+        for( i = first; i <= last && i < CPU_SETSIZE; ++i ) {
+            action( (int)i, context );
+            ++count;
+        }
+        text = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+
+//
+// Read the first line of a sysfs file. Returns -1 if there is no such file.
+//
+static int read_line( const char *path, char *line, size_t size )
+{
+    FILE *input;
+    int   result = 0;
+
+    if( (input = fopen( path, "r" )) == NULL ) return -1;
+    if( fgets( line, (int)size, input ) == NULL ) result = -1;
+    fclose( input );
+    return result;
+}
+
+
+typedef struct {
+    int numbers[CPU_SETSIZE];
+    int count;
+} node_list;
+
+
+static void add_online_node( int number, void *context )
+{
+    node_list *online = context;
+
+    online->numbers[online->count++] = number;
+}
+
+
+static void add_cpu( int number, void *context )
+{
+    const cpu_set_t *usable = context;
+    int node = node_count - 1;
+
+    if( node >= MAX_NODES ) node = MAX_NODES - 1;
+    if( CPU_ISSET( number, usable ) ) cpu_nodes[number] = node;
+}
+
+
+//
+// Read the size of the huge pages the kernel uses by default.
+//
+static void read_huge_page_size( void )
+{
+    char line[64];
+    FILE *input;
+    unsigned long kilobytes;
+
+    if( read_line( "/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", line, sizeof( line ) )
+        == 0 && strtoul( line, NULL, 10 ) > 0 ) {
+        huge_page_size = strtoul( line, NULL, 10 );
+        return;
+    }
+    if( (input = fopen( "/proc/meminfo", "r" )) == NULL ) return;
+    while( fgets( line, sizeof( line ), input ) != NULL ) {
+        if( sscanf( line, "Hugepagesize: %lu kB", &kilobytes ) == 1 && kilobytes > 0 ) {
+            huge_page_size = kilobytes * 1024;
+            break;
+        }
+    }
+    fclose( input );
+}
+
+
+void Topology_initialize( int pin_workers, hugepage_mode mode )
+{
+    static node_list online;
+    char      path[64];
+    char      line[4096];
+    cpu_set_t usable;
+    int       found = 0;
+    int       node;
+    int       cpu;
+    int       seen;
+    int       taken;
+    int       round;
+
+    pinning   = pin_workers;
+    hugepages = mode;
+    read_huge_page_size( );
+
+    CPU_ZERO( &usable );
+    if( sched_getaffinity( 0, sizeof( usable ), &usable ) == -1 ) {
+        for( cpu = 0; cpu < sysconf( _SC_NPROCESSORS_ONLN ) && cpu < CPU_SETSIZE; ++cpu ) {
+            CPU_SET( cpu, &usable );
+        }
+    }
+    for( cpu = 0; cpu < CPU_SETSIZE; ++cpu ) cpu_nodes[cpu] = -1;
+
+    // Read each online node's CPUs.
+    node_count = 0;
+    online.count = 0;
+    if( read_line( "/sys/devices/system/node/online", line, sizeof( line ) ) == 0 ) {
+        parse_list( line, add_online_node, &online );
+    }
+    for( node = 0; node < online.count; ++node ) {
+        snprintf( path, sizeof( path ),
+                  "/sys/devices/system/node/node%d/cpulist", online.numbers[node] );
+        if( read_line( path, line, sizeof( line ) ) == -1 ) continue;
+        if( node_count < MAX_NODES ) node_ids[node_count] = online.numbers[node];
+        ++node_count;
+        found += parse_list( line, add_cpu, &usable );
+    }
+
+    // Without sysfs, every usable CPU is on one node.
+    if( found == 0 ) {
+        node_count  = 1;
+        node_ids[0] = 0;
+        for( cpu = 0; cpu < CPU_SETSIZE; ++cpu ) {
+            cpu_nodes[cpu] = CPU_ISSET( cpu, &usable ) ? 0 : -1;
+        }
+    }
+    if( node_count > MAX_NODES ) node_count = MAX_NODES;
+
+    // Deal the CPUs out to workers a node at a time, so consecutive workers land on different
+    // nodes and any number of workers is spread evenly.
+    worker_cpu_count = 0;
+    for( round = 0; ; ++round ) {
+        taken = 0;
+        for( node = 0; node < node_count; ++node ) {
+            seen = 0;
+            for( cpu = 0; cpu < CPU_SETSIZE; ++cpu ) {
+                if( cpu_nodes[cpu] != node ) continue;
+                if( seen++ == round ) {
+                    worker_cpus[worker_cpu_count]  = cpu;
+                    worker_nodes[worker_cpu_count] = node;
+                    ++worker_cpu_count;
+                    ++taken;
+                    break;
+                }
+            }
+        }
+        if( taken == 0 ) break;
+    }
+}
+
+
+int Topology_node_count( void )
+{
+    return node_count;
+}
+
+
+int Topology_current_node( void )
+{
+    int cpu;
+
+    if( node_count == 1 || (cpu = sched_getcpu( )) < 0 || cpu >= CPU_SETSIZE ||
+        cpu_nodes[cpu] < 0 ) {
+        return 0;
+    }
+    return cpu_nodes[cpu];
+}
+
+
+int Topology_worker_node( int index )
+{
+    if( worker_cpu_count == 0 ) return 0;
+    return worker_nodes[index % worker_cpu_count];
+}
+
+
+void Topology_pin_worker( int index )
+{
+    cpu_set_t cpus;
+
+    if( !pinning || worker_cpu_count == 0 ) return;
+    CPU_ZERO( &cpus );
+    CPU_SET( worker_cpus[index % worker_cpu_count], &cpus );
+
+    // Failure isn't fatal; the worker just runs wherever the scheduler puts it.
+    sched_setaffinity( 0, sizeof( cpus ), &cpus );
+}
+
+
+void *Topology_allocate( size_t size, size_t *mapped )
+{
+    void  *memory = MAP_FAILED;
+    size_t length;
+    size_t page_size = (size_t)sysconf( _SC_PAGESIZE );
+    unsigned long mask;
+    int    huge = hugepages != HUGEPAGES_NONE && size >= huge_page_size;
+
+    *mapped = 0;
+    if( size < MIN_MAPPED_SIZE ) return malloc( size );
+
+    length = huge ? ( size + huge_page_size - 1 ) / huge_page_size * huge_page_size
+                  : ( size + page_size - 1 ) / page_size * page_size;
+    if( huge && hugepages == HUGEPAGES_EXPLICIT ) {
+        memory = mmap( NULL, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+    }
+    if( memory == MAP_FAILED ) {
+        memory = mmap( NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if( memory == MAP_FAILED ) return NULL;
+        if( huge ) madvise( memory, length, MADV_HUGEPAGE );
+    }
+
+    // Nothing has been touched yet, so every page will come from the preferred node. The
+    // kernel falls back to other nodes if that one is out of memory.
+    if( node_count > 1 && node_ids[Topology_current_node( )] < (int)( 8 * sizeof( mask ) ) ) {
+        mask = 1UL << node_ids[Topology_current_node( )];
+        syscall( SYS_mbind, memory, length, MPOL_PREFERRED, &mask, 8 * sizeof( mask ), 0 );
+    }
+    *mapped = length;
+    return memory;
+}
+
+
+void Topology_free( void *memory, size_t mapped )
+{
+    if( mapped == 0 ) free( memory ); else munmap( memory, mapped );
+}
@@ -0,0 +1,79 @@
+/*!
+ * \file topology.h
+ * \author Peter C. Chapin
+ * \brief Interface to the machine's NUMA topology and node-local cache memory.
+ *
+ * On a machine with several NUMA nodes, memory attached to another node's socket is slower to
+ * read than local memory. The server therefore keeps large cached copies (compressed files,
+ * signature lists) in memory bound to the node of the worker that made them, replicates copies
+ * that many transfers use onto each node that asks for them, and can pin each worker to one
+ * core so it stays next to its copies. Large copies are also backed by huge pages, so that
+ * reading a copy of hundreds of megabytes doesn't miss the TLB on every 4 KiB page.
+ *
+ * The topology is read from sysfs (/sys/devices/system/node). If that isn't available (for
+ * example, in a container or on a kernel without NUMA support) the machine is treated as one
+ * node holding every CPU the process may run on, and everything still works; only the
+ * placement is lost. Likewise explicit huge pages fall back to transparent huge pages, and
+ * those to ordinary pages.
+ */
+
+#ifndef TOPOLOGY_H_INCLUDED
+#define TOPOLOGY_H_INCLUDED
+
+#include <stddef.h>
+
+//! Largest number of NUMA nodes told apart. CPUs on further nodes share the last ones' copies.
+#define MAX_NODES 8
+
+//! How memory for large cached copies is obtained.
+typedef enum {
+    HUGEPAGES_NONE,         //!< Ordinary pages.
+    HUGEPAGES_TRANSPARENT,  //!< Ask for transparent huge pages (the default).
+    HUGEPAGES_EXPLICIT      //!< Use the reserved huge page pool, falling back as needed.
+} hugepage_mode;
+
+//! Read the topology and configure placement.
+/*!
+ * This must be called before any worker is created.
+ *
+ * \param pin_workers Non-zero to pin each worker to its own CPU (see Topology_pin_worker()).
+ * \param hugepages How to back large cached copies.
+ */
+void Topology_initialize( int pin_workers, hugepage_mode hugepages );
+
+//! Return the number of NUMA nodes (at least one, at most MAX_NODES).
+int Topology_node_count( void );
+
+//! Return the node (0 to Topology_node_count() - 1) of the CPU the caller is running on.
+int Topology_current_node( void );
+
+//! Return the node a worker is placed on.
+/*!
+ * Workers are spread over the nodes in turn so that any number of workers is balanced.
+ */
+int Topology_worker_node( int index );
+
+//! Pin the calling thread or process to the CPU of the given worker.
+/*!
+ * Nothing is done unless pinning was asked for. If there are more workers than CPUs, CPUs are
+ * shared in turn.
+ */
+void Topology_pin_worker( int index );
+
+//! Allocate memory for a cached copy on the caller's node.
+/*!
+ * Small blocks come from malloc() and are placed by the kernel when first touched. Large blocks
+ * are mapped separately, bound to the caller's node, and backed by huge pages as configured.
+ *
+ * \param size The number of bytes needed.
+ * \param mapped Receives the length of the mapping, or zero if the block came from malloc().
+ * It must be given to Topology_free().
+ *
+ * \return The memory, or NULL if it could not be allocated.
+ */
+void *Topology_allocate( size_t size, size_t *mapped );
+
+//! Release memory obtained from Topology_allocate().
+void Topology_free( void *memory, size_t mapped );
+
+#endif // TOPOLOGY_H_INCLUDED
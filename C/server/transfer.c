@@ -0,0 +1,933 @@
+/*!
+ * \file transfer.c
+ * \author Peter C. Chapin
+ * \brief Implementation of the server side transfer state machine.
+ *
+ * \todo Netascii transfers are currently sent as if they were octet transfers.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "crc32c.h"
+#include "event_log.h"
+#include "flight_recorder.h"
+#include "metrics.h"
+#include "policy.h"
+#include "socket_pool.h"
+#include "transfer.h"
+#include "xdp_path.h"
+
+// Smallest read ahead window worth a system call.
+#define MIN_READAHEAD ( 128 * 1024 )
+
+// How far ahead (ms) of the client the file is read, at the transfer's measured rate.
+#define READAHEAD_LEAD 1000
+
+// Pages behind the client are released from the page cache in pieces at least this large.
+#define DROP_CHUNK ( 1024 * 1024 )
+
+// See Transfer_configure_hints(). Zero disables each hint.
+static off_t readahead_limit = 0;
+static off_t drop_size       = 0;
+
+// See Transfer_configure_spare_sockets(). Each thread (or worker process) has its own spare.
+static int keep_spare_sockets = 0;
+static _Thread_local int spare_socket = -1;
+
+
+long long monotonic_milliseconds( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+long long monotonic_microseconds( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+//
+// Append a record about this transfer to the event log.
+//
+static void log_transfer_event(
+    const Transfer *object,
+    log_event event,
+    uint32_t block,
+    unsigned long long value,
+    uint32_t extra,
+    unsigned code,
+    const char *text )
+{
+    log_record record;
+
+    record.event       = (uint16_t)event;
+    record.transfer_id = object->transfer_id;
+    record.block       = block;
+    record.value       = value;
+    record.extra       = extra;
+    record.code        = code > 0xFFFF ? 0xFFFF : (uint16_t)code;
+    strncpy( record.text, text, sizeof( record.text ) - 1 );
+    record.text[sizeof( record.text ) - 1] = '\0';
+    EventLog_write( &record );
+}
+
+
+//
+// Write the transfer's packet history. Called when the transfer fails or a dump is requested.
+//
+static void dump_recording( Transfer *object )
+{
+    struct sockaddr_in6 local_address;
+    socklen_t address_length = sizeof( local_address );
+
+    memset( &local_address, 0, sizeof( local_address ) );
+    getsockname( object->socket_handle, (struct sockaddr *)&local_address, &address_length );
+    if( FlightRecorder_dump(
+            &object->recorder, object->transfer_id, &local_address, &object->client_address )
+            == -1 ) {
+        EventLog_system_error( "Unable to write flight recording", errno );
+    }
+}
+
+
+//
+// Append a name/value pair to the OACK packet.
+//
+static void append_text_option( Transfer *object, const char *name, const char *value )
+{
+    int written = snprintf(
+        (char *)object->oack + object->oack_length,
+        sizeof( object->oack ) - object->oack_length,
+        "%s%c%s",
+        name, '\0', value );
+
+    if( written > 0 && object->oack_length + (size_t)written + 1 <= sizeof( object->oack ) ) {
+        object->oack_length += (size_t)written + 1;
+    }
+}
+
+
+static void append_option( Transfer *object, const char *name, unsigned long long value )
+{
+    char text[24];
+
+    snprintf( text, sizeof( text ), "%llu", value );
+    append_text_option( object, name, text );
+}
+
+
+//
+// Decide which of the requested options to accept and build the OACK packet for them.
+//
+static void negotiate_options( Transfer *object, const tftp_request *request )
+{
+    char text[48];
+
+    object->oack[0] = 0x00;
+    object->oack[1] = OPCODE_OACK;
+    object->oack_length = 2;
+
+    if( request->block_size >= 8 ) {
+        object->block_size =
+            request->block_size > MAX_BLOCK_SIZE ? MAX_BLOCK_SIZE : request->block_size;
+        append_option( object, "blksize", object->block_size );
+    }
+    if( request->window_size >= 1 ) {
+        object->window_size =
+            request->window_size > MAX_WINDOW_SIZE ? MAX_WINDOW_SIZE : request->window_size;
+        append_option( object, "windowsize", object->window_size );
+    }
+    if( request->timeout >= 1 && request->timeout <= 255 ) {
+        object->timeout = (int)request->timeout * 1000;
+        append_option( object, "timeout", request->timeout );
+    }
+    if( request->tsize_requested ) {
+        append_option( object, "tsize", (unsigned long long)object->file_size );
+    }
+    if( object->compressed ) {
+        append_text_option( object, "compress", "zlib" );
+    }
+    if( object->signatures ) {
+        snprintf( text, sizeof( text ), "crc32c:%u:%lld",
+                  SIGNATURE_BLOCK_SIZE, (long long)object->source_size );
+        append_text_option( object, "signatures", text );
+    }
+    if( object->ranges != NULL ) {
+        append_option( object, "ranges", (unsigned long long)object->source_size );
+    }
+    if( request->digest_requested && object->digest != -1 ) {
+        snprintf( text, sizeof( text ), "crc32c:%08x", (unsigned)object->digest );
+        append_text_option( object, "digest", text );
+    }
+
+    // If no options were accepted, the transfer starts with DATA as in RFC 1350.
+    if( object->oack_length == 2 ) object->oack_length = 0;
+}
+
+
+//
+// Close the file unless it belongs to the policy, then drop the reference to the policy.
+//
+static void release_file( Transfer *object )
+{
+    if( object->file_handle != -1 && !object->file_shared ) close( object->file_handle );
+    if( object->content != NULL ) VirtualContent_release( object->content );
+    free( object->ranges );
+    object->file_handle = -1;
+    object->mapped  = NULL;
+    object->content = NULL;
+    object->ranges  = NULL;
+    Policy_release( object->policy );
+    object->policy = NULL;
+}
+
+
+//
+// Turn the block ranges of a request into the parts of the file to send. Ranges beyond the end
+// of the file are dropped. Returns -1 if memory ran out.
+//
+static int prepare_ranges( Transfer *object, const tftp_request *request )
+{
+    off_t  offset;
+    off_t  end;
+    off_t  position = 0;
+    size_t i;
+
+    if( (object->ranges = malloc( request->range_count * sizeof( file_range ) )) == NULL ) {
+        return -1;
+    }
+    for( i = 0; i < request->range_count; ++i ) {
+        offset = (off_t)request->ranges[i].first * request->range_unit;
+        end    = ( (off_t)request->ranges[i].last + 1 ) * request->range_unit;
+        if( offset >= object->source_size ) break;
+        if( end > object->source_size ) end = object->source_size;
+        object->ranges[i].offset   = offset;
+        object->ranges[i].length   = end - offset;
+        object->ranges[i].position = position;
+        position += end - offset;
+    }
+    object->range_count = i;
+    object->file_size   = position;
+    return 0;
+}
+
+
+void Transfer_configure_hints( off_t limit, off_t size )
+{
+    readahead_limit = limit;
+    drop_size       = size;
+}
+
+
+//
+// Ask the kernel to read the next part of the file into the page cache before the transfer
+// needs it, and to drop the part the client already has if the file is too big to be worth
+// keeping. The read ahead window covers READAHEAD_LEAD ms at the rate the client has managed
+// so far; before anything is acknowledged it is a few windows of the negotiated size. Windows
+// are issued when less than half of the current one is left, so a transfer costs a system call
+// every few hundred kilobytes at most.
+//
+static void advance_hints( Transfer *object, long long now )
+{
+    off_t sent  = (off_t)( object->next_block - 1 ) * object->block_size;
+    off_t acked = (off_t)object->acked_block * object->block_size;
+    off_t window;
+    off_t behind;
+    long long elapsed = now - object->start_time;
+
+    if( !object->hinted ) return;
+    if( readahead_limit > 0 && object->prefetched < object->file_size ) {
+        window = (off_t)object->block_size * object->window_size * 16;
+        if( elapsed > 0 && acked * READAHEAD_LEAD / elapsed > window ) {
+            window = acked * READAHEAD_LEAD / elapsed;
+        }
+        if( window < MIN_READAHEAD ) window = MIN_READAHEAD;
+        if( window > readahead_limit ) window = readahead_limit;
+        if( object->prefetched < sent ) object->prefetched = sent;
+        if( object->prefetched - sent < window / 2 ) {
+            posix_fadvise( object->file_handle, object->prefetched, window, POSIX_FADV_WILLNEED );
+            object->prefetched += window;
+        }
+    }
+
+    // Acknowledged blocks are never sent again.
+    if( drop_size > 0 && object->file_size >= drop_size ) {
+        behind = acked & ~(off_t)( DROP_CHUNK - 1 );
+        if( behind - object->dropped >= DROP_CHUNK ) {
+            posix_fadvise( object->file_handle,
+                           object->dropped, behind - object->dropped, POSIX_FADV_DONTNEED );
+            object->dropped = behind;
+        }
+    }
+}
+
+
+//
+// Give the kernel what it needs to know about how the file will be read. Whole files are read
+// from start to end, so the kernel's own read ahead is widened. The blocks asked for with the
+// ranges option are scattered and few, so they are all asked for at once.
+//
+static void start_hints( Transfer *object, long long now )
+{
+    size_t i;
+
+    if( object->file_handle == -1 || object->content != NULL ) return;
+    if( object->ranges != NULL ) {
+        if( readahead_limit == 0 ) return;
+        for( i = 0; i < object->range_count; ++i ) {
+            posix_fadvise( object->file_handle, object->ranges[i].offset,
+                           object->ranges[i].length, POSIX_FADV_WILLNEED );
+        }
+        return;
+    }
+    object->hinted = 1;
+    posix_fadvise( object->file_handle, 0, 0, POSIX_FADV_SEQUENTIAL );
+    advance_hints( object, now );
+}
+
+
+void Transfer_configure_spare_sockets( int enabled )
+{
+    keep_spare_sockets = enabled;
+}
+
+
+void Transfer_prepare_socket( void )
+{
+    struct sockaddr_in6 address;
+    int socket_handle;
+
+    if( !keep_spare_sockets || spare_socket != -1 ) return;
+    if( (socket_handle = socket( PF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0 )) == -1 ) return;
+
+    // Binding now takes the ephemeral port allocation off the path of the next request.
+    memset( &address, 0, sizeof( address ) );
+    address.sin6_family = AF_INET6;
+    address.sin6_addr   = in6addr_any;
+    if( bind( socket_handle, (struct sockaddr *)&address, sizeof( address ) ) == -1 ) {
+        close( socket_handle );
+        return;
+    }
+    spare_socket = socket_handle;
+}
+
+
+int Transfer_socket( const struct sockaddr_in6 *client_address )
+{
+    int socket_handle;
+
+    if( (socket_handle = SocketPool_take( client_address, monotonic_milliseconds( ) )) != -1 ) {
+        return socket_handle;
+    }
+    if( (socket_handle = spare_socket) != -1 ) {
+        spare_socket = -1;
+        return socket_handle;
+    }
+    return socket( PF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0 );
+}
+
+
+void Transfer_discard_socket( int socket_handle, const struct sockaddr_in6 *client_address )
+{
+    if( SocketPool_give_back( socket_handle, client_address, 0 ) == -1 ) close( socket_handle );
+}
+
+
+//
+// Check the client, parse the request, open the file, and negotiate: everything Transfer_open()
+// and Transfer_resume() have in common. The parsed request is left in request. If compress_now
+// is non-zero a compressed copy that isn't ready is made at once rather than sending the file.
+//
+static int prepare_transfer(
+    Transfer *object,
+    int socket_handle,
+    const struct sockaddr_in6 *client_address,
+    const unsigned char *request_buffer,
+    size_t request_count,
+    long long received_time,
+    int compress_now,
+    tftp_request *request )
+{
+    int error_code;
+    int delta;
+
+    memset( object, 0, sizeof( *object ) );
+    object->socket_handle  = socket_handle;
+    object->client_address = *client_address;
+    object->file_handle    = -1;
+    object->digest         = -1;
+    object->received_time  = received_time;
+    object->transfer_id    = EventLog_transfer_id( );
+    object->policy         = Policy_acquire( );
+    object->request_count  =
+        request_count > sizeof( object->request ) ? sizeof( object->request ) : request_count;
+    memcpy( object->request, request_buffer, object->request_count );
+
+    if( !Policy_admit( object->policy, client_address ) ) {
+        send_error( socket_handle, client_address, ERROR_ACCESS_VIOLATION, "Access denied" );
+        log_transfer_event(
+            object, LOG_TRANSFER_REJECTED, 0, 0, 0, ERROR_ACCESS_VIOLATION, "client refused" );
+        Policy_release( object->policy );
+        return -1;
+    }
+    if( (error_code = parse_request( request_buffer, request_count, request )) != 0 ) {
+        send_error( socket_handle, client_address, error_code, "Malformed or unsupported request" );
+        log_transfer_event( object, LOG_TRANSFER_REJECTED, 0, 0, 0, (unsigned)error_code, "" );
+        Policy_release( object->policy );
+        return -1;
+    }
+    delta = request->signatures_requested || request->range_count > 0;
+    error_code = Policy_render(
+        object->policy, request->file_name, client_address, &object->content );
+    if( error_code == 0 && object->content != NULL ) {
+        object->file_size = (off_t)object->content->size;
+        object->digest    = object->content->digest;
+    }
+    else if( error_code == 0 ) {
+        error_code = Policy_open( object->policy,
+                                  request->file_name,
+                                  &object->file_handle,
+                                  &object->mapped,
+                                  &object->file_size,
+                                  &object->file_shared,
+                                  request->digest_requested ? &object->digest : NULL,
+                                  request->compress_requested && !delta ? &object->content : NULL,
+                                  request->signatures_requested ? &object->content : NULL );
+        object->source_size = object->file_size;
+
+        // A resumed compressed transfer can't wait for the compressor thread to make the copy.
+        if( error_code == 0 && compress_now &&
+            object->content == NULL && object->file_handle != -1 ) {
+            Policy_compress( object->policy, request->file_name, &object->content );
+        }
+    }
+    if( error_code == 0 && object->content != NULL && object->file_handle != -1 ) {
+        object->file_size  = (off_t)object->content->size;
+        object->signatures = request->signatures_requested;
+        object->compressed = !object->signatures;
+    }
+    else if( error_code == 0 && request->range_count > 0 &&
+             ( object->file_handle != -1 || object->mapped != NULL ) &&
+             prepare_ranges( object, request ) == -1 ) {
+        error_code = ERROR_UNDEFINED;
+    }
+    if( error_code != 0 ) {
+        send_error( socket_handle, client_address, error_code,
+                    error_code == ERROR_FILE_NOT_FOUND ? "File not found" :
+                    error_code == ERROR_UNDEFINED ? "Out of memory" : "Access violation" );
+        log_transfer_event(
+            object, LOG_TRANSFER_REJECTED, 0, 0, 0, (unsigned)error_code, request->file_name );
+        release_file( object );
+        return -1;
+    }
+
+    object->block_size  = DEFAULT_BLOCK_SIZE;
+    object->window_size = 1;
+    object->timeout     = DEFAULT_TIMEOUT * 1000;
+    negotiate_options( object, request );
+    object->last_block  = (uint32_t)( object->file_size / object->block_size ) + 1;
+    object->next_block  = 1;
+    object->acked_block = 0;
+
+    if( (object->packet = malloc( object->block_size + 4 )) == NULL ) {
+        send_error( socket_handle, client_address, ERROR_UNDEFINED, "Out of memory" );
+        release_file( object );
+        return -1;
+    }
+
+    // Connecting the socket makes the kernel discard datagrams from other ports or hosts, so
+    // packets from a stray transfer ID never reach the state machine.
+    if( connect( socket_handle,
+                 (const struct sockaddr *)client_address, sizeof( *client_address ) ) == -1 ||
+        fcntl( socket_handle, F_SETFL, fcntl( socket_handle, F_GETFL ) | O_NONBLOCK ) == -1 ) {
+        send_error( socket_handle, client_address, ERROR_UNDEFINED, "Unable to prepare socket" );
+        free( object->packet );
+        release_file( object );
+        return -1;
+    }
+    XdpPath_attach( &object->flow, socket_handle, client_address, object->block_size + 4 );
+    object->status = TRANSFER_ACTIVE;
+    FlightRecorder_initialize( &object->recorder );
+    return 0;
+}
+
+
+int Transfer_open(
+    Transfer *object,
+    int socket_handle,
+    const struct sockaddr_in6 *client_address,
+    const unsigned char *request_buffer,
+    size_t request_count,
+    long long received_time )
+{
+    tftp_request request;
+
+    if( prepare_transfer( object, socket_handle, client_address,
+                          request_buffer, request_count, received_time, 0, &request ) == -1 ) {
+        return -1;
+    }
+    FlightRecorder_record( &object->recorder, FLIGHT_RRQ, 0, 0, request_count );
+    Metrics_count( METRIC_TRANSFERS_STARTED, 1 );
+    log_transfer_event(
+        object, LOG_TRANSFER_START, object->block_size, (unsigned long long)object->file_size,
+        object->window_size, 0, request.file_name );
+    return 0;
+}
+
+
+//
+// Copy data from the parts of the file asked for with the ranges option, starting at the given
+// position in the data sent. Returns the number of bytes copied, or -1 if the file could not be
+// read (or has shrunk since it was opened).
+//
+static ssize_t read_ranges( Transfer *object, unsigned char *buffer, off_t position, size_t size )
+{
+    const file_range *range;
+    size_t low  = 0;
+    size_t high = object->range_count;
+    size_t middle;
+    size_t total = 0;
+    size_t part;
+    off_t  skip;
+
+    // Find the last part that starts at or before the position.
+    while( high - low > 1 ) {
+        middle = low + ( high - low ) / 2;
+        if( object->ranges[middle].position <= position ) low = middle; else high = middle;
+    }
+    for( ; low < object->range_count && total < size; ++low ) {
+        range = &object->ranges[low];
+        skip  = position + (off_t)total - range->position;
+        if( skip >= range->length ) continue;
+        part  = size - total;
+        if( (off_t)part > range->length - skip ) part = (size_t)( range->length - skip );
+        if( object->mapped != NULL ) {
+            memcpy( buffer + total, object->mapped + range->offset + skip, part );
+        }
+        else if( pread( object->file_handle, buffer + total, part, range->offset + skip ) !=
+                 (ssize_t)part ) {
+            return -1;
+        }
+        total += part;
+    }
+    return (ssize_t)total;
+}
+
+
+//
+// Send one DATA packet. Returns -1 if the file could not be read.
+//
+static int send_block( Transfer *object, uint32_t block )
+{
+    off_t   offset = (off_t)( block - 1 ) * object->block_size;
+    ssize_t count;
+    unsigned char *packet = NULL;
+    uint64_t frame;
+
+    // The packet is built in an AF_XDP frame if the transfer can have one.
+    if( object->flow.active ) packet = XdpPath_frame( &object->flow, &frame );
+    if( packet == NULL ) packet = object->packet;
+
+    // Rendered files and files in an archive are copied from memory; everything else is read
+    // from the file.
+    if( object->content != NULL || ( object->mapped != NULL && object->ranges == NULL ) ) {
+        count = offset >= object->file_size ? 0 : (ssize_t)( object->file_size - offset );
+        if( count > (ssize_t)object->block_size ) count = (ssize_t)object->block_size;
+        memcpy( packet + 4,
+                ( object->content != NULL ? object->content->data : object->mapped ) + offset,
+                (size_t)count );
+    }
+    else if( object->ranges != NULL ) {
+        count = read_ranges( object, packet + 4, offset, object->block_size );
+    }
+    else {
+        count = pread( object->file_handle, packet + 4, object->block_size, offset );
+    }
+    if( count == -1 ) {
+        if( packet != object->packet ) XdpPath_discard( frame );
+        return -1;
+    }
+
+    packet[0] = 0x00;
+    packet[1] = OPCODE_DATA;
+    packet[2] = (unsigned char)( ( block >> 8 ) & 0xFF );
+    packet[3] = (unsigned char)( block & 0xFF );
+
+    // A failed send is treated like a lost packet; the retransmission timer recovers.
+    if( packet != object->packet ) {
+        XdpPath_send( &object->flow, frame, (size_t)count + 4 );
+        Metrics_count( METRIC_XDP_PACKETS_SENT, 1 );
+    }
+    else {
+        send( object->socket_handle, packet, (size_t)count + 4, 0 );
+    }
+    object->bytes_sent += count;
+    FlightRecorder_record(
+        &object->recorder,
+        FLIGHT_DATA,
+        FLIGHT_SENT | ( block < object->next_block ? FLIGHT_RETRANSMIT : 0 ),
+        block,
+        (size_t)count + 4 );
+    Metrics_count( METRIC_DATA_PACKETS_SENT, 1 );
+    Metrics_count( METRIC_BYTES_SENT, (unsigned long long)count );
+    return 0;
+}
+
+
+//
+// Send every block that fits in the window and has not been sent yet.
+//
+static transfer_status send_window( Transfer *object, long long now )
+{
+    while( object->next_block <= object->last_block &&
+           object->next_block - object->acked_block <= object->window_size ) {
+        if( send_block( object, object->next_block ) == -1 ) {
+            if( object->flow.active ) XdpPath_flush( );
+            send_error(
+                object->socket_handle, &object->client_address, ERROR_UNDEFINED, "Read error" );
+            FlightRecorder_record( &object->recorder, FLIGHT_ERROR, FLIGHT_SENT, 0, 4 );
+            return object->status = TRANSFER_FAILED;
+        }
+        ++object->next_block;
+    }
+    if( object->flow.active ) XdpPath_flush( );
+    object->deadline = now + object->timeout;
+    return object->status;
+}
+
+
+transfer_status Transfer_start( Transfer *object, long long now )
+{
+    object->start_time = now;
+    if( object->oack_length > 0 ) {
+        send( object->socket_handle, object->oack, object->oack_length, 0 );
+        FlightRecorder_record(
+            &object->recorder, FLIGHT_OACK, FLIGHT_SENT, 0, object->oack_length );
+        object->oack_pending = 1;
+        object->deadline = now + object->timeout;
+    }
+    else {
+        send_window( object, now );
+    }
+    Metrics_observe_first_block( monotonic_microseconds( ) - object->received_time );
+
+    // The hints only matter to later blocks, so they wait until the client has its first.
+    start_hints( object, now );
+    return object->status;
+}
+
+
+//
+// Process an acknowledgement. The 16 bit block number is mapped onto the internal 32 bit
+// numbering relative to the highest block already acknowledged.
+//
+static transfer_status handle_ack( Transfer *object, unsigned wire_block, long long now )
+{
+    uint16_t advance;
+
+    if( object->oack_pending ) {
+        if( wire_block != 0 ) return object->status;
+        object->oack_pending = 0;
+        object->retries = 0;
+        XdpPath_attach( &object->flow, object->socket_handle, &object->client_address,
+                        object->block_size + 4 );
+        return send_window( object, now );
+    }
+
+    // Duplicate and stray ACKs are ignored to avoid the Sorcerer's Apprentice problem.
+    advance = (uint16_t)( wire_block - ( object->acked_block & 0xFFFF ) );
+    if( advance == 0 || advance > object->next_block - 1 - object->acked_block ) {
+        return object->status;
+    }
+    object->acked_block += advance;
+    object->retries = 0;
+
+    // By now the kernel knows the client's link layer address if it is a neighbor.
+    XdpPath_attach(
+        &object->flow, object->socket_handle, &object->client_address, object->block_size + 4 );
+
+    if( object->acked_block == object->last_block ) {
+        return object->status = TRANSFER_DONE;
+    }
+
+    // An acknowledgement short of the window means the client lost the next block (RFC 7440).
+    // The window starts again there rather than waiting for the timeout.
+    if( object->acked_block < object->next_block - 1 ) {
+        object->next_block = object->acked_block + 1;
+    }
+    send_window( object, now );
+    advance_hints( object, now );
+    return object->status;
+}
+
+
+//
+// Resend everything that is outstanding, or give up if the client has gone silent.
+//
+static transfer_status handle_timeout( Transfer *object, long long now )
+{
+    uint32_t block;
+
+    Metrics_count( METRIC_TIMEOUTS, 1 );
+    log_transfer_event(
+        object, LOG_TIMEOUT, object->acked_block + 1, 0, 0, (unsigned)object->retries + 1, "" );
+    if( ++object->retries > MAX_RETRIES ) {
+        return object->status = TRANSFER_FAILED;
+    }
+
+    if( object->oack_pending ) {
+        send( object->socket_handle, object->oack, object->oack_length, 0 );
+        FlightRecorder_record( &object->recorder,
+                               FLIGHT_OACK,
+                               FLIGHT_SENT | FLIGHT_RETRANSMIT,
+                               0,
+                               object->oack_length );
+        ++object->retransmissions;
+        Metrics_count( METRIC_RETRANSMISSIONS, 1 );
+    }
+    else {
+        for( block = object->acked_block + 1; block < object->next_block; ++block ) {
+            if( send_block( object, block ) == -1 ) {
+                object->status = TRANSFER_FAILED;
+                break;
+            }
+            ++object->retransmissions;
+            Metrics_count( METRIC_RETRANSMISSIONS, 1 );
+        }
+        if( object->flow.active ) XdpPath_flush( );
+        if( object->status == TRANSFER_FAILED ) return object->status;
+    }
+    object->deadline = now + object->timeout;
+    return object->status;
+}
+
+
+transfer_status Transfer_service( Transfer *object, long long now )
+{
+    unsigned char incoming[4 + 128];
+    ssize_t count;
+
+    while( object->status == TRANSFER_ACTIVE &&
+           (count = recv(
+                object->socket_handle, incoming, sizeof( incoming ), MSG_DONTWAIT )) != -1 ) {
+
+        if( count < 4 || incoming[0] != 0 ) continue;
+
+        switch( incoming[1] ) {
+        case OPCODE_ACK:
+            FlightRecorder_record( &object->recorder, FLIGHT_ACK, 0,
+                                   ( (unsigned)incoming[2] << 8 ) | incoming[3], (size_t)count );
+            handle_ack( object, ( (unsigned)incoming[2] << 8 ) | incoming[3], now );
+            break;
+
+        case OPCODE_ERROR:
+            // The client has given up (or refused our options). No reply is sent.
+            FlightRecorder_record( &object->recorder, FLIGHT_ERROR, 0, 0, (size_t)count );
+            object->status = TRANSFER_FAILED;
+            break;
+
+        default:
+            send_error( object->socket_handle, &object->client_address,
+                        ERROR_ILLEGAL_OPERATION, "Unexpected packet" );
+            FlightRecorder_record( &object->recorder, FLIGHT_ERROR, FLIGHT_SENT, 0, 4 );
+            object->status = TRANSFER_FAILED;
+            break;
+        }
+    }
+
+    if( object->status == TRANSFER_ACTIVE && now >= object->deadline ) {
+        handle_timeout( object, now );
+    }
+    if( FlightRecorder_dump_pending( &object->recorder ) ) dump_recording( object );
+    return object->status;
+}
+
+
+void Transfer_close( Transfer *object )
+{
+    if( object->status != TRANSFER_DONE ) dump_recording( object );
+    FlightRecorder_destroy( &object->recorder );
+    Metrics_count(
+        object->status == TRANSFER_DONE ? METRIC_TRANSFERS_COMPLETED : METRIC_TRANSFERS_FAILED, 1 );
+    log_transfer_event(
+        object,
+        object->status == TRANSFER_DONE ? LOG_TRANSFER_DONE : LOG_TRANSFER_FAILED,
+        object->acked_block,
+        (unsigned long long)object->bytes_sent,
+        (uint32_t)( monotonic_milliseconds( ) - object->start_time ),
+        object->retransmissions,
+        "" );
+
+    // A file big enough to be dropped behind the client is dropped entirely once it is sent.
+    if( object->hinted && drop_size > 0 && object->file_size >= drop_size ) {
+        posix_fadvise( object->file_handle, object->dropped, 0, POSIX_FADV_DONTNEED );
+    }
+    release_file( object );
+
+    // The client may still send (or resend) packets for this transfer for a while. Until it
+    // stops, the socket is kept from a new transfer with the same client address and port.
+    if( SocketPool_give_back( object->socket_handle, &object->client_address,
+                              monotonic_milliseconds( ) +
+                              (long long)object->timeout * MAX_RETRIES ) == -1 ) {
+        close( object->socket_handle );
+    }
+    free( object->packet );
+    object->packet = NULL;
+}
+
+
+//
+// Identify what a transfer is sending, so that the process it is handed to can tell whether it
+// would send the same thing (see transfer_snapshot).
+//
+static void identify_source(
+    const Transfer *object,
+    uint64_t *device,
+    uint64_t *inode,
+    int64_t *modified,
+    uint32_t *digest )
+{
+    struct stat status;
+
+    *device   = 0;
+    *inode    = 0;
+    *modified = 0;
+    *digest   = 0;
+    if( object->file_handle != -1 && fstat( object->file_handle, &status ) == 0 ) {
+        *device   = (uint64_t)status.st_dev;
+        *inode    = (uint64_t)status.st_ino;
+        *modified = (int64_t)status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+    }
+    if( object->content != NULL ) {
+        *digest = crc32c( 0, object->content->data, object->content->size );
+    }
+    else if( object->mapped != NULL ) {
+        *digest = crc32c( 0, object->mapped, (size_t)object->source_size );
+    }
+}
+
+
+void Transfer_snapshot( const Transfer *object, transfer_snapshot *snapshot )
+{
+    memset( snapshot, 0, sizeof( *snapshot ) );
+    snapshot->client_address  = object->client_address;
+    snapshot->request_count   = (uint32_t)object->request_count;
+    memcpy( snapshot->request, object->request, object->request_count );
+    snapshot->transfer_id     = object->transfer_id;
+    snapshot->file_size       = (int64_t)object->file_size;
+    identify_source( object, &snapshot->file_device, &snapshot->file_inode,
+                     &snapshot->file_modified, &snapshot->content_digest );
+    snapshot->compressed      = object->compressed;
+    snapshot->block_size      = object->block_size;
+    snapshot->window_size     = object->window_size;
+    snapshot->timeout         = object->timeout;
+    snapshot->retries         = object->retries;
+    snapshot->oack_pending    = object->oack_pending;
+    snapshot->next_block      = object->next_block;
+    snapshot->acked_block     = object->acked_block;
+    snapshot->deadline        = object->deadline;
+    snapshot->received_time   = object->received_time;
+    snapshot->start_time      = object->start_time;
+    snapshot->bytes_sent      = object->bytes_sent;
+    snapshot->retransmissions = object->retransmissions;
+    snapshot->socket_handle   = object->socket_handle;
+}
+
+
+void Transfer_detach( Transfer *object )
+{
+    FlightRecorder_destroy( &object->recorder );
+    log_transfer_event(
+        object,
+        LOG_TRANSFER_HANDED_OFF,
+        object->acked_block,
+        (unsigned long long)object->bytes_sent,
+        (uint32_t)( monotonic_milliseconds( ) - object->start_time ),
+        object->retransmissions,
+        "" );
+    release_file( object );
+
+    // The other process's copy of the socket is still connected to the client, so the socket
+    // can't be given back (which would disconnect it).
+    SocketPool_forget( object->socket_handle );
+    close( object->socket_handle );
+    free( object->packet );
+    object->packet = NULL;
+}
+
+
+int Transfer_resume( Transfer *object, const transfer_snapshot *snapshot )
+{
+    tftp_request request;
+    uint64_t device;
+    uint64_t inode;
+    int64_t  modified;
+    uint32_t digest;
+
+    if( prepare_transfer( object,
+                          snapshot->socket_handle,
+                          &snapshot->client_address,
+                          snapshot->request,
+                          snapshot->request_count,
+                          snapshot->received_time,
+                          snapshot->compressed,
+                          &request ) == -1 ) {
+        return -1;
+    }
+
+    // Blocks already sent must mean the same thing they meant to the old process.
+    identify_source( object, &device, &inode, &modified, &digest );
+    if( (int64_t)object->file_size != snapshot->file_size ||
+        object->block_size  != snapshot->block_size ||
+        object->window_size != snapshot->window_size ||
+        object->timeout     != snapshot->timeout ||
+        device   != snapshot->file_device ||
+        inode    != snapshot->file_inode ||
+        modified != snapshot->file_modified ||
+        digest   != snapshot->content_digest ||
+        snapshot->acked_block >= snapshot->next_block ||
+        snapshot->next_block > object->last_block + 1 ) {
+        send_error( object->socket_handle, &object->client_address,
+                    ERROR_UNDEFINED, "File changed during server restart" );
+        log_transfer_event(
+            object, LOG_TRANSFER_REJECTED, 0, 0, 0, ERROR_UNDEFINED, request.file_name );
+        FlightRecorder_destroy( &object->recorder );
+        free( object->packet );
+        release_file( object );
+        return -1;
+    }
+
+    object->retries         = snapshot->retries;
+    object->oack_pending    = snapshot->oack_pending;
+    object->next_block      = snapshot->next_block;
+    object->acked_block     = snapshot->acked_block;
+    object->deadline        = snapshot->deadline;
+    object->start_time      = snapshot->start_time;
+    object->bytes_sent      = snapshot->bytes_sent;
+    object->retransmissions = snapshot->retransmissions;
+    FlightRecorder_record( &object->recorder, FLIGHT_RRQ, 0, 0, object->request_count );
+    Metrics_count( METRIC_TRANSFERS_STARTED, 1 );
+    log_transfer_event( object, LOG_TRANSFER_RESUMED, object->acked_block,
+                        snapshot->transfer_id, 0, 0, request.file_name );
+    start_hints( object, monotonic_milliseconds( ) );
+    return 0;
+}
@@ -0,0 +1,264 @@
+/*!
+ * \file transfer.h
+ * \author Peter C. Chapin
+ * \brief Interface to the server side transfer state machine.
+ *
+ */
+
+#ifndef TRANSFER_H_INCLUDED
+#define TRANSFER_H_INCLUDED
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "flight_recorder.h"
+#include "server.h"
+#include "xdp_path.h"
+
+//! The state of a transfer as seen by whatever is driving it.
+typedef enum {
+    TRANSFER_ACTIVE,   //!< The transfer needs more service.
+    TRANSFER_DONE,     //!< The final block was acknowledged.
+    TRANSFER_FAILED    //!< The transfer was abandoned.
+} transfer_status;
+
+//! A part of the file sent in answer to the ranges option.
+typedef struct {
+    off_t offset;    //!< Where the part starts in the file.
+    off_t length;    //!< Number of bytes in the part.
+    off_t position;  //!< Where the part starts in the data sent to the client.
+} file_range;
+
+//! One file being sent to one client.
+/*!
+ * A Transfer is a non-blocking state machine. It never waits; instead it tells its driver
+ * when it next needs attention (its deadline) and it is serviced whenever its socket becomes
+ * readable or its deadline passes. This allows the same code to be driven by the blocking
+ * send_file() loop in a forked child or by an event loop serving many transfers at once.
+ *
+ * A client may ask for the file's CRC-32C with the nonstandard option "digest" = "crc32c". The
+ * OACK then carries "digest" = "crc32c:<8 hex digits>" so the client can check the file as it
+ * is written. Digests are cached with the file, so this costs no extra pass over the data
+ * after the first request.
+ *
+ * Similarly a client may offer "compress" = "zlib" (a comma separated list of formats). If the
+ * file compresses, the server answers "compress" = "zlib" and sends a zlib stream made once and
+ * kept in memory with the file. The tsize option then gives the size of the stream, while the
+ * digest is still that of the file itself. The stream is made in the background after the
+ * first such request; requests that come before it is ready get the file uncompressed.
+ *
+ * Two more options let a client bring an old copy of a file up to date by fetching only the
+ * blocks that changed. "signatures" = "crc32c" asks for the file's signature list (see
+ * Policy_open()) instead of the file; the OACK carries "signatures" = "crc32c:<block size>:<file
+ * size>". The client compares the list with its own copy and asks for the blocks that differ
+ * with "ranges" = "<block size>:<first>[-<last>],...". Those blocks, cut off at the end of the
+ * file, are sent one after the other, and the OACK carries "ranges" = "<file size>". If either
+ * option is not acknowledged the whole file is sent as usual. Neither is combined with
+ * compression.
+ *
+ * Blocks are numbered internally with 32 bits so the 16 bit block number on the wire may roll
+ * over to zero during large transfers. The window of unacknowledged blocks is resent in full
+ * when the deadline passes (RFC 7440).
+ *
+ * Whole files read from disk are hinted to the kernel as sequential. If configured with
+ * Transfer_configure_hints(), the part of the file the transfer is about to send is also read
+ * into the page cache ahead of time, and huge files are dropped from the page cache behind the
+ * client so that one large transfer doesn't evict the small files many clients want.
+ *
+ * If the server sends through AF_XDP (see xdp_path.h) and the client is a neighbor on its
+ * interface, DATA packets are built in the AF_XDP socket's frames instead of the transfer's
+ * packet buffer. The socket remains the transfer's transfer ID and receives the ACKs.
+ *
+ * A transfer can move to another server process (see handoff.h). Its socket goes with it, so
+ * the client sees the same transfer ID, and so do the request and the progress made so far. The
+ * new process opens the file again and carries on from the last block acknowledged; nothing is
+ * resent until the deadline the old process set passes.
+ */
+typedef struct Transfer {
+    int       socket_handle;       //!< Connected socket for this transfer (non-blocking).
+    struct sockaddr_in6 client_address;  //!< Address of the client.
+    struct Policy *policy;         //!< The access policy the transfer was admitted under.
+    int       file_handle;         //!< The file being sent.
+    const unsigned char *mapped;   //!< The file in the policy's archive, or NULL.
+    int       file_shared;         //!< Non-zero if the file descriptor belongs to the policy.
+    struct VirtualContent *content;  //!< Data sent instead of file_handle, or NULL.
+    off_t     file_size;           //!< Number of bytes to send.
+    off_t     source_size;         //!< Size of the file itself.
+    long long digest;              //!< CRC-32C of the file, or -1 if not known.
+    int       compressed;          //!< Non-zero if content is a compressed copy of the file.
+    int       signatures;          //!< Non-zero if content is the file's signature list.
+    file_range *ranges;            //!< Parts of the file to send instead of all of it, or NULL.
+    size_t    range_count;         //!< Number of entries in ranges.
+    unsigned  block_size;          //!< Negotiated block size.
+    unsigned  window_size;         //!< Negotiated window size.
+    int       timeout;             //!< Retransmission timeout in milliseconds.
+    int       retries;             //!< Consecutive timeouts without progress.
+    uint32_t  next_block;          //!< Next block that has never been sent.
+    uint32_t  acked_block;         //!< Highest block acknowledged by the client.
+    uint32_t  last_block;          //!< Number of the final (short) block.
+    int       oack_pending;        //!< Non-zero while waiting for the ACK of an OACK.
+    size_t    oack_length;         //!< Length of the OACK packet.
+    long long deadline;            //!< Monotonic time (ms) at which to retransmit.
+    size_t    request_count;       //!< Length of the request.
+    unsigned char  request[REQUEST_BUFFER_LENGTH];  //!< The request, kept for a handoff.
+    unsigned char  oack[REQUEST_BUFFER_LENGTH];  //!< The OACK packet, kept for resending.
+    unsigned char *packet;         //!< Buffer for one DATA packet.
+    xdp_flow  flow;                //!< How DATA packets are sent through AF_XDP, if they are.
+    transfer_status status;        //!< Current status.
+    int       hinted;              //!< Non-zero if page cache hints are given for the file.
+    off_t     prefetched;          //!< End of the part of the file asked to be read ahead.
+    off_t     dropped;             //!< End of the part of the file dropped from the page cache.
+
+    // Statistics.
+    uint32_t  transfer_id;         //!< Identifies the transfer in the event log.
+    FlightRecorder recorder;       //!< Packet history (empty unless recording is enabled).
+    long long received_time;       //!< Monotonic time (us) at which the request was received.
+    long long start_time;          //!< Monotonic time (ms) at which the transfer started.
+    long long bytes_sent;          //!< Data bytes sent, including retransmissions.
+    unsigned  retransmissions;     //!< Number of DATA or OACK packets resent.
+} Transfer;
+
+//! The state of a transfer in progress as it is handed to another server process.
+/*!
+ * Monotonic times are system wide, so they are passed as they are. The file is identified by
+ * its device, inode, and modification time, or, for content made in memory (compressed copies,
+ * signature lists, and virtual files) and files in an archive, by the CRC-32C of the content.
+ * A compressed copy the new process doesn't have yet is made when the transfer resumes. If the
+ * new process finds anything else, the transfer is not resumed.
+ */
+typedef struct transfer_snapshot {
+    struct sockaddr_in6 client_address;  //!< Address of the client.
+    uint32_t  request_count;       //!< Length of the request.
+    unsigned char request[REQUEST_BUFFER_LENGTH];  //!< The request that started the transfer.
+    uint32_t  transfer_id;         //!< ID of the transfer in the old process's event log.
+    int64_t   file_size;           //!< Number of bytes being sent.
+    uint64_t  file_device;         //!< Device of the file (zero for content made in memory).
+    uint64_t  file_inode;          //!< Inode of the file (zero for content made in memory).
+    int64_t   file_modified;       //!< Modification time (ns) of the file.
+    uint32_t  content_digest;      //!< CRC-32C of content made in memory (zero for a file).
+    int32_t   compressed;          //!< Non-zero if a compressed copy of the file is being sent.
+    uint32_t  block_size;          //!< Negotiated block size.
+    uint32_t  window_size;         //!< Negotiated window size.
+    int32_t   timeout;             //!< Retransmission timeout in milliseconds.
+    int32_t   retries;             //!< Consecutive timeouts without progress.
+    int32_t   oack_pending;        //!< Non-zero while waiting for the ACK of an OACK.
+    uint32_t  next_block;          //!< Next block that has never been sent.
+    uint32_t  acked_block;         //!< Highest block acknowledged by the client.
+    int64_t   deadline;            //!< Monotonic time (ms) at which to retransmit.
+    int64_t   received_time;       //!< Monotonic time (us) at which the request was received.
+    int64_t   start_time;          //!< Monotonic time (ms) at which the transfer started.
+    int64_t   bytes_sent;          //!< Data bytes sent, including retransmissions.
+    uint32_t  retransmissions;     //!< Number of DATA or OACK packets resent.
+    int32_t   socket_handle;       //!< The socket, once received (not part of the message).
+} transfer_snapshot;
+
+//! Return the current monotonic time in milliseconds.
+long long monotonic_milliseconds( void );
+
+//! Return the current monotonic time in microseconds.
+long long monotonic_microseconds( void );
+
+//! Configure the page cache hints given for the files transfers read.
+/*!
+ * This should be called before any transfer starts.
+ *
+ * \param limit The most (bytes) a transfer reads ahead of the client, or zero to leave read
+ * ahead to the kernel. The amount read ahead follows the transfer's rate up to this limit.
+ * \param size Files of at least this size (bytes) are dropped from the page cache behind the
+ * client and after the transfer, or zero to never do this.
+ */
+void Transfer_configure_hints( off_t limit, off_t size );
+
+//! Have each thread (or worker process) keep a transfer socket made ahead of time.
+/*!
+ * This should be called before any worker is created. See Transfer_prepare_socket().
+ */
+void Transfer_configure_spare_sockets( int enabled );
+
+//! Make the calling thread's spare transfer socket if spares are kept and it has none.
+/*!
+ * The spare is created and bound to an ephemeral port while the thread has nothing better to
+ * do, so the next transfer doesn't wait for either. Does nothing unless spares were enabled
+ * with Transfer_configure_spare_sockets().
+ */
+void Transfer_prepare_socket( void );
+
+//! Return a UDP socket for a new transfer.
+/*!
+ * The socket comes from the socket pool (see socket_pool.h) if one is in use and has a socket
+ * for the client, or else is the calling thread's spare if it has one, or else is new.
+ *
+ * \param client_address The client the transfer is with.
+ *
+ * \return The socket, or -1 if none could be created (errno is set).
+ */
+int Transfer_socket( const struct sockaddr_in6 *client_address );
+
+//! Dispose of a socket from Transfer_socket() that no transfer took ownership of.
+void Transfer_discard_socket( int socket_handle, const struct sockaddr_in6 *client_address );
+
+//! Prepare a transfer for the given request.
+/*!
+ * Checks the client against the current access policy, parses the request, opens the file,
+ * and negotiates options. If the request can't be
+ * satisfied an ERROR packet is sent to the client and the transfer is not created.
+ *
+ * \param object The transfer to initialize.
+ * \param socket_handle A fresh UDP socket for this transfer (see Transfer_socket()). The
+ * transfer takes ownership of the socket only if this function succeeds.
+ * \param client_address The address of the client.
+ * \param request_buffer The raw request datagram.
+ * \param request_count The number of bytes in the request datagram.
+ * \param received_time Monotonic time (us, see monotonic_microseconds()) at which the listener
+ * received the request. The time until the first packet is sent is added to the time to first
+ * block histogram (see Metrics_observe_first_block()).
+ *
+ * \return 0 if the transfer was created; -1 otherwise.
+ */
+int Transfer_open(
+    Transfer *object,
+    int socket_handle,
+    const struct sockaddr_in6 *client_address,
+    const unsigned char *request_buffer,
+    size_t request_count,
+    long long received_time );
+
+//! Send the OACK or the first window of DATA packets.
+transfer_status Transfer_start( Transfer *object, long long now );
+
+//! Process whatever packets have arrived and retransmit if the deadline has passed.
+/*!
+ * This function never blocks. It is safe to call it when nothing has happened; it then
+ * returns without doing anything.
+ */
+transfer_status Transfer_service( Transfer *object, long long now );
+
+//! Close the file and socket used by a transfer and release its memory.
+void Transfer_close( Transfer *object );
+
+//! Record the state of a transfer so that another process can resume it.
+void Transfer_snapshot( const Transfer *object, transfer_snapshot *snapshot );
+
+//! Release a transfer that has been handed to another process.
+/*!
+ * This is Transfer_close() for a transfer that isn't over. The socket is closed rather than
+ * given back to the socket pool, since the other process now owns it.
+ */
+void Transfer_detach( Transfer *object );
+
+//! Carry on with a transfer handed over by another server process.
+/*!
+ * The request is processed again under this process's policy, and the file must be the one
+ * the transfer was sending (see transfer_snapshot). If that fails the client is sent an ERROR.
+ * Otherwise the transfer is left waiting for the client's next ACK or its deadline, just as it
+ * was left in the old process. Transfer_start() is not called.
+ *
+ * \param object The transfer to initialize.
+ * \param snapshot The transfer's state, with the socket it was handed over with.
+ *
+ * \return 0 if the transfer was resumed; -1 otherwise. The socket is the transfer's only if
+ * this succeeds.
+ */
+int Transfer_resume( Transfer *object, const transfer_snapshot *snapshot );
+
+#endif // TRANSFER_H_INCLUDED
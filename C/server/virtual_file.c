@@ -0,0 +1,521 @@
+/*!
+ * \file virtual_file.c
+ * \author Peter C. Chapin
+ * \brief Implementation of files rendered in memory from templates.
+ *
+ * Rendering happens in a per-thread scratch buffer that grows as needed and is reused, so the
+ * only allocation per rendering is the final copy that the cache and transfers share.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+
+#include "crc32c.h"
+#include "topology.h"
+#include "virtual_file.h"
+
+// The number of hash buckets for values and for cached renderings. Powers of two.
+#define VALUE_BUCKETS     1024
+#define RENDERING_BUCKETS 1024
+
+// The maximum number of cached renderings. Beyond this, renderings are not cached.
+#define MAX_RENDERINGS 4096
+
+// How long (seconds) renderings are cached unless the policy says otherwise.
+#define DEFAULT_TIME_TO_LIVE 60
+
+typedef struct virtual_pattern {
+    struct virtual_pattern *next;
+    char   *prefix;              // Text before the '*', or the whole pattern.
+    size_t  prefix_length;
+    char   *suffix;              // Text after the '*', or NULL if there is no '*'.
+    size_t  suffix_length;
+    char   *text;                // The template.
+    size_t  text_length;
+} virtual_pattern;
+
+typedef struct virtual_value {
+    struct virtual_value *next;
+    unsigned long hash;
+    const char *name;            // Points into text.
+    const char *value;           // Points into text.
+    char  text[];                // "key\0name\0value\0".
+} virtual_value;
+
+typedef struct rendering {
+    struct rendering *next;
+    unsigned long hash;
+    long long expires;
+    VirtualContent *content;
+    size_t key_length;
+    char   key[];                // "path\0client".
+} rendering;
+
+static _Thread_local unsigned char *scratch = NULL;
+static _Thread_local size_t scratch_size = 0;
+
+
+static long long monotonic_time( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+static unsigned long hash_bytes( unsigned long hash, const char *text, size_t length )
+{
+    size_t i;
+
+    for( i = 0; i < length; ++i ) {
+        hash = ( hash ^ (unsigned char)text[i] ) * 16777619UL;   // FNV-1a.
+    }
+    return hash;
+}
+
+
+static unsigned long hash_pair( const char *first, size_t first_length, const char *second )
+{
+    unsigned long hash = hash_bytes( 2166136261UL, first, first_length );
+
+    hash = hash_bytes( hash, "", 1 );
+    return hash_bytes( hash, second, strlen( second ) );
+}
+
+
+int VirtualTable_initialize( VirtualTable *object )
+{
+    memset( object, 0, sizeof( *object ) );
+    object->time_to_live = DEFAULT_TIME_TO_LIVE * 1000;
+    object->values     = calloc( VALUE_BUCKETS, sizeof( virtual_value * ) );
+    object->renderings = calloc( RENDERING_BUCKETS, sizeof( rendering * ) );
+    if( object->values == NULL || object->renderings == NULL ) {
+        free( object->values );
+        free( object->renderings );
+        return -1;
+    }
+    pthread_mutex_init( &object->lock, NULL );
+    return 0;
+}
+
+
+void VirtualTable_destroy( VirtualTable *object )
+{
+    virtual_pattern *pattern;
+    virtual_value   *value;
+    rendering       *entry;
+    void *next;
+    size_t i;
+
+    for( pattern = object->patterns; pattern != NULL; pattern = next ) {
+        next = pattern->next;
+        free( pattern->prefix );
+        free( pattern->text );
+        free( pattern );
+    }
+    for( i = 0; i < VALUE_BUCKETS; ++i ) {
+        for( value = object->values[i]; value != NULL; value = next ) {
+            next = value->next;
+            free( value );
+        }
+    }
+    for( i = 0; i < RENDERING_BUCKETS; ++i ) {
+        for( entry = object->renderings[i]; entry != NULL; entry = next ) {
+            next = entry->next;
+            VirtualContent_release( entry->content );
+            free( entry );
+        }
+    }
+    free( object->values );
+    free( object->renderings );
+    pthread_mutex_destroy( &object->lock );
+}
+
+
+//
+// Read a whole file into memory. Returns NULL if it can't be read.
+//
+static char *read_template( const char *file_name, size_t *length )
+{
+    FILE  *input;
+    char  *text = NULL;
+    char  *larger;
+    size_t size = 0;
+    size_t count;
+
+    if( (input = fopen( file_name, "rb" )) == NULL ) return NULL;
+    *length = 0;
+    do {
+        if( *length == size ) {
+            size = size == 0 ? 4096 : 2 * size;
+            if( (larger = realloc( text, size )) == NULL ) {
+                free( text );
+                fclose( input );
+                return NULL;
+            }
+            text = larger;
+        }
+        count = fread( text + *length, 1, size - *length, input );
+        *length += count;
+    } while( count > 0 );
+
+    if( ferror( input ) ) {
+        free( text );
+        text = NULL;
+    }
+    fclose( input );
+    return text;
+}
+
+
+int VirtualTable_add_pattern(
+    VirtualTable *object, const char *pattern, const char *template_file )
+{
+    virtual_pattern  *entry;
+    virtual_pattern **link = &object->patterns;
+    char *star;
+
+    if( *pattern == '/' || *pattern == '\0' ) return -1;
+    if( (star = strchr( pattern, '*' )) != NULL && strchr( star + 1, '*' ) != NULL ) return -1;
+    if( (entry = calloc( 1, sizeof( virtual_pattern ) )) == NULL ) return -1;
+
+    if( (entry->prefix = strdup( pattern )) == NULL ||
+        (entry->text = read_template( template_file, &entry->text_length )) == NULL ) {
+        free( entry->prefix );
+        free( entry );
+        return -1;
+    }
+    if( (star = strchr( entry->prefix, '*' )) != NULL ) {
+        *star = '\0';
+        entry->suffix = star + 1;
+        entry->suffix_length = strlen( entry->suffix );
+    }
+    entry->prefix_length = strlen( entry->prefix );
+
+    // Patterns are tried in the order they were given.
+    while( *link != NULL ) link = &(*link)->next;
+    *link = entry;
+    return 0;
+}
+
+
+int VirtualTable_add_value( VirtualTable *object, const char *key, const char *assignment )
+{
+    virtual_value *entry;
+    const char *equals = strchr( assignment, '=' );
+    size_t key_length = strlen( key );
+    size_t name_length;
+    size_t index;
+
+    if( equals == NULL || equals == assignment ) return -1;
+    name_length = (size_t)( equals - assignment );
+    entry = malloc( sizeof( virtual_value ) + key_length + strlen( assignment ) + 2 );
+    if( entry == NULL ) return -1;
+
+    memcpy( entry->text, key, key_length + 1 );
+    memcpy( entry->text + key_length + 1, assignment, name_length );
+    entry->text[key_length + 1 + name_length] = '\0';
+    strcpy( entry->text + key_length + name_length + 2, equals + 1 );
+    entry->name  = entry->text + key_length + 1;
+    entry->value = entry->text + key_length + name_length + 2;
+    entry->hash  = hash_pair( entry->text, key_length, entry->name );
+
+    index = entry->hash & ( VALUE_BUCKETS - 1 );
+    entry->next = object->values[index];
+    object->values[index] = entry;
+    return 0;
+}
+
+
+void VirtualTable_set_time_to_live( VirtualTable *object, int seconds )
+{
+    object->time_to_live = seconds * 1000;
+}
+
+
+VirtualContent *VirtualContent_allocate( size_t size )
+{
+    VirtualContent *object;
+    size_t mapped;
+
+    if( (object = Topology_allocate( sizeof( VirtualContent ) + size, &mapped )) == NULL ) {
+        return NULL;
+    }
+    atomic_init( &object->references, 1 );
+    object->digest = 0;
+    object->size   = size;
+    object->mapped = mapped;
+    return object;
+}
+
+
+void VirtualContent_release( VirtualContent *object )
+{
+    if( atomic_fetch_sub_explicit( &object->references, 1, memory_order_acq_rel ) == 1 ) {
+        Topology_free( object, object->mapped );
+    }
+}
+
+
+//
+// Return the text matched by the pattern's '*' (or an empty string), or NULL if the path
+// doesn't match.
+//
+static const char *match_pattern(
+    const virtual_pattern *pattern, const char *path, size_t path_length, size_t *match_length )
+{
+    const char *match = path + pattern->prefix_length;
+
+    if( pattern->suffix == NULL ) {
+        *match_length = 0;
+        return strcmp( path, pattern->prefix ) == 0 ? match : NULL;
+    }
+    if( path_length < pattern->prefix_length + pattern->suffix_length ||
+        memcmp( path, pattern->prefix, pattern->prefix_length ) != 0 ||
+        memcmp( path + path_length - pattern->suffix_length,
+                pattern->suffix, pattern->suffix_length ) != 0 ) {
+        return NULL;
+    }
+    *match_length = path_length - pattern->prefix_length - pattern->suffix_length;
+    if( memchr( match, '/', *match_length ) != NULL ) return NULL;
+    return match;
+}
+
+
+static const char *find_value(
+    const VirtualTable *object, const char *key, size_t key_length, const char *name )
+{
+    const virtual_value *entry;
+    unsigned long hash = hash_pair( key, key_length, name );
+
+    for( entry = object->values[hash & ( VALUE_BUCKETS - 1 )];
+         entry != NULL;
+         entry = entry->next ) {
+        if( entry->hash == hash && strcmp( entry->name, name ) == 0 &&
+            strncmp( entry->text, key, key_length ) == 0 && entry->text[key_length] == '\0' ) {
+            return entry->value;
+        }
+    }
+    return NULL;
+}
+
+
+static int append( size_t *length, const void *data, size_t count )
+{
+    unsigned char *larger;
+    size_t size = scratch_size;
+
+    while( *length + count > size ) size = size == 0 ? 4096 : 2 * size;
+    if( size != scratch_size ) {
+        if( (larger = realloc( scratch, size )) == NULL ) return -1;
+        scratch = larger;
+        scratch_size = size;
+    }
+    memcpy( scratch + *length, data, count );
+    *length += count;
+    return 0;
+}
+
+
+//
+// Render a template into the scratch buffer. Returns the length, or -1 if memory ran out.
+//
+static long render_template(
+    const VirtualTable *object,
+    const virtual_pattern *pattern,
+    const char *path,
+    const char *match,
+    size_t match_length,
+    const char *client )
+{
+    const char *text = pattern->text;
+    const char *end  = pattern->text + pattern->text_length;
+    const char *close;
+    const char *value;
+    char   name[64];
+    size_t name_length;
+    size_t length = 0;
+
+    while( text < end ) {
+        if( *text != '$' || text + 1 == end ) {
+            close = memchr( text + 1, '$', (size_t)( end - text - 1 ) );
+            if( close == NULL ) close = end;
+            if( append( &length, text, (size_t)( close - text ) ) == -1 ) return -1;
+            text = close;
+            continue;
+        }
+        if( text[1] == '$' ) {
+            if( append( &length, "$", 1 ) == -1 ) return -1;
+            text += 2;
+            continue;
+        }
+        close = memchr( text, '}', (size_t)( end - text ) );
+        name_length = close == NULL ? 0 : (size_t)( close - text - 2 );
+        if( text[1] != '{' || close == NULL || name_length >= sizeof( name ) ) {
+            if( append( &length, text, 1 ) == -1 ) return -1;   // Not a substitution.
+            ++text;
+            continue;
+        }
+        memcpy( name, text + 2, name_length );
+        name[name_length] = '\0';
+        text = close + 1;
+
+        if( strcmp( name, "path" ) == 0 ) value = path;
+        else if( strcmp( name, "client" ) == 0 ) value = client;
+        else if( strcmp( name, "match" ) == 0 ) {
+            if( append( &length, match, match_length ) == -1 ) return -1;
+            continue;
+        }
+        else if( (value = find_value( object, match, match_length, name )) == NULL ) {
+            value = find_value( object, client, strlen( client ), name );
+        }
+        if( value != NULL && append( &length, value, strlen( value ) ) == -1 ) return -1;
+    }
+    return (long)length;
+}
+
+
+static rendering *find_rendering(
+    const VirtualTable *object, unsigned long hash, const char *key, size_t key_length )
+{
+    rendering *entry;
+
+    for( entry = object->renderings[hash & ( RENDERING_BUCKETS - 1 )];
+         entry != NULL;
+         entry = entry->next ) {
+        if( entry->hash == hash && entry->key_length == key_length &&
+            memcmp( entry->key, key, key_length ) == 0 ) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+//
+// Drop every expired rendering. Called with the lock held when the cache is full.
+//
+static void sweep_renderings( VirtualTable *object, long long now )
+{
+    rendering **link;
+    rendering  *entry;
+    size_t i;
+
+    for( i = 0; i < RENDERING_BUCKETS; ++i ) {
+        link = &object->renderings[i];
+        while( (entry = *link) != NULL ) {
+            if( entry->expires <= now ) {
+                *link = entry->next;
+                VirtualContent_release( entry->content );
+                free( entry );
+                --object->rendering_count;
+            }
+            else {
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+
+//
+// Add a rendering to the cache (or refresh the existing entry). Called with the lock held.
+//
+static void cache_rendering(
+    VirtualTable *object,
+    unsigned long hash,
+    const char *key,
+    size_t key_length,
+    VirtualContent *content,
+    long long now )
+{
+    rendering *entry = find_rendering( object, hash, key, key_length );
+    size_t index;
+
+    if( entry == NULL ) {
+        if( object->rendering_count >= MAX_RENDERINGS ) sweep_renderings( object, now );
+        if( object->rendering_count >= MAX_RENDERINGS ) return;
+        if( (entry = malloc( sizeof( rendering ) + key_length )) == NULL ) return;
+        entry->hash = hash;
+        entry->key_length = key_length;
+        memcpy( entry->key, key, key_length );
+        index = hash & ( RENDERING_BUCKETS - 1 );
+        entry->next = object->renderings[index];
+        object->renderings[index] = entry;
+        ++object->rendering_count;
+    }
+    else {
+        VirtualContent_release( entry->content );
+    }
+    atomic_fetch_add_explicit( &content->references, 1, memory_order_relaxed );
+    entry->content = content;
+    entry->expires = now + object->time_to_live;
+}
+
+
+int VirtualTable_render(
+    VirtualTable *object,
+    const char *path,
+    const struct sockaddr_in6 *client_address,
+    VirtualContent **content )
+{
+    const virtual_pattern *pattern;
+    const rendering *entry;
+    const char *match = NULL;
+    char   client[INET6_ADDRSTRLEN];
+    char   key[512 + INET6_ADDRSTRLEN];
+    size_t path_length = strlen( path );
+    size_t match_length = 0;
+    size_t key_length;
+    unsigned long hash;
+    long long now;
+    long length;
+
+    *content = NULL;
+    for( pattern = object->patterns; pattern != NULL; pattern = pattern->next ) {
+        if( (match = match_pattern( pattern, path, path_length, &match_length )) != NULL ) break;
+    }
+    if( pattern == NULL ) return 0;
+
+    if( IN6_IS_ADDR_V4MAPPED( &client_address->sin6_addr ) ) {
+        inet_ntop( AF_INET, &client_address->sin6_addr.s6_addr[12], client, sizeof( client ) );
+    }
+    else {
+        inet_ntop( AF_INET6, &client_address->sin6_addr, client, sizeof( client ) );
+    }
+
+    // Renderings are cached per path and client.
+    key_length = (size_t)snprintf( key, sizeof( key ), "%s%c%s", path, '\0', client );
+    if( key_length >= sizeof( key ) ) key_length = sizeof( key ) - 1;
+    hash = hash_bytes( 2166136261UL, key, key_length );
+    now  = monotonic_time( );
+    if( object->time_to_live > 0 ) {
+        pthread_mutex_lock( &object->lock );
+        if( (entry = find_rendering( object, hash, key, key_length )) != NULL &&
+            entry->expires > now ) {
+            *content = entry->content;
+            atomic_fetch_add_explicit( &(*content)->references, 1, memory_order_relaxed );
+        }
+        pthread_mutex_unlock( &object->lock );
+        if( *content != NULL ) return 0;
+    }
+
+    if( (length = render_template( object, pattern, path, match, match_length, client )) == -1 ||
+        (*content = VirtualContent_allocate( (size_t)length )) == NULL ) {
+        return -1;
+    }
+    memcpy( (*content)->data, scratch, (size_t)length );
+    (*content)->digest = crc32c( 0, scratch, (size_t)length );
+
+    if( object->time_to_live > 0 ) {
+        pthread_mutex_lock( &object->lock );
+        cache_rendering( object, hash, key, key_length, *content, now );
+        pthread_mutex_unlock( &object->lock );
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*!
+ * \file virtual_file.h
+ * \author Peter C. Chapin
+ * \brief Interface to files rendered in memory from templates.
+ *
+ * Boot configurations such as pxelinux.cfg/01-<mac> are usually thousands of nearly identical
+ * small files. Instead of generating them on disk, a path pattern can be bound to a template.
+ * A request matching the pattern is answered with the template rendered for that request. The
+ * rendered text is cached for a while so a client that retries, or a rack of machines booting
+ * together, does not render the same file over and over.
+ *
+ * Templates substitute ${name} with a value. The values available are:
+ *
+ *     ${path}    The normalized request path.
+ *     ${match}   The part of the path matched by the '*' in the pattern.
+ *     ${client}  The client's address (dotted form for IPv4 clients).
+ *     ${other}   A value defined for the match text, or failing that, for the client address.
+ *
+ * Undefined names render as nothing. "$$" renders as a single '$'.
+ */
+
+#ifndef VIRTUAL_FILE_H_INCLUDED
+#define VIRTUAL_FILE_H_INCLUDED
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+struct virtual_pattern;
+struct virtual_value;
+struct rendering;
+
+//! The rendered text of a virtual file.
+/*!
+ * Renderings are shared between the cache and any transfers sending them. Each holder owns a
+ * reference; the memory is released with the last one.
+ */
+typedef struct VirtualContent {
+    atomic_int    references;  //!< Number of holders.
+    uint32_t      digest;      //!< CRC-32C of data.
+    size_t        size;        //!< Number of bytes in data.
+    size_t        mapped;      //!< Length of the memory's own mapping (see Topology_allocate()).
+    unsigned char data[];      //!< The rendered text.
+} VirtualContent;
+
+//! The templates and values of one policy, together with the cache of renderings.
+typedef struct {
+    struct virtual_pattern *patterns;     //!< Registered patterns, in the order given.
+    struct virtual_value  **values;       //!< Hash table of defined values.
+    struct rendering      **renderings;   //!< Hash table of cached renderings.
+    size_t          rendering_count;      //!< Number of cached renderings.
+    int             time_to_live;         //!< How long (ms) a rendering may be reused.
+    pthread_mutex_t lock;                 //!< Protects the rendering cache.
+} VirtualTable;
+
+//! Prepare an empty table.
+/*!
+ * \return 0 if successful; -1 if memory could not be allocated.
+ */
+int VirtualTable_initialize( VirtualTable *object );
+
+//! Release everything held by a table.
+/*!
+ * Renderings still being sent by transfers survive until their last reference is released.
+ */
+void VirtualTable_destroy( VirtualTable *object );
+
+//! Bind a path pattern to a template file.
+/*!
+ * \param pattern A relative path that may contain one '*'. The '*' matches any text that
+ * doesn't contain '/'.
+ * \param template_file The template. It is read into memory now; later changes to the file take
+ * effect only when the policy is reloaded.
+ *
+ * \return 0 if successful; -1 if the pattern is invalid or the template can't be read.
+ */
+int VirtualTable_add_pattern(
+    VirtualTable *object, const char *pattern, const char *template_file );
+
+//! Define a value for templates rendered for a given key.
+/*!
+ * \param key The match text or client address the value applies to.
+ * \param assignment Text of the form name=value.
+ *
+ * \return 0 if successful; -1 if the assignment is malformed or memory ran out.
+ */
+int VirtualTable_add_value( VirtualTable *object, const char *key, const char *assignment );
+
+//! Set how long, in seconds, renderings are cached. Zero disables the cache.
+void VirtualTable_set_time_to_live( VirtualTable *object, int seconds );
+
+//! Render the file for a path, or return a cached rendering.
+/*!
+ * \param object The table to use.
+ * \param path The normalized request path.
+ * \param client_address The address of the client.
+ * \param content Receives the rendering with a reference for the caller, or NULL if no pattern
+ * matches the path.
+ *
+ * \return 0 if successful (whether or not a pattern matched); -1 if memory ran out.
+ */
+int VirtualTable_render(
+    VirtualTable *object,
+    const char *path,
+    const struct sockaddr_in6 *client_address,
+    VirtualContent **content );
+
+//! Allocate content of the given size with one reference and a zero digest.
+/*!
+ * The memory is local to the caller's NUMA node. This is also used for the other copies of
+ * files the server keeps in memory.
+ *
+ * \return The content, or NULL if memory ran out.
+ */
+VirtualContent *VirtualContent_allocate( size_t size );
+
+//! Drop a reference to a rendering.
+void VirtualContent_release( VirtualContent *object );
+
+#endif // VIRTUAL_FILE_H_INCLUDED
@@ -0,0 +1,108 @@
+/*!
+ * \file work_deque.c
+ * \author Peter C. Chapin
+ * \brief Implementation of a work stealing deque.
+ *
+ * The memory orderings follow Le, Pop, Cohen, and Zappa Nardelli, "Correct and Efficient
+ * Work-Stealing for Weak Memory Models" (PPoPP 2013). The deque does not grow; callers handle a
+ * full deque by running the work immediately.
+ */
+
+#include <stdlib.h>
+
+#include "work_deque.h"
+
+
+int WorkDeque_initialize( WorkDeque *object, size_t capacity )
+{
+    size_t size = 1;
+    size_t i;
+
+    while( size < capacity ) size <<= 1;
+    if( (object->items = malloc( size * sizeof( *object->items ) )) == NULL ) return -1;
+    for( i = 0; i < size; ++i ) {
+        atomic_init( &object->items[i], NULL );
+    }
+    object->mask = (long long)size - 1;
+    atomic_init( &object->top, 0 );
+    atomic_init( &object->bottom, 0 );
+    return 0;
+}
+
+
+void WorkDeque_destroy( WorkDeque *object )
+{
+    free( (void *)object->items );
+    object->items = NULL;
+}
+
+
+int WorkDeque_push( WorkDeque *object, void *item )
+{
+    long long bottom = atomic_load_explicit( &object->bottom, memory_order_relaxed );
+    long long top    = atomic_load_explicit( &object->top, memory_order_acquire );
+
+    if( bottom - top > object->mask ) return -1;
+
+    atomic_store_explicit( &object->items[bottom & object->mask], item, memory_order_relaxed );
+    atomic_thread_fence( memory_order_release );
+    atomic_store_explicit( &object->bottom, bottom + 1, memory_order_relaxed );
+    return 0;
+}
+
+
+void *WorkDeque_pop( WorkDeque *object )
+{
+    long long bottom = atomic_load_explicit( &object->bottom, memory_order_relaxed ) - 1;
+    long long top;
+    void *item;
+
+    atomic_store_explicit( &object->bottom, bottom, memory_order_relaxed );
+    atomic_thread_fence( memory_order_seq_cst );
+    top = atomic_load_explicit( &object->top, memory_order_relaxed );
+
+    if( top > bottom ) {
+        // The deque was empty.
+        atomic_store_explicit( &object->bottom, bottom + 1, memory_order_relaxed );
+        return NULL;
+    }
+
+    item = atomic_load_explicit( &object->items[bottom & object->mask], memory_order_relaxed );
+    if( top == bottom ) {
+        // This is the last item. Race any thief for it.
+        if( !atomic_compare_exchange_strong_explicit(
+                &object->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed ) ) {
+            item = NULL;
+        }
+        atomic_store_explicit( &object->bottom, bottom + 1, memory_order_relaxed );
+    }
+    return item;
+}
+
+
+void *WorkDeque_steal( WorkDeque *object )
+{
+    long long top = atomic_load_explicit( &object->top, memory_order_acquire );
+    long long bottom;
+    void *item;
+
+    atomic_thread_fence( memory_order_seq_cst );
+    bottom = atomic_load_explicit( &object->bottom, memory_order_acquire );
+    if( top >= bottom ) return NULL;
+
+    item = atomic_load_explicit( &object->items[top & object->mask], memory_order_relaxed );
+    if( !atomic_compare_exchange_strong_explicit(
+            &object->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed ) ) {
+        return NULL;
+    }
+    return item;
+}
+
+
+long long WorkDeque_size( WorkDeque *object )
+{
+    long long bottom = atomic_load_explicit( &object->bottom, memory_order_relaxed );
+    long long top    = atomic_load_explicit( &object->top, memory_order_relaxed );
+
+    return bottom > top ? bottom - top : 0;
+}
@@ -0,0 +1,49 @@
+/*!
+ * \file work_deque.h
+ * \author Peter C. Chapin
+ * \brief Interface to a work stealing deque.
+ *
+ */
+
+#ifndef WORK_DEQUE_H_INCLUDED
+#define WORK_DEQUE_H_INCLUDED
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "ring.h"
+
+//! A bounded Chase-Lev work stealing deque of pointers.
+/*!
+ * The owning thread pushes and pops items at the bottom of the deque without any atomic
+ * read-modify-write in the common case. Other threads steal items from the top with a single
+ * compare-and-swap. The owner thus processes its most recent work first (which is likely to be
+ * cache hot) while thieves take the oldest work.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_llong top;      //!< Next item to steal.
+    _Alignas(CACHE_LINE_SIZE) atomic_llong bottom;   //!< Next free position for the owner.
+    _Alignas(CACHE_LINE_SIZE) _Atomic(void *) *items;
+    long long mask;                                  //!< Capacity minus one.
+} WorkDeque;
+
+//! Initialize a deque. The capacity is rounded up to a power of two.
+int WorkDeque_initialize( WorkDeque *object, size_t capacity );
+
+//! Release the memory held by a deque.
+void WorkDeque_destroy( WorkDeque *object );
+
+//! Push an item. Only the owner may call this. Returns -1 if the deque is full.
+int WorkDeque_push( WorkDeque *object, void *item );
+
+//! Pop the most recently pushed item. Only the owner may call this. Returns NULL if empty.
+void *WorkDeque_pop( WorkDeque *object );
+
+//! Steal the oldest item. Any thread may call this. Returns NULL if empty or if the steal lost
+//! a race with another thread.
+void *WorkDeque_steal( WorkDeque *object );
+
+//! Return an estimate of the number of items in the deque.
+long long WorkDeque_size( WorkDeque *object );
+
+#endif // WORK_DEQUE_H_INCLUDED
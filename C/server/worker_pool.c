@@ -0,0 +1,237 @@
+/*!
+ * \file worker_pool.c
+ * \author Peter C. Chapin
+ * \brief Implementation of a pool of pre-forked worker processes.
+ *
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "admission.h"
+#include "event_log.h"
+#include "metrics.h"
+#include "socket_pool.h"
+#include "topology.h"
+#include "transfer.h"
+#include "worker_pool.h"
+#include "xdp_path.h"
+
+
+//
+// The body of a worker process. It services requests until it reaches its transfer limit or
+// until the listener goes away. It never returns. A replacement worker takes over the metrics
+// shard of the worker it replaces.
+//
+static void worker_main( WorkerPool *object, int slot )
+{
+    struct sockaddr_in6 client_address;
+    unsigned char request_buffer[REQUEST_BUFFER_LENGTH];
+    long long     received_time;
+    struct iovec  parts[3];
+    struct msghdr message;
+    ssize_t received;
+    size_t  header_size = sizeof( client_address ) + sizeof( received_time );
+    int     transfer_count = 0;
+
+    close( object->listen_handle );
+    close( object->dispatch_handle );
+    Metrics_attach( slot + 1 );
+    Admission_attach( slot );
+    Topology_pin_worker( slot );
+    SocketPool_open( slot, object->worker_count );
+    XdpPath_open( slot );
+    EventLog_start( );
+
+    while( object->transfer_limit == 0 || transfer_count < object->transfer_limit ) {
+        // Get the next transfer's socket ready while there is nothing to do.
+        Transfer_prepare_socket( );
+
+        parts[0].iov_base = &client_address;
+        parts[0].iov_len  = sizeof( client_address );
+        parts[1].iov_base = &received_time;
+        parts[1].iov_len  = sizeof( received_time );
+        parts[2].iov_base = request_buffer;
+        parts[2].iov_len  = sizeof( request_buffer );
+        memset( &message, 0, sizeof( message ) );
+        message.msg_iov    = parts;
+        message.msg_iovlen = 3;
+
+        received = recvmsg( object->worker_handle, &message, 0 );
+        if( received == -1 ) {
+            if( errno == EINTR ) continue;
+            EventLog_system_error( "Worker unable to receive request", errno );
+            break;
+        }
+
+        // A zero length read means the listener has closed its end of the socket pair.
+        if( received == 0 ) break;
+        if( (size_t)received < header_size ) continue;
+
+        Admission_hold( );
+        object->handler(
+            request_buffer, (size_t)received - header_size, &client_address, received_time );
+        ++transfer_count;
+    }
+    close( object->worker_handle );
+    EventLog_stop( );
+    exit( EXIT_SUCCESS );
+}
+
+
+//
+// Fork a worker into the given slot. Returns 0 on success or -1 if the fork failed.
+//
+static int spawn_worker( WorkerPool *object, int slot )
+{
+    pid_t child_id;
+
+    if( (child_id = fork( )) == -1 ) {
+        perror( "Could not create worker process" );
+        object->worker_ids[slot] = 0;
+        return -1;
+    }
+    if( child_id == 0 ) {
+        worker_main( object, slot );
+    }
+    object->worker_ids[slot] = child_id;
+    return 0;
+}
+
+
+int WorkerPool_initialize(
+    WorkerPool *object,
+    int worker_count,
+    int transfer_limit,
+    int listen_handle,
+    request_handler handler )
+{
+    int handles[2];
+    int slot;
+
+    if( socketpair( AF_UNIX, SOCK_SEQPACKET, 0, handles ) == -1 ) {
+        perror( "Unable to create worker socket pair" );
+        return -1;
+    }
+    object->dispatch_handle = handles[0];
+    object->worker_handle   = handles[1];
+    object->listen_handle   = listen_handle;
+    object->worker_count    = worker_count;
+    object->transfer_limit  = transfer_limit;
+    object->handler         = handler;
+
+    if( (object->worker_ids = calloc( (size_t)worker_count, sizeof( pid_t ) )) == NULL ) {
+        close( handles[0] );
+        close( handles[1] );
+        return -1;
+    }
+
+    for( slot = 0; slot < worker_count; ++slot ) {
+        spawn_worker( object, slot );
+    }
+    return 0;
+}
+
+
+int WorkerPool_dispatch(
+    WorkerPool *object,
+    const unsigned char *request_buffer,
+    size_t request_count,
+    const struct sockaddr_in6 *client_address,
+    long long received_time )
+{
+    struct iovec  parts[3];
+    struct msghdr message;
+
+    if( request_count > REQUEST_BUFFER_LENGTH ) request_count = REQUEST_BUFFER_LENGTH;
+
+    parts[0].iov_base = (void *)client_address;
+    parts[0].iov_len  = sizeof( *client_address );
+    parts[1].iov_base = &received_time;
+    parts[1].iov_len  = sizeof( received_time );
+    parts[2].iov_base = (void *)request_buffer;
+    parts[2].iov_len  = request_count;
+    memset( &message, 0, sizeof( message ) );
+    message.msg_iov    = parts;
+    message.msg_iovlen = 3;
+
+    // Never block the listener. A dropped RRQ is retransmitted by the client.
+    if( sendmsg( object->dispatch_handle, &message, MSG_DONTWAIT ) == -1 ) {
+        if( errno != EAGAIN && errno != EWOULDBLOCK ) {
+            EventLog_system_error( "Unable to dispatch request", errno );
+        }
+        return -1;
+    }
+    return 0;
+}
+
+
+void WorkerPool_reap( WorkerPool *object )
+{
+    pid_t child_id;
+    int   status;
+    int   slot;
+
+    while( (child_id = waitpid( -1, &status, WNOHANG )) > 0 ) {
+        for( slot = 0; slot < object->worker_count; ++slot ) {
+            if( object->worker_ids[slot] == child_id ) {
+                // A worker that died mid-transfer never released it.
+                Admission_reclaim( slot );
+                object->worker_ids[slot] = 0;
+                break;
+            }
+        }
+    }
+
+    // Refill every empty slot. This also retries slots where an earlier fork failed.
+    for( slot = 0; slot < object->worker_count; ++slot ) {
+        if( object->worker_ids[slot] == 0 ) {
+            spawn_worker( object, slot );
+        }
+    }
+}
+
+
+void WorkerPool_destroy( WorkerPool *object )
+{
+    int slot;
+
+    // Closing the dispatch end lets idle workers see end-of-file. Busy workers are told to stop.
+    close( object->dispatch_handle );
+    for( slot = 0; slot < object->worker_count; ++slot ) {
+        if( object->worker_ids[slot] != 0 ) {
+            kill( object->worker_ids[slot], SIGTERM );
+            waitpid( object->worker_ids[slot], NULL, 0 );
+        }
+    }
+    close( object->worker_handle );
+    free( object->worker_ids );
+    object->worker_ids = NULL;
+}
+
+
+void WorkerPool_drain( WorkerPool *object )
+{
+    int slot;
+
+    // Workers see end-of-file once the requests queued in the socket pair are taken.
+    close( object->dispatch_handle );
+    for( slot = 0; slot < object->worker_count; ++slot ) {
+        if( object->worker_ids[slot] != 0 ) {
+            while( waitpid( object->worker_ids[slot], NULL, 0 ) == -1 && errno == EINTR ) ;
+        }
+    }
+    close( object->worker_handle );
+    free( object->worker_ids );
+    object->worker_ids = NULL;
+}
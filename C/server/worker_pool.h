@@ -0,0 +1,87 @@
+/*!
+ * \file worker_pool.h
+ * \author Peter C. Chapin
+ * \brief Interface to a pool of pre-forked worker processes.
+ *
+ */
+
+#ifndef WORKER_POOL_H_INCLUDED
+#define WORKER_POOL_H_INCLUDED
+
+#include <sys/types.h>
+
+#include "server.h"
+
+//! A pool of long lived worker processes.
+/*!
+ * The listener forks the workers once at startup and then hands each incoming request to
+ * the pool as a single message over a Unix domain socket pair. All workers block on the same
+ * end of the socket pair; the kernel delivers each message to exactly one of them. Handing a
+ * request to a worker is therefore a queue hop rather than a fork. Each worker still runs in
+ * its own process so transfers remain isolated from each other.
+ *
+ * A worker exits after servicing a configurable number of transfers. The listener notices the
+ * exit (via SIGCHLD) and forks a fresh replacement so that the pool stays at full strength.
+ */
+typedef struct {
+    int    dispatch_handle;    //!< Listener's end of the socket pair.
+    int    worker_handle;      //!< Workers' end of the socket pair.
+    int    listen_handle;      //!< Listening socket; closed in the workers.
+    pid_t *worker_ids;         //!< Process IDs of the workers (0 for an empty slot).
+    int    worker_count;       //!< Number of workers in the pool.
+    int    transfer_limit;     //!< Transfers a worker services before it is recycled (0 = never).
+    request_handler handler;   //!< Function that services requests.
+} WorkerPool;
+
+//! Create the socket pair and fork the initial set of workers.
+/*!
+ * \param object The pool to initialize.
+ * \param worker_count The number of worker processes to maintain.
+ * \param transfer_limit The number of transfers after which a worker is recycled. Zero means
+ * workers are never recycled.
+ * \param listen_handle The listening socket. Workers close their copy of it.
+ * \param handler The function workers use to service a request.
+ *
+ * \return 0 if the pool was created; -1 otherwise.
+ */
+int WorkerPool_initialize(
+    WorkerPool *object,
+    int worker_count,
+    int transfer_limit,
+    int listen_handle,
+    request_handler handler );
+
+//! Hand a request to one of the workers.
+/*!
+ * This function never blocks. If every worker is busy and the socket pair is full the request
+ * is dropped; the client will retransmit its RRQ.
+ *
+ * \param received_time When the request arrived (see monotonic_microseconds()). It is passed
+ * on to the handler.
+ *
+ * \return 0 if the request was queued; -1 if it was dropped.
+ */
+int WorkerPool_dispatch(
+    WorkerPool *object,
+    const unsigned char *request_buffer,
+    size_t request_count,
+    const struct sockaddr_in6 *client_address,
+    long long received_time );
+
+//! Reap workers that have exited and fork replacements for them.
+/*!
+ * This function is safe to call at any time; it does nothing if no worker has exited. The
+ * listener calls it whenever its receive is interrupted by SIGCHLD.
+ */
+void WorkerPool_reap( WorkerPool *object );
+
+//! Terminate the workers and release the pool's resources.
+void WorkerPool_destroy( WorkerPool *object );
+
+//! Let the workers finish the requests they have and wait for them to exit.
+/*!
+ * Requests already dispatched are still serviced. No worker is replaced.
+ */
+void WorkerPool_drain( WorkerPool *object );
+
+#endif // WORKER_POOL_H_INCLUDED
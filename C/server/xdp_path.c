@@ -0,0 +1,491 @@
+/*!
+ * \file xdp_path.c
+ * \author Peter C. Chapin
+ * \brief Implementation of the AF_XDP path for DATA packets.
+ *
+ * The AF_XDP socket is driven with the kernel's interface directly (linux/if_xdp.h) rather than
+ * through libxdp, which the server would otherwise not need. Only the transmit ring and the
+ * completion ring are used; the fill ring exists because the kernel insists on it, and nothing
+ * is ever received. Frames are handed out from a stack of free frames and come back to it
+ * through the completion ring. A lock protects the stack and the transmit ring, as the threads
+ * of the threaded server share them.
+ *
+ * Client link layer addresses come from the kernel's neighbor table, read over rtnetlink one
+ * entry at a time (Linux 5.0 or later).
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/if_xdp.h>
+#include <linux/neighbour.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#ifndef S_SPLIT_S     // Workaround for splint.
+#include <unistd.h>
+#endif
+
+#include "topology.h"
+#include "xdp_path.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+// The size of a frame and the number of them. A frame holds one packet of up to a page.
+#define FRAME_SIZE  4096
+#define FRAME_COUNT 2048
+
+// Entries in the transmit and completion rings. With one entry per frame, neither can overflow.
+#define RING_SIZE FRAME_COUNT
+
+// The kernel requires a fill ring even though nothing is received.
+#define FILL_RING_SIZE 64
+
+#define ETHERNET_HEADER_LENGTH 14
+#define IPV4_HEADER_LENGTH     20
+#define IPV6_HEADER_LENGTH     40
+#define UDP_HEADER_LENGTH       8
+
+// How many times a transfer is checked for the path. The second check comes after the client
+// has answered, by which time the kernel knows its link layer address.
+#define MAX_ATTEMPTS 2
+
+// Neighbor states in which the link layer address may be used.
+#define USABLE_STATES \
+    ( NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE | NUD_PERMANENT | NUD_NOARP )
+
+typedef struct {
+    void         *map;        // The ring's mapping.
+    size_t        map_length;
+    atomic_uint  *producer;
+    atomic_uint  *consumer;
+    atomic_uint  *flags;
+    void         *entries;
+} xdp_ring;
+
+// The configured interface (see XdpPath_configure()).
+static char          interface_name[IF_NAMESIZE];
+static unsigned      interface_index = 0;
+static int           first_queue     = 0;
+static int           interface_mtu   = 0;
+static unsigned char interface_address[6];
+
+// The calling process's socket and its memory (see XdpPath_open()).
+static pthread_mutex_t path_lock = PTHREAD_MUTEX_INITIALIZER;
+static int            xdp_handle  = -1;
+static unsigned char *umem        = NULL;
+static size_t         umem_mapped = 0;
+static uint64_t      *free_frames = NULL;   // Addresses of free frames; the top is the last entry.
+static int            free_count  = 0;
+static xdp_ring       transmit;
+static xdp_ring       completion;
+static uint32_t       transmit_produced   = 0;
+static uint32_t       completion_consumed = 0;
+
+// Each thread (or process) has its own rtnetlink socket for neighbor lookups.
+static _Thread_local int netlink_handle = -1;
+static _Thread_local uint32_t netlink_sequence = 0;
+
+
+int XdpPath_configure( const char *interface )
+{
+    struct ifreq request;
+    const char  *colon = strchr( interface, ':' );
+    size_t       name_length = colon != NULL ? (size_t)( colon - interface ) : strlen( interface );
+    int          handle;
+    int          result = -1;
+
+    if( name_length == 0 || name_length >= IF_NAMESIZE ) return -1;
+    memset( &request, 0, sizeof( request ) );
+    memcpy( request.ifr_name, interface, name_length );
+    if( (interface_index = if_nametoindex( request.ifr_name )) == 0 ) return -1;
+    first_queue = colon != NULL ? atoi( colon + 1 ) : 0;
+    strcpy( interface_name, request.ifr_name );
+
+    // Frames are only built for Ethernet.
+    if( (handle = socket( AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0 )) == -1 ) return -1;
+    if( ioctl( handle, SIOCGIFHWADDR, &request ) == 0 &&
+        request.ifr_hwaddr.sa_family == ARPHRD_ETHER ) {
+        memcpy( interface_address, request.ifr_hwaddr.sa_data, sizeof( interface_address ) );
+        if( ioctl( handle, SIOCGIFMTU, &request ) == 0 ) {
+            interface_mtu = request.ifr_mtu;
+            result = 0;
+        }
+    }
+    close( handle );
+    if( result == -1 ) interface_index = 0;
+    return result;
+}
+
+
+//
+// Map one of the socket's rings. Returns -1 if it can't be mapped.
+//
+static int map_ring(
+    xdp_ring *ring, const struct xdp_ring_offset *offsets, size_t entry_size, off_t page_offset )
+{
+    ring->map_length = offsets->desc + RING_SIZE * entry_size;
+    ring->map = mmap( NULL, ring->map_length, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, xdp_handle, page_offset );
+    if( ring->map == MAP_FAILED ) {
+        ring->map = NULL;
+        return -1;
+    }
+    ring->producer = (atomic_uint *)( (char *)ring->map + offsets->producer );
+    ring->consumer = (atomic_uint *)( (char *)ring->map + offsets->consumer );
+    ring->flags    = (atomic_uint *)( (char *)ring->map + offsets->flags );
+    ring->entries  = (char *)ring->map + offsets->desc;
+    return 0;
+}
+
+
+int XdpPath_open( int share )
+{
+    struct xdp_umem_reg     registration;
+    struct xdp_mmap_offsets offsets;
+    struct sockaddr_xdp     address;
+    socklen_t offsets_length = sizeof( offsets );
+    int ring_size = RING_SIZE;
+    int fill_size = FILL_RING_SIZE;
+    int i;
+
+    if( interface_index == 0 ) return -1;
+    XdpPath_close( );
+
+    memset( &registration, 0, sizeof( registration ) );
+    memset( &address, 0, sizeof( address ) );
+    address.sxdp_family   = AF_XDP;
+    address.sxdp_ifindex  = interface_index;
+    address.sxdp_queue_id = (uint32_t)( first_queue + share );
+    address.sxdp_flags    = XDP_USE_NEED_WAKEUP;
+
+    // The frames are node-local memory, like the cached copies they are filled from.
+    if( (xdp_handle = socket( AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0 )) == -1 ||
+        (umem = Topology_allocate( (size_t)FRAME_COUNT * FRAME_SIZE, &umem_mapped )) == NULL ||
+        (free_frames = malloc( FRAME_COUNT * sizeof( uint64_t ) )) == NULL ) {
+        goto failed;
+    }
+    registration.addr       = (uintptr_t)umem;
+    registration.len        = (uint64_t)FRAME_COUNT * FRAME_SIZE;
+    registration.chunk_size = FRAME_SIZE;
+    if( setsockopt( xdp_handle, SOL_XDP, XDP_UMEM_REG, &registration, sizeof( registration ) )
+            == -1 ||
+        setsockopt( xdp_handle, SOL_XDP, XDP_UMEM_FILL_RING, &fill_size, sizeof( int ) ) == -1 ||
+        setsockopt( xdp_handle, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof( int ) )
+            == -1 ||
+        setsockopt( xdp_handle, SOL_XDP, XDP_TX_RING, &ring_size, sizeof( int ) ) == -1 ||
+        getsockopt( xdp_handle, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &offsets_length ) == -1 ||
+        map_ring( &transmit, &offsets.tx, sizeof( struct xdp_desc ), XDP_PGOFF_TX_RING ) == -1 ||
+        map_ring( &completion, &offsets.cr, sizeof( uint64_t ),
+                  XDP_UMEM_PGOFF_COMPLETION_RING ) == -1 ||
+        bind( xdp_handle, (struct sockaddr *)&address, sizeof( address ) ) == -1 ) {
+        goto failed;
+    }
+
+    for( i = 0; i < FRAME_COUNT; ++i ) {
+        free_frames[i] = (uint64_t)( FRAME_COUNT - 1 - i ) * FRAME_SIZE;
+    }
+    free_count = FRAME_COUNT;
+    transmit_produced   = atomic_load( transmit.producer );
+    completion_consumed = atomic_load( completion.consumer );
+    return 0;
+
+failed:
+    fprintf( stderr, "AF_XDP is unavailable on %s queue %d (%s); DATA is sent through sockets\n",
+             interface_name, first_queue + share, strerror( errno ) );
+    XdpPath_close( );
+    return -1;
+}
+
+
+void XdpPath_close( void )
+{
+    if( transmit.map != NULL ) munmap( transmit.map, transmit.map_length );
+    if( completion.map != NULL ) munmap( completion.map, completion.map_length );
+    if( xdp_handle != -1 ) close( xdp_handle );
+    if( umem != NULL ) Topology_free( umem, umem_mapped );
+    free( free_frames );
+    memset( &transmit, 0, sizeof( transmit ) );
+    memset( &completion, 0, sizeof( completion ) );
+    xdp_handle  = -1;
+    umem        = NULL;
+    free_frames = NULL;
+    free_count  = 0;
+}
+
+
+//
+// Add data to an unfolded Internet checksum. Adding 32 bit words and folding at the end gives
+// the same one's complement sum as adding 16 bit words.
+//
+static uint32_t add_to_sum( uint32_t sum, const unsigned char *data, size_t length )
+{
+    uint64_t total = sum;
+
+    for( ; length >= 4; data += 4, length -= 4 ) {
+        total += ( (uint32_t)data[0] << 24 ) | ( (uint32_t)data[1] << 16 ) |
+                 ( (uint32_t)data[2] << 8 ) | data[3];
+    }
+    if( length >= 2 ) {
+        total += ( (uint32_t)data[0] << 8 ) | data[1];
+        data += 2;
+        length -= 2;
+    }
+    if( length == 1 ) total += (uint32_t)data[0] << 8;
+    while( total >> 16 ) total = ( total & 0xFFFF ) + ( total >> 16 );
+    return (uint32_t)total;
+}
+
+
+static uint16_t fold_sum( uint32_t sum )
+{
+    while( sum >> 16 ) sum = ( sum & 0xFFFF ) + ( sum >> 16 );
+    return (uint16_t)~sum;
+}
+
+
+static void put_16( unsigned char *where, unsigned value )
+{
+    where[0] = (unsigned char)( ( value >> 8 ) & 0xFF );
+    where[1] = (unsigned char)( value & 0xFF );
+}
+
+
+//
+// Look up a client's link layer address on the interface. Returns -1 if the kernel has no
+// usable entry for it.
+//
+static int find_neighbor( const unsigned char *client, size_t address_length, unsigned char *mac )
+{
+    struct {
+        struct nlmsghdr header;
+        struct ndmsg    message;
+        struct rtattr   attribute;
+        unsigned char   address[16];
+    } request;
+    union {
+        struct nlmsghdr header;
+        unsigned char   bytes[1024];
+    } reply;
+    const struct ndmsg  *entry;
+    const struct rtattr *attribute;
+    ssize_t count;
+    int     length;
+
+    if( netlink_handle == -1 &&
+        (netlink_handle = socket( AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE )) == -1 ) {
+        return -1;
+    }
+    memset( &request, 0, sizeof( request ) );
+    request.header.nlmsg_len      = NLMSG_LENGTH( sizeof( struct ndmsg ) ) +
+                                    RTA_LENGTH( address_length );
+    request.header.nlmsg_type     = RTM_GETNEIGH;
+    request.header.nlmsg_flags    = NLM_F_REQUEST;
+    request.header.nlmsg_seq      = ++netlink_sequence;
+    request.message.ndm_family    = address_length == 16 ? AF_INET6 : AF_INET;
+    request.message.ndm_ifindex   = (int)interface_index;
+    request.attribute.rta_type    = NDA_DST;
+    request.attribute.rta_len     = RTA_LENGTH( address_length );
+    memcpy( request.address, client, address_length );
+
+    // The kernel answers before send() returns.
+    if( send( netlink_handle, &request, request.header.nlmsg_len, 0 ) == -1 ) return -1;
+    do {
+        count = recv( netlink_handle, &reply, sizeof( reply ), MSG_DONTWAIT );
+    } while( count > 0 && reply.header.nlmsg_seq != netlink_sequence );
+    if( count < (ssize_t)NLMSG_LENGTH( sizeof( struct ndmsg ) ) ||
+        !NLMSG_OK( &reply.header, (unsigned)count ) ||
+        reply.header.nlmsg_type != RTM_NEWNEIGH ) {
+        return -1;
+    }
+
+    entry = NLMSG_DATA( &reply.header );
+    if( ( entry->ndm_state & USABLE_STATES ) == 0 ) return -1;
+    attribute = (const struct rtattr *)( (const char *)entry + NLMSG_ALIGN( sizeof( *entry ) ) );
+    length = (int)( reply.header.nlmsg_len - NLMSG_LENGTH( sizeof( *entry ) ) );
+    for( ; RTA_OK( attribute, length ); attribute = RTA_NEXT( attribute, length ) ) {
+        if( attribute->rta_type == NDA_LLADDR && RTA_PAYLOAD( attribute ) == 6 ) {
+            memcpy( mac, RTA_DATA( attribute ), 6 );
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+void XdpPath_attach(
+    xdp_flow *flow,
+    int socket_handle,
+    const struct sockaddr_in6 *client_address,
+    size_t largest_packet )
+{
+    struct sockaddr_in6 local_address;
+    socklen_t local_length = sizeof( local_address );
+    const unsigned char *source;
+    const unsigned char *destination;
+    unsigned char *ip  = flow->header + ETHERNET_HEADER_LENGTH;
+    unsigned char *udp;
+    size_t address_length;
+
+    if( flow->active || flow->attempts >= MAX_ATTEMPTS || xdp_handle == -1 ) return;
+    ++flow->attempts;
+
+    // IPv4 clients appear as IPv4-mapped IPv6 addresses.
+    flow->ipv6 = !IN6_IS_ADDR_V4MAPPED( &client_address->sin6_addr );
+    address_length = flow->ipv6 ? 16 : 4;
+    flow->header_length = ETHERNET_HEADER_LENGTH + UDP_HEADER_LENGTH +
+                          ( flow->ipv6 ? IPV6_HEADER_LENGTH : IPV4_HEADER_LENGTH );
+    if( flow->header_length + largest_packet > FRAME_SIZE ||
+        flow->header_length - ETHERNET_HEADER_LENGTH + largest_packet > (size_t)interface_mtu ||
+        getsockname( socket_handle, (struct sockaddr *)&local_address, &local_length ) == -1 ||
+        local_address.sin6_family != AF_INET6 ) {
+        flow->attempts = MAX_ATTEMPTS;
+        return;
+    }
+    source      = local_address.sin6_addr.s6_addr + 16 - address_length;
+    destination = client_address->sin6_addr.s6_addr + 16 - address_length;
+    if( find_neighbor( destination, address_length, flow->header ) == -1 ) return;
+
+    memcpy( flow->header + 6, interface_address, 6 );
+    memset( ip, 0, flow->header_length - ETHERNET_HEADER_LENGTH );
+    if( flow->ipv6 ) {
+        put_16( flow->header + 12, 0x86DD );
+        ip[0] = 0x60;
+        ip[6] = IPPROTO_UDP;
+        ip[7] = 64;                   // Hop limit.
+        memcpy( ip + 8, source, 16 );
+        memcpy( ip + 24, destination, 16 );
+        udp = ip + IPV6_HEADER_LENGTH;
+        flow->header_sum = 0;
+    }
+    else {
+        put_16( flow->header + 12, 0x0800 );
+        ip[0] = 0x45;
+        ip[6] = 0x40;                 // Don't fragment; the identification is then unused.
+        ip[8] = 64;                   // Time to live.
+        ip[9] = IPPROTO_UDP;
+        memcpy( ip + 12, source, 4 );
+        memcpy( ip + 16, destination, 4 );
+        udp = ip + IPV4_HEADER_LENGTH;
+        flow->header_sum = add_to_sum( 0, ip, IPV4_HEADER_LENGTH );
+    }
+    memcpy( udp, &local_address.sin6_port, 2 );
+    memcpy( udp + 2, &client_address->sin6_port, 2 );
+
+    // The pseudo header and the UDP header, less the length (which appears in both).
+    flow->pseudo_sum = add_to_sum( add_to_sum( IPPROTO_UDP, source, address_length ),
+                                   destination, address_length );
+    flow->pseudo_sum = add_to_sum( flow->pseudo_sum, udp, 4 );
+    flow->active = 1;
+}
+
+
+//
+// Move the frames the kernel has finished with back to the free stack. The lock must be held.
+//
+static void reclaim_frames( void )
+{
+    const uint64_t *addresses = completion.entries;
+    uint32_t produced = atomic_load_explicit( completion.producer, memory_order_acquire );
+
+    while( completion_consumed != produced ) {
+        free_frames[free_count++] = addresses[completion_consumed++ & ( RING_SIZE - 1 )];
+    }
+    atomic_store_explicit( completion.consumer, completion_consumed, memory_order_release );
+}
+
+
+unsigned char *XdpPath_frame( const xdp_flow *flow, uint64_t *frame )
+{
+    pthread_mutex_lock( &path_lock );
+    if( free_count == 0 ) reclaim_frames( );
+    if( free_count == 0 ) {
+        pthread_mutex_unlock( &path_lock );
+        XdpPath_flush( );
+        pthread_mutex_lock( &path_lock );
+        reclaim_frames( );
+    }
+    if( free_count == 0 ) {
+        pthread_mutex_unlock( &path_lock );
+        return NULL;
+    }
+    *frame = free_frames[--free_count];
+    pthread_mutex_unlock( &path_lock );
+    return umem + *frame + flow->header_length;
+}
+
+
+void XdpPath_send( const xdp_flow *flow, uint64_t frame, size_t packet_length )
+{
+    unsigned char   *ip  = umem + frame + ETHERNET_HEADER_LENGTH;
+    unsigned char   *udp = umem + frame + flow->header_length - UDP_HEADER_LENGTH;
+    unsigned         udp_length = (unsigned)( UDP_HEADER_LENGTH + packet_length );
+    uint16_t         checksum;
+    struct xdp_desc *descriptor;
+
+    memcpy( umem + frame, flow->header, flow->header_length );
+    if( flow->ipv6 ) {
+        put_16( ip + 4, udp_length );
+    }
+    else {
+        put_16( ip + 2, IPV4_HEADER_LENGTH + udp_length );
+        put_16( ip + 10, fold_sum( flow->header_sum + IPV4_HEADER_LENGTH + udp_length ) );
+    }
+    put_16( udp + 4, udp_length );
+    checksum = fold_sum(
+        add_to_sum( flow->pseudo_sum + 2 * udp_length, udp + UDP_HEADER_LENGTH, packet_length ) );
+    put_16( udp + 6, checksum == 0 ? 0xFFFF : checksum );
+
+    pthread_mutex_lock( &path_lock );
+    descriptor = (struct xdp_desc *)transmit.entries + ( transmit_produced & ( RING_SIZE - 1 ) );
+    descriptor->addr    = frame;
+    descriptor->len     = (uint32_t)( flow->header_length + packet_length );
+    descriptor->options = 0;
+    atomic_store_explicit( transmit.producer, ++transmit_produced, memory_order_release );
+    pthread_mutex_unlock( &path_lock );
+}
+
+
+void XdpPath_discard( uint64_t frame )
+{
+    pthread_mutex_lock( &path_lock );
+    free_frames[free_count++] = frame;
+    pthread_mutex_unlock( &path_lock );
+}
+
+
+void XdpPath_flush( void )
+{
+    uint32_t consumed;
+    uint32_t previous;
+
+    if( xdp_handle == -1 ) return;
+
+    // In copy mode the kernel sends a limited batch per call, so it is called again as long as
+    // it makes progress. Whatever it leaves is sent by the next flush.
+    consumed = atomic_load_explicit( transmit.consumer, memory_order_acquire );
+    while( consumed != atomic_load_explicit( transmit.producer, memory_order_relaxed ) &&
+           ( atomic_load_explicit( transmit.flags, memory_order_relaxed ) &
+             XDP_RING_NEED_WAKEUP ) != 0 ) {
+        previous = consumed;
+        if( sendto( xdp_handle, NULL, 0, MSG_DONTWAIT, NULL, 0 ) == -1 &&
+            errno != EAGAIN && errno != EBUSY && errno != ENOBUFS ) {
+            break;
+        }
+        consumed = atomic_load_explicit( transmit.consumer, memory_order_acquire );
+        if( consumed == previous ) break;
+    }
+}
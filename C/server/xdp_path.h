@@ -0,0 +1,119 @@
+/*!
+ * \file xdp_path.h
+ * \author Peter C. Chapin
+ * \brief Interface to the AF_XDP path for DATA packets.
+ *
+ * When many clients boot at once, the server spends most of its time in the kernel's UDP send
+ * path. With an interface configured, DATA packets bypass that path: each is written, complete
+ * with its Ethernet, IP, and UDP headers, into a frame of a memory area shared with the kernel
+ * (the UMEM) and queued on the transmit ring of an AF_XDP socket. The file data is read or
+ * copied straight into the frame, so nothing is copied after that. Large windows are queued
+ * whole and the kernel is told about them once.
+ *
+ * Only DATA packets take this path. A transfer's socket still receives its ACKs, so the kernel
+ * keeps filtering stray transfer IDs (see Transfer_open()), and the source port of every frame
+ * is that socket's port. Requests, OACKs, ERRORs, and the DATA of transfers the path can't
+ * carry go through the socket as before. A transfer can use the path if
+ *
+ * - its client is a neighbor on the configured interface (the kernel's neighbor table has the
+ *   client's link layer address), and
+ * - its DATA packets fit in the interface's MTU without fragmentation.
+ *
+ * If the interface or queue can't be bound, or the kernel lacks AF_XDP, the server warns and
+ * uses its sockets for everything. A frame that can't be had when a packet is sent (all of them
+ * are waiting for the kernel) also means that packet goes through the socket.
+ *
+ * The socket is bound in whatever mode the driver supports: zero copy where the driver has it,
+ * otherwise copy mode, which works on any interface (including veth). No XDP program is needed
+ * to transmit. The sockets belong to one process: the threaded server has one, shared by its
+ * threads; each pre-forked worker binds the next queue of the interface. A child forked per
+ * request does not use the path.
+ */
+
+#ifndef XDP_PATH_H_INCLUDED
+#define XDP_PATH_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+//! Room for the Ethernet (14 bytes), IPv6 (40), and UDP (8) headers of a frame.
+#define XDP_HEADER_SPACE 62
+
+//! How one transfer's DATA packets are sent through the path.
+typedef struct {
+    int           active;          //!< Non-zero if DATA packets take the path.
+    int           attempts;        //!< Number of times the transfer was checked for the path.
+    int           ipv6;            //!< Non-zero for IPv6 frames, zero for IPv4 frames.
+    size_t        header_length;   //!< Number of bytes of headers before the TFTP packet.
+    uint32_t      header_sum;      //!< Unfolded checksum of the fixed IPv4 header fields.
+    uint32_t      pseudo_sum;      //!< Unfolded checksum of the fixed UDP pseudo header fields.
+    unsigned char header[XDP_HEADER_SPACE];  //!< Headers of every frame, less lengths and sums.
+} xdp_flow;
+
+//! Set the interface DATA packets are sent on.
+/*!
+ * \param interface The interface name, optionally followed by ":" and the first queue to use
+ * (0 by default).
+ *
+ * \return 0 if successful; -1 if there is no such interface.
+ */
+int XdpPath_configure( const char *interface );
+
+//! Create the calling process's AF_XDP socket and bind it to its queue.
+/*!
+ * Nothing is done if no interface was configured. A warning is printed if the socket can't be
+ * made, and DATA packets are then sent through sockets. Calling this again, as a recycled worker
+ * does, replaces the socket.
+ *
+ * \param share The process's index. It is bound to the configured queue plus this.
+ *
+ * \return 0 if the path is in use; -1 otherwise.
+ */
+int XdpPath_open( int share );
+
+//! Release the calling process's AF_XDP socket and its memory.
+void XdpPath_close( void );
+
+//! Find out if a transfer can use the path and prepare its frame headers if it can.
+/*!
+ * The check is cheap once the outcome is known, so it may be repeated freely. A client the
+ * kernel has not yet resolved is looked for again on the next call, once.
+ *
+ * \param flow The transfer's flow (zeroed before the first call).
+ * \param socket_handle The transfer's connected socket.
+ * \param client_address The client.
+ * \param largest_packet The size of the transfer's largest TFTP packet.
+ */
+void XdpPath_attach(
+    xdp_flow *flow,
+    int socket_handle,
+    const struct sockaddr_in6 *client_address,
+    size_t largest_packet );
+
+//! Take a frame for a packet of the given flow.
+/*!
+ * \param flow An active flow.
+ * \param frame Receives the frame, for XdpPath_send() or XdpPath_discard().
+ *
+ * \return Where to write the TFTP packet, or NULL if no frame is free.
+ */
+unsigned char *XdpPath_frame( const xdp_flow *flow, uint64_t *frame );
+
+//! Complete a frame's headers and queue it for transmission.
+/*!
+ * The frame is not necessarily sent until XdpPath_flush() is called.
+ *
+ * \param flow The flow the frame was taken for.
+ * \param frame The frame from XdpPath_frame().
+ * \param packet_length The size of the TFTP packet written to the frame.
+ */
+void XdpPath_send( const xdp_flow *flow, uint64_t frame, size_t packet_length );
+
+//! Return a frame from XdpPath_frame() that won't be sent.
+void XdpPath_discard( uint64_t frame );
+
+//! Have the kernel transmit the frames that have been queued.
+void XdpPath_flush( void );
+
+#endif // XDP_PATH_H_INCLUDED
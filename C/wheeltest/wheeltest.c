@@ -0,0 +1,273 @@
+/*!
+ * \file wheeltest.c
+ * \author Peter C. Chapin
+ * \brief Check that the server's timing wheel expires timers in order and on time.
+ *
+ * Usage: wheeltest [seed]
+ *
+ * Timers are armed at deltas on either side of every level boundary (63/64 ticks, 4095/4096
+ * ticks, and so on up to and beyond the span of the wheel) from several starting times, after
+ * long idle gaps, and at random among re-arms and cancellations. The wheel is driven both one
+ * call per wait the way the event loop drives it (advancing to TimerWheel_next_expiry()) and in
+ * large jumps. Every timer must expire exactly once, on the tick it was armed for, with expiry
+ * times never decreasing. The exit status is zero if every check passed.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timer_wheel.h"
+
+// Span of each level of the wheel, in ticks.
+#define LEVEL_SPAN( level ) ( 1LL << ( TIMER_SLOT_BITS * ( level ) ) )
+
+// Number of timers in the random test.
+#define RANDOM_TIMERS 2000
+
+typedef struct {
+    TimerEntry entry;              // Must be first; the callback casts back from it.
+    long long  expected;           // Tick at which the timer should expire.
+    int        fired;              // Number of times the timer has expired.
+} test_timer;
+
+typedef struct {
+    TimerWheel *wheel;
+    long long   last_tick;         // Time of the previous expiry.
+    long long   fired;             // Number of expiries seen.
+} expiry_log;
+
+static int failures = 0;
+
+
+static void check( int condition, const char *description, long long detail )
+{
+    if( !condition ) {
+        fprintf( stderr, "FAILED: %s (%lld)\n", description, detail );
+        ++failures;
+    }
+}
+
+
+static void record_expiry( TimerEntry *entry, void *context )
+{
+    test_timer *timer = (test_timer *)entry;
+    expiry_log *log   = context;
+    long long   tick  = log->wheel->current;
+
+    check( tick == timer->expected, "timer expires on the tick it was armed for",
+           tick - timer->expected );
+    check( tick >= log->last_tick, "expiry times never decrease", tick );
+    check( !TimerEntry_armed( entry ), "an expired timer is disarmed", tick );
+    log->last_tick = tick;
+    ++log->fired;
+    ++timer->fired;
+}
+
+
+// A small, fast generator for the random test.
+static uint64_t next_random( uint64_t *state )
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+
+// Drive the wheel the way the event loop does: wait until the next expiry it reports and
+// advance to that time, until the wheel is empty or the given time is reached. Returns the
+// number of waits.
+static long long run_event_loop( TimerWheel *wheel, expiry_log *log, long long until )
+{
+    long long waits = 0;
+    long long next;
+
+    while( (next = TimerWheel_next_expiry( wheel )) != -1 && next <= until ) {
+        check( next > wheel->current, "the next expiry is in the future", next );
+        TimerWheel_advance( wheel, next, record_expiry, log );
+        ++waits;
+    }
+    return waits;
+}
+
+
+// ================
+// Level boundaries
+// ================
+
+static const long long boundary_deltas[] = {
+    1, 2, 62, 63, 64, 65, 127, 128, 4094, 4095, 4096, 4097, 8191, 8192,
+    262143, 262144, 262145, 16777214, 16777215, 16777216, 16777217, 20000000
+};
+
+#define BOUNDARY_COUNT ( sizeof( boundary_deltas ) / sizeof( boundary_deltas[0] ) )
+
+
+// Arm one timer at each boundary delta from the given start and check each expires on time.
+// With jump non-zero the wheel is advanced in steps of that size; otherwise event loop style.
+static void check_boundaries( long long start, long long jump )
+{
+    static TimerWheel wheel;
+    test_timer timers[BOUNDARY_COUNT];
+    expiry_log log = { &wheel, start, 0 };
+    long long  end = start + boundary_deltas[BOUNDARY_COUNT - 1];
+    long long  waits;
+    long long  next;
+    size_t i;
+
+    TimerWheel_initialize( &wheel, start );
+    for( i = 0; i < BOUNDARY_COUNT; ++i ) {
+        TimerEntry_initialize( &timers[i].entry );
+        timers[i].expected = start + boundary_deltas[i];
+        timers[i].fired    = 0;
+        TimerWheel_arm( &wheel, &timers[i].entry, timers[i].expected );
+    }
+
+    // The wheel may ask to be woken early to cascade, but never after the earliest timer.
+    next = TimerWheel_next_expiry( &wheel );
+    check( next != -1 && next <= start + 1, "the next expiry covers the earliest timer", next );
+
+    if( jump == 0 ) {
+        waits = run_event_loop( &wheel, &log, end );
+        // One wait per timer plus at most one per cascade of each level, not one per tick.
+        check( waits < (long long)BOUNDARY_COUNT * ( 1 + TIMER_SLOTS * TIMER_LEVELS ),
+               "the event loop waits a bounded number of times", waits );
+    }
+    else {
+        for( next = start; next < end; ) {
+            next = next + jump < end ? next + jump : end;
+            TimerWheel_advance( &wheel, next, record_expiry, &log );
+        }
+    }
+
+    for( i = 0; i < BOUNDARY_COUNT; ++i ) {
+        check( timers[i].fired == 1, "each boundary timer expires once", boundary_deltas[i] );
+    }
+    check( TimerWheel_next_expiry( &wheel ) == -1, "the wheel is empty afterward", start );
+}
+
+
+// ================
+// Idle gaps
+// ================
+
+static void check_idle_gaps( void )
+{
+    static TimerWheel wheel;
+    test_timer timer;
+    expiry_log log = { &wheel, 0, 0 };
+    long long  gaps[] = { 1, 63, 64, 4096, 262144, 16777216, 1000000007LL };
+    size_t i;
+
+    TimerWheel_initialize( &wheel, 0 );
+    TimerEntry_initialize( &timer.entry );
+    for( i = 0; i < sizeof( gaps ) / sizeof( gaps[0] ); ++i ) {
+        // An empty wheel skips the gap at once; a timer armed afterward is relative to its end.
+        long long idle_end = wheel.current + gaps[i];
+
+        TimerWheel_advance( &wheel, idle_end, record_expiry, &log );
+        check( wheel.current == idle_end, "an empty wheel advances over an idle gap", gaps[i] );
+        log.last_tick  = idle_end;
+        timer.expected = idle_end + 100;
+        timer.fired    = 0;
+        TimerWheel_arm( &wheel, &timer.entry, timer.expected );
+        run_event_loop( &wheel, &log, idle_end + 100 );
+        check( timer.fired == 1, "a timer armed after an idle gap expires", gaps[i] );
+
+        // A single long timer across the gap, reached in one call.
+        timer.expected = wheel.current + gaps[i];
+        timer.fired    = 0;
+        TimerWheel_arm( &wheel, &timer.entry, timer.expected );
+        TimerWheel_advance( &wheel, timer.expected - 1, record_expiry, &log );
+        check( TimerEntry_armed( &timer.entry ), "a timer does not expire early", gaps[i] );
+        TimerWheel_advance( &wheel, timer.expected + gaps[i], record_expiry, &log );
+        check( timer.fired == 1, "a timer spanning the gap expires", gaps[i] );
+    }
+}
+
+
+// ================
+// Random arms, re-arms and cancellations
+// ================
+
+static void check_random( uint64_t seed )
+{
+    static TimerWheel wheel;
+    static test_timer timers[RANDOM_TIMERS];
+    expiry_log log = { &wheel, 0, 0 };
+    long long  armed_count = 0;
+    long long  fired_during_run = 0;
+    long long  step;
+    long long  before;
+    int round;
+    int i;
+
+    TimerWheel_initialize( &wheel, (long long)( next_random( &seed ) % 1000000 ) );
+    log.last_tick = wheel.current;
+    for( i = 0; i < RANDOM_TIMERS; ++i ) TimerEntry_initialize( &timers[i].entry );
+
+    for( round = 0; round < 2000; ++round ) {
+        // Touch a few timers: arm, re-arm, or cancel them. Deltas cluster near the levels.
+        for( i = 0; i < 20; ++i ) {
+            test_timer *timer = &timers[next_random( &seed ) % RANDOM_TIMERS];
+            int level = (int)( next_random( &seed ) % ( TIMER_LEVELS + 1 ) );
+            long long delta = 1 + (long long)( next_random( &seed ) % LEVEL_SPAN( level ) );
+
+            if( TimerEntry_armed( &timer->entry ) ) {
+                --armed_count;
+                if( next_random( &seed ) % 4 == 0 ) {
+                    TimerWheel_cancel( &wheel, &timer->entry );
+                    check( !TimerEntry_armed( &timer->entry ), "cancel disarms", round );
+                    continue;
+                }
+            }
+            timer->expected = wheel.current + delta;
+            timer->fired    = 0;
+            TimerWheel_arm( &wheel, &timer->entry, timer->expected );
+            ++armed_count;
+        }
+
+        // Advance by a random amount, now and then past a level 2 slot or two.
+        step   = 1 + (long long)( next_random( &seed ) % LEVEL_SPAN( 1 + round % 3 ) );
+        before = log.fired;
+        TimerWheel_advance( &wheel, wheel.current + step, record_expiry, &log );
+        armed_count      -= log.fired - before;
+        fired_during_run += log.fired - before;
+        check( armed_count == (long long)wheel.count, "the wheel counts its timers", round );
+    }
+
+    // Drain the rest and make sure nothing is left behind or expired twice.
+    run_event_loop( &wheel, &log, wheel.current + 2 * LEVEL_SPAN( TIMER_LEVELS ) );
+    check( wheel.count == 0, "every random timer expires", (long long)wheel.count );
+    for( i = 0; i < RANDOM_TIMERS; ++i ) {
+        check( timers[i].fired <= 1, "no random timer expires twice", i );
+    }
+    printf( "random: %lld expiries during the run, %lld at the end\n",
+            fired_during_run, log.fired - fired_during_run );
+}
+
+
+int main( int argc, char **argv )
+{
+    static const long long starts[] = { 0, 63, 4095, 262143, 987654321 };
+    uint64_t seed = argc > 1 ? strtoull( argv[1], NULL, 10 ) : 88172645463325252ULL;
+    size_t i;
+
+    if( seed == 0 ) seed = 1;
+    for( i = 0; i < sizeof( starts ) / sizeof( starts[0] ); ++i ) {
+        check_boundaries( starts[i], 0 );
+        check_boundaries( starts[i], 5000000 );
+    }
+    printf( "boundaries: done\n" );
+    check_idle_gaps( );
+    printf( "idle gaps: done\n" );
+    check_random( seed );
+
+    if( failures > 0 ) {
+        fprintf( stderr, "%d check(s) failed\n", failures );
+        return EXIT_FAILURE;
+    }
+    printf( "All checks passed\n" );
+    return EXIT_SUCCESS;
+}
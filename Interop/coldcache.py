@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+#
+# FILE   : coldcache.py
+# SUBJECT: Cold-cache throughput of the C server with and without page cache hints.
+#
+# A large file is written to the given directory, dropped from the page cache before every run,
+# and fetched over loopback by the reference client of interop.py. The C server is run once
+# with only the kernel's read ahead (-R 0) and once with each of the hint configurations below,
+# and the median throughput of each is reported.
+#
+# Usage: coldcache.py [--directory dir] [--size MiB] [--runs n] [--readahead MiB]
+#                     [--c-server path]
+#
+# The directory must be on a disk (or network file system) for the numbers to mean anything: a
+# tmpfs has no backing store to read from and ignores the request to drop its pages.
+#
+
+import argparse
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+import interop
+
+
+def evict(path):
+    with open(path, "rb") as f:
+        os.fsync(f.fileno())
+        os.posix_fadvise(f.fileno(), 0, 0, os.POSIX_FADV_DONTNEED)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare cold-cache transfer throughput.")
+    parser.add_argument("--directory", default=".", help="where to put the test file")
+    parser.add_argument("--size", type=int, default=512, help="size of the test file (MiB)")
+    parser.add_argument("--runs", type=int, default=3, help="runs per configuration")
+    parser.add_argument("--readahead", type=int, default=16, help="read ahead limit (MiB)")
+    parser.add_argument("--c-server", help="C server executable (default: compile C/server)")
+    arguments = parser.parse_args()
+
+    work = tempfile.mkdtemp(prefix="tftp-coldcache-")
+    files = tempfile.mkdtemp(prefix="tftp-coldcache-", dir=arguments.directory)
+    configurations = [
+        ("kernel read ahead only", ["-R", "0"]),
+        ("read ahead %d MiB" % arguments.readahead, ["-R", str(arguments.readahead)]),
+        ("read ahead and drop behind",
+         ["-R", str(arguments.readahead), "-D", str(max(arguments.size // 2, 1))]),
+    ]
+    server = None
+    try:
+        path = arguments.c_server or interop.build_c("server", work)
+        name = "large.bin"
+        with open(os.path.join(files, name), "wb") as f:
+            for _ in range(arguments.size):
+                f.write(os.urandom(1 << 20))
+
+        print("| configuration | median MB/s | runs |")
+        print("|---|---|---|")
+        for title, flags in configurations:
+            port = interop.free_port()
+            server = subprocess.Popen([path] + flags + [str(port)], cwd=files,
+                                      stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+            time.sleep(0.3)
+            rates = []
+            for _ in range(arguments.runs):
+                evict(os.path.join(files, name))
+                started = time.monotonic()
+                failure = interop.reference_get(
+                    port, name, {"blksize": "1428", "windowsize": "16"}, os.devnull)
+                if failure is not None:
+                    print("%s: %s" % (title, failure), file=sys.stderr)
+                    return 1
+                rates.append(arguments.size * (1 << 20) / (time.monotonic() - started) / 1e6)
+            server.kill()
+            server.wait()
+            server = None
+            print("| %s | %.1f | %s |" % (
+                title, statistics.median(rates), ", ".join("%.1f" % r for r in rates)))
+        return 0
+    except interop.Skipped as ex:
+        print("C server skipped: %s" % ex, file=sys.stderr)
+        return 1
+    finally:
+        if server is not None:
+            server.kill()
+            server.wait()
+        shutil.rmtree(work, ignore_errors=True)
+        shutil.rmtree(files, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+#
+# FILE   : firstblock.py
+# SUBJECT: Time to first block of the C server with and without its low latency mode.
+#
+# A client sends read requests one after another, with a pause between them as PXE clients
+# booting in turn would, and measures the time from sending each RRQ to receiving the first
+# DATA packet. The C server is run in each of the configurations below and a histogram of the
+# times is reported for each, along with the median and tail.
+#
+# Usage: firstblock.py [--requests n] [--pause ms] [--spin us] [--c-server path]
+#
+# The server's own view of the same times is the tftp_first_block_seconds histogram its
+# metrics exporter publishes (-m).
+#
+
+import argparse
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+import interop
+
+# Upper bounds (microseconds) of the histogram buckets, as in the server's exporter.
+BOUNDS = [10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000]
+
+
+def first_block(port, name):
+    """Return the time (us) to the first DATA packet of one transfer, or None if it failed."""
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as sock:
+        sock.settimeout(2)
+        request = struct.pack("!H", 1) + name.encode() + b"\0octet\0"
+        started = time.perf_counter()
+        sock.sendto(request, ("127.0.0.1", port))
+        try:
+            data, address = sock.recvfrom(1024)
+        except socket.timeout:
+            return None
+        elapsed = (time.perf_counter() - started) * 1e6
+        if struct.unpack("!H", data[:2])[0] != 3:
+            return None
+
+        # Finish the transfer so the server isn't left retransmitting.
+        while True:
+            sock.sendto(struct.pack("!H", 4) + data[2:4], address)
+            if len(data) < 516:
+                return elapsed
+            try:
+                data = sock.recvfrom(1024)[0]
+            except socket.timeout:
+                return elapsed
+
+
+def percentile(values, fraction):
+    ordered = sorted(values)
+    return ordered[min(int(fraction * len(ordered)), len(ordered) - 1)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare time to first block.")
+    parser.add_argument("--requests", type=int, default=1000, help="requests per configuration")
+    parser.add_argument("--pause", type=float, default=1.0, help="pause between requests (ms)")
+    parser.add_argument("--spin", type=int, default=200, help="listener spin time (us)")
+    parser.add_argument("--c-server", help="C server executable (default: compile C/server)")
+    arguments = parser.parse_args()
+
+    work = tempfile.mkdtemp(prefix="tftp-firstblock-")
+    files = os.path.join(work, "files")
+    os.mkdir(files)
+    configurations = [
+        ("fork per request", []),
+        ("fork per request, low latency", ["-L", str(arguments.spin)]),
+        ("4 threads", ["-t", "4"]),
+        ("4 threads, low latency", ["-t", "4", "-L", str(arguments.spin)]),
+    ]
+    server = None
+    try:
+        path = arguments.c_server or interop.build_c("server", work)
+        name = "pxelinux.0"
+        with open(os.path.join(files, name), "wb") as f:
+            f.write(os.urandom(2000))
+
+        print("| configuration | median us | 99th us | " +
+              " | ".join("<=%d" % bound for bound in BOUNDS) + " | more | failed |")
+        print("|---" * (len(BOUNDS) + 5) + "|")
+        for title, flags in configurations:
+            port = interop.free_port()
+            server = subprocess.Popen([path] + flags + [str(port)], cwd=files,
+                                      stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+            time.sleep(0.3)
+            times = []
+            failed = 0
+            for _ in range(arguments.requests):
+                elapsed = first_block(port, name)
+                if elapsed is None:
+                    failed += 1
+                else:
+                    times.append(elapsed)
+                time.sleep(arguments.pause / 1000)
+            server.kill()
+            server.wait()
+            server = None
+            if not times:
+                print("%s: every request failed" % title, file=sys.stderr)
+                return 1
+
+            counts = [0] * (len(BOUNDS) + 1)
+            for elapsed in times:
+                counts[next((i for i, bound in enumerate(BOUNDS) if elapsed <= bound),
+                            len(BOUNDS))] += 1
+            print("| %s | %.0f | %.0f | %s | %d |" % (
+                title, percentile(times, 0.5), percentile(times, 0.99),
+                " | ".join(str(count) for count in counts), failed))
+        return 0
+    except interop.Skipped as ex:
+        print("C server skipped: %s" % ex, file=sys.stderr)
+        return 1
+    finally:
+        if server is not None:
+            server.kill()
+            server.wait()
+        shutil.rmtree(work, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,563 @@
+#!/usr/bin/env python3
+#
+# FILE   : interop.py
+# SUBJECT: Interoperability and performance matrix for the TFTP clients and servers.
+#
+# Every client (C, Java, and a reference client defined here) is run against every server (C,
+# Java, and a stand-in for a stock tftpd defined here) over loopback, for each of a set of cases
+# covering the negotiated options (blksize, windowsize, tsize, timeout) and block number
+# rollover. Each run is checked for byte-identical output and timed, and the results are
+# written as one matrix.
+#
+# Usage: interop.py [--report file] [--c-server path] [--c-client path] [--java-server dir]
+#                   [--java-client dir] [--keep]
+#
+# Without explicit paths the C programs are compiled from C/ with cc and the Java programs with
+# javac. An implementation that can't be built is reported as skipped rather than failed. The
+# exit status is the number of failed cells.
+#
+# The stand-in server and reference client are deliberately plain: one thread per transfer,
+# no extensions beyond the standard options, block numbers wrapping to zero as most stock
+# implementations do. "interop.py --serve port" runs the stand-in server alone.
+#
+
+import argparse
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+OPCODE_RRQ = 1
+OPCODE_DATA = 3
+OPCODE_ACK = 4
+OPCODE_ERROR = 5
+OPCODE_OACK = 6
+
+# Time allowed for one transfer before the client is killed.
+RUN_TIMEOUT = 120
+
+# Libraries (directories under C) compiled into each C program besides common.
+C_LIBRARIES = {"client": ["libtftpclient"]}
+
+# Files served to every client. The rollover file has more than 65535 blocks of the default size
+# so that the 16 bit block number wraps.
+FILES = {
+    "empty.bin": 0,
+    "short.bin": 511,
+    "exact.bin": 512,
+    "small.bin": 1025,
+    "medium.bin": 1000000,
+    "rollover.bin": 65536 * 512 + 100,
+}
+
+# The cases: name, file, and the options asked for. A client that can't ask for exactly those
+# options is not run for the case.
+CASES = [
+    ("plain", "small.bin", {}),
+    ("empty", "empty.bin", {}),
+    ("short block", "short.bin", {}),
+    ("exact block", "exact.bin", {}),
+    ("blksize 1428", "medium.bin", {"blksize": "1428"}),
+    ("blksize 8", "small.bin", {"blksize": "8"}),
+    ("windowsize 16", "medium.bin", {"blksize": "1428", "windowsize": "16"}),
+    ("tsize", "medium.bin", {"tsize": "0"}),
+    ("timeout 2", "small.bin", {"timeout": "2"}),
+    ("rollover", "rollover.bin", {}),
+    ("rollover blksize 1428", "rollover.bin", {"blksize": "1428", "windowsize": "16"}),
+
+    # Extensions of the C programs. Other servers must ignore them and the C client must cope.
+    ("digest", "medium.bin", {"digest": "crc32c"}),
+    ("compress", "medium.bin", {"compress": "zlib"}),
+]
+
+STANDARD_OPTIONS = {"blksize", "windowsize", "tsize", "timeout"}
+
+
+# ----------------------------------------------------------------------------------------------
+# Stand-in server
+# ----------------------------------------------------------------------------------------------
+
+def send_error(sock, address, code, message):
+    sock.sendto(struct.pack("!HH", OPCODE_ERROR, code) + message.encode() + b"\0", address)
+
+
+def parse_strings(data):
+    return data.split(b"\0")[:-1]
+
+
+def serve_transfer(path, address, options):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("127.0.0.1", 0))
+    sock.connect(address)
+    block_size, window_size, timeout = 512, 1, 1.0
+    accepted = []
+    try:
+        with open(path, "rb") as f:
+            content = f.read()
+    except OSError:
+        send_error(sock, address, 1, "File not found")
+        return
+
+    for name, value in options.items():
+        try:
+            number = int(value)
+        except ValueError:
+            continue
+        if name == "blksize" and number >= 8:
+            block_size = min(number, 65464)
+            accepted.append((name, block_size))
+        elif name == "windowsize" and number >= 1:
+            window_size = min(number, 64)
+            accepted.append((name, window_size))
+        elif name == "timeout" and 1 <= number <= 255:
+            timeout = float(number)
+            accepted.append((name, number))
+        elif name == "tsize":
+            accepted.append((name, len(content)))
+
+    last = len(content) // block_size + 1
+    sock.settimeout(timeout)
+
+    def block(n):
+        data = content[(n - 1) * block_size:n * block_size]
+        return struct.pack("!HH", OPCODE_DATA, n & 0xFFFF) + data
+
+    acked = 0
+    retries = 0
+    if accepted:
+        oack = struct.pack("!H", OPCODE_OACK)
+        oack += b"".join(b"%s\0%d\0" % (n.encode(), v) for n, v in accepted)
+        while True:
+            sock.send(oack)
+            try:
+                reply = sock.recv(516)
+            except socket.timeout:
+                retries += 1
+                if retries > 5:
+                    return
+                continue
+            except OSError:
+                return
+            opcode, number = struct.unpack("!HH", reply[:4])
+            if opcode == OPCODE_ACK and number == 0:
+                break
+            if opcode == OPCODE_ERROR:
+                return
+
+    retries = 0
+    while acked < last:
+        for n in range(acked + 1, min(acked + window_size, last) + 1):
+            sock.send(block(n))
+        try:
+            reply = sock.recv(516)
+        except socket.timeout:
+            retries += 1
+            if retries > 5:
+                return
+            continue
+        except OSError:
+            return
+        if len(reply) < 4:
+            continue
+        opcode, number = struct.unpack("!HH", reply[:4])
+        if opcode == OPCODE_ERROR:
+            return
+        if opcode != OPCODE_ACK:
+            continue
+        advance = (number - acked) & 0xFFFF
+        if 0 < advance <= min(window_size, last - acked):
+            acked += advance
+            retries = 0
+
+
+def stand_in_server(port, directory):
+    listener = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    listener.bind(("127.0.0.1", port))
+    while True:
+        request, address = listener.recvfrom(512)
+        if struct.unpack("!H", request[:2])[0] != OPCODE_RRQ:
+            send_error(listener, address, 4, "Illegal TFTP operation")
+            continue
+        fields = parse_strings(request[2:])
+        if len(fields) < 2:
+            send_error(listener, address, 4, "Illegal TFTP operation")
+            continue
+        name = os.path.basename(fields[0].decode(errors="replace"))
+        options = {}
+        for i in range(2, len(fields) - 1, 2):
+            options[fields[i].decode().lower()] = fields[i + 1].decode()
+        threading.Thread(
+            target=serve_transfer,
+            args=(os.path.join(directory, name), address, options),
+            daemon=True).start()
+
+
+# ----------------------------------------------------------------------------------------------
+# Reference client
+# ----------------------------------------------------------------------------------------------
+
+def reference_get(port, name, options, output):
+    """Fetches one file; returns None on success or a description of the failure."""
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(1.0)
+    request = struct.pack("!H", OPCODE_RRQ) + name.encode() + b"\0octet\0"
+    request += b"".join(b"%s\0%s\0" % (k.encode(), v.encode()) for k, v in options.items())
+    server = ("127.0.0.1", port)
+    last_sent = request
+    block_size, window_size, tsize = 512, 1, None
+    expected = 1
+    received = 0
+    timeouts = 0
+    started = False
+    with open(output, "wb") as f:
+        sock.sendto(request, server)
+        while True:
+            try:
+                packet, source = sock.recvfrom(65536)
+            except socket.timeout:
+                timeouts += 1
+                if timeouts > 5:
+                    return "timed out"
+                sock.sendto(last_sent, server)
+                continue
+            timeouts = 0
+            if not started:
+                server = source
+                started = True
+            elif source != server:
+                send_error(sock, source, 5, "Unknown transfer ID")
+                continue
+            opcode = struct.unpack("!H", packet[:2])[0]
+            if opcode == OPCODE_ERROR:
+                return "error from server: " + packet[4:-1].decode(errors="replace")
+            if opcode == OPCODE_OACK and expected == 1:
+                fields = parse_strings(packet[2:])
+                acknowledged = dict(zip(fields[0::2], fields[1::2]))
+                for key, value in acknowledged.items():
+                    key = key.decode().lower()
+                    if key not in options:
+                        return "server acknowledged %s, which was not requested" % key
+                    if key == "blksize":
+                        block_size = int(value)
+                    elif key == "windowsize":
+                        window_size = int(value)
+                    elif key == "tsize":
+                        tsize = int(value)
+                last_sent = struct.pack("!HH", OPCODE_ACK, 0)
+                sock.sendto(last_sent, server)
+                continue
+            if opcode != OPCODE_DATA:
+                continue
+            number = struct.unpack("!H", packet[2:4])[0]
+            data = packet[4:]
+            if number == expected & 0xFFFF and len(data) <= block_size:
+                f.write(data)
+                received += len(data)
+                final = len(data) < block_size
+                if final or expected % window_size == 0:
+                    last_sent = struct.pack("!HH", OPCODE_ACK, number)
+                    sock.sendto(last_sent, server)
+                expected += 1
+                if final:
+                    break
+            else:
+                last_sent = struct.pack("!HH", OPCODE_ACK, (expected - 1) & 0xFFFF)
+                sock.sendto(last_sent, server)
+    if tsize is not None and tsize != received:
+        return "tsize %d does not match the %d bytes received" % (tsize, received)
+    return None
+
+
+# ----------------------------------------------------------------------------------------------
+# Implementations under test
+# ----------------------------------------------------------------------------------------------
+
+class Skipped(Exception):
+    pass
+
+
+def build_c(program, work):
+    """Compiles one of the C programs; returns the path of the executable."""
+    compiler = shutil.which("cc") or shutil.which("gcc")
+    if compiler is None:
+        raise Skipped("no C compiler")
+    sources = []
+    includes = []
+    for directory in [program, "common"] + C_LIBRARIES.get(program, []):
+        path = os.path.join(ROOT, "C", directory)
+        sources += [os.path.join(path, f) for f in sorted(os.listdir(path)) if f.endswith(".c")]
+        includes.append("-I" + path)
+    output = os.path.join(work, "c-" + program)
+    result = subprocess.run(
+        [compiler, "-std=gnu11", "-O2", "-pthread", "-o", output] + includes + sources +
+        ["-lz"],
+        stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    if result.returncode != 0:
+        raise Skipped("does not compile")
+    return output
+
+
+def build_java(module, work):
+    """Compiles one of the Java modules; returns the class directory."""
+    if shutil.which("javac") is None or shutil.which("java") is None:
+        raise Skipped("no JDK")
+    source = os.path.join(ROOT, "Java", module, "src", "edu", "vtc", "tftp")
+    output = os.path.join(work, "java-" + module)
+    result = subprocess.run(
+        ["javac", "-d", output] +
+        [os.path.join(source, f) for f in sorted(os.listdir(source)) if f.endswith(".java")],
+        stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    if result.returncode != 0:
+        raise Skipped("does not compile")
+    return output
+
+
+class Server:
+    def __init__(self, name, command):
+        self.name = name
+        self.command = command  # Function of the port, or None if skipped.
+        self.reason = ""
+        self.process = None
+
+    def start(self, port, directory):
+        self.process = subprocess.Popen(
+            self.command(port), cwd=directory,
+            stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+        # Wait until the server answers a request for a file that doesn't exist.
+        probe = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        probe.settimeout(0.2)
+        for _ in range(50):
+            if self.process.poll() is not None:
+                return False
+            probe.sendto(struct.pack("!H", OPCODE_RRQ) + b"no-such-file\0octet\0",
+                         ("127.0.0.1", port))
+            try:
+                probe.recvfrom(516)
+                return True
+            except OSError:
+                time.sleep(0.1)
+        return False
+
+    def stop(self):
+        if self.process is not None:
+            self.process.kill()
+            self.process.wait()
+            self.process = None
+
+
+class Client:
+    def __init__(self, name, run):
+        self.name = name
+        self.run = run  # Function (port, case, output directory) -> failure, None, or "n/a".
+        self.reason = ""
+
+
+def run_process(command, directory, stdin=None):
+    try:
+        result = subprocess.run(
+            command, cwd=directory, input=stdin, timeout=RUN_TIMEOUT,
+            stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    except subprocess.TimeoutExpired:
+        return "timed out"
+    if result.returncode != 0:
+        lines = result.stdout.decode(errors="replace").strip().splitlines()
+        return "exit status %d%s" % (result.returncode, ": " + lines[-1] if lines else "")
+    return None
+
+
+def c_client(path):
+    def run(port, case, directory):
+        name, file_name, options = case
+
+        # The C client asks only for its own extensions; of the standard options it can only be
+        # run with none.
+        flags = {"digest": "-d", "compress": "-z"}
+        if set(options) - set(flags):
+            return "n/a"
+        return run_process(
+            [path] + [flags[option] for option in options] +
+            ["-p", str(port), "-o", directory, "127.0.0.1", file_name], directory)
+    return run
+
+
+def java_client(classes):
+    def run(port, case, directory):
+        name, file_name, options = case
+        if set(options) - {"blksize", "windowsize"}:
+            return "n/a"
+        return run_process(
+            ["java", "-cp", classes, "edu.vtc.tftp.Client", "127.0.0.1", str(port),
+             options.get("blksize", "0"), options.get("windowsize", "0")],
+            directory, stdin=("%s\n!quit\n" % file_name).encode())
+    return run
+
+
+def reference_client(port, case, directory):
+    name, file_name, options = case
+    if set(options) - STANDARD_OPTIONS:
+        return "n/a"
+    return reference_get(port, file_name, options, os.path.join(directory, file_name))
+
+
+# ----------------------------------------------------------------------------------------------
+# The matrix
+# ----------------------------------------------------------------------------------------------
+
+def same_content(first, second):
+    if not os.path.exists(second) or os.path.getsize(first) != os.path.getsize(second):
+        return False
+    with open(first, "rb") as a, open(second, "rb") as b:
+        while True:
+            x = a.read(1 << 20)
+            if x != b.read(1 << 20):
+                return False
+            if not x:
+                return True
+
+
+def make_files(directory):
+    for name, size in FILES.items():
+        with open(os.path.join(directory, name), "wb") as f:
+            remaining = size
+            while remaining > 0:
+                chunk = os.urandom(min(remaining, 1 << 20))
+                f.write(chunk)
+                remaining -= len(chunk)
+
+
+def free_port():
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("127.0.0.1", 0))
+    port = sock.getsockname()[1]
+    sock.close()
+    return port
+
+
+def run_matrix(servers, clients, work):
+    files = os.path.join(work, "files")
+    os.mkdir(files)
+    make_files(files)
+
+    # results[(client, case)][server] = text of the cell
+    results = {}
+    failures = 0
+    for server in servers:
+        port = free_port()
+        if server.command is not None and not server.start(port, files):
+            server.stop()
+            server.reason = "does not start"
+            server.command = None
+        for client in clients:
+            for case in CASES:
+                cell = results.setdefault((client.name, case[0]), {})
+                if server.command is None or client.run is None:
+                    cell[server.name] = "skipped"
+                    continue
+                output = tempfile.mkdtemp(dir=work)
+                started = time.monotonic()
+                failure = client.run(port, case, output)
+                elapsed = time.monotonic() - started
+                received = os.path.join(output, case[1])
+                if failure == "n/a":
+                    cell[server.name] = "n/a"
+                elif failure is None and not same_content(os.path.join(files, case[1]), received):
+                    failure = "output differs"
+                if failure is None:
+                    size = FILES[case[1]]
+                    cell[server.name] = "ok %.1f MB/s" % (size / elapsed / 1e6) if size >= 1e6 \
+                        else "ok %.0f ms" % (elapsed * 1000)
+                elif failure != "n/a":
+                    cell[server.name] = "FAIL: " + failure
+                    failures += 1
+                shutil.rmtree(output, ignore_errors=True)
+                print("%-10s %-10s %-22s %s" % (server.name, client.name, case[0],
+                                                cell[server.name]), file=sys.stderr)
+        server.stop()
+    return results, failures
+
+
+def write_report(stream, servers, clients, results, failures):
+    stream.write("# TFTP interoperability matrix\n\n")
+    for item, kind in [(s, "server") for s in servers] + [(c, "client") for c in clients]:
+        if item.reason:
+            stream.write("- %s %s: skipped (%s)\n" % (item.name, kind, item.reason))
+    stream.write("\nThroughput includes process start up (notably the JVM) and is only shown for "
+                 "files of 1 MB or more.\n\n")
+    stream.write("| client | case | " + " | ".join(s.name + " server" for s in servers) + " |\n")
+    stream.write("|---|---|" + "---|" * len(servers) + "\n")
+    for client in clients:
+        for case in CASES:
+            cell = results[(client.name, case[0])]
+            stream.write("| %s | %s | %s |\n" % (
+                client.name, case[0], " | ".join(cell[s.name] for s in servers)))
+    stream.write("\n%d failed\n" % failures)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Run every TFTP client against every server.")
+    parser.add_argument("--report", help="write the matrix to this file as well as stdout")
+    parser.add_argument("--c-server", help="C server executable (default: compile C/server)")
+    parser.add_argument("--c-client", help="C client executable (default: compile C/client)")
+    parser.add_argument("--java-server", help="Java server classes (default: compile)")
+    parser.add_argument("--java-client", help="Java client classes (default: compile)")
+    parser.add_argument("--keep", action="store_true", help="keep the work directory")
+    parser.add_argument("--serve", type=int, metavar="PORT",
+                        help="only run the stand-in server, on PORT, serving the current folder")
+    arguments = parser.parse_args()
+
+    if arguments.serve:
+        stand_in_server(arguments.serve, os.getcwd())
+        return 0
+
+    work = tempfile.mkdtemp(prefix="tftp-interop-")
+    servers = [
+        Server("C", None),
+        Server("Java", None),
+        Server("stand-in", lambda port: [sys.executable, os.path.abspath(__file__),
+                                         "--serve", str(port)]),
+    ]
+    clients = [Client("C", None), Client("Java", None), Client("reference", reference_client)]
+    try:
+        try:
+            path = arguments.c_server or build_c("server", work)
+            servers[0].command = lambda port: [path, str(port)]
+        except Skipped as ex:
+            servers[0].reason = str(ex)
+        try:
+            classes = arguments.java_server or build_java("server", work)
+            servers[1].command = lambda port: ["java", "-cp", classes, "edu.vtc.tftp.Server",
+                                               str(port)]
+        except Skipped as ex:
+            servers[1].reason = str(ex)
+        try:
+            clients[0].run = c_client(arguments.c_client or build_c("client", work))
+        except Skipped as ex:
+            clients[0].reason = str(ex)
+        try:
+            clients[1].run = java_client(arguments.java_client or build_java("client", work))
+        except Skipped as ex:
+            clients[1].reason = str(ex)
+
+        results, failures = run_matrix(servers, clients, work)
+        write_report(sys.stdout, servers, clients, results, failures)
+        if arguments.report:
+            with open(arguments.report, "w") as report:
+                write_report(report, servers, clients, results, failures)
+        return failures
+    finally:
+        for server in servers:
+            server.stop()
+        if not arguments.keep:
+            shutil.rmtree(work, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,229 @@
+#!/usr/bin/env python3
+#
+# FILE   : restart.py
+# SUBJECT: Replacing a running C server without disturbing its transfers.
+#
+# The C server is started with a handoff socket (-Z), and slow clients begin fetching the
+# medium file of interop.py from it. While they are part way through, a second server is
+# started with the same handoff socket and takes over. Each slow transfer must complete intact
+# without the client seeing a retransmitted block or an ERROR, and its longest pause between
+# blocks is reported. The first server must exit, and the second must serve new requests.
+#
+# Half of the slow clients ask for a compressed transfer of a text file instead. The script waits
+# until the old server has a compressed copy to offer before starting them, so the new server,
+# which has none yet, must make its own to carry on.
+#
+# Usage: restart.py [--clients n] [--old "flags"] [--new "flags"] [--c-server path]
+#
+# The flags select how each server runs (the default is "-t 2" for both). The old server hands
+# its transfers over only if both run threads; otherwise it finishes them itself.
+#
+
+import argparse
+import os
+import random
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import zlib
+
+import interop
+
+NAME = "medium.bin"
+TEXT_NAME = "text.txt"
+TEXT_SIZE = 4000000  # Compresses to enough blocks to be under way at the takeover.
+BLOCK_SIZE = 1024
+ACK_PAUSE = 0.002    # Seconds each slow client waits before acknowledging a block.
+TAKEOVER_AFTER = 1.0
+
+
+def make_text(path):
+    """Write TEXT_SIZE bytes of words, which zlib compresses to about a third."""
+    generator = random.Random(1350)
+    words = ["".join(generator.choice("abcdefghijklmnopqrstuvwxyz")
+                     for _ in range(generator.randint(2, 9))) for _ in range(2000)]
+    with open(path, "w") as f:
+        written = 0
+        while written < TEXT_SIZE:
+            line = " ".join(generator.choice(words) for _ in range(12)) + "\n"
+            f.write(line)
+            written += len(line)
+
+
+def request(name, compress):
+    options = b"blksize\0%d\0" % BLOCK_SIZE + (b"compress\0zlib\0" if compress else b"")
+    return struct.pack("!H", interop.OPCODE_RRQ) + name.encode() + b"\0octet\0" + options
+
+
+def compressed_ready(port, timeout=10.0):
+    """Ask for TEXT_NAME compressed until the server offers it so. Returns True once it does."""
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(1.0)
+    deadline = time.time() + timeout
+    try:
+        while time.time() < deadline:
+            sock.sendto(request(TEXT_NAME, True), ("127.0.0.1", port))
+            try:
+                packet, source = sock.recvfrom(65536)
+            except socket.timeout:
+                continue
+            sock.sendto(struct.pack("!HH", interop.OPCODE_ERROR, 0) + b"done\0", source)
+            if (struct.unpack("!H", packet[:2])[0] == interop.OPCODE_OACK and
+                    b"compress\0zlib\0" in packet):
+                return True
+            time.sleep(0.2)
+        return False
+    finally:
+        sock.close()
+
+
+def slow_get(port, name, compress, output, result):
+    """Fetch a file slowly, noting retransmitted blocks and the longest pause between blocks."""
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(5.0)
+    sock.sendto(request(name, compress), ("127.0.0.1", port))
+    compressed = False
+    server = None
+    expected = 1
+    repeats = 0
+    longest = 0.0
+    last = time.perf_counter()
+    with open(output, "wb") as f:
+        while True:
+            try:
+                packet, source = sock.recvfrom(65536)
+            except socket.timeout:
+                result.update(problem="timed out at block %d" % expected)
+                return
+            server = server or source
+            if source != server:
+                continue
+            opcode = struct.unpack("!H", packet[:2])[0]
+            if opcode == interop.OPCODE_ERROR:
+                result.update(problem="error: " + packet[4:-1].decode(errors="replace"))
+                return
+            if opcode == interop.OPCODE_OACK:
+                compressed = b"compress\0zlib\0" in packet
+                sock.sendto(struct.pack("!HH", interop.OPCODE_ACK, 0), server)
+                continue
+            number = struct.unpack("!H", packet[2:4])[0]
+            if number != expected & 0xFFFF:
+                repeats += 1
+                continue
+            now = time.perf_counter()
+            longest = max(longest, now - last)
+            last = now
+            f.write(packet[4:])
+            expected += 1
+            if len(packet) - 4 < BLOCK_SIZE:
+                sock.sendto(struct.pack("!HH", interop.OPCODE_ACK, number), server)
+                break
+            time.sleep(ACK_PAUSE)
+            sock.sendto(struct.pack("!HH", interop.OPCODE_ACK, number), server)
+    sock.close()
+    if compress and not compressed:
+        result.update(problem="sent uncompressed")
+        return
+    if compressed:
+        with open(output, "rb") as f:
+            data = f.read()
+        try:
+            data = zlib.decompress(data)
+        except zlib.error:
+            result.update(problem="compressed data damaged")
+            return
+        with open(output, "wb") as f:
+            f.write(data)
+    result.update(repeats=repeats, longest=longest)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Replace a running C server.")
+    parser.add_argument("--clients", type=int, default=4, help="slow transfers in progress")
+    parser.add_argument("--old", default="-t 2", help="flags of the server replaced")
+    parser.add_argument("--new", default="-t 2", help="flags of the server taking over")
+    parser.add_argument("--c-server", help="C server executable (default: compile C/server)")
+    arguments = parser.parse_args()
+
+    work = tempfile.mkdtemp(prefix="tftp-restart-")
+    files = os.path.join(work, "files")
+    received = os.path.join(work, "received")
+    os.mkdir(files)
+    os.mkdir(received)
+    handoff = os.path.join(work, "handoff")
+    servers = []
+    failures = 0
+    try:
+        path = arguments.c_server or interop.build_c("server", work)
+        interop.make_files(files)
+        make_text(os.path.join(files, TEXT_NAME))
+        port = interop.free_port()
+
+        def start(flags, log):
+            servers.append(subprocess.Popen(
+                [path] + flags.split() + ["-Z", handoff, "-l", os.path.join(work, log),
+                                          str(port)],
+                cwd=files, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE))
+            time.sleep(0.3)
+
+        start(arguments.old, "old.log")
+        if not compressed_ready(port):
+            print("the old server never offered a compressed copy of %s" % TEXT_NAME)
+            failures += 1
+        names = [TEXT_NAME if i % 2 else NAME for i in range(arguments.clients)]
+        results = [{} for _ in range(arguments.clients)]
+        clients = [threading.Thread(target=slow_get, args=(
+            port, names[i], names[i] == TEXT_NAME, os.path.join(received, "%d.bin" % i),
+            results[i]))
+            for i in range(arguments.clients)]
+        for client in clients:
+            client.start()
+        time.sleep(TAKEOVER_AFTER)
+        start(arguments.new, "new.log")
+
+        for name in sorted(interop.FILES):
+            problem = interop.reference_get(port, name, {}, os.path.join(received, name))
+            if problem is None and not interop.same_content(
+                    os.path.join(files, name), os.path.join(received, name)):
+                problem = "content differs"
+            print("new request %-13s %s" % (name, problem or "ok"))
+            failures += problem is not None
+
+        for i, client in enumerate(clients):
+            client.join()
+            problem = results[i].get("problem")
+            if problem is None and not interop.same_content(
+                    os.path.join(files, names[i]), os.path.join(received, "%d.bin" % i)):
+                problem = "content differs"
+            if problem is None and results[i]["repeats"] > 0:
+                problem = "%d blocks repeated" % results[i]["repeats"]
+            print("transfer %-2d %-10s %s (longest pause %.1f ms)" % (
+                i, "compressed" if names[i] == TEXT_NAME else "plain", problem or "ok",
+                1000 * results[i].get("longest", 0)))
+            failures += problem is not None
+
+        try:
+            servers[0].wait(timeout=10)
+        except subprocess.TimeoutExpired:
+            print("the old server is still running")
+            failures += 1
+        return 1 if failures else 0
+    except interop.Skipped as ex:
+        print("C server skipped: %s" % ex, file=sys.stderr)
+        return 1
+    finally:
+        for server in servers:
+            server.kill()
+            warnings = server.communicate()[1].decode().strip()
+            if warnings:
+                print(warnings, file=sys.stderr)
+        shutil.rmtree(work, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
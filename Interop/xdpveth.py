@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+#
+# FILE   : xdpveth.py
+# SUBJECT: The C server's AF_XDP path over a veth pair.
+#
+# A veth pair is made with one end in a network namespace of its own, and the C server is run
+# with -X on the other end, where the veth driver gives it an AF_XDP socket in copy mode. The
+# C client fetches the test files of interop.py from inside the namespace over IPv4 and IPv6,
+# with and without its extensions, and each file is checked. The server's metrics must then show
+# that DATA packets went through AF_XDP.
+#
+# Usage: xdpveth.py [--threads n | --workers n] [--c-server path] [--c-client path]
+#
+# This needs root (or CAP_NET_ADMIN and CAP_SYS_ADMIN) and the ip command.
+#
+
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.request
+
+import interop
+
+NAMESPACE = "tftp-xdp-%d" % os.getpid()
+SERVER_END = "txdp%d" % (os.getpid() % 100000)
+CLIENT_END = SERVER_END + "c"
+ADDRESSES = [("10.213.0.1", "10.213.0.2/24", "10.213.0.1/24"),
+             ("fd00:213::1", "fd00:213::2/64", "fd00:213::1/64")]
+
+
+def ip(*arguments, namespace=False):
+    command = ["ip"] + (["netns", "exec", NAMESPACE, "ip"] if namespace else []) + list(arguments)
+    subprocess.run(command, check=True, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+
+
+def make_link(queues):
+    # Each pre-forked worker binds a queue of its own.
+    ip("netns", "add", NAMESPACE)
+    ip("link", "add", SERVER_END, "numtxqueues", str(queues), "numrxqueues", str(queues),
+       "type", "veth", "peer", "name", CLIENT_END)
+    ip("link", "set", CLIENT_END, "netns", NAMESPACE)
+    for _, client, server in ADDRESSES:
+        # Duplicate address detection would hold the IPv6 addresses back for a second or two.
+        ip("addr", "add", server, "dev", SERVER_END, "nodad")
+        ip("addr", "add", client, "dev", CLIENT_END, "nodad", namespace=True)
+    ip("link", "set", SERVER_END, "up")
+    ip("link", "set", CLIENT_END, "up", namespace=True)
+
+
+def remove_link():
+    subprocess.run(["ip", "link", "del", SERVER_END], stderr=subprocess.DEVNULL)
+    subprocess.run(["ip", "netns", "del", NAMESPACE], stderr=subprocess.DEVNULL)
+
+
+def xdp_packets(metrics_port):
+    with urllib.request.urlopen("http://127.0.0.1:%d/metrics" % metrics_port) as response:
+        for line in response.read().decode().splitlines():
+            if line.startswith("tftp_xdp_packets_sent_total "):
+                return int(line.split()[1])
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Check the C server's AF_XDP path.")
+    group = parser.add_mutually_exclusive_group()
+    group.add_argument("--threads", type=int, default=2, help="server threads")
+    group.add_argument("--workers", type=int, help="pre-forked server workers")
+    parser.add_argument("--c-server", help="C server executable (default: compile C/server)")
+    parser.add_argument("--c-client", help="C client executable (default: compile C/client)")
+    arguments = parser.parse_args()
+
+    if os.geteuid() != 0 or shutil.which("ip") is None:
+        print("This needs root and the ip command", file=sys.stderr)
+        return 1
+    work = tempfile.mkdtemp(prefix="tftp-xdp-")
+    files = os.path.join(work, "files")
+    received = os.path.join(work, "received")
+    os.mkdir(files)
+    os.mkdir(received)
+    server = None
+    failures = 0
+    try:
+        server_path = arguments.c_server or interop.build_c("server", work)
+        client_path = arguments.c_client or interop.build_c("client", work)
+        interop.make_files(files)
+        make_link(arguments.workers or 1)
+
+        port = interop.free_port()
+        metrics_port = interop.free_port()
+        mode = ["-w", str(arguments.workers)] if arguments.workers else \
+               ["-t", str(arguments.threads)]
+        server = subprocess.Popen(
+            [server_path] + mode + ["-X", SERVER_END, "-m", str(metrics_port),
+                                    "-l", os.path.join(work, "events.log"), str(port)],
+            cwd=files, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+        time.sleep(0.5)
+
+        for address, _, _ in ADDRESSES:
+            for flags in [[], ["-d", "-z"]]:
+                for name in sorted(interop.FILES):
+                    output = os.path.join(received, name)
+                    problem = interop.run_process(
+                        ["ip", "netns", "exec", NAMESPACE, client_path] + flags +
+                        ["-p", str(port), "-o", received, address, name], received)
+                    if problem is None and not interop.same_content(
+                            os.path.join(files, name), output):
+                        problem = "content differs"
+                    print("%-12s %-6s %-13s %s" % (
+                        address, " ".join(flags) or "-", name, problem or "ok"))
+                    failures += problem is not None
+                    if os.path.exists(output):
+                        os.remove(output)
+
+        sent = xdp_packets(metrics_port)
+        print("DATA packets sent through AF_XDP: %d" % sent)
+        if sent == 0:
+            failures += 1
+        return 1 if failures else 0
+    except interop.Skipped as ex:
+        print("Skipped: %s" % ex, file=sys.stderr)
+        return 1
+    except subprocess.CalledProcessError as ex:
+        print("Unable to make the veth pair: %s" % ex.stderr.decode().strip(), file=sys.stderr)
+        return 1
+    finally:
+        if server is not None:
+            server.kill()
+            warnings = server.communicate()[1].decode().strip()
+            if warnings:
+                print(warnings, file=sys.stderr)
+        remove_link()
+        shutil.rmtree(work, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
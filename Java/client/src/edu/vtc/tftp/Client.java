@@ -15,15 +15,20 @@ package edu.vtc.tftp;
 import java.io.BufferedReader;
 import java.io.IOException;
 import java.io.InputStreamReader;
-import java.net.DatagramSocket;
 import java.net.InetSocketAddress;
 import java.net.SocketAddress;
+import java.nio.ByteBuffer;
+import java.nio.channels.DatagramChannel;
 
 /**
  * Main class of a TFTP client. See RFC 1350.
  */
 public class Client {
 
+    // Options asked for unless others are given on the command line. The block size fills an Ethernet frame.
+    private static final int DEFAULT_BLOCK_SIZE  = 1428;
+    private static final int DEFAULT_WINDOW_SIZE = 16;
+
     public static void main(String[] args)
     {
         try {
@@ -46,14 +51,26 @@ public class Client {
         if (args.length >= 1) {
             host = args[0];
         }
+        int blockSize = DEFAULT_BLOCK_SIZE;
+        if (args.length >= 3) {
+            blockSize = Integer.parseInt(args[2]);
+        }
+        int windowSize = DEFAULT_WINDOW_SIZE;
+        if (args.length >= 4) {
+            windowSize = Integer.parseInt(args[3]);
+        }
 
         InetSocketAddress serverAddress = new InetSocketAddress(host, port);
-        mainLoop(serverAddress);
+        mainLoop(serverAddress, blockSize, windowSize);
     }
 
 
-    private static void mainLoop(SocketAddress serverAddress) throws IOException
+    private static void mainLoop(SocketAddress serverAddress, int blockSize, int windowSize) throws IOException
     {
+        // One pair of direct buffers serves every transfer.
+        ByteBuffer packet = ByteBuffer.allocateDirect(FileReceiver.MAX_PACKET_SIZE);
+        ByteBuffer reply  = ByteBuffer.allocateDirect(512);
+
         BufferedReader consoleReader = new BufferedReader(new InputStreamReader(System.in, "US-ASCII"));
 
         System.out.println("Enter \"!quit\" to end.");
@@ -61,10 +78,19 @@ public class Client {
             System.out.print("get> ");
             String line = consoleReader.readLine();
 
-            if (line.equals("!quit")) break;
-            DatagramSocket clientSocket = new DatagramSocket();
-            FileReceiver receiver = new FileReceiver(line, clientSocket, serverAddress);
-            receiver.doReceive();
+            if (line == null || line.equals("!quit")) break;
+            if (line.isEmpty()) continue;
+
+            // Each transfer uses a fresh port, as its transfer ID.
+            DatagramChannel channel = DatagramChannel.open();
+            FileReceiver receiver =
+                new FileReceiver(line, channel, serverAddress, blockSize, windowSize, packet, reply);
+            try {
+                receiver.doReceive();
+            }
+            catch (IOException ex) {
+                System.out.println("\nTransfer failed: " + ex.getMessage());
+            }
         }
     }
 
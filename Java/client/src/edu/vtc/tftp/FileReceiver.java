@@ -5,64 +5,333 @@
 //***************************************************************************
 package edu.vtc.tftp;
 
-import java.net.DatagramSocket;
+import java.io.IOException;
 import java.net.SocketAddress;
+import java.nio.BufferOverflowException;
+import java.nio.ByteBuffer;
+import java.nio.channels.DatagramChannel;
+import java.nio.channels.FileChannel;
+import java.nio.channels.SelectionKey;
+import java.nio.channels.Selector;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Paths;
+import java.nio.file.StandardOpenOption;
 
 public class FileReceiver {
-    
-    private String         fileName;
-    private DatagramSocket clientSocket;
-    private SocketAddress  serverAddress;
+
+    /** Size of the buffers passed to the constructor. Large enough for any block size. */
+    public static final int MAX_PACKET_SIZE = 4 + 65464;
+
+    private static final int OPCODE_RRQ   = 1;
+    private static final int OPCODE_DATA  = 3;
+    private static final int OPCODE_ACK   = 4;
+    private static final int OPCODE_ERROR = 5;
+    private static final int OPCODE_OACK  = 6;
+
+    private static final int DEFAULT_BLOCK_SIZE = 512;
+
+    // Time (ms) to wait for a packet before sending again, and how often to do so.
+    private static final int TIMEOUT      = 1000;
+    private static final int MAX_TIMEOUTS = 5;
+
+    // Minimum time (ms) between updates of the progress display.
+    private static final int PROGRESS_INTERVAL = 250;
+
+    private String          fileName;
+    private DatagramChannel channel;
+    private SocketAddress   serverAddress;
+    private int             requestedBlockSize;
+    private int             requestedWindowSize;
+    private ByteBuffer      packet;
+    private ByteBuffer      reply;
+
+    // The options in effect for the transfer.
+    private int blockSize;
+    private int windowSize;
 
     /**
      * Constructs a FileReceiver. An instance of this class is responsible for receiving and storing a single file from
      * the TFTP server.
      *
+     * The buffers are supplied by the caller so that one pair of direct buffers can serve every transfer. Nothing is
+     * allocated per packet: data is written to the output file straight from the packet buffer.
+     *
      * @param fileName      The name of the file on the server host to receive. The file is stored locally in the
      *                      current folder regardless of any path that might be on the file name.
-     * @param clientSocket  An initialized socket object on the client side to use for the transfer.
+     * @param channel       An open channel on the client side to use for the transfer. It is closed when the
+     *                      transfer ends.
      * @param serverAddress The address (IP and port) of the listening server.
+     * @param blockSize     The block size to ask for (RFC 2348), or zero to use the default of 512 bytes.
+     * @param windowSize    The window size to ask for (RFC 7440), or zero to acknowledge every block.
+     * @param packet        A direct buffer of at least MAX_PACKET_SIZE bytes for incoming packets.
+     * @param reply         A direct buffer of at least 512 bytes for outgoing packets. A file name too long for the
+     *                      request to fit in it is refused.
      */
-    FileReceiver(String fileName, DatagramSocket clientSocket, SocketAddress serverAddress)
+    FileReceiver(String          fileName,
+                 DatagramChannel channel,
+                 SocketAddress   serverAddress,
+                 int             blockSize,
+                 int             windowSize,
+                 ByteBuffer      packet,
+                 ByteBuffer      reply)
+    {
+        this.fileName            = fileName;
+        this.channel             = channel;
+        this.serverAddress       = serverAddress;
+        this.requestedBlockSize  = blockSize;
+        this.requestedWindowSize = windowSize;
+        this.packet              = packet;
+        this.reply               = reply;
+    }
+
+
+    private static void putString(ByteBuffer buffer, String text)
+    {
+        buffer.put(text.getBytes(StandardCharsets.US_ASCII));
+        buffer.put((byte)0);
+    }
+
+
+    // Returns false if the request doesn't fit in the reply buffer.
+    private boolean buildRequest()
+    {
+        reply.clear();
+        try {
+            reply.putShort((short)OPCODE_RRQ);
+            putString(reply, fileName);
+            putString(reply, "octet");
+            if (requestedBlockSize > 0) {
+                putString(reply, "blksize");
+                putString(reply, Integer.toString(requestedBlockSize));
+            }
+            if (requestedWindowSize > 0) {
+                putString(reply, "windowsize");
+                putString(reply, Integer.toString(requestedWindowSize));
+            }
+        }
+        catch (BufferOverflowException ex) {
+            return false;
+        }
+        reply.flip();
+        return true;
+    }
+
+
+    private void buildAck(int blockNumber)
+    {
+        reply.clear();
+        reply.putShort((short)OPCODE_ACK);
+        reply.putShort((short)blockNumber);
+        reply.flip();
+    }
+
+
+    // Reads the NUL terminated string at the packet's position. Returns null if there is none.
+    private String nextString()
+    {
+        int start = packet.position();
+        for (int i = start; i < packet.limit(); ++i) {
+            if (packet.get(i) == 0) {
+                byte[] text = new byte[i - start];
+                packet.get(text);
+                packet.get();
+                return new String(text, StandardCharsets.US_ASCII);
+            }
+        }
+        return null;
+    }
+
+
+    // Applies the options acknowledged by the server. Returns false if the server acknowledged something that was not
+    // asked for, which RFC 2347 says ends the transfer.
+    private boolean acceptOptions()
+    {
+        String option;
+        String value;
+
+        while ((option = nextString()) != null && (value = nextString()) != null) {
+            try {
+                if (option.equalsIgnoreCase("blksize") && requestedBlockSize > 0) {
+                    blockSize = Integer.parseInt(value);
+                    if (blockSize < 8 || blockSize > requestedBlockSize) return false;
+                }
+                else if (option.equalsIgnoreCase("windowsize") && requestedWindowSize > 0) {
+                    windowSize = Integer.parseInt(value);
+                    if (windowSize < 1 || windowSize > requestedWindowSize) return false;
+                }
+                else {
+                    return false;
+                }
+            }
+            catch (NumberFormatException ex) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+
+    // Sends the packet in the reply buffer, to the server's transfer port once that is known.
+    private void send() throws IOException
     {
-        this.fileName      = fileName;
-        this.clientSocket  = clientSocket;
-        this.serverAddress = serverAddress;
+        reply.rewind();
+        if (channel.isConnected()) {
+            channel.write(reply);
+        }
+        else {
+            channel.send(reply, serverAddress);
+        }
     }
 
 
     /**
      * Receives the file using the parameters previously passed to the constructor.
+     *
+     * @return True if the whole file was received.
      */
-    void doReceive()
+    boolean doReceive() throws IOException
     {
-        // Fill in the request packet...
+        FileChannel output       = null;
+        long        blockCount   = 0;  // Blocks received in order so far.
+        int         lastBlock    = 0;  // Block number of the last of those blocks (as sent).
+        int         windowCount  = 0;  // Blocks received since the last acknowledgement.
+        long        byteCount    = 0;
+        int         timeouts     = 0;
+        boolean     success      = false;
+        long        nextDisplay  = 0;
 
-        // Send the request...
+        blockSize  = DEFAULT_BLOCK_SIZE;
+        windowSize = 1;
 
-        // Now go into a loop to retrieve the data blocks...
-        // TODO: Time out receive operations.
-        //
-        while (true) {
+        try (Selector selector = Selector.open()) {
+            channel.configureBlocking(false);
+            channel.register(selector, SelectionKey.OP_READ);
 
-            // Receive a packet from the server...
+            // Send the request...
+            if (!buildRequest()) {
+                System.out.println("The file name is too long");
+                return false;
+            }
+            send();
 
-            // Make sure the receive was successful and the packet is a data packet...
+            while (true) {
 
-            // Strip paths off file name. Be sure the output file is open...
+                // Wait for a packet, sending again if none comes...
+                if (selector.select(TIMEOUT) == 0) {
+                    if (++timeouts > MAX_TIMEOUTS) {
+                        System.out.println("\nThe server stopped answering");
+                        break;
+                    }
+                    send();
+                    continue;
+                }
+                selector.selectedKeys().clear();
 
-            // If there was data in this packet and it's a new block...
+                // Receive a packet from the server. The server answers from a new port (its transfer ID). Once the
+                // first answer arrives the channel is connected to that port so that the kernel discards packets
+                // from anywhere else and reading doesn't need a new address object for every packet...
+                packet.clear();
+                if (channel.isConnected()) {
+                    if (channel.read(packet) <= 0) continue;
+                }
+                else {
+                    SocketAddress source = channel.receive(packet);
+                    if (source == null) continue;
+                    channel.connect(source);
+                }
+                packet.flip();
+                timeouts = 0;
 
-            // Send acknowledgements for the "current" block or for duplicates of the previous
-            // block. Send the ACKs to the "incoming address" instead of the server address. This
-            // is because the server might use a different port for the data transfer...
+                // Make sure the packet is one we expect...
+                if (packet.remaining() < 4) continue;
+                int opcode = packet.getShort() & 0xFFFF;
 
-            // Provide user feedback...
+                if (opcode == OPCODE_ERROR) {
+                    packet.getShort();
+                    String message = nextString();
+                    System.out.println("Error from server: " + (message == null ? "" : message));
+                    break;
+                }
+                if (opcode == OPCODE_OACK && blockCount == 0) {
+                    if (!acceptOptions()) {
+                        reply.clear();
+                        reply.putShort((short)OPCODE_ERROR);
+                        reply.putShort((short)8);
+                        putString(reply, "Unexpected option");
+                        reply.flip();
+                        send();
+                        System.out.println("The server acknowledged options that were not requested");
+                        break;
+                    }
+                    buildAck(0);
+                    send();
+                    continue;
+                }
+                if (opcode != OPCODE_DATA) continue;
 
-            // If this was the final packet, I am done. Indicate success...
-        }
+                int blockNumber = packet.getShort() & 0xFFFF;
+                int dataLength  = packet.remaining();
+
+                if (blockNumber == ((lastBlock + 1) & 0xFFFF) && dataLength <= blockSize) {
 
-        
+                    // Strip paths off file name. Be sure the output file is open...
+                    if (output == null) {
+                        output = FileChannel.open(
+                            Paths.get(Paths.get(fileName).getFileName().toString()),
+                            StandardOpenOption.CREATE,
+                            StandardOpenOption.WRITE,
+                            StandardOpenOption.TRUNCATE_EXISTING);
+                    }
+
+                    // Write the data where it belongs in the file. Blocks only arrive here in order, but writing at
+                    // an explicit offset keeps the file position out of it...
+                    long offset = blockCount * blockSize;
+                    while (packet.hasRemaining()) {
+                        offset += output.write(packet, offset);
+                    }
+                    ++blockCount;
+                    lastBlock   = blockNumber;
+                    byteCount  += dataLength;
+                    ++windowCount;
+
+                    // Acknowledge once per window, and at the end of the file...
+                    if (dataLength < blockSize) {
+                        buildAck(lastBlock);
+                        send();
+                        success = true;
+                        break;
+                    }
+                    if (windowCount >= windowSize) {
+                        buildAck(lastBlock);
+                        send();
+                        windowCount = 0;
+                    }
+                }
+                else {
+                    // A block was lost or repeated. Acknowledging the last block received in order makes the server
+                    // send again from the one after it (RFC 7440)...
+                    buildAck(lastBlock);
+                    send();
+                    windowCount = 0;
+                }
+
+                // Provide user feedback. The display is refreshed at a fixed rate rather than once per block...
+                long now = System.nanoTime() / 1000000;
+                if (now >= nextDisplay) {
+                    System.out.print("\rReceived: " + byteCount + " bytes");
+                    System.out.flush();
+                    nextDisplay = now + PROGRESS_INTERVAL;
+                }
+            }
+        }
+        finally {
+            if (output != null) output.close();
+            channel.close();
+        }
+        if (blockCount > 0) {
+            System.out.println("\rReceived: " + byteCount + " bytes");
+        }
+        return success;
     }
 
 }
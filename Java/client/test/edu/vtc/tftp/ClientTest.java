@@ -1,12 +1,274 @@
 package edu.vtc.tftp;
 
+import static org.junit.Assert.assertArrayEquals;
+import static org.junit.Assert.assertEquals;
+import static org.junit.Assert.assertFalse;
+import static org.junit.Assert.assertTrue;
+
+import java.io.IOException;
+import java.net.DatagramPacket;
+import java.net.DatagramSocket;
+import java.net.InetAddress;
+import java.net.SocketAddress;
+import java.nio.ByteBuffer;
+import java.nio.channels.DatagramChannel;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.nio.file.Paths;
+import java.util.Arrays;
+import java.util.Random;
+
+import org.junit.After;
+import org.junit.Before;
 import org.junit.Test;
 
+/**
+ * Checks of the client's transfers. Each test runs a FileReceiver against a scripted server on the loopback
+ * interface. The script runs on a thread of its own, answers the request from a second socket (its transfer ID), and
+ * checks each packet the client sends. The received file is written to the current folder and removed afterward.
+ */
 public class ClientTest {
 
+    private static final int OPCODE_RRQ   = 1;
+    private static final int OPCODE_DATA  = 3;
+    private static final int OPCODE_ACK   = 4;
+    private static final int OPCODE_ERROR = 5;
+    private static final int OPCODE_OACK  = 6;
+
+    // Time (ms) the scripted server waits for a packet that should arrive.
+    private static final int WAIT = 5000;
+
+    /** One side of a conversation with the client. */
+    private interface Script {
+        void run() throws Exception;
+    }
+
+    private DatagramSocket listener;
+    private DatagramSocket transfer;
+    private SocketAddress  clientAddress;
+    private String         fileName;
+    private Path           output;
+    private byte[]         contents;
+    private volatile Throwable scriptFailure;
+
+    @Before
+    public void setUp() throws IOException
+    {
+        InetAddress loopback = InetAddress.getLoopbackAddress();
+
+        listener = new DatagramSocket(0, loopback);
+        listener.setSoTimeout(WAIT);
+        transfer = new DatagramSocket(0, loopback);
+        transfer.setSoTimeout(WAIT);
+
+        fileName = "ClientTest-" + System.nanoTime() + ".bin";
+        output   = Paths.get(fileName);
+
+        // Three full 16 byte blocks and a short one.
+        contents = new byte[3 * 16 + 5];
+        new Random(1350).nextBytes(contents);
+    }
+
+
+    @After
+    public void tearDown() throws IOException
+    {
+        listener.close();
+        transfer.close();
+        Files.deleteIfExists(output);
+    }
+
+
+    // Runs the client for the test file while the script plays the server. Returns what doReceive() returned.
+    private boolean receive(int blockSize, int windowSize, Script script) throws Exception
+    {
+        Thread server = new Thread(() -> {
+            try {
+                script.run();
+            }
+            catch (Throwable ex) {
+                scriptFailure = ex;
+            }
+        });
+        server.start();
+
+        FileReceiver receiver = new FileReceiver(
+            "some/folder/" + fileName,
+            DatagramChannel.open(),
+            listener.getLocalSocketAddress(),
+            blockSize,
+            windowSize,
+            ByteBuffer.allocateDirect(FileReceiver.MAX_PACKET_SIZE),
+            ByteBuffer.allocateDirect(512));
+        boolean result = receiver.doReceive();
+
+        server.join(2 * WAIT);
+        if (scriptFailure instanceof AssertionError) throw (AssertionError)scriptFailure;
+        if (scriptFailure != null) throw new AssertionError("Scripted server failed", scriptFailure);
+        return result;
+    }
+
+
+    // Receives a packet on the given socket. Returns its contents from the opcode on.
+    private static byte[] expectPacket(DatagramSocket socket, DatagramPacket received) throws IOException
+    {
+        socket.receive(received);
+        return Arrays.copyOf(received.getData(), received.getLength());
+    }
+
+
+    // Receives the client's request and checks it; the path is sent as given and the options as asked for.
+    private void expectRequest(String... options) throws IOException
+    {
+        DatagramPacket received = new DatagramPacket(new byte[600], 600);
+        byte[] request = expectPacket(listener, received);
+        clientAddress = received.getSocketAddress();
+
+        assertEquals(OPCODE_RRQ, ((request[0] & 0xFF) << 8) | (request[1] & 0xFF));
+        String[] fields = new String(request, 2, request.length - 2, StandardCharsets.US_ASCII).split("\0");
+        String[] expected = new String[2 + options.length];
+        expected[0] = "some/folder/" + fileName;
+        expected[1] = "octet";
+        System.arraycopy(options, 0, expected, 2, options.length);
+        assertArrayEquals(expected, fields);
+    }
+
+
+    // Receives a packet on the transfer socket and checks that it acknowledges the given block.
+    private void expectAck(int block) throws IOException
+    {
+        DatagramPacket received = new DatagramPacket(new byte[600], 600);
+        byte[] ack = expectPacket(transfer, received);
+
+        assertEquals(clientAddress, received.getSocketAddress());
+        assertEquals(4, ack.length);
+        assertEquals(OPCODE_ACK, ((ack[0] & 0xFF) << 8) | (ack[1] & 0xFF));
+        assertEquals(block, ((ack[2] & 0xFF) << 8) | (ack[3] & 0xFF));
+    }
+
+
+    // Sends a packet from the transfer socket: the opcode, then the two byte number, then the rest.
+    private void send(int opcode, int number, byte[] rest) throws IOException
+    {
+        byte[] message = new byte[4 + rest.length];
+        message[0] = (byte)(opcode >> 8);
+        message[1] = (byte)opcode;
+        message[2] = (byte)(number >> 8);
+        message[3] = (byte)number;
+        System.arraycopy(rest, 0, message, 4, rest.length);
+        transfer.send(new DatagramPacket(message, message.length, clientAddress));
+    }
+
+
+    // Sends an OACK with the given NUL terminated name/value pairs.
+    private void sendOptions(String options) throws IOException
+    {
+        byte[] text = options.getBytes(StandardCharsets.US_ASCII);
+        byte[] message = new byte[2 + text.length];
+        message[1] = (byte)OPCODE_OACK;
+        System.arraycopy(text, 0, message, 2, text.length);
+        transfer.send(new DatagramPacket(message, message.length, clientAddress));
+    }
+
+
+    // Sends one block of the test file, cut off at its end.
+    private void sendBlock(int block, int blockSize) throws IOException
+    {
+        int start = (block - 1) * blockSize;
+        send(OPCODE_DATA, block, Arrays.copyOfRange(contents, start, Math.min(start + blockSize, contents.length)));
+    }
+
+
+    @Test
+    public void testReceivesFileInWindows() throws Exception
+    {
+        boolean success = receive(16, 2, () -> {
+            expectRequest("blksize", "16", "windowsize", "2");
+            sendOptions("blksize\0" + "16\0" + "windowsize\0" + "2\0");
+            expectAck(0);
+
+            // The client acknowledges each window of two blocks.
+            sendBlock(1, 16);
+            sendBlock(2, 16);
+            expectAck(2);
+
+            // Block 3 is lost. The client acknowledges the last block it has, then takes the rest.
+            sendBlock(4, 16);
+            expectAck(2);
+            sendBlock(3, 16);
+            sendBlock(4, 16);
+            expectAck(4);
+        });
+
+        assertTrue(success);
+        assertArrayEquals(contents, Files.readAllBytes(output));
+    }
+
+
+    @Test
+    public void testReceivesWithoutOptions() throws Exception
+    {
+        boolean success = receive(0, 0, () -> {
+            expectRequest();
+            sendBlock(1, 512);
+            expectAck(1);
+        });
+
+        assertTrue(success);
+        assertArrayEquals(contents, Files.readAllBytes(output));
+    }
+
+
+    @Test
+    public void testErrorFromServer() throws Exception
+    {
+        boolean success = receive(0, 0, () -> {
+            expectRequest();
+            send(OPCODE_ERROR, 1, "File not found\0".getBytes(StandardCharsets.US_ASCII));
+        });
+
+        assertFalse(success);
+        assertFalse(Files.exists(output));
+    }
+
+
+    @Test
+    public void testUnrequestedOptionEndsTransfer() throws Exception
+    {
+        boolean success = receive(0, 0, () -> {
+            expectRequest();
+            sendOptions("tsize\0" + "53\0");
+
+            // RFC 2347: the client answers with error 8 and gives up.
+            DatagramPacket received = new DatagramPacket(new byte[600], 600);
+            byte[] error = expectPacket(transfer, received);
+            assertEquals(OPCODE_ERROR, ((error[0] & 0xFF) << 8) | (error[1] & 0xFF));
+            assertEquals(8, ((error[2] & 0xFF) << 8) | (error[3] & 0xFF));
+        });
+
+        assertFalse(success);
+        assertFalse(Files.exists(output));
+    }
+
+
     @Test
-    public void testMain() throws Exception {
+    public void testLongNameIsRefused() throws Exception
+    {
+        char[] name = new char[600];
+        Arrays.fill(name, 'x');
+
+        // The request doesn't fit in the reply buffer, so nothing is sent.
+        FileReceiver receiver = new FileReceiver(
+            new String(name),
+            DatagramChannel.open(),
+            listener.getLocalSocketAddress(),
+            16,
+            2,
+            ByteBuffer.allocateDirect(FileReceiver.MAX_PACKET_SIZE),
+            ByteBuffer.allocateDirect(512));
 
+        assertFalse(receiver.doReceive());
     }
 
 }
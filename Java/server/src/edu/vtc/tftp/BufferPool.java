@@ -0,0 +1,50 @@
+//**************************************************************************
+// FILE   : BufferPool.java
+// SUBJECT: Class that recycles direct buffers between transfers.
+//
+//***************************************************************************
+package edu.vtc.tftp;
+
+import java.nio.ByteBuffer;
+import java.util.ArrayDeque;
+
+/**
+ * A pool of direct buffers, all the same size. Direct buffers are expensive to allocate and are only reclaimed by the
+ * garbage collector, so each transfer borrows one for its lifetime instead of allocating its own. The pool is used
+ * only from the server's selector thread and is not synchronized.
+ */
+public class BufferPool {
+
+    private final int                    bufferSize;
+    private final ArrayDeque<ByteBuffer> free = new ArrayDeque<>();
+
+    /**
+     * Constructs an empty pool.
+     *
+     * @param bufferSize The capacity of every buffer handed out.
+     */
+    BufferPool(int bufferSize)
+    {
+        this.bufferSize = bufferSize;
+    }
+
+
+    /** Returns a cleared buffer, reusing a released one if there is one. */
+    ByteBuffer acquire()
+    {
+        ByteBuffer buffer = free.poll();
+        if (buffer == null) {
+            buffer = ByteBuffer.allocateDirect(bufferSize);
+        }
+        buffer.clear();
+        return buffer;
+    }
+
+
+    /** Returns a buffer to the pool. The caller must not use it afterward. */
+    void release(ByteBuffer buffer)
+    {
+        free.push(buffer);
+    }
+
+}
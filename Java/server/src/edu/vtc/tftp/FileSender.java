@@ -1,9 +1,298 @@
 //**************************************************************************
 // FILE   : FileSender.java
-// SUBJECT: Class that knows how to receive a file using TFTP.
+// SUBJECT: Class that knows how to send a file using TFTP.
 //
 //***************************************************************************
 package edu.vtc.tftp;
 
+import java.io.IOException;
+import java.net.PortUnreachableException;
+import java.net.SocketAddress;
+import java.nio.ByteBuffer;
+import java.nio.channels.DatagramChannel;
+import java.nio.channels.FileChannel;
+import java.nio.channels.SelectionKey;
+import java.nio.channels.Selector;
+import java.nio.charset.StandardCharsets;
+
+/**
+ * One transfer in progress. Each transfer has its own channel, connected to the client, so the kernel discards packets
+ * from any other transfer ID. The server's selector calls back into this class when an acknowledgement arrives or
+ * when the transfer's deadline passes; nothing here blocks.
+ *
+ * Blocks are numbered internally with a long, starting at one, so files with more than 65535 blocks work: the 16 bit
+ * numbers on the wire wrap around (as most implementations do) and acknowledgements are mapped back relative to the
+ * last block acknowledged.
+ */
 public class FileSender {
+
+    public static final int DEFAULT_BLOCK_SIZE = 512;
+    public static final int MAX_BLOCK_SIZE     = 65464;
+    public static final int MAX_WINDOW_SIZE    = 64;
+
+    /** Size of the buffers taken from the pool. Large enough for any block size. */
+    public static final int MAX_PACKET_SIZE = 4 + MAX_BLOCK_SIZE;
+
+    private static final int OPCODE_DATA  = 3;
+    private static final int OPCODE_ACK   = 4;
+    private static final int OPCODE_ERROR = 5;
+    private static final int OPCODE_OACK  = 6;
+
+    private static final int DEFAULT_TIMEOUT = 1;  // Seconds.
+    private static final int MAX_RETRIES     = 5;
+
+    private FileChannel     file;
+    private long            fileSize;
+    private SocketAddress   clientAddress;
+    private BufferPool      pool;
+    private DatagramChannel channel;
+    private ByteBuffer      packet;
+
+    private int     blockSize  = DEFAULT_BLOCK_SIZE;
+    private int     windowSize = 1;
+    private long    timeout;             // Nanoseconds.
+    private String  options    = "";     // Accepted options, as name/value pairs separated by NULs.
+    private boolean optionsPending;      // True while waiting for the acknowledgement of the OACK.
+    private long    ackedBlock;          // Highest block acknowledged.
+    private long    nextBlock  = 1;      // Next block to send for the first time.
+    private long    lastBlock;           // The final (short) block.
+    private long    deadline;            // System.nanoTime() after which outstanding packets are sent again.
+    private int     retries;
+    private boolean finished;
+
+    /**
+     * Constructs a FileSender and decides which of the requested options to accept (RFC 2347).
+     *
+     * @param file          The file to send, open for reading. It is closed when the transfer ends.
+     * @param clientAddress The address (IP and port) the request came from.
+     * @param blockSize     The requested block size (RFC 2348), or zero if none was requested.
+     * @param windowSize    The requested window size (RFC 7440), or zero if none was requested.
+     * @param timeout       The requested timeout in seconds (RFC 2349), or zero if none was requested.
+     * @param tsize         True if the client asked for the size of the file (RFC 2349).
+     * @param pool          Where the transfer's packet buffer comes from and goes back to.
+     */
+    FileSender(FileChannel   file,
+               SocketAddress clientAddress,
+               int           blockSize,
+               int           windowSize,
+               int           timeout,
+               boolean       tsize,
+               BufferPool    pool) throws IOException
+    {
+        this.file          = file;
+        this.fileSize      = file.size();
+        this.clientAddress = clientAddress;
+        this.pool          = pool;
+
+        StringBuilder accepted = new StringBuilder();
+        if (blockSize >= 8) {
+            this.blockSize = Math.min(blockSize, MAX_BLOCK_SIZE);
+            accepted.append("blksize\0").append(this.blockSize).append('\0');
+        }
+        if (windowSize >= 1) {
+            this.windowSize = Math.min(windowSize, MAX_WINDOW_SIZE);
+            accepted.append("windowsize\0").append(this.windowSize).append('\0');
+        }
+        if (timeout >= 1 && timeout <= 255) {
+            accepted.append("timeout\0").append(timeout).append('\0');
+        }
+        else {
+            timeout = DEFAULT_TIMEOUT;
+        }
+        if (tsize) {
+            accepted.append("tsize\0").append(fileSize).append('\0');
+        }
+        this.options   = accepted.toString();
+        this.timeout   = timeout * 1000000000L;
+        this.lastBlock = fileSize / this.blockSize + 1;
+    }
+
+
+    /**
+     * Opens the transfer's channel, registers it with the selector, and sends the OACK or the first window of data.
+     */
+    void start(Selector selector) throws IOException
+    {
+        channel = DatagramChannel.open();
+        channel.connect(clientAddress);
+        channel.configureBlocking(false);
+        channel.register(selector, SelectionKey.OP_READ, this);
+        packet = pool.acquire();
+
+        if (!options.isEmpty()) {
+            sendOptions();
+            optionsPending = true;
+            deadline = System.nanoTime() + timeout;
+        }
+        else {
+            sendWindow();
+        }
+    }
+
+
+    /** Returns true once the transfer is over, successfully or not. */
+    boolean isFinished()
+    {
+        return finished;
+    }
+
+
+    /** Returns the System.nanoTime() value at which onTimeout() should be called. */
+    long getDeadline()
+    {
+        return deadline;
+    }
+
+
+    /**
+     * Releases everything the transfer holds. The channel's selection key is cancelled by closing it.
+     */
+    void close()
+    {
+        finished = true;
+        try {
+            if (channel != null) channel.close();
+        }
+        catch (IOException ex) {
+            // Nothing more can be done with the channel either way.
+        }
+        try {
+            file.close();
+        }
+        catch (IOException ex) {
+            // Likewise.
+        }
+        if (packet != null) {
+            pool.release(packet);
+            packet = null;
+        }
+    }
+
+
+    private void sendOptions() throws IOException
+    {
+        packet.clear();
+        packet.putShort((short)OPCODE_OACK);
+        packet.put(options.getBytes(StandardCharsets.US_ASCII));
+        packet.flip();
+        channel.write(packet);
+    }
+
+
+    // Send one DATA packet. The block is read from the file straight into the packet buffer, at its offset, so
+    // transfers sharing a file never disturb one another.
+    private void sendBlock(long block) throws IOException
+    {
+        long offset = (block - 1) * blockSize;
+
+        packet.clear();
+        packet.putShort((short)OPCODE_DATA);
+        packet.putShort((short)block);
+        packet.limit(4 + blockSize);
+        while (packet.hasRemaining()) {
+            int count = file.read(packet, offset + packet.position() - 4);
+            if (count <= 0) break;
+        }
+        packet.flip();
+
+        // A failed send is treated like a lost packet; the retransmission timer recovers.
+        try {
+            channel.write(packet);
+        }
+        catch (PortUnreachableException ex) {
+            finished = true;
+        }
+    }
+
+
+    // Send every block that fits in the window and has not been sent yet.
+    private void sendWindow() throws IOException
+    {
+        while (nextBlock <= lastBlock && nextBlock - ackedBlock <= windowSize && !finished) {
+            sendBlock(nextBlock);
+            ++nextBlock;
+        }
+        deadline = System.nanoTime() + timeout;
+    }
+
+
+    // Process an acknowledgement. The 16 bit block number is mapped onto the internal numbering relative to the
+    // highest block already acknowledged.
+    private void handleAck(int wireBlock) throws IOException
+    {
+        if (optionsPending) {
+            if (wireBlock != 0) return;
+            optionsPending = false;
+            retries = 0;
+            sendWindow();
+            return;
+        }
+
+        // Duplicate and stray ACKs are ignored to avoid the Sorcerer's Apprentice problem.
+        int advance = (wireBlock - (int)ackedBlock) & 0xFFFF;
+        if (advance == 0 || advance > nextBlock - 1 - ackedBlock) return;
+        ackedBlock += advance;
+        retries = 0;
+
+        if (ackedBlock == lastBlock) {
+            finished = true;
+            return;
+        }
+
+        // An acknowledgement short of the last block sent means the client saw a gap. Everything after it is sent
+        // again (RFC 7440).
+        nextBlock = ackedBlock + 1;
+        sendWindow();
+    }
+
+
+    /**
+     * Reads whatever the client has sent. The scratch buffer is shared by all transfers; packets are consumed before
+     * this method returns.
+     */
+    void onReadable(ByteBuffer scratch) throws IOException
+    {
+        while (!finished) {
+            scratch.clear();
+            try {
+                if (channel.read(scratch) <= 0) return;
+            }
+            catch (PortUnreachableException ex) {
+                finished = true;
+                return;
+            }
+            scratch.flip();
+            if (scratch.remaining() < 4) continue;
+
+            int opcode = scratch.getShort() & 0xFFFF;
+            if (opcode == OPCODE_ACK) {
+                handleAck(scratch.getShort() & 0xFFFF);
+            }
+            else if (opcode == OPCODE_ERROR) {
+                finished = true;
+            }
+        }
+    }
+
+
+    /**
+     * Resends everything that is outstanding, or gives up if the client has gone silent.
+     */
+    void onTimeout() throws IOException
+    {
+        if (++retries > MAX_RETRIES) {
+            finished = true;
+            return;
+        }
+        if (optionsPending) {
+            sendOptions();
+        }
+        else {
+            for (long block = ackedBlock + 1; block < nextBlock && !finished; ++block) {
+                sendBlock(block);
+            }
+        }
+        deadline = System.nanoTime() + timeout;
+    }
+
 }
@@ -13,12 +13,49 @@
 package edu.vtc.tftp;
 
 import java.io.IOException;
+import java.net.InetSocketAddress;
+import java.net.SocketAddress;
+import java.nio.ByteBuffer;
+import java.nio.channels.DatagramChannel;
+import java.nio.channels.FileChannel;
+import java.nio.channels.SelectionKey;
+import java.nio.channels.Selector;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.NoSuchFileException;
+import java.nio.file.Path;
+import java.nio.file.Paths;
+import java.nio.file.StandardOpenOption;
+import java.util.ArrayList;
+import java.util.function.Consumer;
 
 /**
  * Main class of a TFTP server. See RFC 1350.
+ *
+ * A single thread serves every transfer. The listening channel and one channel per transfer are registered with a
+ * selector; the thread wakes when a packet arrives or when the earliest retransmission deadline passes. Packets are
+ * read into and sent from direct buffers that are reused, so a steady transfer allocates nothing per packet.
  */
 public class Server {
 
+    private static final int OPCODE_RRQ   = 1;
+    private static final int OPCODE_WRQ   = 2;
+    private static final int OPCODE_ERROR = 5;
+
+    private static final int ERROR_UNDEFINED         = 0;
+    private static final int ERROR_FILE_NOT_FOUND    = 1;
+    private static final int ERROR_ACCESS_VIOLATION  = 2;
+    private static final int ERROR_ILLEGAL_OPERATION = 4;
+
+    private static final int REQUEST_BUFFER_LENGTH = 512;
+
+    private static DatagramChannel       listener;
+    private static ByteBuffer            request;
+    private static ByteBuffer            scratch;
+    private static BufferPool            pool;
+    private static Selector              selector;
+    private static ArrayList<FileSender> active = new ArrayList<>();
+
     public static void main(String[] args)
     {
         try {
@@ -34,11 +71,223 @@ public class Server {
     {
         // Get stuff from the command line if it is there.
         int port = 69;
-        if (args.length >= 2) {
-            port = Integer.parseInt(args[1]);
+        if (args.length >= 1) {
+            port = Integer.parseInt(args[0]);
+        }
+
+        listener = DatagramChannel.open();
+        listener.bind(new InetSocketAddress(port));
+        listener.configureBlocking(false);
+        selector = Selector.open();
+        listener.register(selector, SelectionKey.OP_READ);
+
+        request = ByteBuffer.allocateDirect(REQUEST_BUFFER_LENGTH);
+        scratch = ByteBuffer.allocateDirect(REQUEST_BUFFER_LENGTH);
+        pool    = new BufferPool(FileSender.MAX_PACKET_SIZE);
+        serve();
+    }
+
+
+    private static void serve() throws IOException
+    {
+        // The handler is created once. Selecting with a handler, rather than walking the selected key set, avoids an
+        // iterator for every wake up.
+        Consumer<SelectionKey> handler = new Consumer<SelectionKey>() {
+            @Override
+            public void accept(SelectionKey key)
+            {
+                FileSender sender = (FileSender)key.attachment();
+                try {
+                    if (sender == null) {
+                        acceptRequests();
+                    }
+                    else {
+                        sender.onReadable(scratch);
+                    }
+                }
+                catch (IOException ex) {
+                    if (sender != null) sender.close();
+                    else System.out.println("Error reading requests: " + ex.getMessage());
+                }
+            }
+        };
+
+        while (true) {
+            long now  = System.nanoTime();
+            long wait = 0;
+            for (int i = 0; i < active.size(); ++i) {
+                long remaining = active.get(i).getDeadline() - now;
+                if (wait == 0 || remaining < wait) wait = Math.max(remaining, 1);
+            }
+
+            // A wait of zero means no transfer is in progress; block until a request arrives.
+            selector.select(handler, wait == 0 ? 0 : Math.max(wait / 1000000, 1));
+
+            now = System.nanoTime();
+            for (int i = active.size() - 1; i >= 0; --i) {
+                FileSender sender = active.get(i);
+                if (!sender.isFinished() && sender.getDeadline() - now <= 0) {
+                    try {
+                        sender.onTimeout();
+                    }
+                    catch (IOException ex) {
+                        sender.close();
+                    }
+                }
+                if (sender.isFinished()) {
+                    sender.close();
+                    active.remove(i);
+                }
+            }
+        }
+    }
+
+
+    private static void sendError(SocketAddress clientAddress, int errorCode, String message) throws IOException
+    {
+        ByteBuffer error = ByteBuffer.allocate(4 + message.length() + 1);
+        error.putShort((short)OPCODE_ERROR);
+        error.putShort((short)errorCode);
+        error.put(message.getBytes(StandardCharsets.US_ASCII));
+        error.put((byte)0);
+        error.flip();
+
+        // Send it to the client. Don't worry about if the send succeeds or fails.
+        listener.send(error, clientAddress);
+    }
+
+
+    // Reads the NUL terminated string at the request's position. Returns null if there is none.
+    private static String nextString()
+    {
+        int start = request.position();
+        for (int i = start; i < request.limit(); ++i) {
+            if (request.get(i) == 0) {
+                byte[] text = new byte[i - start];
+                request.get(text);
+                request.get();
+                return new String(text, StandardCharsets.US_ASCII);
+            }
+        }
+        return null;
+    }
+
+
+    private static int optionValue(String value)
+    {
+        try {
+            return Math.max(Integer.parseInt(value), 0);
+        }
+        catch (NumberFormatException ex) {
+            return 0;
+        }
+    }
+
+
+    // Reads and handles every request waiting on the listening channel.
+    private static void acceptRequests() throws IOException
+    {
+        SocketAddress clientAddress;
+
+        while (true) {
+            request.clear();
+            if ((clientAddress = listener.receive(request)) == null) return;
+            request.flip();
+            handleRequest(clientAddress);
+        }
+    }
+
+
+    private static void handleRequest(SocketAddress clientAddress) throws IOException
+    {
+        if (request.remaining() < 2) return;
+        int opcode = request.getShort() & 0xFFFF;
+        if (opcode != OPCODE_RRQ) {
+            // This server is read only. Write requests are refused with a proper error.
+            if (opcode == OPCODE_WRQ) {
+                sendError(clientAddress, ERROR_ACCESS_VIOLATION, "Access violation");
+            }
+            else {
+                sendError(clientAddress, ERROR_ILLEGAL_OPERATION, "Illegal TFTP operation");
+            }
+            return;
+        }
+
+        String fileName = nextString();
+        String mode     = nextString();
+        if (fileName == null || mode == null) {
+            sendError(clientAddress, ERROR_ILLEGAL_OPERATION, "Illegal TFTP operation");
+            return;
+        }
+        if (!mode.equalsIgnoreCase("octet") && !mode.equalsIgnoreCase("netascii")) {
+            sendError(clientAddress, ERROR_ILLEGAL_OPERATION, "Illegal TFTP operation");
+            return;
+        }
+
+        // Options come in name/value pairs. Unknown options are ignored (RFC 2347).
+        int     blockSize  = 0;
+        int     windowSize = 0;
+        int     timeout    = 0;
+        boolean tsize      = false;
+        String  option;
+        String  value;
+        while ((option = nextString()) != null && (value = nextString()) != null) {
+            if (option.equalsIgnoreCase("blksize")) {
+                blockSize = optionValue(value);
+            }
+            else if (option.equalsIgnoreCase("windowsize")) {
+                windowSize = optionValue(value);
+            }
+            else if (option.equalsIgnoreCase("timeout")) {
+                timeout = optionValue(value);
+            }
+            else if (option.equalsIgnoreCase("tsize")) {
+                tsize = true;
+            }
+        }
+
+        // Files are served from the current folder and below it only.
+        Path path = Paths.get(fileName).normalize();
+        if (fileName.isEmpty() || path.isAbsolute() || path.startsWith("..")) {
+            sendError(clientAddress, ERROR_ACCESS_VIOLATION, "Access violation");
+            return;
+        }
+
+        if (!Files.isRegularFile(path)) {
+            sendError(clientAddress, ERROR_FILE_NOT_FOUND, "File not found");
+            return;
+        }
+
+        FileChannel file;
+        FileSender  sender;
+        try {
+            file = FileChannel.open(path, StandardOpenOption.READ);
+        }
+        catch (NoSuchFileException ex) {
+            sendError(clientAddress, ERROR_FILE_NOT_FOUND, "File not found");
+            return;
+        }
+        catch (IOException ex) {
+            sendError(clientAddress, ERROR_UNDEFINED, "Can't open file");
+            return;
+        }
+        try {
+            sender = new FileSender(file, clientAddress, blockSize, windowSize, timeout, tsize, pool);
+        }
+        catch (IOException ex) {
+            file.close();
+            sendError(clientAddress, ERROR_UNDEFINED, "Can't read file");
+            return;
+        }
+
+        active.add(sender);
+        try {
+            sender.start(selector);
+        }
+        catch (IOException ex) {
+            // The sender is removed from the active list the next time around.
+            sender.close();
         }
-        
-        System.out.println("Hello, World!");
     }
 
 }
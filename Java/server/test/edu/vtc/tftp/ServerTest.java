@@ -1,12 +1,262 @@
 package edu.vtc.tftp;
 
+import static org.junit.Assert.assertArrayEquals;
+import static org.junit.Assert.assertEquals;
+import static org.junit.Assert.assertFalse;
+import static org.junit.Assert.assertNotNull;
+import static org.junit.Assert.assertNotSame;
+import static org.junit.Assert.assertNull;
+import static org.junit.Assert.assertSame;
+import static org.junit.Assert.assertTrue;
+
+import java.io.ByteArrayOutputStream;
+import java.io.IOException;
+import java.net.InetAddress;
+import java.net.InetSocketAddress;
+import java.net.SocketAddress;
+import java.nio.ByteBuffer;
+import java.nio.channels.DatagramChannel;
+import java.nio.channels.FileChannel;
+import java.nio.channels.SelectionKey;
+import java.nio.channels.Selector;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.nio.file.StandardOpenOption;
+import java.util.Random;
+
+import org.junit.After;
+import org.junit.Before;
 import org.junit.Test;
 
+/**
+ * Checks of the server's transfers. Each test plays the client over the loopback interface and drives a FileSender
+ * the way the server's selector loop does: packets from the client are handed to onReadable() and timeouts are
+ * simulated by calling onTimeout().
+ */
 public class ServerTest {
 
+    private static final int OPCODE_DATA = 3;
+    private static final int OPCODE_ACK  = 4;
+    private static final int OPCODE_OACK = 6;
+
+    // Time (ms) to wait for a packet that should arrive.
+    private static final int WAIT = 2000;
+
+    private Path            path;
+    private byte[]          contents;
+    private DatagramChannel client;
+    private Selector        clientSelector;
+    private Selector        serverSelector;
+    private BufferPool      pool;
+    private ByteBuffer      packet;
+    private ByteBuffer      scratch;
+    private SocketAddress   transferAddress;  // The sender's channel, learned from its first packet.
+    private FileSender      sender;
+
+    @Before
+    public void setUp() throws IOException
+    {
+        // Three full 16 byte blocks and a short one.
+        contents = new byte[3 * 16 + 5];
+        new Random(1350).nextBytes(contents);
+        path = Files.createTempFile("ServerTest", ".bin");
+        Files.write(path, contents);
+
+        client = DatagramChannel.open();
+        client.bind(new InetSocketAddress(InetAddress.getLoopbackAddress(), 0));
+        client.configureBlocking(false);
+        clientSelector = Selector.open();
+        client.register(clientSelector, SelectionKey.OP_READ);
+
+        serverSelector = Selector.open();
+        pool    = new BufferPool(FileSender.MAX_PACKET_SIZE);
+        packet  = ByteBuffer.allocate(FileSender.MAX_PACKET_SIZE);
+        scratch = ByteBuffer.allocateDirect(512);
+    }
+
+
+    @After
+    public void tearDown() throws IOException
+    {
+        if (sender != null) sender.close();
+        client.close();
+        clientSelector.close();
+        serverSelector.close();
+        Files.deleteIfExists(path);
+    }
+
+
+    // Starts a transfer of the test file with the given requested options.
+    private void startSender(int blockSize, int windowSize, int timeout, boolean tsize) throws IOException
+    {
+        FileChannel file = FileChannel.open(path, StandardOpenOption.READ);
+        sender = new FileSender(file, client.getLocalAddress(), blockSize, windowSize, timeout, tsize, pool);
+        sender.start(serverSelector);
+    }
+
+
+    // Waits for the next packet to the client. Returns it ready to read, positioned after the opcode.
+    private int receive() throws IOException
+    {
+        packet.clear();
+        clientSelector.select(WAIT);
+        clientSelector.selectedKeys().clear();
+        SocketAddress source = client.receive(packet);
+        assertNotNull("Expected a packet from the server", source);
+        if (transferAddress == null) transferAddress = source;
+        assertEquals(transferAddress, source);
+        packet.flip();
+        return packet.getShort() & 0xFFFF;
+    }
+
+
+    // Checks that nothing more has been sent to the client.
+    private void assertNothingSent() throws IOException
+    {
+        packet.clear();
+        clientSelector.selectNow();
+        clientSelector.selectedKeys().clear();
+        assertNull("Expected no packet from the server", client.receive(packet));
+    }
+
+
+    // Receives a DATA packet, checks its block number, and adds its data to the given stream.
+    private int receiveBlock(int expected, ByteArrayOutputStream data) throws IOException
+    {
+        assertEquals(OPCODE_DATA, receive());
+        assertEquals(expected, packet.getShort() & 0xFFFF);
+        byte[] block = new byte[packet.remaining()];
+        packet.get(block);
+        if (data != null) data.write(block, 0, block.length);
+        return block.length;
+    }
+
+
+    // Sends an ACK to the transfer and lets the sender handle it.
+    private void acknowledge(int block) throws IOException
+    {
+        ByteBuffer ack = ByteBuffer.allocate(4);
+        ack.putShort((short)OPCODE_ACK);
+        ack.putShort((short)block);
+        ack.flip();
+        client.send(ack, transferAddress);
+
+        serverSelector.select(WAIT);
+        serverSelector.selectedKeys().clear();
+        sender.onReadable(scratch);
+    }
+
+
+    @Test
+    public void testBufferPoolReusesBuffers()
+    {
+        BufferPool small = new BufferPool(64);
+
+        ByteBuffer first = small.acquire();
+        assertTrue(first.isDirect());
+        assertEquals(64, first.capacity());
+        first.put((byte)1);
+        small.release(first);
+
+        ByteBuffer second = small.acquire();
+        assertSame(first, second);
+        assertEquals(0, second.position());
+        assertEquals(64, second.limit());
+        assertNotSame(second, small.acquire());
+    }
+
+
+    @Test
+    public void testOptionsAreClampedAndAcknowledged() throws IOException
+    {
+        // The block and window sizes are larger than the server allows, and a timeout of zero is not valid.
+        startSender(100000, 100, 0, true);
+        assertEquals(OPCODE_OACK, receive());
+
+        byte[] options = new byte[packet.remaining()];
+        packet.get(options);
+        assertArrayEquals(
+            new String[] { "blksize", "65464", "windowsize", "64", "tsize", Integer.toString(contents.length) },
+            new String(options, StandardCharsets.US_ASCII).split("\0"));
+        assertFalse(sender.isFinished());
+    }
+
+
+    @Test
+    public void testTransferInWindows() throws IOException
+    {
+        ByteArrayOutputStream data = new ByteArrayOutputStream();
+
+        startSender(16, 2, 0, false);
+        assertEquals(OPCODE_OACK, receive());
+        acknowledge(0);
+
+        // Each window is two blocks; the server waits for its acknowledgement before sending more.
+        assertEquals(16, receiveBlock(1, data));
+        assertEquals(16, receiveBlock(2, data));
+        assertNothingSent();
+        acknowledge(2);
+        assertEquals(16, receiveBlock(3, data));
+        assertEquals(5, receiveBlock(4, data));
+        assertNothingSent();
+        acknowledge(4);
+
+        assertTrue(sender.isFinished());
+        assertArrayEquals(contents, data.toByteArray());
+    }
+
+
+    @Test
+    public void testGapIsSentAgain() throws IOException
+    {
+        startSender(16, 2, 0, false);
+        assertEquals(OPCODE_OACK, receive());
+        acknowledge(0);
+        receiveBlock(1, null);
+        receiveBlock(2, null);
+
+        // The client only saw block 1, so the next window starts at block 2.
+        acknowledge(1);
+        receiveBlock(2, null);
+        receiveBlock(3, null);
+        assertNothingSent();
+    }
+
+
+    @Test
+    public void testDuplicateAckIsIgnored() throws IOException
+    {
+        startSender(16, 0, 0, false);
+        assertEquals(OPCODE_OACK, receive());
+        acknowledge(0);
+        receiveBlock(1, null);
+        acknowledge(1);
+        receiveBlock(2, null);
+
+        // Answering a repeated ACK would send every block twice from then on (the Sorcerer's Apprentice problem).
+        acknowledge(1);
+        assertNothingSent();
+        assertFalse(sender.isFinished());
+    }
+
+
     @Test
-    public void testMain() throws Exception {
+    public void testTimeoutsSendAgainThenGiveUp() throws IOException
+    {
+        startSender(16, 0, 0, false);
+        assertEquals(OPCODE_OACK, receive());
+        acknowledge(0);
+        receiveBlock(1, null);
 
+        for (int i = 0; i < 5; ++i) {
+            sender.onTimeout();
+            assertFalse(sender.isFinished());
+            receiveBlock(1, null);
+        }
+        sender.onTimeout();
+        assertTrue(sender.isFinished());
+        assertNothingSent();
     }
 
 }